@@ -0,0 +1,244 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#pragma once
+
+// A capture filter is a small program deciding whether a log entry is captured, which the driver runs before copying
+// anything of the entry. It is modeled after classic BPF: Instructions operate on a single 32-bit accumulator, which is
+// loaded from the entry or an immediate value, and the program ends with a return instruction telling the verdict.
+//
+// Jumps only go forward, so every program terminates after at most CAPTURE_FILTER_MAX_INSTRUCTIONS instructions.
+// CaptureFilterVerify checks that all opcodes are known, all jumps stay within the program and the last instruction
+// returns. Loads from the data are checked against its length at runtime and reject the entry if they go beyond it.
+//
+// This header only depends on basic Windows data types.
+// It is therefore shared between driver and tool and can also be compiled for user-mode tests on other platforms.
+
+#define CAPTURE_FILTER_MAX_INSTRUCTIONS     64
+
+// Loads into the accumulator. Multi-byte values are read in little-endian byte order at offset K of the data.
+// CAPTURE_FILTER_LD_LENGTH loads the full length of the data, even if the entry is later truncated to its SnapLength.
+// CAPTURE_FILTER_LD_IOCTL loads the I/O control code passed by the caller, which is zero for entries other than IOCTLs.
+#define CAPTURE_FILTER_LD_TYPE              0x0001
+#define CAPTURE_FILTER_LD_LENGTH            0x0002
+#define CAPTURE_FILTER_LD_IOCTL             0x0003
+#define CAPTURE_FILTER_LD_BYTE              0x0004
+#define CAPTURE_FILTER_LD_USHORT            0x0005
+#define CAPTURE_FILTER_LD_ULONG             0x0006
+#define CAPTURE_FILTER_LD_IMMEDIATE         0x0007
+
+// Arithmetic on the accumulator with K. The shift count must be below 32.
+#define CAPTURE_FILTER_AND                  0x0010
+#define CAPTURE_FILTER_RSH                  0x0011
+
+// CAPTURE_FILTER_JUMP skips K instructions. All other jumps compare the accumulator with K and skip JumpTrue or
+// JumpFalse instructions depending on the result. CAPTURE_FILTER_JSET is true if the accumulator shares a bit with K.
+#define CAPTURE_FILTER_JUMP                 0x0020
+#define CAPTURE_FILTER_JEQ                  0x0021
+#define CAPTURE_FILTER_JGT                  0x0022
+#define CAPTURE_FILTER_JGE                  0x0023
+#define CAPTURE_FILTER_JSET                 0x0024
+
+// Ends the program and captures the entry if K is nonzero.
+#define CAPTURE_FILTER_RETURN               0x0030
+
+typedef struct _CAPTURE_FILTER_INSTRUCTION
+{
+    USHORT Code;
+    UCHAR JumpTrue;
+    UCHAR JumpFalse;
+    ULONG K;
+}
+CAPTURE_FILTER_INSTRUCTION, *PCAPTURE_FILTER_INSTRUCTION;
+
+static __inline BOOLEAN
+CaptureFilterVerify(
+    __in_ecount(InstructionCount) const CAPTURE_FILTER_INSTRUCTION* Instructions,
+    __in ULONG InstructionCount
+    )
+{
+    ULONG i;
+    ULONG remaining;
+
+    // An empty program captures everything.
+    if (InstructionCount == 0)
+    {
+        return TRUE;
+    }
+
+    if (InstructionCount > CAPTURE_FILTER_MAX_INSTRUCTIONS || Instructions[InstructionCount - 1].Code != CAPTURE_FILTER_RETURN)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < InstructionCount; i++)
+    {
+        // Instructions left after this one, which is the farthest any jump may skip.
+        remaining = InstructionCount - i - 1;
+
+        switch (Instructions[i].Code)
+        {
+            case CAPTURE_FILTER_LD_TYPE:
+            case CAPTURE_FILTER_LD_LENGTH:
+            case CAPTURE_FILTER_LD_IOCTL:
+            case CAPTURE_FILTER_LD_BYTE:
+            case CAPTURE_FILTER_LD_USHORT:
+            case CAPTURE_FILTER_LD_ULONG:
+            case CAPTURE_FILTER_LD_IMMEDIATE:
+            case CAPTURE_FILTER_AND:
+            case CAPTURE_FILTER_RETURN:
+                break;
+
+            case CAPTURE_FILTER_RSH:
+                if (Instructions[i].K >= 32)
+                {
+                    return FALSE;
+                }
+
+                break;
+
+            case CAPTURE_FILTER_JUMP:
+                if (Instructions[i].K >= remaining)
+                {
+                    return FALSE;
+                }
+
+                break;
+
+            case CAPTURE_FILTER_JEQ:
+            case CAPTURE_FILTER_JGT:
+            case CAPTURE_FILTER_JGE:
+            case CAPTURE_FILTER_JSET:
+                if (Instructions[i].JumpTrue >= remaining || Instructions[i].JumpFalse >= remaining)
+                {
+                    return FALSE;
+                }
+
+                break;
+
+            default:
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static __inline BOOLEAN
+CaptureFilterRun(
+    __in_ecount(InstructionCount) const CAPTURE_FILTER_INSTRUCTION* Instructions,
+    __in ULONG InstructionCount,
+    __in USHORT Type,
+    __in ULONG IoControlCode,
+    __in_bcount(DataLength) const UCHAR* Data,
+    __in ULONG DataLength
+    )
+{
+    ULONG a;
+    BOOLEAN condition;
+    const CAPTURE_FILTER_INSTRUCTION* instruction;
+    ULONG pc;
+
+    // The program must have passed CaptureFilterVerify.
+    if (InstructionCount == 0)
+    {
+        return TRUE;
+    }
+
+    a = 0;
+    for (pc = 0; pc < InstructionCount; pc++)
+    {
+        instruction = &Instructions[pc];
+
+        switch (instruction->Code)
+        {
+            case CAPTURE_FILTER_LD_TYPE:
+                a = Type;
+                break;
+
+            case CAPTURE_FILTER_LD_LENGTH:
+                a = DataLength;
+                break;
+
+            case CAPTURE_FILTER_LD_IOCTL:
+                a = IoControlCode;
+                break;
+
+            case CAPTURE_FILTER_LD_BYTE:
+                if (instruction->K >= DataLength)
+                {
+                    return FALSE;
+                }
+
+                a = Data[instruction->K];
+                break;
+
+            case CAPTURE_FILTER_LD_USHORT:
+                if (instruction->K >= DataLength || DataLength - instruction->K < 2)
+                {
+                    return FALSE;
+                }
+
+                a = (ULONG)Data[instruction->K] | ((ULONG)Data[instruction->K + 1] << 8);
+                break;
+
+            case CAPTURE_FILTER_LD_ULONG:
+                if (instruction->K >= DataLength || DataLength - instruction->K < 4)
+                {
+                    return FALSE;
+                }
+
+                a = (ULONG)Data[instruction->K] | ((ULONG)Data[instruction->K + 1] << 8) |
+                    ((ULONG)Data[instruction->K + 2] << 16) | ((ULONG)Data[instruction->K + 3] << 24);
+                break;
+
+            case CAPTURE_FILTER_LD_IMMEDIATE:
+                a = instruction->K;
+                break;
+
+            case CAPTURE_FILTER_AND:
+                a &= instruction->K;
+                break;
+
+            case CAPTURE_FILTER_RSH:
+                a >>= instruction->K;
+                break;
+
+            case CAPTURE_FILTER_JUMP:
+                pc += instruction->K;
+                break;
+
+            case CAPTURE_FILTER_RETURN:
+                return (instruction->K != 0);
+
+            default:
+                // CAPTURE_FILTER_JEQ, CAPTURE_FILTER_JGT, CAPTURE_FILTER_JGE and CAPTURE_FILTER_JSET.
+                if (instruction->Code == CAPTURE_FILTER_JEQ)
+                {
+                    condition = (a == instruction->K);
+                }
+                else if (instruction->Code == CAPTURE_FILTER_JGT)
+                {
+                    condition = (a > instruction->K);
+                }
+                else if (instruction->Code == CAPTURE_FILTER_JGE)
+                {
+                    condition = (a >= instruction->K);
+                }
+                else
+                {
+                    condition = ((a & instruction->K) != 0);
+                }
+
+                pc += condition ? instruction->JumpTrue : instruction->JumpFalse;
+                break;
+        }
+    }
+
+    // Not reached for a verified program, which always ends with a return instruction.
+    return FALSE;
+}
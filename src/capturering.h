@@ -0,0 +1,218 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#pragma once
+
+// A capture ring collects the log entries of one direction of a port until the driver merges them into the port log.
+// It is a single-producer/single-consumer ring following the protocol of a shared port log (see portlog.h).
+// All requests capturing entries of the direction share the producer side and serialize on its ProducerLock, a spin lock
+// held from reserving an entry until publishing it. The consumer holds a lock of its own (LogLock in the driver) and
+// merges the capture rings by always taking the oldest entry next.
+//
+// Every captured entry must start with the LARGE_INTEGER performance counter value it has been captured at, and must be
+// timestamped while holding ProducerLock. The entries of each capture ring are therefore in timestamp order, and
+// CaptureRingsSync can make sure that it sees every entry timestamped before a cutoff.
+//
+// This header only depends on basic Windows data types and kernel functions.
+// It is therefore used by the driver and can also be compiled for user-mode tests on other platforms.
+
+#include "portlog.h"
+
+// Log entries that have been dropped, but not yet reported through a PORTSNIFFER_PORTLOG_GAP entry.
+typedef struct _PORTLOG_GAP
+{
+    LARGE_INTEGER Timestamp;
+    ULONG SequenceNumber;
+    ULONG Entries;
+    ULONGLONG Bytes;
+}
+PORTLOG_GAP, *PPORTLOG_GAP;
+
+typedef struct _CAPTURE_RING
+{
+    // Serializes the producers of this direction, which the port driver processes one at a time anyway.
+    // It is never acquired by producers of another direction, and the consumer only acquires it for an instant
+    // to wait for an entry being captured, see CaptureRingsSync.
+    KSPIN_LOCK ProducerLock;
+
+    // Nonpaged memory of the ring or NULL while it isn't used.
+    // Only changed while holding both ProducerLock and the lock of the consumer, so either one is sufficient for reading it.
+    PPORTLOG_SHARED_HEADER Header;
+
+    // Producer side, protected by ProducerLock.
+    // DroppedGap describes the entries dropped while the capture ring was full. The producer captures them as a
+    // PORTSNIFFER_PORTLOG_GAP entry before the next entry, so that the consumer can account for them in order.
+    PORTLOG_RING ProducerRing;
+    PORTLOG_GAP DroppedGap;
+
+    // Consumer side, protected by the lock of the consumer.
+    PORTLOG_RING ConsumerRing;
+}
+CAPTURE_RING, *PCAPTURE_RING;
+
+#define CAPTURE_RING_TIMESTAMP(Record)  (((const LARGE_INTEGER*)PORTLOG_RECORD_PAYLOAD(Record))->QuadPart)
+
+// Reserves a record for an entry of Length bytes.
+// The caller must hold ProducerLock and commit the record before reserving another one.
+// Returns NULL if the capture ring is full, in which case the caller should count the entry through CaptureRingDrop.
+static __inline PPORTLOG_RECORD
+CaptureRingReserve(
+    __inout PCAPTURE_RING Ring,
+    __in ULONG Length
+    )
+{
+    // Learn about the entries the consumer has merged.
+    PortLogSharedProducerSync(&Ring->ProducerRing, Ring->Header);
+    return PortLogRingReserve(&Ring->ProducerRing, Length);
+}
+
+static __inline void
+CaptureRingCommit(
+    __inout PCAPTURE_RING Ring
+    )
+{
+    PortLogRingCommit(&Ring->ProducerRing);
+}
+
+// Counts an entry of Length bytes that didn't fit into the capture ring. The caller must hold ProducerLock.
+static __inline void
+CaptureRingDrop(
+    __inout PCAPTURE_RING Ring,
+    __in ULONG Length
+    )
+{
+    if (Ring->DroppedGap.Entries == 0)
+    {
+        Ring->DroppedGap.Timestamp = KeQueryPerformanceCounter(NULL);
+    }
+
+    Ring->DroppedGap.Entries++;
+    Ring->DroppedGap.Bytes += Length;
+}
+
+// Makes all committed records visible to the consumer. The caller must hold ProducerLock.
+static __inline void
+CaptureRingPublish(
+    __inout PCAPTURE_RING Ring
+    )
+{
+    // Nobody waits on a capture ring, so there is no wakeup to send.
+    PortLogSharedProducerPublish(&Ring->ProducerRing, Ring->Header);
+}
+
+// Discards all captured entries that haven't been merged yet. The caller must be the consumer.
+// This acquires ProducerLock, so it must not run from pageable code in the driver.
+static __inline void
+CaptureRingClear(
+    __inout PCAPTURE_RING Ring
+    )
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Ring->ProducerLock, &oldIrql);
+    RtlZeroMemory(&Ring->DroppedGap, sizeof(Ring->DroppedGap));
+    KeReleaseSpinLock(&Ring->ProducerLock, oldIrql);
+
+    PortLogSharedConsumerSync(&Ring->ConsumerRing, Ring->Header);
+    PortLogRingClear(&Ring->ConsumerRing);
+    PortLogSharedConsumerPublish(&Ring->ConsumerRing, Ring->Header);
+}
+
+// Prepares a merge of Count capture rings and returns its cutoff. The caller must be the consumer.
+// This acquires every ProducerLock for an instant, so it must not run from pageable code in the driver.
+//
+// A producer holds its ProducerLock from timestamping an entry until it has published it. Acquiring the lock for
+// an instant therefore makes every entry visible that has been timestamped before the cutoff. A newer entry of one
+// capture ring may already be visible before an older one of another, so CaptureRingsPeekOldest leaves everything
+// from the cutoff on to the next merge. This also keeps busy producers from stalling the consumer forever.
+static __inline LONGLONG
+CaptureRingsSync(
+    __inout_ecount(Count) PCAPTURE_RING Rings,
+    __in ULONG Count
+    )
+{
+    LARGE_INTEGER cutoff;
+    ULONG i;
+    KIRQL oldIrql;
+
+    cutoff = KeQueryPerformanceCounter(NULL);
+
+    for (i = 0; i < Count; i++)
+    {
+        KeAcquireSpinLock(&Rings[i].ProducerLock, &oldIrql);
+        KeReleaseSpinLock(&Rings[i].ProducerLock, oldIrql);
+
+        PortLogSharedConsumerSync(&Rings[i].ConsumerRing, Rings[i].Header);
+    }
+
+    return cutoff.QuadPart;
+}
+
+// Returns the oldest entry of all Count capture rings if it has been timestamped before Cutoff or NULL otherwise.
+// OldestRing receives the capture ring of the entry, which the caller passes to CaptureRingRemove after merging it.
+static __inline PPORTLOG_RECORD
+CaptureRingsPeekOldest(
+    __in_ecount(Count) PCAPTURE_RING Rings,
+    __in ULONG Count,
+    __in LONGLONG Cutoff,
+    __out PCAPTURE_RING* OldestRing
+    )
+{
+    ULONG i;
+    PPORTLOG_RECORD oldestRecord;
+    PPORTLOG_RECORD record;
+
+    *OldestRing = NULL;
+    oldestRecord = NULL;
+
+    for (i = 0; i < Count; i++)
+    {
+        record = PortLogRingPeek(&Rings[i].ConsumerRing);
+        if (!record)
+        {
+            continue;
+        }
+
+        if (!oldestRecord || CAPTURE_RING_TIMESTAMP(record) < CAPTURE_RING_TIMESTAMP(oldestRecord))
+        {
+            *OldestRing = &Rings[i];
+            oldestRecord = record;
+        }
+    }
+
+    if (!oldestRecord || CAPTURE_RING_TIMESTAMP(oldestRecord) >= Cutoff)
+    {
+        *OldestRing = NULL;
+        return NULL;
+    }
+
+    return oldestRecord;
+}
+
+static __inline void
+CaptureRingRemove(
+    __inout PCAPTURE_RING Ring,
+    __in PPORTLOG_RECORD Record
+    )
+{
+    PortLogRingRemove(&Ring->ConsumerRing, Record);
+}
+
+// Hands the space of all merged entries back to the producers of Count capture rings.
+static __inline void
+CaptureRingsRelease(
+    __inout_ecount(Count) PCAPTURE_RING Rings,
+    __in ULONG Count
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++)
+    {
+        PortLogSharedConsumerPublish(&Rings[i].ConsumerRing, Rings[i].Header);
+    }
+}
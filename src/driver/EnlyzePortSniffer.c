@@ -9,28 +9,139 @@
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (INIT, DriverEntry)
+#pragma alloc_text (PAGE, PortSnifferControlArmPortTrigger)
+#pragma alloc_text (PAGE, PortSnifferControlClearPortLog)
+#pragma alloc_text (PAGE, PortSnifferControlConfigurePortLog)
 #pragma alloc_text (PAGE, PortSnifferControlCreate)
+#pragma alloc_text (PAGE, PortSnifferControlCreateMapping)
+#pragma alloc_text (PAGE, PortSnifferControlDeleteMapping)
+#pragma alloc_text (PAGE, PortSnifferControlDereferencePort)
+#pragma alloc_text (PAGE, PortSnifferControlEvtDeviceFileCreate)
+#pragma alloc_text (PAGE, PortSnifferControlEvtFileCleanup)
+#pragma alloc_text (PAGE, PortSnifferControlEvtFileClose)
 #pragma alloc_text (PAGE, PortSnifferControlEvtIoDeviceControl)
+#pragma alloc_text (PAGE, PortSnifferControlEvtIoInCallerContext)
+#pragma alloc_text (PAGE, PortSnifferControlFindPort)
 #pragma alloc_text (PAGE, PortSnifferControlGetAttachedPorts)
+#pragma alloc_text (PAGE, PortSnifferControlGetPortIndexes)
+#pragma alloc_text (PAGE, PortSnifferControlGetPortLogCounters)
+#pragma alloc_text (PAGE, PortSnifferControlGetPortStatistics)
+#pragma alloc_text (PAGE, PortSnifferControlGetPortTrigger)
+#pragma alloc_text (PAGE, PortSnifferControlGetSubscriber)
 #pragma alloc_text (PAGE, PortSnifferControlGetVersion)
+#pragma alloc_text (PAGE, PortSnifferControlMapPortLog)
+#pragma alloc_text (PAGE, PortSnifferControlOpenPortSession)
+#pragma alloc_text (PAGE, PortSnifferControlPopMergedPortLogEntries)
+#pragma alloc_text (PAGE, PortSnifferControlPopMergedPortLogEntriesInternal)
 #pragma alloc_text (PAGE, PortSnifferControlPopPortLogEntry)
 #pragma alloc_text (PAGE, PortSnifferControlPopPortLogEntryInternal)
+#pragma alloc_text (PAGE, PortSnifferControlPopPortLogEntries)
+#pragma alloc_text (PAGE, PortSnifferControlPopPortLogEntriesInternal)
+#pragma alloc_text (PAGE, PortSnifferControlReferencePort)
 #pragma alloc_text (PAGE, PortSnifferControlResetPortMonitoring)
+#pragma alloc_text (PAGE, PortSnifferControlSetCaptureFilter)
+#pragma alloc_text (PAGE, PortSnifferControlSetIoctlFilter)
+#pragma alloc_text (PAGE, PortSnifferControlSetPortMonitorMask)
+#pragma alloc_text (PAGE, PortSnifferControlSubscribePort)
+#pragma alloc_text (PAGE, PortSnifferControlUnsubscribePort)
+#pragma alloc_text (PAGE, PortSnifferControlWaitPortLogEntries)
+#pragma alloc_text (PAGE, PortSnifferControlWaitPortLogEntriesInternal)
+#pragma alloc_text (PAGE, PortSnifferFilterAddClockEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterAddGapEntry)
 #pragma alloc_text (PAGE, PortSnifferFilterAddPortLogEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterAddRepeatEntries)
+#pragma alloc_text (PAGE, PortSnifferFilterAddToGap)
+#pragma alloc_text (PAGE, PortSnifferFilterAdvanceTrigger)
+#pragma alloc_text (PAGE, PortSnifferFilterAllocatePortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterAppendToOpenEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterAssignPortIndex)
+#pragma alloc_text (PAGE, PortSnifferFilterBeginLifecycle)
+#pragma alloc_text (PAGE, PortSnifferFilterBeginLineStatus)
+#pragma alloc_text (PAGE, PortSnifferFilterCancelLinger)
+#pragma alloc_text (PAGE, PortSnifferFilterChargePortLogBudget)
+#pragma alloc_text (PAGE, PortSnifferFilterCheckConsumer)
 #pragma alloc_text (PAGE, PortSnifferFilterClearPortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterCloseCapture)
+#pragma alloc_text (PAGE, PortSnifferFilterCloseOpenEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterCompleteWaitQueue)
+#pragma alloc_text (PAGE, PortSnifferFilterCompleteWaitRequests)
+#pragma alloc_text (PAGE, PortSnifferFilterDeliverPortLogEntries)
+#pragma alloc_text (PAGE, PortSnifferFilterDetachMapping)
+#pragma alloc_text (PAGE, PortSnifferFilterDetachSubscribers)
+#pragma alloc_text (PAGE, PortSnifferFilterDrainCaptureRings)
+#pragma alloc_text (PAGE, PortSnifferFilterDropPortLogEntries)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtCaptureWorkItem)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtCoalesceTimer)
 #pragma alloc_text (PAGE, PortSnifferFilterEvtDeviceAdd)
 #pragma alloc_text (PAGE, PortSnifferFilterEvtDeviceCleanup)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtDeviceSelfManagedIoCleanup)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtDrainWorkItem)
 #pragma alloc_text (PAGE, PortSnifferFilterEvtIoDeviceControl)
 #pragma alloc_text (PAGE, PortSnifferFilterEvtIoDeviceControlInternal)
 #pragma alloc_text (PAGE, PortSnifferFilterEvtIoRead)
-#pragma alloc_text (PAGE, PortSnifferFilterEvtIoReadCompletionWorkItem)
 #pragma alloc_text (PAGE, PortSnifferFilterEvtIoWrite)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtLingerTimer)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtRepeatTimer)
+#pragma alloc_text (PAGE, PortSnifferFilterEvtWaitTimer)
+#pragma alloc_text (PAGE, PortSnifferFilterFreePortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterGetCoalesceGapTime)
+#pragma alloc_text (PAGE, PortSnifferFilterGetConsumerRing)
+#pragma alloc_text (PAGE, PortSnifferFilterGetFairShare)
+#pragma alloc_text (PAGE, PortSnifferFilterGetRepeat)
+#pragma alloc_text (PAGE, PortSnifferFilterGrowPortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterHashEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterIsOldestEntryRead)
+#pragma alloc_text (PAGE, PortSnifferFilterIsTriggerPending)
+#pragma alloc_text (PAGE, PortSnifferFilterNormalizeCapacity)
+#pragma alloc_text (PAGE, PortSnifferFilterOpenCaptureFile)
+#pragma alloc_text (PAGE, PortSnifferFilterOpenCaptureKey)
+#pragma alloc_text (PAGE, PortSnifferFilterOverwriteOldestEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterPackPortLogEntries)
+#pragma alloc_text (PAGE, PortSnifferFilterQueryClock)
+#pragma alloc_text (PAGE, PortSnifferFilterReclaimPortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterRememberRepeat)
+#pragma alloc_text (PAGE, PortSnifferFilterReportRepeats)
+#pragma alloc_text (PAGE, PortSnifferFilterReservePortLogEntry)
+#pragma alloc_text (PAGE, PortSnifferFilterResetRepeats)
+#pragma alloc_text (PAGE, PortSnifferFilterResizePortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterReturnPortLogBudget)
+#pragma alloc_text (PAGE, PortSnifferFilterSampleRequest)
+#pragma alloc_text (PAGE, PortSnifferFilterShrinkPortLog)
+#pragma alloc_text (PAGE, PortSnifferFilterStartCapture)
+#pragma alloc_text (PAGE, PortSnifferFilterStopCapture)
+#pragma alloc_text (PAGE, PortSnifferFilterSuppressRepeat)
+#pragma alloc_text (PAGE, PortSnifferFilterTicksToRelativeTime)
+#pragma alloc_text (PAGE, PortSnifferFilterTrackLineSettings)
+#pragma alloc_text (PAGE, PortSnifferFilterUnpublishPort)
+#pragma alloc_text (PAGE, PortSnifferFilterWriteCaptureFile)
 #endif
 
 WDFDEVICE ControlDevice = NULL;
 WDFCOLLECTION FilterDevices = NULL;
 WDFWAITLOCK FilterDevicesLock = NULL;
-WDFLOOKASIDE PortLogLookaside = NULL;
+
+// Hash index of all ports in FilterDevices by name, protected by FilterDevicesLock.
+PORT_HASH_TABLE PortHashTable;
+
+// Ports by their index for PORTSNIFFER_IOCTL_CONTROL_POP_MERGED_PORTLOG_ENTRIES, protected by FilterDevicesLock.
+// The search for a free index starts at NextPortIndex, so that the index of a removed port is reused as late as possible.
+PFILTER_CONTEXT PortIndexes[PORTSNIFFER_PORT_INDEX_COUNT];
+ULONG NextPortIndex = 0;
+
+// Memory budget for all port logs together and the number of bytes and port logs currently charged to it.
+ULONG DefaultPortLogCapacity = PORTLOG_DEFAULT_CAPACITY;
+ULONG PortLogBudget = PORTLOG_DEFAULT_BUDGET;
+volatile LONG PortLogBudgetUsed = 0;
+volatile LONG PortLogCount = 0;
+
+// Ticks per second of the performance counter, which timestamps all log entries.
+LARGE_INTEGER PerformanceFrequency;
+
+// Directory, size limit and number of the capture files of all ports configured for unattended capture.
+WCHAR CaptureDirectoryBuffer[CAPTURE_DIRECTORY_LENGTH];
+UNICODE_STRING CaptureDirectory;
+ULONG CaptureFileSize = CAPTURE_FILE_DEFAULT_SIZE;
+ULONG CaptureFileCount = CAPTURE_FILE_DEFAULT_COUNT;
 
 
 __drv_functionClass(DRIVER_INITIALIZE)
@@ -41,20 +152,74 @@ DriverEntry(
     __in PUNICODE_STRING RegistryPath
     )
 {
+    DECLARE_CONST_UNICODE_STRING(captureDirectoryValueName, L"CaptureDirectory");
+    DECLARE_CONST_UNICODE_STRING(captureFileCountValueName, L"CaptureFileCount");
+    DECLARE_CONST_UNICODE_STRING(captureFileSizeValueName, L"CaptureFileSize");
+    DECLARE_CONST_UNICODE_STRING(portLogBudgetValueName, L"PortLogBudget");
+    DECLARE_CONST_UNICODE_STRING(portLogCapacityValueName, L"PortLogCapacity");
+
     WDF_DRIVER_CONFIG config;
+    WDFDRIVER driver;
+    WDFKEY parametersKey;
     NTSTATUS status;
+    ULONG value;
 
     KdPrint(("ENLYZE PortSniffer Driver " PORTSNIFFER_VERSION_COMBINED "\n"));
 
     // Create our driver object.
     WDF_DRIVER_CONFIG_INIT(&config, PortSnifferFilterEvtDeviceAdd);
-    status = WdfDriverCreate(DriverObject, RegistryPath, WDF_NO_OBJECT_ATTRIBUTES, &config, WDF_NO_HANDLE);
+    status = WdfDriverCreate(DriverObject, RegistryPath, WDF_NO_OBJECT_ATTRIBUTES, &config, &driver);
     if (!NT_SUCCESS(status))
     {
         KdPrint(("WdfDriverCreate failed, status = 0x%08lX\n", status));
         return status;
     }
 
+    // Read the port log defaults and capture file settings from our Parameters registry key.
+    // Neither the key nor any of its values need to exist.
+    RtlInitEmptyUnicodeString(&CaptureDirectory, CaptureDirectoryBuffer, sizeof(CaptureDirectoryBuffer));
+    status = WdfDriverOpenParametersRegistryKey(driver, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &parametersKey);
+    if (NT_SUCCESS(status))
+    {
+        if (NT_SUCCESS(WdfRegistryQueryULong(parametersKey, &portLogCapacityValueName, &value)))
+        {
+            DefaultPortLogCapacity = PortSnifferFilterNormalizeCapacity(value);
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(parametersKey, &portLogBudgetValueName, &value)))
+        {
+            PortLogBudget = max(min(value, PORTLOG_MAX_BUDGET), PORTLOG_MIN_CAPACITY);
+        }
+
+        if (!NT_SUCCESS(WdfRegistryQueryUnicodeString(parametersKey, &captureDirectoryValueName, NULL, &CaptureDirectory)))
+        {
+            CaptureDirectory.Length = 0;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(parametersKey, &captureFileSizeValueName, &value)))
+        {
+            CaptureFileSize = max(min(value, CAPTURE_FILE_MAX_SIZE), CAPTURE_FILE_MIN_SIZE);
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(parametersKey, &captureFileCountValueName, &value)))
+        {
+            CaptureFileCount = max(min(value, CAPTURE_FILE_MAX_COUNT), 1);
+        }
+
+        WdfRegistryClose(parametersKey);
+    }
+
+    if (CaptureDirectory.Length == 0)
+    {
+        RtlAppendUnicodeToString(&CaptureDirectory, CAPTURE_DEFAULT_DIRECTORY);
+    }
+
+    KdPrint(("Default port log capacity is %lu bytes, budget is %lu bytes\n", DefaultPortLogCapacity, PortLogBudget));
+    KdPrint(("Capture files go to %wZ, up to %lu files of %lu bytes\n", &CaptureDirectory, CaptureFileCount, CaptureFileSize));
+
+    // The frequency is fixed at system boot.
+    KeQueryPerformanceCounter(&PerformanceFrequency);
+
     // Maintain a collection of all active port filter devices.
     status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES, &FilterDevices);
     if (!NT_SUCCESS(status))
@@ -71,20 +236,251 @@ DriverEntry(
         return status;
     }
 
-    // Create a lookaside list to serve all memory requests for port log entries.
-    status = WdfLookasideListCreate(WDF_NO_OBJECT_ATTRIBUTES,
-        PORTSNIFFER_PORTLOG_ENTRY_LENGTH,
-        PagedPool,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        POOL_TAG,
-        &PortLogLookaside);
+    PortHashInitialize(&PortHashTable);
+
+    return STATUS_SUCCESS;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlArmPortTrigger(
+    __in WDFREQUEST Request
+    )
+{
+    PPORTSNIFFER_ARM_PORT_TRIGGER_REQUEST armRequest;
+    ULONG capacity;
+    PFILTER_CONTEXT filterContext;
+    ULONG postLength;
+    ULONG preLength;
+    NTSTATUS status;
+    BOOLEAN subscribed;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlArmPortTrigger(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_ARM_PORT_TRIGGER_REQUEST), &armRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // The program runs for every entry added to the port log, so it must be verified once here.
+    // A trigger without any log entries to look at could never fire.
+    if (!CaptureFilterVerify(armRequest->Instructions, armRequest->InstructionCount) ||
+        (armRequest->MonitorMask & ~PORTSNIFFER_MONITOR_STATS) == PORTSNIFFER_MONITOR_NONE)
+    {
+        KdPrint(("Invalid trigger with %lu instructions and monitor mask 0x%04X\n", armRequest->InstructionCount, armRequest->MonitorMask));
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, armRequest->PortName, &filterContext);
     if (!NT_SUCCESS(status))
     {
-        KdPrint(("WdfLookasideListCreate failed, status = 0x%08lX\n", status));
-        return status;
+        WdfRequestComplete(Request, status);
+        return;
     }
 
-    return STATUS_SUCCESS;
+    // Subscribing and mapping the port log check the trigger under FilterDevicesLock, so hold it until the trigger is armed.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    WdfWaitLockAcquire(filterContext->LogLock, NULL);
+    subscribed = !IsListEmpty(&filterContext->Subscribers);
+    capacity = filterContext->LogCapacity;
+    WdfWaitLockRelease(filterContext->LogLock);
+
+    // Each unspecified length takes half of the capacity.
+    preLength = (armRequest->PreTriggerLength > 0) ? armRequest->PreTriggerLength : capacity / 2;
+    postLength = (armRequest->PostTriggerLength > 0) ? armRequest->PostTriggerLength : capacity / 2;
+
+    if (filterContext->Mapping)
+    {
+        // The entries of a shared port log belong to the application and can't be overwritten.
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else if (subscribed)
+    {
+        // The subscribers read every entry, so we can't hold any back.
+        status = STATUS_DEVICE_BUSY;
+    }
+    else if (preLength > capacity || postLength > capacity - preLength)
+    {
+        status = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        // Start with an empty port log, which also disarms any previous trigger, and set the new monitor mask afterwards.
+        status = PortSnifferFilterAllocatePortLog(filterContext);
+        if (NT_SUCCESS(status))
+        {
+            WdfWaitLockAcquire(filterContext->LogLock, NULL);
+            RtlCopyMemory(filterContext->Trigger, armRequest->Instructions, armRequest->InstructionCount * sizeof(CAPTURE_FILTER_INSTRUCTION));
+            filterContext->TriggerLength = armRequest->InstructionCount;
+            filterContext->TriggerPreLength = preLength;
+            filterContext->TriggerPostLength = postLength;
+            filterContext->TriggerPostBytes = 0;
+            filterContext->TriggerState = PORTSNIFFER_TRIGGER_ARMED;
+            WdfWaitLockRelease(filterContext->LogLock);
+
+            filterContext->MonitorMask = armRequest->MonitorMask;
+        }
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+
+    // Snapshot the request counters every second while collecting statistics.
+    if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+    {
+        WdfTimerStart(filterContext->StatsTimer, WDF_REL_TIMEOUT_IN_MS(1000));
+    }
+    else
+    {
+        WdfTimerStop(filterContext->StatsTimer, TRUE);
+    }
+
+    PortSnifferControlDereferencePort(filterContext);
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlClearPortLog(
+    __in WDFREQUEST Request
+    )
+{
+    PPORTSNIFFER_CLEAR_PORTLOG_REQUEST clearRequest;
+    PFILTER_CONTEXT filterContext;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlClearPortLog(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_CLEAR_PORTLOG_REQUEST), &clearRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, clearRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        // Clearing would leave the read positions of subscribers behind the port log.
+        // Subscribers are added while holding LogLock, so the port can't get a new subscriber before we are done.
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+
+        if (IsListEmpty(&filterContext->Subscribers))
+        {
+            PortSnifferFilterClearPortLog(filterContext);
+        }
+        else
+        {
+            status = STATUS_DEVICE_BUSY;
+        }
+
+        WdfWaitLockRelease(filterContext->LogLock);
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlConfigurePortLog(
+    __in WDFREQUEST Request
+    )
+{
+    ULONG capacity;
+    PPORTSNIFFER_CONFIGURE_PORTLOG_REQUEST configureRequest;
+    PFILTER_CONTEXT filterContext;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlConfigurePortLog(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST), &configureRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    if (configureRequest->OverflowPolicy != PORTSNIFFER_OVERFLOW_DROP_NEWEST &&
+        configureRequest->OverflowPolicy != PORTSNIFFER_OVERFLOW_OVERWRITE_OLDEST)
+    {
+        KdPrint(("Invalid overflow policy %u\n", configureRequest->OverflowPolicy));
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    if ((configureRequest->SamplingMode != PORTSNIFFER_SAMPLING_NONE &&
+         configureRequest->SamplingMode != PORTSNIFFER_SAMPLING_REQUESTS &&
+         configureRequest->SamplingMode != PORTSNIFFER_SAMPLING_SECONDS) ||
+        (configureRequest->SamplingMode != PORTSNIFFER_SAMPLING_NONE && configureRequest->SamplingRate == 0))
+    {
+        KdPrint(("Invalid sampling mode %u with rate %u\n", configureRequest->SamplingMode, configureRequest->SamplingRate));
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    if (configureRequest->RepeatDepth > PORTSNIFFER_MAX_REPEAT_DEPTH)
+    {
+        KdPrint(("Invalid repeat depth %u\n", configureRequest->RepeatDepth));
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    if (configureRequest->Capacity == 0)
+    {
+        capacity = DefaultPortLogCapacity;
+    }
+    else
+    {
+        capacity = PortSnifferFilterNormalizeCapacity(configureRequest->Capacity);
+    }
+
+    status = PortSnifferControlReferencePort(Request, configureRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+
+        filterContext->LogCapacity = capacity;
+        filterContext->OverflowPolicy = configureRequest->OverflowPolicy;
+        filterContext->CoalesceGap = configureRequest->CoalesceGap;
+        filterContext->SnapLength = configureRequest->SnapLength;
+        filterContext->SamplingMode = configureRequest->SamplingMode;
+        filterContext->SamplingRate = configureRequest->SamplingRate;
+        filterContext->SamplingStart = KeQueryPerformanceCounter(NULL).QuadPart;
+
+        // Don't keep an entry open anymore if coalescing has been disabled.
+        if (filterContext->OpenRecord && filterContext->CoalesceGap == 0)
+        {
+            PortSnifferFilterCloseOpenEntry(filterContext);
+            PortSnifferFilterDeliverPortLogEntries(filterContext);
+        }
+
+        // Report the repetitions suppressed so far and start over with the new depth.
+        if (filterContext->Log.Buffer && PortSnifferFilterAddRepeatEntries(filterContext))
+        {
+            PortSnifferFilterDeliverPortLogEntries(filterContext);
+        }
+
+        PortSnifferFilterResetRepeats(filterContext);
+        filterContext->RepeatDepth = configureRequest->RepeatDepth;
+
+        // Give back memory beyond the new capacity right away if possible.
+        PortSnifferFilterShrinkPortLog(filterContext);
+
+        WdfWaitLockRelease(filterContext->LogLock);
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestComplete(Request, status);
 }
 
 __drv_requiresIRQL(PASSIVE_LEVEL)
@@ -99,6 +495,8 @@ PortSnifferControlCreate(
     WDFDEVICE controlDevice = NULL;
     WDF_OBJECT_ATTRIBUTES deviceAttributes;
     PWDFDEVICE_INIT deviceInit = NULL;
+    WDF_OBJECT_ATTRIBUTES fileAttributes;
+    WDF_FILEOBJECT_CONFIG fileConfig;
     WDF_OBJECT_ATTRIBUTES ioQueueAttributes;
     WDF_IO_QUEUE_CONFIG ioQueueConfig;
     NTSTATUS status;
@@ -123,8 +521,16 @@ PortSnifferControlCreate(
         goto Cleanup;
     }
 
-    // For now, we only want a single application to simultaneously access the control device (no concurrency).
-    WdfDeviceInitSetExclusive(deviceInit, TRUE);
+    // Several applications may access the control device at the same time (access is still limited by the SDDL above).
+    // Keep track of the port logs mapped into the application, its subscription and the port session per file object.
+    // Port logs are unmapped in the cleanup callback, which is called in the context of the application.
+    // The port session is released in the close callback, when no more requests of the file object are running.
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, PortSnifferControlEvtDeviceFileCreate, PortSnifferControlEvtFileClose, PortSnifferControlEvtFileCleanup);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, CONTROL_FILE_CONTEXT);
+    WdfDeviceInitSetFileObjectConfig(deviceInit, &fileConfig, &fileAttributes);
+
+    // Mapping a port log into the application also needs to be done in its context.
+    WdfDeviceInitSetIoInCallerContextCallback(deviceInit, PortSnifferControlEvtIoInCallerContext);
 
     // Create our control device.
     WDF_OBJECT_ATTRIBUTES_INIT(&deviceAttributes);
@@ -136,7 +542,9 @@ PortSnifferControlCreate(
     }
 
     // Register a callback for the application's DeviceIoControl calls to our control device.
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig, WdfIoQueueDispatchSequential);
+    // Requests are handled in parallel, so that applications consuming different ports don't wait for each other.
+    // Control requests synchronize through FilterDevicesLock and the LogLock of each port instead.
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig, WdfIoQueueDispatchParallel);
     ioQueueConfig.EvtIoDeviceControl = PortSnifferControlEvtIoDeviceControl;
 
     // Ensure that all callback routines are run at IRQL == PASSIVE_LEVEL as we are acquiring a wait lock there.
@@ -179,132 +587,453 @@ Cleanup:
     return status;
 }
 
-__drv_functionClass(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
-__drv_sameIRQL
-__drv_maxIRQL(DISPATCH_LEVEL)
-void
-PortSnifferControlEvtIoDeviceControl(
-    __in WDFQUEUE Queue,
-    __in WDFREQUEST Request,
-    __in size_t OutputBufferLength,
-    __in size_t InputBufferLength,
-    __in ULONG IoControlCode
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlCreateMapping(
+    __in HANDLE EventHandle,
+    __in ULONG LogSize,
+    __out PPORTLOG_MAPPING* Mapping
     )
 {
-    UNREFERENCED_PARAMETER(Queue);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
+    PPORTLOG_MAPPING mapping;
+    NTSTATUS status;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferControlEvtIoDeviceControl(%p, %p, %Iu, %Iu, %lu)\n", Queue, Request, OutputBufferLength, InputBufferLength, IoControlCode));
+    KdPrint(("PortSnifferControlCreateMapping(%p, %lu, %p)\n", EventHandle, LogSize, Mapping));
 
-    switch (IoControlCode)
+    // This must be called in the context of the application.
+    mapping = ExAllocatePoolWithTag(PagedPool, sizeof(PORTLOG_MAPPING), POOL_TAG);
+    if (!mapping)
     {
-        case PORTSNIFFER_IOCTL_CONTROL_GET_VERSION:
-            PortSnifferControlGetVersion(Request);
-            break;
-
-        case PORTSNIFFER_IOCTL_CONTROL_GET_ATTACHED_PORTS:
-            PortSnifferControlGetAttachedPorts(Request);
-            break;
-
-        case PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING:
-            PortSnifferControlResetPortMonitoring(Request);
-            break;
+        KdPrint(("ExAllocatePoolWithTag failed for %Iu bytes\n", sizeof(PORTLOG_MAPPING)));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        case PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRY:
-            PortSnifferControlPopPortLogEntry(Request);
-            break;
+    RtlZeroMemory(mapping, sizeof(PORTLOG_MAPPING));
 
-        default:
-            WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
-            break;
+    // Keep a reference to the application's event for as long as we may set it.
+    status = ObReferenceObjectByHandle(EventHandle, EVENT_MODIFY_STATE, *ExEventObjectType, UserMode, &mapping->Event, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ObReferenceObjectByHandle failed, status = 0x%08lX\n", status));
+        goto Cleanup;
     }
-}
 
-__drv_requiresIRQL(PASSIVE_LEVEL)
-void
-PortSnifferControlGetAttachedPorts(
-    __in WDFREQUEST Request
-    )
-{
-    ULONG count;
-    WDFDEVICE device;
-    ULONG i;
-    PWSTR p;
-    PFILTER_CONTEXT filterContext;
-    PPORTSNIFFER_GET_ATTACHED_PORTS_RESPONSE response;
-    size_t responseBufferLength;
-    NTSTATUS status;
+    // A shared port log can't grow, so its full size is charged to the budget right away.
+    if (!PortSnifferFilterChargePortLogBudget(LogSize))
+    {
+        KdPrint(("Port log budget is exhausted\n"));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
 
-    PAGED_CODE();
-    KdPrint(("PortSnifferControlGetAttachedPorts(%p)\n", Request));
+    mapping->LogSize = LogSize;
 
-    // Get the output buffer that must have enough space for at least the Length field.
-    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), &response, &responseBufferLength);
-    if (!NT_SUCCESS(status))
+    // The application gets whole pages mapped, so allocate and zero whole pages to not reveal any other memory.
+    // The memory must be nonpaged, because we access it through an MDL.
+    mapping->Length = (ULONG)ROUND_TO_PAGES(sizeof(PORTLOG_SHARED_HEADER) + LogSize);
+    mapping->Header = ExAllocatePoolWithTag(NonPagedPool, mapping->Length, POOL_TAG);
+    if (!mapping->Header)
     {
-        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
-        return;
+        KdPrint(("ExAllocatePoolWithTag failed for %lu bytes\n", mapping->Length));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
     }
 
-    // Calculate the required output buffer size.
-    WdfWaitLockAcquire(FilterDevicesLock, NULL);
-    count = WdfCollectionGetCount(FilterDevices);
+    RtlZeroMemory(mapping->Header, mapping->Length);
 
-    response->Length = FIELD_OFFSET(PORTSNIFFER_GET_ATTACHED_PORTS_RESPONSE, PortNames);
-    for (i = 0; i < count; i++)
+    mapping->Mdl = IoAllocateMdl(mapping->Header, mapping->Length, FALSE, FALSE, NULL);
+    if (!mapping->Mdl)
     {
-        device = WdfCollectionGetItem(FilterDevices, i);
-        filterContext = GetFilterContext(device);
-        response->Length += filterContext->PortName.Length + sizeof(WCHAR);
+        KdPrint(("IoAllocateMdl failed\n"));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
     }
 
-    response->Length += sizeof(WCHAR);
+    MmBuildMdlForNonPagedPool(mapping->Mdl);
 
-    // Check if the provided buffer is large enough.
-    if (responseBufferLength >= response->Length)
+    // Mapping into user space raises an exception instead of returning NULL on failure.
+    __try
     {
-        // Copy the port names to the provided buffer.
-        // They are separated by NUL terminators, with a final NUL to terminate the string sequence (just like REG_MULTI_SZ).
-        p = response->PortNames;
-        for (i = 0; i < count; i++)
-        {
-            device = WdfCollectionGetItem(FilterDevices, i);
-            filterContext = GetFilterContext(device);
+        mapping->UserAddress = MmMapLockedPagesSpecifyCache(mapping->Mdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        KdPrint(("MmMapLockedPagesSpecifyCache failed, status = 0x%08lX\n", GetExceptionCode()));
+        mapping->UserAddress = NULL;
+    }
 
-            RtlCopyMemory(p, filterContext->PortName.Buffer, filterContext->PortName.Length);
-            p += filterContext->PortName.Length / sizeof(WCHAR);
-            *p = L'\0';
-            p++;
+    if (!mapping->UserAddress)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Cleanup;
+    }
+
+    *Mapping = mapping;
+    mapping = NULL;
+    status = STATUS_SUCCESS;
+
+Cleanup:
+    if (mapping)
+    {
+        PortSnifferControlDeleteMapping(mapping);
+    }
+
+    return status;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlDeleteMapping(
+    __in PPORTLOG_MAPPING Mapping
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlDeleteMapping(%p)\n", Mapping));
+
+    // This must be called in the context of the application and after the mapping has been detached from its port.
+    if (Mapping->UserAddress)
+    {
+        MmUnmapLockedPages(Mapping->UserAddress, Mapping->Mdl);
+    }
+
+    if (Mapping->Mdl)
+    {
+        IoFreeMdl(Mapping->Mdl);
+    }
+
+    if (Mapping->Header)
+    {
+        ExFreePoolWithTag(Mapping->Header, POOL_TAG);
+    }
+
+    if (Mapping->Event)
+    {
+        ObDereferenceObject(Mapping->Event);
+    }
+
+    if (Mapping->LogSize)
+    {
+        PortSnifferFilterReturnPortLogBudget(Mapping->LogSize);
+    }
+
+    ExFreePoolWithTag(Mapping, POOL_TAG);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlDereferencePort(
+    __in PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlDereferencePort(%p)\n", FilterContext));
+
+    // Counterpart of PortSnifferControlReferencePort.
+    ExReleaseRundownProtection(&FilterContext->Rundown);
+}
+
+__drv_functionClass(EVT_WDF_DEVICE_FILE_CREATE)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlEvtDeviceFileCreate(
+    __in WDFDEVICE Device,
+    __in WDFREQUEST Request,
+    __in WDFFILEOBJECT FileObject
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+
+    UNREFERENCED_PARAMETER(Device);
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlEvtDeviceFileCreate(%p, %p, %p)\n", Device, Request, FileObject));
+
+    fileContext = GetControlFileContext(FileObject);
+    InitializeListHead(&fileContext->Mappings);
+    fileContext->SessionDevice = NULL;
+    InitializeListHead(&fileContext->Subscriber.ListEntry);
+    fileContext->Subscriber.FilterContext = NULL;
+    fileContext->Subscriber.WaitQueue = NULL;
+    fileContext->Subscriber.WaitMinLength = 0;
+    fileContext->Subscriber.WaitMaxDelay = 0;
+
+    WdfRequestComplete(Request, STATUS_SUCCESS);
+}
+
+__drv_functionClass(EVT_WDF_FILE_CLEANUP)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlEvtFileCleanup(
+    __in WDFFILEOBJECT FileObject
+    )
+{
+    ULONG count;
+    PLIST_ENTRY entry;
+    PCONTROL_FILE_CONTEXT fileContext;
+    PFILTER_CONTEXT filterContext;
+    ULONG i;
+    PPORTLOG_MAPPING mapping;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlEvtFileCleanup(%p)\n", FileObject));
+
+    // We are called in the context of the application, so this is the place to unmap all its port logs.
+    // The framework has already canceled all pending requests of this file object in the wait queues of the control device.
+    fileContext = GetControlFileContext(FileObject);
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    while (!IsListEmpty(&fileContext->Mappings))
+    {
+        entry = RemoveHeadList(&fileContext->Mappings);
+        mapping = CONTAINING_RECORD(entry, PORTLOG_MAPPING, ListEntry);
+
+        // Stop the port from adding further log entries to this mapping.
+        filterContext = mapping->FilterContext;
+        if (filterContext)
+        {
+            WdfWaitLockAcquire(filterContext->LogLock, NULL);
+            PortSnifferFilterDetachMapping(filterContext);
+            WdfWaitLockRelease(filterContext->LogLock);
         }
 
-        *p = L'\0';
-        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, response->Length);
+        PortSnifferControlDeleteMapping(mapping);
     }
-    else
+
+    // Let the port go on without this subscriber.
+    if (fileContext->Subscriber.FilterContext)
     {
-        // Return only the Length field containing the required buffer size.
-        WdfRequestCompleteWithInformation(Request, STATUS_BUFFER_OVERFLOW, sizeof(ULONG));
+        PortSnifferControlUnsubscribePort(&fileContext->Subscriber);
+    }
+
+    // Ports whose monitoring is bound to this file object keep capturing for their linger period.
+    count = WdfCollectionGetCount(FilterDevices);
+    for (i = 0; i < count; i++)
+    {
+        filterContext = GetFilterContext(WdfCollectionGetItem(FilterDevices, i));
+        if (filterContext->LingerOwner == FileObject)
+        {
+            KdPrint(("%wZ lingers for %lu seconds\n", &filterContext->PortName, filterContext->LingerTime));
+            filterContext->LingerOwner = NULL;
+            filterContext->LingerPending = TRUE;
+            WdfTimerStart(filterContext->LingerTimer, WDF_REL_TIMEOUT_IN_SEC(filterContext->LingerTime));
+        }
     }
 
     WdfWaitLockRelease(FilterDevicesLock);
 }
 
+__drv_functionClass(EVT_WDF_FILE_CLOSE)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlEvtFileClose(
+    __in WDFFILEOBJECT FileObject
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlEvtFileClose(%p)\n", FileObject));
+
+    // All requests of this file object have finished, so the port session can let go of its filter device.
+    fileContext = GetControlFileContext(FileObject);
+    if (fileContext->SessionDevice)
+    {
+        WdfObjectDereference(fileContext->SessionDevice);
+        fileContext->SessionDevice = NULL;
+    }
+}
+
+__drv_functionClass(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferControlEvtIoDeviceControl(
+    __in WDFQUEUE Queue,
+    __in WDFREQUEST Request,
+    __in size_t OutputBufferLength,
+    __in size_t InputBufferLength,
+    __in ULONG IoControlCode
+    )
+{
+    UNREFERENCED_PARAMETER(Queue);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlEvtIoDeviceControl(%p, %p, %Iu, %Iu, %lu)\n", Queue, Request, OutputBufferLength, InputBufferLength, IoControlCode));
+
+    switch (IoControlCode)
+    {
+        case PORTSNIFFER_IOCTL_CONTROL_GET_VERSION:
+            PortSnifferControlGetVersion(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_GET_ATTACHED_PORTS:
+            PortSnifferControlGetAttachedPorts(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING:
+            PortSnifferControlResetPortMonitoring(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRY:
+            PortSnifferControlPopPortLogEntry(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES:
+            PortSnifferControlPopPortLogEntries(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES:
+            PortSnifferControlWaitPortLogEntries(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_GET_PORTLOG_COUNTERS:
+            PortSnifferControlGetPortLogCounters(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_CONFIGURE_PORTLOG:
+            PortSnifferControlConfigurePortLog(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_OPEN_PORT_SESSION:
+            PortSnifferControlOpenPortSession(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_SET_IOCTL_FILTER:
+            PortSnifferControlSetIoctlFilter(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_GET_PORT_INDEXES:
+            PortSnifferControlGetPortIndexes(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_POP_MERGED_PORTLOG_ENTRIES:
+            PortSnifferControlPopMergedPortLogEntries(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_GET_PORT_STATISTICS:
+            PortSnifferControlGetPortStatistics(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_SET_CAPTURE_FILTER:
+            PortSnifferControlSetCaptureFilter(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT:
+            PortSnifferControlSubscribePort(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_ARM_PORT_TRIGGER:
+            PortSnifferControlArmPortTrigger(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_GET_PORT_TRIGGER:
+            PortSnifferControlGetPortTrigger(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_SET_PORT_MONITOR_MASK:
+            PortSnifferControlSetPortMonitorMask(Request);
+            break;
+
+        case PORTSNIFFER_IOCTL_CONTROL_CLEAR_PORTLOG:
+            PortSnifferControlClearPortLog(Request);
+            break;
+
+        default:
+            WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+            break;
+    }
+}
+
+__drv_functionClass(EVT_WDF_IO_IN_CALLER_CONTEXT)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferControlEvtIoInCallerContext(
+    __in WDFDEVICE Device,
+    __in WDFREQUEST Request
+    )
+{
+    WDF_REQUEST_PARAMETERS parameters;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlEvtIoInCallerContext(%p, %p)\n", Device, Request));
+
+    // Handle PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG right here, because it must run in the context of the application.
+    // Everything else goes to our I/O Queue.
+    WDF_REQUEST_PARAMETERS_INIT(&parameters);
+    WdfRequestGetParameters(Request, &parameters);
+
+    if (parameters.Type == WdfRequestTypeDeviceControl &&
+        parameters.Parameters.DeviceIoControl.IoControlCode == PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG)
+    {
+        PortSnifferControlMapPortLog(Request);
+        return;
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfDeviceEnqueueRequest failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PFILTER_CONTEXT
+PortSnifferControlFindPort(
+    __inout_ecount(PORTSNIFFER_PORTNAME_LENGTH) PWSTR PortName
+    )
+{
+    PPORT_HASH_ENTRY entry;
+    UNICODE_STRING unicodePortName;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlFindPort(%p)\n", PortName));
+
+    // The caller may have sent us a non-NUL-terminated buffer, causing a buffer overrun if fed directly to wcscmp.
+    // Avoid that by NUL-terminating the last possible character ourselves.
+    PortName[PORTSNIFFER_PORTNAME_LENGTH - 1] = L'\0';
+    RtlInitUnicodeString(&unicodePortName, PortName);
+
+    // Look for the requested port name in its hash bucket.
+    // The caller must hold FilterDevicesLock and can only keep using the returned filter context after releasing it
+    // if it has acquired the rundown protection of the port in the meantime.
+    entry = PortHashFind(&PortHashTable, unicodePortName.Buffer, unicodePortName.Length / sizeof(WCHAR));
+    if (!entry)
+    {
+        return NULL;
+    }
+
+    return CONTAINING_RECORD(entry, FILTER_CONTEXT, HashEntry);
+}
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
-PortSnifferControlGetVersion(
+PortSnifferControlGetAttachedPorts(
     __in WDFREQUEST Request
     )
 {
-    PPORTSNIFFER_GET_VERSION_RESPONSE response;
+    ULONG count;
+    WDFDEVICE device;
+    ULONG i;
+    PWSTR p;
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_GET_ATTACHED_PORTS_RESPONSE response;
+    size_t responseBufferLength;
     NTSTATUS status;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferControlGetVersion(%p)\n", Request));
+    KdPrint(("PortSnifferControlGetAttachedPorts(%p)\n", Request));
 
-    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(PORTSNIFFER_GET_VERSION_RESPONSE), &response, NULL);
+    // Get the output buffer that must have enough space for at least the Length field.
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), &response, &responseBufferLength);
     if (!NT_SUCCESS(status))
     {
         KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
@@ -312,725 +1041,5704 @@ PortSnifferControlGetVersion(
         return;
     }
 
-    response->MajorVersion = PORTSNIFFER_MAJOR_VERSION;
-    response->MinorVersion = PORTSNIFFER_MINOR_VERSION;
-
-    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(PORTSNIFFER_GET_VERSION_RESPONSE));
+    // Calculate the required output buffer size.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+    count = WdfCollectionGetCount(FilterDevices);
+
+    response->Length = FIELD_OFFSET(PORTSNIFFER_GET_ATTACHED_PORTS_RESPONSE, PortNames);
+    for (i = 0; i < count; i++)
+    {
+        device = WdfCollectionGetItem(FilterDevices, i);
+        filterContext = GetFilterContext(device);
+        response->Length += filterContext->PortName.Length + sizeof(WCHAR);
+    }
+
+    response->Length += sizeof(WCHAR);
+
+    // Check if the provided buffer is large enough.
+    if (responseBufferLength >= response->Length)
+    {
+        // Copy the port names to the provided buffer.
+        // They are separated by NUL terminators, with a final NUL to terminate the string sequence (just like REG_MULTI_SZ).
+        p = response->PortNames;
+        for (i = 0; i < count; i++)
+        {
+            device = WdfCollectionGetItem(FilterDevices, i);
+            filterContext = GetFilterContext(device);
+
+            RtlCopyMemory(p, filterContext->PortName.Buffer, filterContext->PortName.Length);
+            p += filterContext->PortName.Length / sizeof(WCHAR);
+            *p = L'\0';
+            p++;
+        }
+
+        *p = L'\0';
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, response->Length);
+    }
+    else
+    {
+        // Return only the Length field containing the required buffer size.
+        WdfRequestCompleteWithInformation(Request, STATUS_BUFFER_OVERFLOW, sizeof(ULONG));
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortIndexes(
+    __in WDFREQUEST Request
+    )
+{
+    ULONG count;
+    PFILTER_CONTEXT filterContext;
+    ULONG i;
+    PPORTSNIFFER_PORT_INDEX_ENTRY port;
+    PPORTSNIFFER_GET_PORT_INDEXES_RESPONSE response;
+    size_t responseBufferLength;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlGetPortIndexes(%p)\n", Request));
+
+    // Get the output buffer that must have enough space for at least the Length field.
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), &response, &responseBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // Calculate the required output buffer size.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    count = 0;
+    for (i = 0; i < PORTSNIFFER_PORT_INDEX_COUNT; i++)
+    {
+        if (PortIndexes[i])
+        {
+            count++;
+        }
+    }
+
+    response->Length = FIELD_OFFSET(PORTSNIFFER_GET_PORT_INDEXES_RESPONSE, Ports) + count * sizeof(PORTSNIFFER_PORT_INDEX_ENTRY);
+
+    // Check if the provided buffer is large enough.
+    if (responseBufferLength >= response->Length)
+    {
+        // Copy index and NUL-terminated name of every port that has an index.
+        port = response->Ports;
+        for (i = 0; i < PORTSNIFFER_PORT_INDEX_COUNT; i++)
+        {
+            filterContext = PortIndexes[i];
+            if (filterContext)
+            {
+                port->PortIndex = (USHORT)i;
+                RtlZeroMemory(port->PortName, sizeof(port->PortName));
+                RtlCopyMemory(port->PortName, filterContext->PortName.Buffer, min(filterContext->PortName.Length, sizeof(port->PortName) - sizeof(WCHAR)));
+                port++;
+            }
+        }
+
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, response->Length);
+    }
+    else
+    {
+        // Return only the Length field containing the required buffer size.
+        WdfRequestCompleteWithInformation(Request, STATUS_BUFFER_OVERFLOW, sizeof(ULONG));
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortLogCounters(
+    __in WDFREQUEST Request
+    )
+{
+    PPORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST countersRequest;
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE response;
+    ULONG_PTR responseLength = 0;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlGetPortLogCounters(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST), &countersRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE), &response, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, countersRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        // The response overwrites the request in the shared system buffer, but we are done with the port name.
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+        *response = filterContext->Counters;
+        WdfWaitLockRelease(filterContext->LogLock);
+
+        // The request counters are updated without LogLock, so read them atomically.
+        response->ReadRequests = InterlockedCompareExchange64(&filterContext->RequestCounters[CAPTURE_READ].Completed, 0, 0);
+        response->ReadBytes = InterlockedCompareExchange64(&filterContext->RequestCounters[CAPTURE_READ].Bytes, 0, 0);
+        response->WriteRequests = InterlockedCompareExchange64(&filterContext->RequestCounters[CAPTURE_WRITE].Completed, 0, 0);
+        response->WriteBytes = InterlockedCompareExchange64(&filterContext->RequestCounters[CAPTURE_WRITE].Bytes, 0, 0);
+        response->IoctlRequests = InterlockedCompareExchange64(&filterContext->RequestCounters[CAPTURE_IOCTL].Completed, 0, 0);
+
+        PortSnifferControlDereferencePort(filterContext);
+        responseLength = sizeof(PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE);
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, responseLength);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortStatistics(
+    __in WDFREQUEST Request
+    )
+{
+    ULONG count;
+    ULONG i;
+    PPORTSNIFFER_GET_PORT_STATISTICS_RESPONSE response;
+    size_t responseBufferLength;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlGetPortStatistics(%p)\n", Request));
+
+    // Get the output buffer that must have enough space for at least the Length field.
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ULONG), &response, &responseBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // Calculate the required output buffer size.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+    count = WdfCollectionGetCount(FilterDevices);
+    response->Length = FIELD_OFFSET(PORTSNIFFER_GET_PORT_STATISTICS_RESPONSE, Ports) + count * sizeof(PORTSNIFFER_PORT_STATISTICS);
+
+    // Check if the provided buffer is large enough.
+    if (responseBufferLength >= response->Length)
+    {
+        // The buffer of this METHOD_BUFFERED request is nonpaged, so the statistics can be copied right into it.
+        for (i = 0; i < count; i++)
+        {
+            PortSnifferFilterGetStatistics(GetFilterContext(WdfCollectionGetItem(FilterDevices, i)), &response->Ports[i]);
+        }
+
+        WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, response->Length);
+    }
+    else
+    {
+        // Return only the Length field containing the required buffer size.
+        WdfRequestCompleteWithInformation(Request, STATUS_BUFFER_OVERFLOW, sizeof(ULONG));
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortTrigger(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_GET_PORT_TRIGGER_RESPONSE response;
+    ULONG_PTR responseLength = 0;
+    NTSTATUS status;
+    PPORTSNIFFER_GET_PORT_TRIGGER_REQUEST triggerRequest;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlGetPortTrigger(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_GET_PORT_TRIGGER_REQUEST), &triggerRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(PORTSNIFFER_GET_PORT_TRIGGER_RESPONSE), &response, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, triggerRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        // The response overwrites the request in the shared system buffer, but we are done with the port name.
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+        response->State = filterContext->TriggerState;
+        response->PreTriggerLength = filterContext->TriggerPreLength;
+        response->PostTriggerLength = filterContext->TriggerPostLength;
+        response->Timestamp = filterContext->TriggerTimestamp;
+        response->Clock = filterContext->TriggerClock;
+        WdfWaitLockRelease(filterContext->LogLock);
+
+        PortSnifferControlDereferencePort(filterContext);
+        responseLength = sizeof(PORTSNIFFER_GET_PORT_TRIGGER_RESPONSE);
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, responseLength);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_SUBSCRIBER
+PortSnifferControlGetSubscriber(
+    __in WDFREQUEST Request,
+    __in PFILTER_CONTEXT FilterContext
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlGetSubscriber(%p, %p)\n", Request, FilterContext));
+
+    // Requests on a subscribed handle consume through its read position when they address the subscribed port.
+    // The handle may be closed in the meantime, which PortSnifferFilterCheckConsumer detects under LogLock.
+    fileContext = GetControlFileContext(WdfRequestGetFileObject(Request));
+    if (fileContext->Subscriber.FilterContext != FilterContext)
+    {
+        return NULL;
+    }
+
+    return &fileContext->Subscriber;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetVersion(
+    __in WDFREQUEST Request
+    )
+{
+    PPORTSNIFFER_GET_VERSION_RESPONSE response;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlGetVersion(%p)\n", Request));
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(PORTSNIFFER_GET_VERSION_RESPONSE), &response, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    response->MajorVersion = PORTSNIFFER_MAJOR_VERSION;
+    response->MinorVersion = PORTSNIFFER_MINOR_VERSION;
+
+    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(PORTSNIFFER_GET_VERSION_RESPONSE));
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlMapPortLog(
+    __in WDFREQUEST Request
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+    PFILTER_CONTEXT filterContext;
+    ULONG logSize;
+    PPORTSNIFFER_MAP_PORTLOG_REQUEST mapRequest;
+    PPORTLOG_MAPPING mapping = NULL;
+    PVOID privateBuffer = NULL;
+    ULONG privateSize = 0;
+    PPORTSNIFFER_MAP_PORTLOG_RESPONSE response;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlMapPortLog(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_MAP_PORTLOG_REQUEST), &mapRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(PORTSNIFFER_MAP_PORTLOG_RESPONSE), &response, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    fileContext = GetControlFileContext(WdfRequestGetFileObject(Request));
+
+    status = PortSnifferControlReferencePort(Request, mapRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        // We are called in the context of the application, so we can map the new port log into it right away.
+        // A shared port log can't grow, so it gets the full capacity of the port.
+        // Our reference keeps the port from going away, but we don't block adding log entries meanwhile.
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+        logSize = filterContext->LogCapacity;
+        WdfWaitLockRelease(filterContext->LogLock);
+
+        status = PortSnifferControlCreateMapping((HANDLE)(ULONG_PTR)mapRequest->Event, logSize, &mapping);
+        if (NT_SUCCESS(status))
+        {
+            // Linking the mapping with the port and our file object requires FilterDevicesLock.
+            WdfWaitLockAcquire(FilterDevicesLock, NULL);
+            WdfWaitLockAcquire(filterContext->LogLock, NULL);
+
+            if (filterContext->Mapping)
+            {
+                status = STATUS_DEVICE_BUSY;
+            }
+            else if (!filterContext->Log.Buffer)
+            {
+                // Monitoring has not been started for this port.
+                status = STATUS_INVALID_DEVICE_STATE;
+            }
+            else if (!IsListEmpty(&filterContext->Subscribers))
+            {
+                // The subscribers are still reading from the private port log.
+                status = STATUS_INVALID_DEVICE_STATE;
+            }
+            else if (filterContext->TriggerState != PORTSNIFFER_TRIGGER_NONE)
+            {
+                // The trigger keeps its entries in the private port log until they have been popped.
+                status = STATUS_INVALID_DEVICE_STATE;
+            }
+            else
+            {
+                // Replace the private port log by the shared one.
+                // Any entries that have not been popped so far are discarded.
+                privateBuffer = filterContext->Log.Buffer;
+                privateSize = filterContext->Log.Size;
+                filterContext->OpenRecord = NULL;
+                PortLogSharedInitialize(mapping->Header, mapping->LogSize, &filterContext->Log);
+                filterContext->Mapping = mapping;
+                mapping->FilterContext = filterContext;
+                InsertTailList(&fileContext->Mappings, &mapping->ListEntry);
+
+                response->Address = (ULONG_PTR)mapping->UserAddress;
+                response->Length = mapping->Length;
+                mapping = NULL;
+                status = STATUS_SUCCESS;
+            }
+
+            WdfWaitLockRelease(filterContext->LogLock);
+            WdfWaitLockRelease(FilterDevicesLock);
+        }
+        else
+        {
+            KdPrint(("PortSnifferControlCreateMapping failed, status = 0x%08lX\n", status));
+        }
+
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+Cleanup:
+    if (privateBuffer)
+    {
+        ExFreePoolWithTag(privateBuffer, POOL_TAG);
+        PortSnifferFilterReturnPortLogBudget(privateSize);
+    }
+
+    if (mapping)
+    {
+        PortSnifferControlDeleteMapping(mapping);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        WdfRequestCompleteWithInformation(Request, status, sizeof(PORTSNIFFER_MAP_PORTLOG_RESPONSE));
+    }
+    else
+    {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlOpenPortSession(
+    __in WDFREQUEST Request
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_OPEN_PORT_SESSION_REQUEST sessionRequest;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlOpenPortSession(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_OPEN_PORT_SESSION_REQUEST), &sessionRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // A file object can only be bound to a single port.
+    // Binding it requires FilterDevicesLock, so that parallel requests of the same application can't bind it twice.
+    fileContext = GetControlFileContext(WdfRequestGetFileObject(Request));
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    // Look for the requested port name.
+    filterContext = PortSnifferControlFindPort(sessionRequest->PortName);
+    if (fileContext->SessionDevice)
+    {
+        status = STATUS_DEVICE_BUSY;
+    }
+    else if (!filterContext)
+    {
+        status = STATUS_NO_SUCH_DEVICE;
+    }
+    else
+    {
+        // Keep the filter device and its context alive until the file object is closed.
+        // This doesn't keep the port from being removed, which its rundown protection takes care of.
+        fileContext->SessionDevice = WdfObjectContextGetObject(filterContext);
+        WdfObjectReference(fileContext->SessionDevice);
+        status = STATUS_SUCCESS;
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlPopMergedPortLogEntries(
+    __in WDFREQUEST Request
+    )
+{
+    ULONG count;
+    PFILTER_CONTEXT filterContext;
+    PFILTER_CONTEXT* filterContexts;
+    ULONG i;
+    PPORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_REQUEST popRequest;
+    PPORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE response;
+    size_t responseBufferLength;
+    ULONG_PTR responseLength;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlPopMergedPortLogEntries(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_REQUEST), &popRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // This is a METHOD_OUT_DIRECT request, so we get a system address for the locked user buffer and write to it directly.
+    status = WdfRequestRetrieveOutputBuffer(Request, PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_MIN_LENGTH, &response, &responseBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // An array for all possible ports is too large for the kernel stack.
+    filterContexts = ExAllocatePoolWithTag(PagedPool, PORTSNIFFER_PORT_INDEX_COUNT * sizeof(PFILTER_CONTEXT), POOL_TAG);
+    if (!filterContexts)
+    {
+        KdPrint(("ExAllocatePoolWithTag failed for %Iu bytes\n", PORTSNIFFER_PORT_INDEX_COUNT * sizeof(PFILTER_CONTEXT)));
+        WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+        return;
+    }
+
+    // Reference all selected ports in the order of their indexes.
+    // Ports are only unpublished under FilterDevicesLock, so a port we find can't be drained before we have a reference.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    count = 0;
+    for (i = 0; i < PORTSNIFFER_PORT_INDEX_COUNT; i++)
+    {
+        filterContext = PortIndexes[i];
+        if (filterContext && PORTSNIFFER_PORT_MASK_TEST(popRequest->PortMask, i) && ExAcquireRundownProtection(&filterContext->Rundown))
+        {
+            filterContexts[count] = filterContext;
+            count++;
+        }
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+
+    responseLength = PortSnifferControlPopMergedPortLogEntriesInternal(filterContexts, count, response, responseBufferLength);
+
+    for (i = 0; i < count; i++)
+    {
+        PortSnifferControlDereferencePort(filterContexts[i]);
+    }
+
+    ExFreePoolWithTag(filterContexts, POOL_TAG);
+
+    // Still return ExcludedPortMask if there are no entries.
+    status = (responseLength > FIELD_OFFSET(PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE, Records)) ? STATUS_SUCCESS : STATUS_NO_MORE_ENTRIES;
+    WdfRequestCompleteWithInformation(Request, status, responseLength);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+size_t
+PortSnifferControlPopMergedPortLogEntriesInternal(
+    __in_ecount(Count) PFILTER_CONTEXT* FilterContexts,
+    __in ULONG Count,
+    __out_bcount(ResponseBufferLength) PPORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE Response,
+    __in size_t ResponseBufferLength
+    )
+{
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    PFILTER_CONTEXT filterContext;
+    ULONG i;
+    PPORTSNIFFER_MERGED_PORTLOG_ENTRY mergedEntry;
+    size_t offset;
+    PFILTER_CONTEXT oldestFilterContext;
+    PPORTLOG_RECORD oldestRecord;
+    LONGLONG oldestTimestamp;
+    USHORT payloadLength;
+    PPORTLOG_RECORD record;
+    LONGLONG timestamp;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlPopMergedPortLogEntriesInternal(%p, %lu, %p, %Iu)\n", FilterContexts, Count, Response, ResponseBufferLength));
+
+    // The caller has referenced the ports in the order of their indexes, and the index of a port never changes.
+    // Acquiring their LogLocks in this order therefore can't deadlock with other merged requests.
+    // The response buffer is at least PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_MIN_LENGTH bytes large.
+    RtlZeroMemory(Response->ExcludedPortMask, sizeof(Response->ExcludedPortMask));
+
+    for (i = 0; i < Count; i++)
+    {
+        filterContext = FilterContexts[i];
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+
+        // Never read from a shared port log, as the application can write anything to it.
+        // Entries of a port with subscribers are only removed once all of them have read them.
+        // Popping the entries of such a port by name fails, so tell the application instead of silently leaving them out.
+        if (filterContext->Log.Buffer && !NT_SUCCESS(PortSnifferFilterCheckConsumer(filterContext, NULL)))
+        {
+            PORTSNIFFER_PORT_MASK_SET(Response->ExcludedPortMask, filterContext->PortIndex);
+        }
+    }
+
+    offset = FIELD_OFFSET(PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE, Records);
+
+    for (;;)
+    {
+        // Find the port with the oldest entry.
+        // The entries of every port are in timestamp order, so this only needs to look at the oldest entry of each port.
+        oldestFilterContext = NULL;
+        oldestRecord = NULL;
+        oldestTimestamp = 0;
+
+        for (i = 0; i < Count; i++)
+        {
+            filterContext = FilterContexts[i];
+
+            // Entries of a port with a pending trigger are held back until its capture is complete.
+            if (!filterContext->Log.Buffer || PORTSNIFFER_PORT_MASK_TEST(Response->ExcludedPortMask, filterContext->PortIndex) ||
+                PortSnifferFilterIsTriggerPending(filterContext))
+            {
+                continue;
+            }
+
+            // Report overwritten entries before the oldest remaining one.
+            record = NULL;
+            if (filterContext->OverwrittenGap.Entries > 0)
+            {
+                timestamp = filterContext->OverwrittenGap.Timestamp.QuadPart;
+            }
+            else
+            {
+                record = PortLogRingPeek(&filterContext->Log);
+                if (!record)
+                {
+                    continue;
+                }
+
+                entry = PORTLOG_RECORD_PAYLOAD(record);
+                timestamp = entry->Timestamp.QuadPart;
+            }
+
+            if (!oldestFilterContext || timestamp < oldestTimestamp)
+            {
+                oldestFilterContext = filterContext;
+                oldestRecord = record;
+                oldestTimestamp = timestamp;
+            }
+        }
+
+        if (!oldestFilterContext)
+        {
+            break;
+        }
+
+        // Stop at the first entry that doesn't fit anymore, so that the response stays in timestamp order.
+        if (oldestRecord)
+        {
+            payloadLength = FIELD_OFFSET(PORTSNIFFER_MERGED_PORTLOG_ENTRY, Entry) + oldestRecord->PayloadLength;
+        }
+        else
+        {
+            payloadLength = FIELD_OFFSET(PORTSNIFFER_MERGED_PORTLOG_ENTRY, Entry) + FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + sizeof(PORTSNIFFER_GAP_DATA);
+        }
+
+        if (PORTLOG_RECORD_SIZE(payloadLength) > ResponseBufferLength - offset)
+        {
+            break;
+        }
+
+        // Tag the entry with the index of its port and move it into the response.
+        record = (PPORTLOG_RECORD)((PUCHAR)Response + offset);
+        record->Size = PORTLOG_RECORD_SIZE(payloadLength);
+        record->Flags = 0;
+        record->PayloadLength = payloadLength;
+
+        mergedEntry = PORTLOG_RECORD_PAYLOAD(record);
+        mergedEntry->PortIndex = oldestFilterContext->PortIndex;
+        RtlZeroMemory(mergedEntry->Reserved, sizeof(mergedEntry->Reserved));
+
+        if (oldestRecord)
+        {
+            RtlCopyMemory(&mergedEntry->Entry, PORTLOG_RECORD_PAYLOAD(oldestRecord), oldestRecord->PayloadLength);
+            PortLogRingRemove(&oldestFilterContext->Log, oldestRecord);
+        }
+        else
+        {
+            PortSnifferFilterFillGapEntry(&mergedEntry->Entry, &oldestFilterContext->OverwrittenGap);
+        }
+
+        // Never leave the contents of the alignment bytes to the application.
+        RtlZeroMemory((PUCHAR)mergedEntry + payloadLength, record->Size - sizeof(PORTLOG_RECORD) - payloadLength);
+        offset += record->Size;
+    }
+
+    for (i = 0; i < Count; i++)
+    {
+        PortSnifferFilterShrinkPortLog(FilterContexts[i]);
+        WdfWaitLockRelease(FilterContexts[i]->LogLock);
+    }
+
+    return offset;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlPopPortLogEntry(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST popRequest;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE response;
+    ULONG_PTR responseLength = 0;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlPopPortLogEntry(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST), &popRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, PORTSNIFFER_PORTLOG_ENTRY_LENGTH, &response, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, popRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        status = PortSnifferControlPopPortLogEntryInternal(filterContext, PortSnifferControlGetSubscriber(Request, filterContext), response, &responseLength);
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, responseLength);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlPopPortLogEntryInternal(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __out PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Response,
+    __out PULONG_PTR ResponseLength
+    )
+{
+    PPORTLOG_GAP gap;
+    PPORTLOG_RECORD record;
+    PPORTLOG_RING ring;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlPopPortLogEntryInternal(%p, %p, %p, %p)\n", FilterContext, Subscriber, Response, ResponseLength));
+
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+
+    status = PortSnifferFilterCheckConsumer(FilterContext, Subscriber);
+    if (!NT_SUCCESS(status))
+    {
+        WdfWaitLockRelease(FilterContext->LogLock);
+        *ResponseLength = 0;
+        return status;
+    }
+
+    // Nothing is available before the capture of a trigger is complete.
+    if (PortSnifferFilterIsTriggerPending(FilterContext))
+    {
+        WdfWaitLockRelease(FilterContext->LogLock);
+        *ResponseLength = 0;
+        return STATUS_NO_MORE_ENTRIES;
+    }
+
+    // A subscriber pops from its own read position and only learns about the entries it has missed itself.
+    ring = PortSnifferFilterGetConsumerRing(FilterContext, Subscriber);
+    gap = Subscriber ? &Subscriber->MissedGap : &FilterContext->OverwrittenGap;
+
+    record = NULL;
+    if (ring->Buffer)
+    {
+        record = PortLogRingPeek(ring);
+    }
+
+    if (gap->Entries > 0)
+    {
+        // Report overwritten entries before the oldest remaining one.
+        PortSnifferFilterFillGapEntry(Response, gap);
+        *ResponseLength = FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + sizeof(PORTSNIFFER_GAP_DATA);
+
+        status = STATUS_SUCCESS;
+    }
+    else if (record)
+    {
+        // Copy the oldest log entry to the response buffer and remove it from the log.
+        // The record payload is a complete PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE.
+        *ResponseLength = record->PayloadLength;
+        RtlCopyMemory(Response, PORTLOG_RECORD_PAYLOAD(record), record->PayloadLength);
+        PortLogRingRemove(ring, record);
+        PortSnifferFilterReclaimPortLog(FilterContext);
+
+        status = STATUS_SUCCESS;
+    }
+    else
+    {
+        *ResponseLength = 0;
+        status = STATUS_NO_MORE_ENTRIES;
+    }
+
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    return status;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlPopPortLogEntries(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST popRequest;
+    PUCHAR response;
+    size_t responseBufferLength;
+    ULONG_PTR responseLength = 0;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlPopPortLogEntries(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST), &popRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // This is a METHOD_OUT_DIRECT request, so we get a system address for the locked user buffer and write to it directly.
+    status = WdfRequestRetrieveOutputBuffer(Request, PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH, &response, &responseBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, popRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        status = PortSnifferControlPopPortLogEntriesInternal(filterContext, PortSnifferControlGetSubscriber(Request, filterContext), response, responseBufferLength, &responseLength);
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestCompleteWithInformation(Request, status, responseLength);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlPopPortLogEntriesInternal(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __out_bcount(ResponseBufferLength) PUCHAR Response,
+    __in size_t ResponseBufferLength,
+    __out PULONG_PTR ResponseLength
+    )
+{
+    size_t length;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlPopPortLogEntriesInternal(%p, %p, %p, %Iu, %p)\n", FilterContext, Subscriber, Response, ResponseBufferLength, ResponseLength));
+
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+
+    status = PortSnifferFilterCheckConsumer(FilterContext, Subscriber);
+    if (!NT_SUCCESS(status))
+    {
+        WdfWaitLockRelease(FilterContext->LogLock);
+        *ResponseLength = 0;
+        return status;
+    }
+
+    length = PortSnifferFilterPackPortLogEntries(FilterContext, Subscriber, Response, ResponseBufferLength);
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    *ResponseLength = length;
+    return (length > 0) ? STATUS_SUCCESS : STATUS_NO_MORE_ENTRIES;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlReferencePort(
+    __in WDFREQUEST Request,
+    __inout_ecount(PORTSNIFFER_PORTNAME_LENGTH) PWSTR PortName,
+    __out PFILTER_CONTEXT* FilterContext
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+    PFILTER_CONTEXT filterContext;
+    BOOLEAN referenced;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlReferencePort(%p, %p, %p)\n", Request, PortName, FilterContext));
+
+    *FilterContext = NULL;
+
+    if (PortName[0] == L'\0')
+    {
+        // An empty port name addresses the port session of the file object.
+        // It keeps the filter device alive, so this needs neither a lookup nor FilterDevicesLock.
+        fileContext = GetControlFileContext(WdfRequestGetFileObject(Request));
+        if (!fileContext->SessionDevice)
+        {
+            return STATUS_NO_SUCH_DEVICE;
+        }
+
+        filterContext = GetFilterContext(fileContext->SessionDevice);
+        referenced = ExAcquireRundownProtection(&filterContext->Rundown);
+    }
+    else
+    {
+        // Ports are only unpublished under FilterDevicesLock, so a port we find can't be drained before we have a reference.
+        WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+        filterContext = PortSnifferControlFindPort(PortName);
+        referenced = (filterContext && ExAcquireRundownProtection(&filterContext->Rundown));
+
+        WdfWaitLockRelease(FilterDevicesLock);
+    }
+
+    // No reference can be acquired anymore once the port is being removed.
+    if (!referenced)
+    {
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    // The caller must pass the port to PortSnifferControlDereferencePort when it is done.
+    *FilterContext = filterContext;
+    return STATUS_SUCCESS;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlResetPortMonitoring(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_RESET_PORT_MONITORING_REQUEST portMonitoringRequest;
+    NTSTATUS status;
+    BOOLEAN subscribed;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlResetPortMonitoring(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST), &portMonitoringRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, portMonitoringRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        // Subscribers share the port log, so monitoring only stops when the last of them is gone.
+        // Subscribing holds FilterDevicesLock as well, so the port can't get a new subscriber before we are done.
+        // It also serializes starting and stopping with all other control requests allocating or freeing the port log.
+        WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+        subscribed = !IsListEmpty(&filterContext->Subscribers);
+        WdfWaitLockRelease(filterContext->LogLock);
+
+        if (subscribed)
+        {
+            status = STATUS_DEVICE_BUSY;
+        }
+        else
+        {
+            // Starting or stopping anew supersedes any linger period.
+            PortSnifferFilterCancelLinger(filterContext);
+
+            if ((portMonitoringRequest->MonitorMask & ~PORTSNIFFER_MONITOR_STATS) == PORTSNIFFER_MONITOR_NONE)
+            {
+                // Stop monitoring and give the memory of the port log back.
+                filterContext->MonitorMask = PORTSNIFFER_MONITOR_NONE;
+                PortSnifferFilterFreePortLog(filterContext);
+
+                // Statistics alone don't need a port log, only fresh counters.
+                if (portMonitoringRequest->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+                {
+                    PortSnifferFilterResetStatistics(filterContext);
+                    filterContext->MonitorMask = PORTSNIFFER_MONITOR_STATS;
+                }
+            }
+            else
+            {
+                // Get an empty port log and set the new monitor mask afterwards.
+                status = PortSnifferFilterAllocatePortLog(filterContext);
+                if (NT_SUCCESS(status))
+                {
+                    filterContext->MonitorMask = portMonitoringRequest->MonitorMask;
+                }
+            }
+        }
+
+        WdfWaitLockRelease(FilterDevicesLock);
+
+        // Snapshot the request counters every second while collecting statistics.
+        // The subscribers of a busy port keep its monitor mask, so leave the timer alone then.
+        if (!subscribed)
+        {
+            if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+            {
+                WdfTimerStart(filterContext->StatsTimer, WDF_REL_TIMEOUT_IN_MS(1000));
+            }
+            else
+            {
+                WdfTimerStop(filterContext->StatsTimer, TRUE);
+            }
+        }
+
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSetCaptureFilter(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_SET_CAPTURE_FILTER_REQUEST filterRequest;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlSetCaptureFilter(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_SET_CAPTURE_FILTER_REQUEST), &filterRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // The program runs at DISPATCH_LEVEL for every captured entry, so it must be verified once here.
+    if (!CaptureFilterVerify(filterRequest->Instructions, filterRequest->InstructionCount))
+    {
+        KdPrint(("Capture filter program with %lu instructions failed verification\n", filterRequest->InstructionCount));
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, filterRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        PortSnifferFilterSetCaptureFilter(filterContext, filterRequest->Instructions, filterRequest->InstructionCount);
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSetIoctlFilter(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_SET_IOCTL_FILTER_REQUEST filterRequest;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlSetIoctlFilter(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_SET_IOCTL_FILTER_REQUEST), &filterRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, filterRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        RtlCopyMemory(filterContext->IoctlFilter, filterRequest->Functions, sizeof(filterContext->IoctlFilter));
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSetPortMonitorMask(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PPORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST maskRequest;
+    NTSTATUS status;
+    BOOLEAN subscribed;
+    USHORT triggerState;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlSetPortMonitorMask(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST), &maskRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    if (maskRequest->LingerTime > PORTSNIFFER_MAX_LINGER_TIME)
+    {
+        KdPrint(("Invalid linger time of %lu seconds\n", maskRequest->LingerTime));
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, maskRequest->PortName, &filterContext);
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // The linger fields are protected by FilterDevicesLock, and it keeps a mapping from being detached meanwhile.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    WdfWaitLockAcquire(filterContext->LogLock, NULL);
+    subscribed = !IsListEmpty(&filterContext->Subscribers);
+    triggerState = filterContext->TriggerState;
+    WdfWaitLockRelease(filterContext->LogLock);
+
+    if (subscribed)
+    {
+        // Subscribers start and stop monitoring on their own.
+        status = STATUS_DEVICE_BUSY;
+    }
+    else if (triggerState != PORTSNIFFER_TRIGGER_NONE)
+    {
+        // The trigger decides when monitoring stops.
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else
+    {
+        // Only a port without a port log gets a new one. An existing one keeps all its entries and counters.
+        if ((maskRequest->MonitorMask & ~PORTSNIFFER_MONITOR_STATS) != PORTSNIFFER_MONITOR_NONE && !filterContext->Log.Buffer)
+        {
+            status = PortSnifferFilterAllocatePortLog(filterContext);
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            // This supersedes any previous linger period, and a new one begins when the calling handle is closed.
+            PortSnifferFilterCancelLinger(filterContext);
+            filterContext->MonitorMask = maskRequest->MonitorMask;
+
+            if (maskRequest->LingerTime > 0)
+            {
+                filterContext->LingerOwner = WdfRequestGetFileObject(Request);
+                filterContext->LingerTime = maskRequest->LingerTime;
+            }
+        }
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+
+    // Snapshot the request counters every second while collecting statistics.
+    if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+    {
+        WdfTimerStart(filterContext->StatsTimer, WDF_REL_TIMEOUT_IN_MS(1000));
+    }
+    else
+    {
+        WdfTimerStop(filterContext->StatsTimer, TRUE);
+    }
+
+    PortSnifferControlDereferencePort(filterContext);
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSubscribePort(
+    __in WDFREQUEST Request
+    )
+{
+    PCONTROL_FILE_CONTEXT fileContext;
+    PFILTER_CONTEXT filterContext;
+    WDF_IO_QUEUE_CONFIG ioQueueConfig;
+    NTSTATUS status;
+    PPORTSNIFFER_SUBSCRIBE_PORT_REQUEST subscribeRequest;
+    PPORTLOG_SUBSCRIBER subscriber;
+    WDFQUEUE waitQueue = NULL;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlSubscribePort(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_SUBSCRIBE_PORT_REQUEST), &subscribeRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // A subscriber without any log entries to read makes no sense.
+    if ((subscribeRequest->MonitorMask & ~PORTSNIFFER_MONITOR_STATS) == PORTSNIFFER_MONITOR_NONE)
+    {
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, subscribeRequest->PortName, &filterContext);
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    fileContext = GetControlFileContext(WdfRequestGetFileObject(Request));
+    subscriber = &fileContext->Subscriber;
+
+    // Pending requests of the subscriber have to be kept in a queue of our control device.
+    WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchManual);
+    status = WdfIoQueueCreate(ControlDevice, &ioQueueConfig, WDF_NO_OBJECT_ATTRIBUTES, &waitQueue);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfIoQueueCreate failed, status = 0x%08lX\n", status));
+        waitQueue = NULL;
+        goto Cleanup;
+    }
+
+    // Linking the subscriber with the port and stopping monitoring when the last subscriber is gone requires FilterDevicesLock.
+    // The control device handles requests in parallel, so the file object may be subscribed or bound by another request
+    // of the same application until we hold it.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    if (subscriber->FilterContext)
+    {
+        // A file object can only be subscribed once.
+        status = STATUS_DEVICE_BUSY;
+    }
+    else if (fileContext->SessionDevice && fileContext->SessionDevice != WdfObjectContextGetObject(filterContext))
+    {
+        // A file object bound to a port session can only subscribe to that port.
+        status = STATUS_DEVICE_BUSY;
+    }
+    else if (filterContext->Mapping)
+    {
+        // The application owning the shared port log is the only consumer.
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else if (filterContext->TriggerState != PORTSNIFFER_TRIGGER_NONE)
+    {
+        // A trigger only holds its capture for a single consumer.
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else if (!filterContext->Log.Buffer)
+    {
+        // Start monitoring with an empty port log, but keep collecting statistics.
+        status = PortSnifferFilterAllocatePortLog(filterContext);
+        if (NT_SUCCESS(status))
+        {
+            filterContext->MonitorMask = (filterContext->MonitorMask & PORTSNIFFER_MONITOR_STATS) | subscribeRequest->MonitorMask;
+        }
+    }
+    else
+    {
+        // Monitoring is already running, so only add the types this subscriber wants to see.
+        filterContext->MonitorMask |= subscribeRequest->MonitorMask;
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        // Start with the next entry. Any entries already in the port log are left to those who have been consuming them.
+        WdfWaitLockAcquire(filterContext->LogLock, NULL);
+        subscriber->Cursor = filterContext->Log;
+        subscriber->Cursor.Head = filterContext->Log.Tail;
+        RtlZeroMemory(&subscriber->MissedGap, sizeof(subscriber->MissedGap));
+        subscriber->WaitQueue = waitQueue;
+        subscriber->WaitMinLength = 0;
+        subscriber->WaitMaxDelay = 0;
+        subscriber->FilterContext = filterContext;
+        InsertTailList(&filterContext->Subscribers, &subscriber->ListEntry);
+        WdfWaitLockRelease(filterContext->LogLock);
+
+        waitQueue = NULL;
+
+        // Bind the file object to the port like a port session, so that it is found again by an empty port name.
+        if (!fileContext->SessionDevice)
+        {
+            fileContext->SessionDevice = WdfObjectContextGetObject(filterContext);
+            WdfObjectReference(fileContext->SessionDevice);
+        }
+
+        // Snapshot the request counters every second while collecting statistics.
+        if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+        {
+            WdfTimerStart(filterContext->StatsTimer, WDF_REL_TIMEOUT_IN_MS(1000));
+        }
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+
+Cleanup:
+    if (waitQueue)
+    {
+        WdfObjectDelete(waitQueue);
+    }
+
+    PortSnifferControlDereferencePort(filterContext);
+    WdfRequestComplete(Request, status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlUnsubscribePort(
+    __inout PPORTLOG_SUBSCRIBER Subscriber
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    BOOLEAN lastSubscriber;
+    WDFQUEUE waitQueue;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlUnsubscribePort(%p)\n", Subscriber));
+
+    // The caller must hold FilterDevicesLock, so the port can't detach the subscriber in the meantime.
+    filterContext = Subscriber->FilterContext;
+
+    WdfWaitLockAcquire(filterContext->LogLock, NULL);
+
+    RemoveEntryList(&Subscriber->ListEntry);
+    Subscriber->FilterContext = NULL;
+    waitQueue = Subscriber->WaitQueue;
+    Subscriber->WaitQueue = NULL;
+
+    // Entries only this subscriber hasn't read yet can go now.
+    lastSubscriber = IsListEmpty(&filterContext->Subscribers);
+    if (!lastSubscriber)
+    {
+        PortSnifferFilterReclaimPortLog(filterContext);
+    }
+
+    WdfWaitLockRelease(filterContext->LogLock);
+
+    // Cancel all requests of this subscriber still waiting for log entries.
+    WdfObjectDelete(waitQueue);
+
+    // Stop monitoring after the last subscriber, unless the port is already being removed.
+    // Statistics don't need a port log and continue to be collected.
+    if (lastSubscriber && ExAcquireRundownProtection(&filterContext->Rundown))
+    {
+        filterContext->MonitorMask &= PORTSNIFFER_MONITOR_STATS;
+        PortSnifferFilterFreePortLog(filterContext);
+        ExReleaseRundownProtection(&filterContext->Rundown);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlWaitPortLogEntries(
+    __in WDFREQUEST Request
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PUCHAR response;
+    size_t responseBufferLength;
+    NTSTATUS status;
+    PPORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST waitRequest;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlWaitPortLogEntries(%p)\n", Request));
+
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST), &waitRequest, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    // Validate the output buffer now, so that every request in the wait queue can take at least one log entry.
+    status = WdfRequestRetrieveOutputBuffer(Request, PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH, &response, &responseBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    status = PortSnifferControlReferencePort(Request, waitRequest->PortName, &filterContext);
+    if (NT_SUCCESS(status))
+    {
+        status = PortSnifferControlWaitPortLogEntriesInternal(filterContext, PortSnifferControlGetSubscriber(Request, filterContext), Request, waitRequest, responseBufferLength);
+        PortSnifferControlDereferencePort(filterContext);
+    }
+
+    // On success, the request is owned by the wait queue and must not be touched anymore.
+    if (!NT_SUCCESS(status))
+    {
+        WdfRequestComplete(Request, status);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlWaitPortLogEntriesInternal(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __in WDFREQUEST Request,
+    __in PPORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST WaitRequest,
+    __in size_t ResponseBufferLength
+    )
+{
+    WDF_IO_QUEUE_CONFIG ioQueueConfig;
+    ULONG minLength;
+    NTSTATUS status;
+    WDFQUEUE waitQueue;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferControlWaitPortLogEntriesInternal(%p, %p, %p, %p, %Iu)\n", FilterContext, Subscriber, Request, WaitRequest, ResponseBufferLength));
+
+    // Pending requests have to be kept in a queue of the device they were sent to, which is our control device.
+    // The caller holds a reference to the port, so the wait queue can't be deleted in the meantime.
+    // A subscriber already got its own wait queue when subscribing.
+    waitQueue = FilterContext->WaitQueue;
+    if (!waitQueue && !Subscriber)
+    {
+        WDF_IO_QUEUE_CONFIG_INIT(&ioQueueConfig, WdfIoQueueDispatchManual);
+        status = WdfIoQueueCreate(ControlDevice, &ioQueueConfig, WDF_NO_OBJECT_ATTRIBUTES, &waitQueue);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("WdfIoQueueCreate failed, status = 0x%08lX\n", status));
+            return status;
+        }
+    }
+
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+
+    // Another request may have created the wait queue in the meantime.
+    if (!Subscriber)
+    {
+        if (!FilterContext->WaitQueue)
+        {
+            FilterContext->WaitQueue = waitQueue;
+        }
+        else if (FilterContext->WaitQueue != waitQueue)
+        {
+            WdfObjectDelete(waitQueue);
+        }
+    }
+
+    status = PortSnifferFilterCheckConsumer(FilterContext, Subscriber);
+    if (!NT_SUCCESS(status))
+    {
+        WdfWaitLockRelease(FilterContext->LogLock);
+        return status;
+    }
+
+    // A minimum batch length beyond the output buffer could never be reached.
+    // The size of the port log may still change, so it is only taken into account when completing requests.
+    // A subscriber keeps its own wait parameters, so that other handles can't change them.
+    minLength = WaitRequest->MinBatchLength;
+    if (minLength > ResponseBufferLength)
+    {
+        minLength = (ULONG)ResponseBufferLength;
+    }
+
+    if (Subscriber)
+    {
+        Subscriber->WaitMinLength = minLength;
+        Subscriber->WaitMaxDelay = WaitRequest->MaxDelay;
+    }
+    else
+    {
+        FilterContext->WaitMinLength = minLength;
+        FilterContext->WaitMaxDelay = WaitRequest->MaxDelay;
+    }
+
+    // Queue the request behind all other pending requests and immediately complete them if enough log entries are available.
+    waitQueue = Subscriber ? Subscriber->WaitQueue : FilterContext->WaitQueue;
+    status = WdfRequestForwardToIoQueue(Request, waitQueue);
+    if (NT_SUCCESS(status))
+    {
+        PortSnifferFilterCompleteWaitRequests(FilterContext, FALSE);
+    }
+    else
+    {
+        KdPrint(("WdfRequestForwardToIoQueue failed, status = 0x%08lX\n", status));
+    }
+
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    return status;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddClockEntry(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PPORTSNIFFER_CLOCK_DATA clockData;
+    BOOLEAN entriesAdded;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    PPORTLOG_RECORD record;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAddClockEntry(%p)\n", FilterContext));
+
+    // The caller must hold LogLock and deliver the entries if we return TRUE.
+    // Nothing else may be reserved while an entry is open, so the clock entry completes it.
+    entriesAdded = FALSE;
+    if (FilterContext->OpenRecord)
+    {
+        PortSnifferFilterCloseOpenEntry(FilterContext);
+        entriesAdded = TRUE;
+    }
+
+    // Dropped entries have to be reported first. Try again next time if that's not possible yet.
+    record = NULL;
+    if (FilterContext->DroppedGap.Entries == 0)
+    {
+        record = PortSnifferFilterReservePortLogEntry(FilterContext, sizeof(PORTSNIFFER_CLOCK_DATA));
+    }
+
+    if (!record)
+    {
+        return entriesAdded;
+    }
+
+    entry = PORTLOG_RECORD_PAYLOAD(record);
+    clockData = (PPORTSNIFFER_CLOCK_DATA)entry->Data;
+    PortSnifferFilterQueryClock(clockData);
+
+    entry->Timestamp = clockData->PerformanceCounter;
+    entry->Duration = 0;
+    entry->SequenceNumber = FilterContext->Counters.NextSequenceNumber++;
+    entry->Type = PORTSNIFFER_PORTLOG_CLOCK;
+    entry->Flags = 0;
+    entry->OriginalLength = sizeof(PORTSNIFFER_CLOCK_DATA);
+    entry->DataLength = sizeof(PORTSNIFFER_CLOCK_DATA);
+    entry->SamplingWeight = 1;
+    PortLogRingCommit(&FilterContext->Log);
+
+    FilterContext->NextClockEntry = clockData->PerformanceCounter.QuadPart + PORTSNIFFER_CLOCK_INTERVAL * PerformanceFrequency.QuadPart;
+    return TRUE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddGapEntry(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PPORTLOG_RECORD record;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAddGapEntry(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    record = PortSnifferFilterReservePortLogEntry(FilterContext, sizeof(PORTSNIFFER_GAP_DATA));
+    if (!record)
+    {
+        return FALSE;
+    }
+
+    PortSnifferFilterFillGapEntry(PORTLOG_RECORD_PAYLOAD(record), &FilterContext->DroppedGap);
+    PortLogRingCommit(&FilterContext->Log);
+
+    return TRUE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddPortLogEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry,
+    __out PBOOLEAN Stored
+    )
+{
+    BOOLEAN entriesAdded;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    ULONGLONG hash;
+    PPORTLOG_RECORD record;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAddPortLogEntry(%p, %p, %p)\n", FilterContext, CapturedEntry, Stored));
+
+    // The caller must hold LogLock and deliver the entries if we return TRUE.
+    // Stored tells whether the captured entry has made it into the port log, as opposed to being suppressed or dropped.
+    // A repetition is only counted, but nothing may be coalesced across it.
+    entriesAdded = FALSE;
+    hash = 0;
+    *Stored = FALSE;
+    if (PortSnifferFilterSuppressRepeat(FilterContext, CapturedEntry, &hash))
+    {
+        if (FilterContext->OpenRecord)
+        {
+            PortSnifferFilterCloseOpenEntry(FilterContext);
+            entriesAdded = TRUE;
+        }
+
+        return entriesAdded;
+    }
+
+    // Append the data to the entry being coalesced if it continues that one.
+    // Otherwise, that entry is complete and has to go before anything new.
+    if (FilterContext->OpenRecord)
+    {
+        if (PortSnifferFilterAppendToOpenEntry(FilterContext, CapturedEntry))
+        {
+            PortSnifferFilterRememberRepeat(FilterContext, CapturedEntry->Type, hash, FilterContext->OpenEntry.SequenceNumber);
+            *Stored = TRUE;
+            return FALSE;
+        }
+
+        PortSnifferFilterCloseOpenEntry(FilterContext);
+        entriesAdded = TRUE;
+    }
+
+    // Report previously dropped entries before adding anything new, so that the application sees everything in order.
+    if (FilterContext->DroppedGap.Entries > 0 && PortSnifferFilterAddGapEntry(FilterContext))
+    {
+        entriesAdded = TRUE;
+    }
+
+    // The same goes for repetitions suppressed since.
+    if (PortSnifferFilterAddRepeatEntries(FilterContext))
+    {
+        entriesAdded = TRUE;
+    }
+
+    // Reserve space for the entry at the end of the port log.
+    record = NULL;
+    if (FilterContext->DroppedGap.Entries == 0)
+    {
+        record = PortSnifferFilterReservePortLogEntry(FilterContext, CapturedEntry->DataLength);
+    }
+
+    if (!record)
+    {
+        // Account for the dropped entry. It is reported through a gap entry once there is space again.
+        KdPrint(("Port log is full, dropping log entry\n"));
+        PortSnifferFilterDropPortLogEntries(FilterContext, &CapturedEntry->Timestamp, 1, CapturedEntry->OriginalLength);
+        return entriesAdded;
+    }
+
+    // Copy the captured entry into the port log and give it the next sequence number.
+    entry = PORTLOG_RECORD_PAYLOAD(record);
+    RtlCopyMemory(entry, CapturedEntry, FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + CapturedEntry->DataLength);
+    entry->SequenceNumber = FilterContext->Counters.NextSequenceNumber++;
+    PortSnifferFilterRememberRepeat(FilterContext, CapturedEntry->Type, hash, FilterContext->Counters.NextSequenceNumber - 1);
+    *Stored = TRUE;
+
+    // Keep read and write entries open for appending subsequent data if coalescing is enabled.
+    // The timer closes the entry if nothing else arrives within the gap.
+    if (FilterContext->CoalesceGap > 0 && (CapturedEntry->Type == PORTSNIFFER_MONITOR_READ || CapturedEntry->Type == PORTSNIFFER_MONITOR_WRITE))
+    {
+        FilterContext->OpenRecord = record;
+        RtlCopyMemory(&FilterContext->OpenEntry, CapturedEntry, FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data));
+        FilterContext->OpenEntry.SequenceNumber = FilterContext->Counters.NextSequenceNumber - 1;
+        WdfTimerStart(FilterContext->CoalesceTimer, PortSnifferFilterTicksToRelativeTime(PortSnifferFilterGetCoalesceGapTime(FilterContext)));
+    }
+    else
+    {
+        PortLogRingCommit(&FilterContext->Log);
+        entriesAdded = TRUE;
+    }
+
+    return entriesAdded;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddRepeatEntries(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    ULONGLONG droppedBytes;
+    ULONG droppedEntries;
+    LARGE_INTEGER droppedTimestamp;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    BOOLEAN entriesAdded;
+    ULONG i;
+    ULONG j;
+    PPORTLOG_REPEAT oldestRepeat;
+    PPORTLOG_REPEAT_HASH oldestRepeatHash;
+    PPORTLOG_RECORD record;
+    PPORTSNIFFER_REPEAT_DATA repeatData;
+    PPORTLOG_REPEAT_HASH repeatHash;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAddRepeatEntries(%p)\n", FilterContext));
+
+    // The caller must hold LogLock and deliver the entries if we return TRUE.
+    // Add a repeat entry for every remembered entry with suppressed repetitions, the one whose repetitions began first going first.
+    entriesAdded = FALSE;
+    droppedBytes = 0;
+    droppedEntries = 0;
+    droppedTimestamp.QuadPart = 0;
+
+    for (;;)
+    {
+        oldestRepeat = NULL;
+        oldestRepeatHash = NULL;
+        for (i = 0; i < CAPTURE_COUNT; i++)
+        {
+            for (j = 0; j < FilterContext->Repeats[i].HashCount; j++)
+            {
+                repeatHash = &FilterContext->Repeats[i].Hashes[j];
+                if (repeatHash->Entries > 0 &&
+                    (!oldestRepeatHash || repeatHash->Timestamp.QuadPart < oldestRepeatHash->Timestamp.QuadPart))
+                {
+                    oldestRepeat = &FilterContext->Repeats[i];
+                    oldestRepeatHash = repeatHash;
+                }
+            }
+        }
+
+        if (!oldestRepeatHash)
+        {
+            break;
+        }
+
+        // Nothing else may be reserved while an entry is open, so the repeat entry completes it.
+        if (FilterContext->OpenRecord)
+        {
+            PortSnifferFilterCloseOpenEntry(FilterContext);
+            entriesAdded = TRUE;
+        }
+
+        // Once a repeat entry has been dropped, all further ones have to be dropped as well to keep the order.
+        record = NULL;
+        if (droppedEntries == 0 && FilterContext->DroppedGap.Entries == 0)
+        {
+            record = PortSnifferFilterReservePortLogEntry(FilterContext, sizeof(PORTSNIFFER_REPEAT_DATA));
+        }
+
+        if (record)
+        {
+            entry = PORTLOG_RECORD_PAYLOAD(record);
+            entry->Timestamp = oldestRepeatHash->Timestamp;
+            entry->Duration = 0;
+            entry->SequenceNumber = FilterContext->Counters.NextSequenceNumber++;
+            entry->Type = PORTSNIFFER_PORTLOG_REPEAT;
+            entry->Flags = 0;
+            entry->OriginalLength = sizeof(PORTSNIFFER_REPEAT_DATA);
+            entry->DataLength = sizeof(PORTSNIFFER_REPEAT_DATA);
+            entry->SamplingWeight = 1;
+
+            repeatData = (PPORTSNIFFER_REPEAT_DATA)entry->Data;
+            repeatData->LastTimestamp = oldestRepeatHash->LastTimestamp;
+            repeatData->RepeatedBytes = oldestRepeatHash->Bytes;
+            repeatData->RepeatedEntries = oldestRepeatHash->Entries;
+            repeatData->RepeatedSequenceNumber = oldestRepeatHash->SequenceNumber;
+            repeatData->RepeatedType = oldestRepeat->Type;
+
+            PortLogRingCommit(&FilterContext->Log);
+            entriesAdded = TRUE;
+        }
+        else
+        {
+            if (droppedEntries == 0)
+            {
+                droppedTimestamp = oldestRepeatHash->Timestamp;
+            }
+
+            droppedEntries++;
+            droppedBytes += sizeof(PORTSNIFFER_REPEAT_DATA);
+        }
+
+        oldestRepeatHash->Entries = 0;
+        oldestRepeatHash->Bytes = 0;
+    }
+
+    // Account for the dropped repeat entries. Nothing is pending anymore, so this doesn't get back to us.
+    if (droppedEntries > 0)
+    {
+        KdPrint(("Port log is full, dropping %lu repeat entries\n", droppedEntries));
+        if (PortSnifferFilterDropPortLogEntries(FilterContext, &droppedTimestamp, droppedEntries, droppedBytes))
+        {
+            entriesAdded = TRUE;
+        }
+    }
+
+    return entriesAdded;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterAddToGap(
+    __inout PPORTLOG_GAP Gap,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry,
+    __in ULONG Entries,
+    __in ULONGLONG Bytes
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAddToGap(%p, %p, %lu, %I64u)\n", Gap, Entry, Entries, Bytes));
+
+    // The gap starts with the first entry added to it.
+    if (Gap->Entries == 0)
+    {
+        Gap->Timestamp = Entry->Timestamp;
+        Gap->SequenceNumber = Entry->SequenceNumber;
+    }
+
+    Gap->Entries += Entries;
+    Gap->Bytes += Bytes;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAdvanceTrigger(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry
+    )
+{
+    ULONG ioControlCode;
+    PPORTLOG_RECORD record;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAdvanceTrigger(%p, %p)\n", FilterContext, CapturedEntry));
+
+    // The caller must hold LogLock and has just stored the captured entry in the port log.
+    // We return TRUE when the capture is complete, so that the caller delivers the held entries.
+    if (FilterContext->TriggerState == PORTSNIFFER_TRIGGER_ARMED)
+    {
+        ioControlCode = (CapturedEntry->Type == PORTSNIFFER_MONITOR_IOCTL) ? ((PPORTSNIFFER_IOCTL_DATA)CapturedEntry->Data)->IoControlCode : 0;
+        if (!CaptureFilterRun(FilterContext->Trigger, FilterContext->TriggerLength, CapturedEntry->Type, ioControlCode, CapturedEntry->Data, CapturedEntry->DataLength))
+        {
+            // Only keep the newest entries before the trigger. The overwritten ones are reported through a gap entry.
+            while (FilterContext->Log.Tail - FilterContext->Log.Head > FilterContext->TriggerPreLength &&
+                (record = PortLogRingPeek(&FilterContext->Log)) != NULL)
+            {
+                PortSnifferFilterOverwriteOldestEntry(FilterContext, record);
+            }
+
+            return FALSE;
+        }
+
+        // Remember the moment along with a clock correlation, as the clock entries before may have been overwritten.
+        KdPrint(("Trigger fired for %wZ\n", &FilterContext->PortName));
+        FilterContext->TriggerState = PORTSNIFFER_TRIGGER_FIRED;
+        FilterContext->TriggerTimestamp = CapturedEntry->Timestamp;
+        PortSnifferFilterQueryClock(&FilterContext->TriggerClock);
+    }
+    else if (FilterContext->TriggerState == PORTSNIFFER_TRIGGER_FIRED)
+    {
+        FilterContext->TriggerPostBytes += PORTLOG_RECORD_SIZE(FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + CapturedEntry->DataLength);
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (FilterContext->TriggerPostBytes < FilterContext->TriggerPostLength)
+    {
+        return FALSE;
+    }
+
+    // The capture is complete, including an entry still being coalesced and any suppressed repetitions.
+    // Stop monitoring except for statistics and hold the port log as it is.
+    if (FilterContext->OpenRecord)
+    {
+        PortSnifferFilterCloseOpenEntry(FilterContext);
+    }
+
+    PortSnifferFilterAddRepeatEntries(FilterContext);
+
+    KdPrint(("Holding the capture of %wZ\n", &FilterContext->PortName));
+    FilterContext->TriggerState = PORTSNIFFER_TRIGGER_HELD;
+    FilterContext->MonitorMask &= PORTSNIFFER_MONITOR_STATS;
+
+    return TRUE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterAllocateCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PCAPTURE_RING captureRing;
+    PPORTLOG_SHARED_HEADER header;
+    ULONG i;
+    KIRQL oldIrql;
+    PORTLOG_RING producerRing;
+
+    KdPrint(("PortSnifferFilterAllocateCaptureRings(%p)\n", FilterContext));
+
+    // This must not be pageable, because it acquires the ProducerLocks.
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        // Reuse an already allocated capture ring.
+        // The caller serializes allocating and freeing (see PortSnifferFilterAllocatePortLog), so it can't be allocated twice.
+        captureRing = &FilterContext->CaptureRings[i];
+        if (captureRing->Header)
+        {
+            continue;
+        }
+
+        // Producers may capture at IRQL == DISPATCH_LEVEL, so the capture ring must be nonpaged.
+        header = ExAllocatePoolWithTag(NonPagedPool, sizeof(PORTLOG_SHARED_HEADER) + CAPTURE_RING_SIZE, POOL_TAG);
+        if (!header)
+        {
+            KdPrint(("ExAllocatePoolWithTag failed for %lu bytes\n", (ULONG)(sizeof(PORTLOG_SHARED_HEADER) + CAPTURE_RING_SIZE)));
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        PortLogSharedInitialize(header, CAPTURE_RING_SIZE, &producerRing);
+
+        WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+        KeAcquireSpinLock(&captureRing->ProducerLock, &oldIrql);
+
+        captureRing->Header = header;
+        captureRing->ProducerRing = producerRing;
+        RtlZeroMemory(&captureRing->DroppedGap, sizeof(captureRing->DroppedGap));
+        PortLogSharedConsumerInitialize(header, &captureRing->ConsumerRing);
+
+        KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+        WdfWaitLockRelease(FilterContext->LogLock);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterAllocatePortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PVOID buffer;
+    ULONG size;
+
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAllocatePortLog(%p)\n", FilterContext));
+
+    // The caller must hold FilterDevicesLock, unless the port hasn't been added to FilterDevices yet.
+    // This serializes allocating and freeing the port log between all control requests.
+    // The capture rings come first, so that an allocated port log always has them.
+    status = PortSnifferFilterAllocateCaptureRings(FilterContext);
+    if (!NT_SUCCESS(status))
+    {
+        PortSnifferFilterFreeCaptureRings(FilterContext);
+        return status;
+    }
+
+    // Reuse an already allocated port log.
+    if (!FilterContext->Log.Buffer)
+    {
+        WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+        size = min(PORTLOG_INITIAL_SIZE, FilterContext->LogCapacity);
+        WdfWaitLockRelease(FilterContext->LogLock);
+
+        if (!PortSnifferFilterChargePortLogBudget(size))
+        {
+            KdPrint(("Port log budget is exhausted\n"));
+            PortSnifferFilterFreeCaptureRings(FilterContext);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        buffer = ExAllocatePoolWithTag(PagedPool, size, POOL_TAG);
+        if (!buffer)
+        {
+            KdPrint(("ExAllocatePoolWithTag failed for %lu bytes\n", size));
+            PortSnifferFilterReturnPortLogBudget(size);
+            PortSnifferFilterFreeCaptureRings(FilterContext);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+        PortLogRingInitialize(&FilterContext->Log, buffer, size);
+        WdfWaitLockRelease(FilterContext->LogLock);
+
+        InterlockedIncrement(&PortLogCount);
+    }
+
+    // Start with no entries and fresh counters.
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+    PortSnifferFilterClearPortLog(FilterContext);
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    return STATUS_SUCCESS;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAppendToOpenEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry
+    )
+{
+    const USHORT MaxDataLength = PORTSNIFFER_PORTLOG_ENTRY_LENGTH - FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data);
+
+    USHORT appendLength;
+    LONGLONG duration;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE record;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAppendToOpenEntry(%p, %p)\n", FilterContext, CapturedEntry));
+
+    // The caller must hold LogLock and have an open entry.
+    // Only data of the same type and sampling weight continues it, and only if it has arrived within the gap after the last data.
+    entry = &FilterContext->OpenEntry;
+    if (entry->Type != CapturedEntry->Type || entry->SamplingWeight != CapturedEntry->SamplingWeight || !FilterContext->CoalesceGap)
+    {
+        return FALSE;
+    }
+
+    duration = CapturedEntry->Timestamp.QuadPart - entry->Timestamp.QuadPart;
+    if (duration < entry->Duration || duration > MAXULONG ||
+        duration - entry->Duration > PortSnifferFilterGetCoalesceGapTime(FilterContext))
+    {
+        return FALSE;
+    }
+
+    if (CapturedEntry->OriginalLength > MAXULONG - entry->OriginalLength)
+    {
+        return FALSE;
+    }
+
+    // The SnapLength applies to the coalesced entry as a whole.
+    // Once it has been truncated, its data is no longer contiguous and we only count the appended data.
+    appendLength = CapturedEntry->DataLength;
+    if (entry->Flags & PORTSNIFFER_PORTLOG_FLAG_TRUNCATED)
+    {
+        appendLength = 0;
+    }
+    else if (FilterContext->SnapLength > 0 && appendLength > FilterContext->SnapLength - min(entry->DataLength, FilterContext->SnapLength))
+    {
+        appendLength = FilterContext->SnapLength - min(entry->DataLength, FilterContext->SnapLength);
+    }
+
+    // A coalesced entry must still fit into the buffer the application provides for popping it.
+    if (appendLength > 0 &&
+        (appendLength > MaxDataLength - entry->DataLength ||
+         !PortLogRingExtend(&FilterContext->Log, FilterContext->OpenRecord, FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + entry->DataLength + appendLength)))
+    {
+        return FALSE;
+    }
+
+    // Append the data behind what we have written so far and then update the header in the port log.
+    record = PORTLOG_RECORD_PAYLOAD(FilterContext->OpenRecord);
+    RtlCopyMemory(&record->Data[entry->DataLength], CapturedEntry->Data, appendLength);
+    entry->DataLength += appendLength;
+    entry->OriginalLength += CapturedEntry->OriginalLength;
+    entry->Duration = (ULONG)duration;
+
+    if (entry->OriginalLength > entry->DataLength)
+    {
+        entry->Flags |= PORTSNIFFER_PORTLOG_FLAG_TRUNCATED;
+    }
+
+    RtlCopyMemory(record, entry, FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data));
+    return TRUE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterAssignPortIndex(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    ULONG i;
+    ULONG portIndex;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterAssignPortIndex(%p)\n", FilterContext));
+
+    // The caller must hold FilterDevicesLock.
+    // Take the next free index after the one assigned last. If all are in use, the port can only be addressed by name.
+    for (i = 0; i < PORTSNIFFER_PORT_INDEX_COUNT; i++)
+    {
+        portIndex = (NextPortIndex + i) % PORTSNIFFER_PORT_INDEX_COUNT;
+        if (!PortIndexes[portIndex])
+        {
+            PortIndexes[portIndex] = FilterContext;
+            FilterContext->PortIndex = (USHORT)portIndex;
+            NextPortIndex = (portIndex + 1) % PORTSNIFFER_PORT_INDEX_COUNT;
+            return;
+        }
+    }
+
+    KdPrint(("No free port index for %wZ\n", &FilterContext->PortName));
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterBeginLifecycle(
+    __in WDFREQUEST Request,
+    __in USHORT RequestType,
+    __in ULONG IoControlCode,
+    __in size_t RequestedLength
+    )
+{
+    PREQUEST_CONTEXT requestContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterBeginLifecycle(%p, %x, %lX, %Iu)\n", Request, RequestType, IoControlCode, RequestedLength));
+
+    // The caller passes the request down right after this, so it is timestamped last.
+    requestContext = GetRequestContext(Request);
+    requestContext->Lifecycle.IoControlCode = IoControlCode;
+    requestContext->Lifecycle.RequestedLength = (ULONG)RequestedLength;
+    requestContext->Lifecycle.RequestType = RequestType;
+    requestContext->Lifecycle.DispatchTimestamp = KeQueryPerformanceCounter(NULL);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterBeginLineStatus(
+    __in WDFREQUEST Request,
+    __in ULONG IoControlCode
+    )
+{
+    size_t length;
+    PVOID outputBuffer;
+    PREQUEST_CONTEXT requestContext;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterBeginLineStatus(%p, %lX)\n", Request, IoControlCode));
+
+    // These are the IOCTLs applications poll for the line status.
+    switch (IoControlCode)
+    {
+        case IOCTL_SERIAL_GET_COMMSTATUS:
+            length = sizeof(SERIAL_STATUS);
+            break;
+
+        case IOCTL_SERIAL_GET_MODEMSTATUS:
+        case IOCTL_SERIAL_WAIT_ON_MASK:
+            length = sizeof(ULONG);
+            break;
+
+        case IOCTL_SERIAL_GET_STATS:
+            length = sizeof(SERIALPERF_STATS);
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    // The port driver fails the request anyway if the output buffer is too small.
+    status = WdfRequestRetrieveOutputBuffer(Request, length, &outputBuffer, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+        return FALSE;
+    }
+
+    requestContext = GetRequestContext(Request);
+    requestContext->LineStatusBuffer = outputBuffer;
+    requestContext->LineStatusIoControlCode = IoControlCode;
+    return TRUE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCancelLinger(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterCancelLinger(%p)\n", FilterContext));
+
+    // The caller must hold FilterDevicesLock.
+    // A timer callback already waiting for the lock finds LingerPending cleared and leaves the port alone.
+    FilterContext->LingerOwner = NULL;
+    FilterContext->LingerPending = FALSE;
+    WdfTimerStop(FilterContext->LingerTimer, FALSE);
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCaptureIoctlEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    )
+{
+    PPORTSNIFFER_IOCTL_DATA ioctlData;
+    size_t outputLength;
+    PREQUEST_CONTEXT requestContext;
+
+    KdPrint(("PortSnifferFilterCaptureIoctlEntry(%p, %p, %08lX, %Iu)\n", FilterContext, Request, Status, Information));
+
+    // Only IOCTLs prepared by PortSnifferFilterEvtIoDeviceControlInternal are logged.
+    requestContext = GetRequestContext(Request);
+    ioctlData = requestContext->IoctlData;
+    if (!ioctlData)
+    {
+        return;
+    }
+
+    // Append as much of the returned output as we have reserved space for.
+    outputLength = min(Information, requestContext->OutputLength);
+    RtlCopyMemory(&ioctlData->Data[ioctlData->InputLength], requestContext->OutputBuffer, outputLength);
+    ioctlData->Status = Status;
+    ioctlData->OutputLength = (USHORT)outputLength;
+
+    PortSnifferFilterCapturePortLogEntry(FilterContext,
+        PORTSNIFFER_MONITOR_IOCTL,
+        (PUCHAR)ioctlData,
+        FIELD_OFFSET(PORTSNIFFER_IOCTL_DATA, Data) + ioctlData->InputLength + outputLength,
+        requestContext->SamplingWeight
+    );
+
+    requestContext->IoctlData = NULL;
+    ExFreePoolWithTag(ioctlData, POOL_TAG);
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCaptureLifecycleEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    )
+{
+    PREQUEST_CONTEXT requestContext;
+
+    KdPrint(("PortSnifferFilterCaptureLifecycleEntry(%p, %p, %08lX, %Iu)\n", FilterContext, Request, Status, Information));
+
+    // Only requests passed to PortSnifferFilterBeginLifecycle are traced.
+    requestContext = GetRequestContext(Request);
+    if (requestContext->Lifecycle.RequestType == 0)
+    {
+        return;
+    }
+
+    requestContext->Lifecycle.Status = Status;
+    requestContext->Lifecycle.TransferredLength = (ULONG)Information;
+    PortSnifferFilterCapturePortLogEntry(FilterContext,
+        PORTSNIFFER_PORTLOG_LIFECYCLE,
+        (PUCHAR)&requestContext->Lifecycle,
+        sizeof(PORTSNIFFER_LIFECYCLE_DATA),
+        requestContext->SamplingWeight
+    );
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCaptureLineStatusEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    )
+{
+    // Data events are visible through read and write entries anyway and would swamp the port log.
+    const ULONG LineEvents = SERIAL_EV_CTS | SERIAL_EV_DSR | SERIAL_EV_RLSD | SERIAL_EV_BREAK | SERIAL_EV_ERR | SERIAL_EV_RING;
+    const ULONG ModemStatusDeltas = SERIAL_MSR_DCTS | SERIAL_MSR_DDSR | SERIAL_MSR_TERI | SERIAL_MSR_DDCD;
+
+    ULONG changes;
+    PPORTSNIFFER_LINE_STATUS_DATA lineStatus;
+    ULONG modemStatus;
+    KIRQL oldIrql;
+    PREQUEST_CONTEXT requestContext;
+    PSERIAL_STATUS serialStatus;
+    PSERIALPERF_STATS stats;
+
+    KdPrint(("PortSnifferFilterCaptureLineStatusEntry(%p, %p, %08lX, %Iu)\n", FilterContext, Request, Status, Information));
+
+    // Only requests passed to PortSnifferFilterBeginLineStatus and successfully completed tell about the line status.
+    requestContext = GetRequestContext(Request);
+    if (!requestContext->LineStatusBuffer || !NT_SUCCESS(Status))
+    {
+        return;
+    }
+
+    // Hold LineStatusLock while capturing, so that concurrently completed status IOCTLs are captured in the order
+    // they have updated the line status.
+    lineStatus = &FilterContext->LineStatus;
+    changes = 0;
+    KeAcquireSpinLock(&FilterContext->LineStatusLock, &oldIrql);
+
+    switch (requestContext->LineStatusIoControlCode)
+    {
+        case IOCTL_SERIAL_GET_COMMSTATUS:
+            if (Information >= sizeof(SERIAL_STATUS))
+            {
+                // The port driver collects errors between two queries, so any reported error is new.
+                serialStatus = (PSERIAL_STATUS)requestContext->LineStatusBuffer;
+                if (!(FilterContext->LineStatusValid & PORTSNIFFER_LINE_STATUS_COMM) ||
+                    serialStatus->HoldReasons != lineStatus->HoldReasons ||
+                    serialStatus->Errors != 0)
+                {
+                    changes = PORTSNIFFER_LINE_STATUS_COMM;
+                    lineStatus->HoldReasons = serialStatus->HoldReasons;
+                    lineStatus->Errors = serialStatus->Errors;
+                }
+
+                FilterContext->LineStatusValid |= PORTSNIFFER_LINE_STATUS_COMM;
+            }
+            break;
+
+        case IOCTL_SERIAL_GET_MODEMSTATUS:
+            if (Information >= sizeof(ULONG))
+            {
+                // Besides the current state of the lines, the modem status register tells which lines have changed
+                // since the previous query. This reveals lines that have changed back in the meantime.
+                modemStatus = *(PULONG)requestContext->LineStatusBuffer;
+                if (!(FilterContext->LineStatusValid & PORTSNIFFER_LINE_STATUS_MODEM) ||
+                    (modemStatus & ~ModemStatusDeltas) != (lineStatus->ModemStatus & ~ModemStatusDeltas) ||
+                    (modemStatus & ModemStatusDeltas) != 0)
+                {
+                    changes = PORTSNIFFER_LINE_STATUS_MODEM;
+                    lineStatus->ModemStatus = modemStatus;
+                }
+
+                FilterContext->LineStatusValid |= PORTSNIFFER_LINE_STATUS_MODEM;
+            }
+            break;
+
+        case IOCTL_SERIAL_GET_STATS:
+            if (Information >= sizeof(SERIALPERF_STATS))
+            {
+                // The first query only provides the baseline for the counters.
+                // Counters lower than before have been reset via IOCTL_SERIAL_CLEAR_STATS and count from zero.
+                stats = (PSERIALPERF_STATS)requestContext->LineStatusBuffer;
+                if (FilterContext->LineStatusValid & PORTSNIFFER_LINE_STATUS_STATS)
+                {
+                    lineStatus->FrameErrors = stats->FrameErrorCount -
+                        ((stats->FrameErrorCount >= FilterContext->LineStats.FrameErrorCount) ? FilterContext->LineStats.FrameErrorCount : 0);
+                    lineStatus->SerialOverrunErrors = stats->SerialOverrunErrorCount -
+                        ((stats->SerialOverrunErrorCount >= FilterContext->LineStats.SerialOverrunErrorCount) ? FilterContext->LineStats.SerialOverrunErrorCount : 0);
+                    lineStatus->BufferOverrunErrors = stats->BufferOverrunErrorCount -
+                        ((stats->BufferOverrunErrorCount >= FilterContext->LineStats.BufferOverrunErrorCount) ? FilterContext->LineStats.BufferOverrunErrorCount : 0);
+                    lineStatus->ParityErrors = stats->ParityErrorCount -
+                        ((stats->ParityErrorCount >= FilterContext->LineStats.ParityErrorCount) ? FilterContext->LineStats.ParityErrorCount : 0);
+
+                    if (lineStatus->FrameErrors || lineStatus->SerialOverrunErrors || lineStatus->BufferOverrunErrors || lineStatus->ParityErrors)
+                    {
+                        changes = PORTSNIFFER_LINE_STATUS_STATS;
+                    }
+                }
+
+                FilterContext->LineStats = *stats;
+                FilterContext->LineStatusValid |= PORTSNIFFER_LINE_STATUS_STATS;
+            }
+            break;
+
+        case IOCTL_SERIAL_WAIT_ON_MASK:
+            if (Information >= sizeof(ULONG))
+            {
+                lineStatus->Events = *(PULONG)requestContext->LineStatusBuffer & LineEvents;
+                if (lineStatus->Events)
+                {
+                    changes = PORTSNIFFER_LINE_STATUS_EVENTS;
+                }
+            }
+            break;
+    }
+
+    if (changes)
+    {
+        // Only keep the fields of this IOCTL, the others were reported by previous entries already.
+        lineStatus->Changes = changes;
+
+        if (changes != PORTSNIFFER_LINE_STATUS_COMM)
+        {
+            lineStatus->Errors = 0;
+        }
+
+        if (changes != PORTSNIFFER_LINE_STATUS_EVENTS)
+        {
+            lineStatus->Events = 0;
+        }
+
+        if (changes != PORTSNIFFER_LINE_STATUS_STATS)
+        {
+            lineStatus->FrameErrors = 0;
+            lineStatus->SerialOverrunErrors = 0;
+            lineStatus->BufferOverrunErrors = 0;
+            lineStatus->ParityErrors = 0;
+        }
+
+        PortSnifferFilterCapturePortLogEntry(FilterContext,
+            PORTSNIFFER_PORTLOG_LINE_STATUS,
+            (PUCHAR)lineStatus,
+            sizeof(PORTSNIFFER_LINE_STATUS_DATA),
+            1
+        );
+    }
+
+    KeReleaseSpinLock(&FilterContext->LineStatusLock, oldIrql);
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCapturePortLogEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in USHORT Type,
+    __in PUCHAR Data,
+    __in size_t DataLength,
+    __in USHORT SamplingWeight
+    )
+{
+    // A log entry must always fit into the PORTSNIFFER_PORTLOG_ENTRY_LENGTH bytes the application provides for popping it.
+    // The actual data may consume everything that's left after the other fields.
+    const USHORT MaxDataLength = PORTSNIFFER_PORTLOG_ENTRY_LENGTH - FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data);
+
+    PCAPTURE_RING captureRing;
+    USHORT captureType;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    ULONG ioControlCode;
+    KIRQL oldIrql;
+    ULONG originalLength;
+    PPORTLOG_RECORD record;
+    USHORT snapLength;
+
+    KdPrint(("PortSnifferFilterCapturePortLogEntry(%p, %x, %p, %Iu, %u)\n", FilterContext, Type, Data, DataLength, SamplingWeight));
+
+    originalLength = (ULONG)min(DataLength, MAXULONG);
+
+    // Only copy the first SnapLength bytes of read and write data, but keep the original length.
+    // SnapLength is a single USHORT, so reading it without LogLock is fine.
+    snapLength = FilterContext->SnapLength;
+    if ((Type == PORTSNIFFER_MONITOR_READ || Type == PORTSNIFFER_MONITOR_WRITE) && snapLength > 0 && DataLength > snapLength)
+    {
+        DataLength = snapLength;
+    }
+
+    // Truncate any data that goes beyond our maximum supported length.
+    if (DataLength > MaxDataLength)
+    {
+        KdPrint(("Truncating log entry data from %Iu to %u bytes\n", DataLength, MaxDataLength));
+        DataLength = MaxDataLength;
+    }
+
+    // Lifecycle entries go into the capture ring of their request, so that they follow any data captured for it.
+    captureType = Type;
+    if (Type == PORTSNIFFER_PORTLOG_LIFECYCLE)
+    {
+        captureType = ((PPORTSNIFFER_LIFECYCLE_DATA)Data)->RequestType;
+    }
+
+    if (captureType == PORTSNIFFER_MONITOR_READ)
+    {
+        captureRing = &FilterContext->CaptureRings[CAPTURE_READ];
+    }
+    else if (captureType == PORTSNIFFER_MONITOR_WRITE)
+    {
+        captureRing = &FilterContext->CaptureRings[CAPTURE_WRITE];
+    }
+    else
+    {
+        captureRing = &FilterContext->CaptureRings[CAPTURE_IOCTL];
+    }
+
+    KeAcquireSpinLock(&captureRing->ProducerLock, &oldIrql);
+
+    // Monitoring may have been stopped in the meantime.
+    if (!captureRing->Header)
+    {
+        KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+        return;
+    }
+
+    // Let the capture filter program discard the entry before anything of it is copied.
+    // It sees all of the original data, no matter how much of it is captured.
+    if (FilterContext->CaptureFilterLength > 0)
+    {
+        ioControlCode = (Type == PORTSNIFFER_MONITOR_IOCTL) ? ((PPORTSNIFFER_IOCTL_DATA)Data)->IoControlCode : 0;
+        if (!CaptureFilterRun(FilterContext->CaptureFilter, FilterContext->CaptureFilterLength, Type, ioControlCode, Data, originalLength))
+        {
+            KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+            return;
+        }
+    }
+
+    // Report previously dropped entries before capturing anything new.
+    if (captureRing->DroppedGap.Entries > 0)
+    {
+        record = CaptureRingReserve(captureRing, FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + sizeof(PORTSNIFFER_GAP_DATA));
+        if (record)
+        {
+            PortSnifferFilterFillGapEntry(PORTLOG_RECORD_PAYLOAD(record), &captureRing->DroppedGap);
+            CaptureRingCommit(captureRing);
+        }
+    }
+
+    record = NULL;
+    if (captureRing->DroppedGap.Entries == 0)
+    {
+        record = CaptureRingReserve(captureRing, FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + (ULONG)DataLength);
+    }
+
+    if (record)
+    {
+        // Timestamp the entry while holding ProducerLock, so that the entries of each capture ring are in timestamp order.
+        // The drain work item relies on that for merging the capture rings (see capturering.h).
+        entry = PORTLOG_RECORD_PAYLOAD(record);
+        entry->Timestamp = KeQueryPerformanceCounter(NULL);
+        entry->Duration = 0;
+        entry->SequenceNumber = 0;
+        entry->Type = Type;
+        entry->Flags = (originalLength > DataLength) ? PORTSNIFFER_PORTLOG_FLAG_TRUNCATED : 0;
+        entry->OriginalLength = originalLength;
+        entry->DataLength = (USHORT)DataLength;
+        entry->SamplingWeight = SamplingWeight;
+        RtlCopyMemory(entry->Data, Data, DataLength);
+
+        CaptureRingCommit(captureRing);
+    }
+    else
+    {
+        // The drain work item hasn't caught up yet.
+        KdPrint(("Capture ring is full, dropping log entry\n"));
+        CaptureRingDrop(captureRing, originalLength);
+    }
+
+    CaptureRingPublish(captureRing);
+    KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+
+    // Let the drain work item merge the entry into the port log.
+    // This does nothing if the work item is already queued, but queues it again if it is already running.
+    WdfWorkItemEnqueue(FilterContext->DrainWorkItem);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterChargePortLogBudget(
+    __in ULONG Length
+    )
+{
+    LONG used;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterChargePortLogBudget(%lu)\n", Length));
+
+    // Port logs are allocated and resized under different locks, so charge the budget atomically.
+    do
+    {
+        used = PortLogBudgetUsed;
+        if (Length > PortLogBudget - (ULONG)used)
+        {
+            return FALSE;
+        }
+    }
+    while (InterlockedCompareExchange(&PortLogBudgetUsed, used + (LONG)Length, used) != used);
+
+    return TRUE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterCheckConsumer(
+    __in PFILTER_CONTEXT FilterContext,
+    __in_opt PPORTLOG_SUBSCRIBER Subscriber
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterCheckConsumer(%p, %p)\n", FilterContext, Subscriber));
+
+    // The caller must hold LogLock and wants to consume entries.
+    // The application must not consume entries from a port log it has mapped.
+    if (FilterContext->Mapping)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // Once a port has subscribers, only they may consume entries, each through its own read position.
+    if (Subscriber)
+    {
+        return (Subscriber->FilterContext == FilterContext) ? STATUS_SUCCESS : STATUS_INVALID_DEVICE_STATE;
+    }
+
+    return IsListEmpty(&FilterContext->Subscribers) ? STATUS_SUCCESS : STATUS_INVALID_DEVICE_STATE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterClearCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    ULONG i;
+
+    KdPrint(("PortSnifferFilterClearCaptureRings(%p)\n", FilterContext));
+
+    // This must not be pageable, because it acquires the ProducerLocks. The caller must hold LogLock.
+    // Discard all captured entries that haven't been merged into the port log yet.
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        if (FilterContext->CaptureRings[i].Header)
+        {
+            CaptureRingClear(&FilterContext->CaptureRings[i]);
+        }
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterClearPortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterClearPortLog(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    // The application owns the Head of a shared port log, so leave it to the application to skip any entries there.
+    if (!FilterContext->Mapping)
+    {
+        PortLogRingClear(&FilterContext->Log);
+    }
+
+    // An open entry has never been committed, so just forget about it.
+    // The same goes for suppressed repetitions, and the next entries mustn't be compared to the cleared ones.
+    FilterContext->OpenRecord = NULL;
+    PortSnifferFilterResetRepeats(FilterContext);
+    PortSnifferFilterClearCaptureRings(FilterContext);
+
+    // A new start disarms any trigger.
+    FilterContext->TriggerState = PORTSNIFFER_TRIGGER_NONE;
+
+    // Let the next entries start with a clock entry.
+    FilterContext->NextClockEntry = 0;
+
+    // Let the next status IOCTLs report the initial line status.
+    PortSnifferFilterResetLineStatus(FilterContext);
+
+    RtlZeroMemory(&FilterContext->Counters, sizeof(FilterContext->Counters));
+    RtlZeroMemory(&FilterContext->DroppedGap, sizeof(FilterContext->DroppedGap));
+    RtlZeroMemory(&FilterContext->OverwrittenGap, sizeof(FilterContext->OverwrittenGap));
+    PortSnifferFilterResetStatistics(FilterContext);
+
+    // Let time-sliced sampling start with a captured second.
+    FilterContext->SamplingStart = KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCloseCapture(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterCloseCapture(%p)\n", FilterContext));
+
+    // The caller must hold CaptureLock (unless the port is being removed).
+    // Afterwards, the capture file writer has nothing to do anymore.
+    if (FilterContext->CaptureFileHandle)
+    {
+        ZwClose(FilterContext->CaptureFileHandle);
+        FilterContext->CaptureFileHandle = NULL;
+    }
+
+    if (FilterContext->CaptureBuffer)
+    {
+        if (FilterContext->CaptureBufferLength > 0)
+        {
+            KdPrint(("Dropping %lu bytes of log entries of %wZ\n", FilterContext->CaptureBufferLength, &FilterContext->PortName));
+            FilterContext->CaptureBufferLength = 0;
+        }
+
+        ExFreePoolWithTag(FilterContext->CaptureBuffer, POOL_TAG);
+        FilterContext->CaptureBuffer = NULL;
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCloseOpenEntry(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterCloseOpenEntry(%p)\n", FilterContext));
+
+    // The caller must hold LogLock and deliver the entry afterwards.
+    PortLogRingCommit(&FilterContext->Log);
+    FilterContext->OpenRecord = NULL;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCompleteWaitQueue(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __in BOOLEAN DelayElapsed
+    )
+{
+    ULONG maxDelay;
+    ULONG minLength;
+    WDFREQUEST request;
+    PUCHAR response;
+    size_t responseBufferLength;
+    size_t responseLength;
+    PPORTLOG_RING ring;
+    NTSTATUS status;
+    WDFQUEUE waitQueue;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterCompleteWaitQueue(%p, %p, %u)\n", FilterContext, Subscriber, DelayElapsed));
+
+    // The caller must hold LogLock and has checked that we may read from the port log.
+    // A subscriber has its own wait queue and wait parameters and reads from its own position.
+    if (Subscriber)
+    {
+        waitQueue = Subscriber->WaitQueue;
+        minLength = Subscriber->WaitMinLength;
+        maxDelay = Subscriber->WaitMaxDelay;
+    }
+    else
+    {
+        waitQueue = FilterContext->WaitQueue;
+        minLength = FilterContext->WaitMinLength;
+        maxDelay = FilterContext->WaitMaxDelay;
+    }
+
+    // A minimum batch length beyond half the port log could never be reached.
+    minLength = min(minLength, FilterContext->Log.Size / 2);
+
+    // Hand out the log entries to the pending requests in the order these requests have arrived.
+    // Packing may resize the port log, so get the ring anew every time.
+    for (;;)
+    {
+        ring = PortSnifferFilterGetConsumerRing(FilterContext, Subscriber);
+        if (!PortLogRingPeek(ring))
+        {
+            break;
+        }
+
+        // Once the maximum delay has elapsed, the oldest request gets whatever is there.
+        // Otherwise, wait for the minimum batch length and make sure that the delay timer is running.
+        if (!DelayElapsed && ring->Tail - ring->Head < minLength)
+        {
+            if (maxDelay > 0 && !FilterContext->WaitTimerStarted)
+            {
+                FilterContext->WaitTimerStarted = TRUE;
+                WdfTimerStart(FilterContext->WaitTimer, WDF_REL_TIMEOUT_IN_MS(maxDelay));
+            }
+
+            break;
+        }
+
+        status = WdfIoQueueRetrieveNextRequest(waitQueue, &request);
+        if (!NT_SUCCESS(status))
+        {
+            // No request is pending (or all pending ones have been canceled).
+            break;
+        }
+
+        DelayElapsed = FALSE;
+
+        status = WdfRequestRetrieveOutputBuffer(request, PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH, &response, &responseBufferLength);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+            WdfRequestComplete(request, status);
+            continue;
+        }
+
+        responseLength = PortSnifferFilterPackPortLogEntries(FilterContext, Subscriber, response, responseBufferLength);
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, responseLength);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCompleteWaitRequests(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in BOOLEAN DelayElapsed
+    )
+{
+    PLIST_ENTRY entry;
+    PPORTLOG_RING ring;
+    PPORTLOG_SUBSCRIBER subscriber;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterCompleteWaitRequests(%p, %u)\n", FilterContext, DelayElapsed));
+
+    // The caller must hold LogLock.
+    // Never read from a shared port log, as the application can write anything to it.
+    // Requests waiting for the capture of a trigger stay pending until it is complete.
+    if (!FilterContext->Log.Buffer || FilterContext->Mapping || PortSnifferFilterIsTriggerPending(FilterContext))
+    {
+        return;
+    }
+
+    // Once a port has subscribers, each of them waits for the entries it hasn't read yet.
+    // They share the delay timer of the port, which completes the pending requests of all of them when it fires.
+    if (IsListEmpty(&FilterContext->Subscribers))
+    {
+        if (FilterContext->WaitQueue)
+        {
+            PortSnifferFilterCompleteWaitQueue(FilterContext, NULL, DelayElapsed);
+        }
+
+        return;
+    }
+
+    for (entry = FilterContext->Subscribers.Flink; entry != &FilterContext->Subscribers; entry = entry->Flink)
+    {
+        subscriber = CONTAINING_RECORD(entry, PORTLOG_SUBSCRIBER, ListEntry);
+        if (subscriber->WaitQueue)
+        {
+            PortSnifferFilterCompleteWaitQueue(FilterContext, subscriber, DelayElapsed);
+            continue;
+        }
+
+        // The capture file writer only wakes up early for a batch worth writing, otherwise its timer does the job.
+        ring = PortSnifferFilterGetConsumerRing(FilterContext, subscriber);
+        if (ring->Tail - ring->Head >= min(CAPTURE_FILE_BATCH_SIZE, FilterContext->Log.Size) / 2)
+        {
+            WdfWorkItemEnqueue(FilterContext->CaptureWorkItem);
+        }
+    }
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCountRequest(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    )
+{
+    ULONG bucket;
+    PREQUEST_COUNTERS counters;
+    PREQUEST_CONTEXT requestContext;
+
+    KdPrint(("PortSnifferFilterCountRequest(%p, %p, %08lX, %Iu)\n", FilterContext, Request, Status, Information));
+
+    // Only requests passed to PortSnifferFilterSampleRequest are counted, no matter whether they have been sampled.
+    requestContext = GetRequestContext(Request);
+    if (requestContext->MonitorType == PORTSNIFFER_MONITOR_READ)
+    {
+        counters = &FilterContext->RequestCounters[CAPTURE_READ];
+    }
+    else if (requestContext->MonitorType == PORTSNIFFER_MONITOR_WRITE)
+    {
+        counters = &FilterContext->RequestCounters[CAPTURE_WRITE];
+    }
+    else if (requestContext->MonitorType == PORTSNIFFER_MONITOR_IOCTL)
+    {
+        counters = &FilterContext->RequestCounters[CAPTURE_IOCTL];
+    }
+    else
+    {
+        return;
+    }
+
+    InterlockedIncrement64(&counters->Completed);
+
+    // The transferred bytes of IOCTLs are just output buffers, so we don't count them.
+    if (requestContext->MonitorType != PORTSNIFFER_MONITOR_IOCTL)
+    {
+        InterlockedExchangeAdd64(&counters->Bytes, (LONGLONG)Information);
+    }
+
+    if (!NT_SUCCESS(Status))
+    {
+        InterlockedIncrement64(&counters->Failed);
+    }
+
+    // Bucket n counts transfers from 2^(n-1) bytes on, the last one everything larger.
+    bucket = 0;
+    while (bucket < PORTSNIFFER_STATS_SIZE_BUCKETS - 1 && Information >= ((ULONG_PTR)1 << bucket))
+    {
+        bucket++;
+    }
+
+    InterlockedIncrement64(&counters->SizeHistogram[bucket]);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDeliverPortLogEntries(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterDeliverPortLogEntries(%p)\n", FilterContext));
+
+    // The caller must hold LogLock and has just committed new entries.
+    // Deliver them to the application if it is waiting for them.
+    if (FilterContext->Mapping)
+    {
+        if (PortLogSharedProducerPublish(&FilterContext->Log, FilterContext->Mapping->Header))
+        {
+            KeSetEvent(FilterContext->Mapping->Event, IO_NO_INCREMENT, FALSE);
+        }
+    }
+    else
+    {
+        PortSnifferFilterCompleteWaitRequests(FilterContext, FALSE);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDetachMapping(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PPORTLOG_MAPPING mapping;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterDetachMapping(%p)\n", FilterContext));
+
+    // The caller must hold FilterDevicesLock and LogLock (unless the port is being removed).
+    // The shared port log belongs to the mapping and is only freed along with it.
+    mapping = FilterContext->Mapping;
+    FilterContext->Mapping = NULL;
+    FilterContext->OpenRecord = NULL;
+    PortLogRingInitialize(&FilterContext->Log, NULL, 0);
+    InterlockedDecrement(&PortLogCount);
+
+    // Tell the application that no more entries are coming and wake it up.
+    mapping->FilterContext = NULL;
+    mapping->Header->Flags |= PORTLOG_SHARED_FLAG_DETACHED;
+    KeSetEvent(mapping->Event, IO_NO_INCREMENT, FALSE);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDetachSubscribers(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PLIST_ENTRY entry;
+    PPORTLOG_SUBSCRIBER subscriber;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterDetachSubscribers(%p)\n", FilterContext));
+
+    // The caller must hold FilterDevicesLock and the port is being removed, so LogLock may already be gone.
+    // Subscribers stay part of their file objects until the handles are closed, only unlink them from this port.
+    while (!IsListEmpty(&FilterContext->Subscribers))
+    {
+        entry = RemoveHeadList(&FilterContext->Subscribers);
+        subscriber = CONTAINING_RECORD(entry, PORTLOG_SUBSCRIBER, ListEntry);
+        subscriber->FilterContext = NULL;
+
+        // Cancel all requests of the subscriber still waiting for log entries.
+        // The capture file writer doesn't have any.
+        if (subscriber->WaitQueue)
+        {
+            WdfObjectDelete(subscriber->WaitQueue);
+            subscriber->WaitQueue = NULL;
+        }
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDrainCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    LONGLONG cutoff;
+    BOOLEAN entriesAdded;
+    PPORTSNIFFER_GAP_DATA gapData;
+    PCAPTURE_RING oldestCaptureRing;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE oldestEntry;
+    PPORTLOG_RECORD oldestRecord;
+    BOOLEAN stored;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterDrainCaptureRings(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    // An allocated port log always has its capture rings, but they outlive a shared port log closed by the application.
+    // Nobody wants the entries in that case.
+    if (!FilterContext->Log.Buffer)
+    {
+        PortSnifferFilterClearCaptureRings(FilterContext);
+        return;
+    }
+
+    // Learn about the entries the application has consumed from a shared port log.
+    if (FilterContext->Mapping)
+    {
+        PortLogSharedProducerSync(&FilterContext->Log, FilterContext->Mapping->Header);
+    }
+
+    // Only merge the entries captured before now (see CaptureRingsSync).
+    // Newer entries are left to the next pass, which their producers have queued.
+    cutoff = PortSnifferFilterSyncCaptureRings(FilterContext);
+
+    // Precede the entries with a clock entry if it's time for one, so that the application can always convert their timestamps.
+    entriesAdded = FALSE;
+    if (FilterContext->TriggerState != PORTSNIFFER_TRIGGER_HELD &&
+        KeQueryPerformanceCounter(NULL).QuadPart >= FilterContext->NextClockEntry && PortSnifferFilterAddClockEntry(FilterContext))
+    {
+        entriesAdded = TRUE;
+    }
+
+    // Merge the capture rings into the port log by always taking the oldest captured entry next.
+    for (;;)
+    {
+        // A held capture must stay as it is, so discard everything captured after it.
+        if (FilterContext->TriggerState == PORTSNIFFER_TRIGGER_HELD)
+        {
+            PortSnifferFilterClearCaptureRings(FilterContext);
+            break;
+        }
+
+        oldestRecord = CaptureRingsPeekOldest(FilterContext->CaptureRings, CAPTURE_COUNT, cutoff, &oldestCaptureRing);
+        if (!oldestRecord)
+        {
+            break;
+        }
+
+        oldestEntry = PORTLOG_RECORD_PAYLOAD(oldestRecord);
+
+        if (oldestEntry->Type == PORTSNIFFER_PORTLOG_GAP)
+        {
+            // Entries were dropped because the capture ring was full.
+            gapData = (PPORTSNIFFER_GAP_DATA)oldestEntry->Data;
+            if (PortSnifferFilterDropPortLogEntries(FilterContext, &oldestEntry->Timestamp, gapData->DroppedEntries, gapData->DroppedBytes))
+            {
+                entriesAdded = TRUE;
+            }
+        }
+        else
+        {
+            if (PortSnifferFilterAddPortLogEntry(FilterContext, oldestEntry, &stored))
+            {
+                entriesAdded = TRUE;
+            }
+
+            // An armed trigger looks at every entry stored in the port log. Dropped entries can't fire it or count
+            // towards the entries after it.
+            if (stored && FilterContext->TriggerState != PORTSNIFFER_TRIGGER_NONE && PortSnifferFilterAdvanceTrigger(FilterContext, oldestEntry))
+            {
+                entriesAdded = TRUE;
+            }
+        }
+
+        CaptureRingRemove(oldestCaptureRing, oldestRecord);
+    }
+
+    // Hand the space back to the producers.
+    CaptureRingsRelease(FilterContext->CaptureRings, CAPTURE_COUNT);
+
+    if (entriesAdded)
+    {
+        PortSnifferFilterDeliverPortLogEntries(FilterContext);
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterDropPortLogEntries(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PLARGE_INTEGER Timestamp,
+    __in ULONG Entries,
+    __in ULONGLONG Bytes
+    )
+{
+    BOOLEAN entriesAdded;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterDropPortLogEntries(%p, %p, %lu, %I64u)\n", FilterContext, Timestamp, Entries, Bytes));
+
+    // The caller must hold LogLock and deliver the entries if we return TRUE.
+    // Nothing may be coalesced across dropped entries, so the open entry is complete.
+    entriesAdded = FALSE;
+    if (FilterContext->OpenRecord)
+    {
+        PortSnifferFilterCloseOpenEntry(FilterContext);
+        entriesAdded = TRUE;
+    }
+
+    // Repetitions suppressed before go first.
+    // The dropped entries may differ from those the application has seen, so don't compare anything to those anymore.
+    if (PortSnifferFilterAddRepeatEntries(FilterContext))
+    {
+        entriesAdded = TRUE;
+    }
+
+    PortSnifferFilterResetRepeats(FilterContext);
+
+    // The dropped entries are reported through a gap entry once there is space again.
+    if (FilterContext->DroppedGap.Entries == 0)
+    {
+        FilterContext->DroppedGap.Timestamp = *Timestamp;
+        FilterContext->DroppedGap.SequenceNumber = FilterContext->Counters.NextSequenceNumber;
+    }
+
+    FilterContext->DroppedGap.Entries += Entries;
+    FilterContext->DroppedGap.Bytes += Bytes;
+    FilterContext->Counters.DroppedEntries += Entries;
+    FilterContext->Counters.DroppedBytes += Bytes;
+
+    // Dropped entries consume sequence numbers as well.
+    FilterContext->Counters.NextSequenceNumber += Entries;
+
+    return entriesAdded;
+}
+
+__drv_functionClass(EVT_WDF_TIMER)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterEvtCaptureTimer(
+    __in WDFTIMER Timer
+    )
+{
+    KdPrint(("PortSnifferFilterEvtCaptureTimer(%p)\n", Timer));
+
+    // This must not be pageable, because it runs at DISPATCH_LEVEL.
+    // Let the work item write whatever has been collected since the last time.
+    WdfWorkItemEnqueue(GetFilterContext(WdfTimerGetParentObject(Timer))->CaptureWorkItem);
+}
+
+__drv_functionClass(EVT_WDF_WORKITEM)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtCaptureWorkItem(
+    __in WDFWORKITEM WorkItem
+    )
+{
+    PFILTER_CONTEXT filterContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtCaptureWorkItem(%p)\n", WorkItem));
+
+    // Writing to the capture file happens in a system worker thread, so it never delays a monitored request.
+    filterContext = GetFilterContext(WdfWorkItemGetParentObject(WorkItem));
+
+    WdfWaitLockAcquire(filterContext->CaptureLock, NULL);
+    PortSnifferFilterWriteCaptureFile(filterContext);
+    WdfWaitLockRelease(filterContext->CaptureLock);
+}
+
+__drv_functionClass(EVT_WDF_TIMER)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtCoalesceTimer(
+    __in WDFTIMER Timer
+    )
+{
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    PFILTER_CONTEXT filterContext;
+    LONGLONG gapTime;
+    LONGLONG remainingTime;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtCoalesceTimer(%p)\n", Timer));
+
+    filterContext = GetFilterContext(WdfTimerGetParentObject(Timer));
+    WdfWaitLockAcquire(filterContext->LogLock, NULL);
+
+    if (filterContext->OpenRecord)
+    {
+        // Data may have been appended since the timer was started, so check how much of the gap is left.
+        entry = &filterContext->OpenEntry;
+        gapTime = PortSnifferFilterGetCoalesceGapTime(filterContext);
+        remainingTime = entry->Timestamp.QuadPart + entry->Duration + gapTime - KeQueryPerformanceCounter(NULL).QuadPart;
+
+        if (remainingTime > 0)
+        {
+            WdfTimerStart(Timer, PortSnifferFilterTicksToRelativeTime(min(remainingTime, gapTime)));
+        }
+        else
+        {
+            // No more data has arrived within the gap, so the entry is complete.
+            PortSnifferFilterCloseOpenEntry(filterContext);
+            PortSnifferFilterDeliverPortLogEntries(filterContext);
+        }
+    }
+
+    WdfWaitLockRelease(filterContext->LogLock);
+}
+
+__drv_functionClass(EVT_WDF_DRIVER_DEVICE_ADD)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterEvtDeviceAdd(
+    __in WDFDRIVER Driver,
+    __inout PWDFDEVICE_INIT DeviceInit
+    )
+{
+    DECLARE_CONST_UNICODE_STRING(portNameValueName, L"PortName");
+
+    WDF_OBJECT_ATTRIBUTES captureLockAttributes;
+    WDF_OBJECT_ATTRIBUTES captureTimerAttributes;
+    WDF_TIMER_CONFIG captureTimerConfig;
+    WDF_OBJECT_ATTRIBUTES captureWorkItemAttributes;
+    WDF_WORKITEM_CONFIG captureWorkItemConfig;
+    WDF_OBJECT_ATTRIBUTES coalesceTimerAttributes;
+    WDF_TIMER_CONFIG coalesceTimerConfig;
+    ULONG count;
+    WDFDEVICE device;
+    WDF_OBJECT_ATTRIBUTES deviceAttributes;
+    WDF_OBJECT_ATTRIBUTES drainWorkItemAttributes;
+    WDF_WORKITEM_CONFIG drainWorkItemConfig;
+    PFILTER_CONTEXT filterContext;
+    ULONG i;
+    WDF_OBJECT_ATTRIBUTES ioQueueAttributes;
+    WDF_IO_QUEUE_CONFIG ioQueueConfig;
+    WDF_OBJECT_ATTRIBUTES lingerTimerAttributes;
+    WDF_TIMER_CONFIG lingerTimerConfig;
+    WDF_OBJECT_ATTRIBUTES logLockAttributes;
+    WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
+    WDFSTRING portNameValueData;
+    WDF_OBJECT_ATTRIBUTES portNameValueDataAttributes;
+    WDFKEY regKey = WDF_NO_HANDLE;
+    WDF_OBJECT_ATTRIBUTES repeatTimerAttributes;
+    WDF_TIMER_CONFIG repeatTimerConfig;
+    WDF_OBJECT_ATTRIBUTES requestAttributes;
+    WDF_OBJECT_ATTRIBUTES statsTimerAttributes;
+    WDF_TIMER_CONFIG statsTimerConfig;
+    NTSTATUS status;
+    WDF_OBJECT_ATTRIBUTES waitTimerAttributes;
+    WDF_TIMER_CONFIG waitTimerConfig;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtDeviceAdd(%p, %p)\n", Driver, DeviceInit));
+
+    // Register us as a filter device.
+    WdfFdoInitSetFilter(DeviceInit);
+
+    // Register a callback to stop all control requests for the port before it is removed.
+    WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&pnpPowerCallbacks);
+    pnpPowerCallbacks.EvtDeviceSelfManagedIoCleanup = PortSnifferFilterEvtDeviceSelfManagedIoCleanup;
+    WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
+
+    // Give every request a context for tracing its lifecycle.
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, REQUEST_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+
+    // Register a callback to clean up the control device for the last port.
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, FILTER_CONTEXT);
+    deviceAttributes.EvtCleanupCallback = PortSnifferFilterEvtDeviceCleanup;
+
+    // Create our filter device and attach it to the stack of the port device.
+    status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfDeviceCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Our cleanup callbacks rely on these fields from now on.
+    filterContext = GetFilterContext(device);
+    PortHashInitializeEntry(&filterContext->HashEntry);
+    filterContext->PortIndex = PORTSNIFFER_PORT_INDEX_NONE;
+    ExInitializeRundownProtection(&filterContext->Rundown);
+    InitializeListHead(&filterContext->Subscribers);
+    filterContext->CaptureBuffer = NULL;
+    filterContext->CaptureBufferLength = 0;
+    filterContext->CaptureFileHandle = NULL;
+
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        KeInitializeSpinLock(&filterContext->CaptureRings[i].ProducerLock);
+        filterContext->CaptureRings[i].Header = NULL;
+    }
+
+    KeInitializeSpinLock(&filterContext->LineStatusLock);
+    PortSnifferFilterResetLineStatus(filterContext);
+
+    KeInitializeSpinLock(&filterContext->StatsLock);
+    PortSnifferFilterResetStatistics(filterContext);
+
+    // Query the port name and store it in our context.
+    status = WdfDeviceOpenRegistryKey(device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &regKey);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfFdoInitOpenRegistryKey failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&portNameValueDataAttributes);
+    portNameValueDataAttributes.ParentObject = device;
+    status = WdfStringCreate(NULL, &portNameValueDataAttributes, &portNameValueData);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfStringCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    status = WdfRegistryQueryString(regKey, &portNameValueName, portNameValueData);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfRegistryQueryString failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    WdfStringGetUnicodeString(portNameValueData, &filterContext->PortName);
+    if (filterContext->PortName.Length >= PORTSNIFFER_PORTNAME_LENGTH)
+    {
+        KdPrint(("PortName is too long: %wZ\n", &filterContext->PortName));
+        status = STATUS_NAME_TOO_LONG;
+        goto Cleanup;
+    }
+
+    // Initialize a Work Item for merging the capture rings into the port log at IRQL == PASSIVE_LEVEL.
+    WDF_WORKITEM_CONFIG_INIT(&drainWorkItemConfig, PortSnifferFilterEvtDrainWorkItem);
+    WDF_OBJECT_ATTRIBUTES_INIT(&drainWorkItemAttributes);
+    drainWorkItemAttributes.ParentObject = device;
+    status = WdfWorkItemCreate(&drainWorkItemConfig, &drainWorkItemAttributes, &filterContext->DrainWorkItem);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfWorkItemCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize the remaining context fields.
+    // The port log is only allocated when monitoring is started.
+    filterContext->MonitorMask = PORTSNIFFER_MONITOR_NONE;
+    PortLogRingInitialize(&filterContext->Log, NULL, 0);
+    filterContext->Mapping = NULL;
+    filterContext->LogCapacity = DefaultPortLogCapacity;
+    filterContext->OverflowPolicy = PORTSNIFFER_OVERFLOW_DROP_NEWEST;
+    filterContext->CoalesceGap = 0;
+    filterContext->SnapLength = 0;
+    filterContext->SamplingMode = PORTSNIFFER_SAMPLING_NONE;
+    filterContext->SamplingRate = 0;
+    filterContext->RepeatDepth = 0;
+    filterContext->SamplingStart = 0;
+    filterContext->OpenRecord = NULL;
+    RtlZeroMemory(filterContext->Repeats, sizeof(filterContext->Repeats));
+    RtlFillMemory(filterContext->IoctlFilter, sizeof(filterContext->IoctlFilter), 0xFF);
+    filterContext->BaudRate = DEFAULT_BAUD_RATE;
+    filterContext->LineControl.StopBits = STOP_BIT_1;
+    filterContext->LineControl.Parity = NO_PARITY;
+    filterContext->LineControl.WordLength = DEFAULT_WORD_LENGTH;
+    filterContext->WaitQueue = NULL;
+    filterContext->WaitTimerStarted = FALSE;
+    InitializeListHead(&filterContext->CaptureSubscriber.ListEntry);
+    filterContext->CaptureSubscriber.FilterContext = NULL;
+    filterContext->CaptureSubscriber.WaitQueue = NULL;
+    filterContext->CaptureSubscriber.WaitMinLength = 0;
+    filterContext->CaptureSubscriber.WaitMaxDelay = 0;
+    filterContext->CaptureFileIndex = 0;
+    filterContext->CaptureFileOffset = 0;
+    filterContext->TriggerState = PORTSNIFFER_TRIGGER_NONE;
+    filterContext->TriggerLength = 0;
+    filterContext->LingerOwner = NULL;
+    filterContext->LingerTime = 0;
+    filterContext->LingerPending = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&logLockAttributes);
+    logLockAttributes.ParentObject = device;
+    status = WdfWaitLockCreate(&logLockAttributes, &filterContext->LogLock);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfWaitLockCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a one-shot timer for completing PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES requests after their maximum delay.
+    // It runs at IRQL == PASSIVE_LEVEL as we are acquiring LogLock there.
+    WDF_TIMER_CONFIG_INIT(&waitTimerConfig, PortSnifferFilterEvtWaitTimer);
+    waitTimerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&waitTimerAttributes);
+    waitTimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+    waitTimerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&waitTimerConfig, &waitTimerAttributes, &filterContext->WaitTimer);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfTimerCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a one-shot timer for closing a coalesced log entry when no more data arrives.
+    // It runs at IRQL == PASSIVE_LEVEL as we are acquiring LogLock there.
+    WDF_TIMER_CONFIG_INIT(&coalesceTimerConfig, PortSnifferFilterEvtCoalesceTimer);
+    coalesceTimerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&coalesceTimerAttributes);
+    coalesceTimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+    coalesceTimerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&coalesceTimerConfig, &coalesceTimerAttributes, &filterContext->CoalesceTimer);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfTimerCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a one-shot timer for reporting suppressed repetitions when nothing else does.
+    // It runs at IRQL == PASSIVE_LEVEL as we are acquiring LogLock there.
+    WDF_TIMER_CONFIG_INIT(&repeatTimerConfig, PortSnifferFilterEvtRepeatTimer);
+    repeatTimerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&repeatTimerAttributes);
+    repeatTimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+    repeatTimerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&repeatTimerConfig, &repeatTimerAttributes, &filterContext->RepeatTimer);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfTimerCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a periodic timer for taking snapshots of the request counters under PORTSNIFFER_MONITOR_STATS.
+    // It runs at IRQL == DISPATCH_LEVEL, because it only uses interlocked operations and StatsLock.
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&statsTimerConfig, PortSnifferFilterEvtStatsTimer, 1000);
+    statsTimerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&statsTimerAttributes);
+    statsTimerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&statsTimerConfig, &statsTimerAttributes, &filterContext->StatsTimer);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfTimerCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a Work Item for writing capture files at IRQL == PASSIVE_LEVEL and a lock serializing its runs.
+    WDF_WORKITEM_CONFIG_INIT(&captureWorkItemConfig, PortSnifferFilterEvtCaptureWorkItem);
+    WDF_OBJECT_ATTRIBUTES_INIT(&captureWorkItemAttributes);
+    captureWorkItemAttributes.ParentObject = device;
+    status = WdfWorkItemCreate(&captureWorkItemConfig, &captureWorkItemAttributes, &filterContext->CaptureWorkItem);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfWorkItemCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&captureLockAttributes);
+    captureLockAttributes.ParentObject = device;
+    status = WdfWaitLockCreate(&captureLockAttributes, &filterContext->CaptureLock);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfWaitLockCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a periodic timer for writing the capture file even if a batch isn't complete.
+    // It runs at IRQL == DISPATCH_LEVEL, because it only queues the work item.
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&captureTimerConfig, PortSnifferFilterEvtCaptureTimer, CAPTURE_FILE_WRITE_INTERVAL);
+    captureTimerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&captureTimerAttributes);
+    captureTimerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&captureTimerConfig, &captureTimerAttributes, &filterContext->CaptureTimer);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfTimerCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Initialize a one-shot timer for stopping to capture once a linger period has elapsed.
+    // It runs at IRQL == PASSIVE_LEVEL as we are acquiring FilterDevicesLock there.
+    WDF_TIMER_CONFIG_INIT(&lingerTimerConfig, PortSnifferFilterEvtLingerTimer);
+    lingerTimerConfig.AutomaticSerialization = FALSE;
+    WDF_OBJECT_ATTRIBUTES_INIT(&lingerTimerAttributes);
+    lingerTimerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+    lingerTimerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&lingerTimerConfig, &lingerTimerAttributes, &filterContext->LingerTimer);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfTimerCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Register callbacks for all requests we possibly want to monitor.
+    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig, WdfIoQueueDispatchParallel);
+    ioQueueConfig.EvtIoRead = PortSnifferFilterEvtIoRead;
+    ioQueueConfig.EvtIoWrite = PortSnifferFilterEvtIoWrite;
+    ioQueueConfig.EvtIoDeviceControl = PortSnifferFilterEvtIoDeviceControl;
+
+    // Ensure that all callback routines are run at IRQL == PASSIVE_LEVEL as we are dealing with paged-pool memory there.
+    WDF_OBJECT_ATTRIBUTES_INIT(&ioQueueAttributes);
+    ioQueueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+
+    // Set up an I/O Queue to handle requests to our filter device.
+    status = WdfIoQueueCreate(device, &ioQueueConfig, &ioQueueAttributes, WDF_NO_HANDLE);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfIoQueueCreate failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Start capturing right away if the port is configured for unattended capture.
+    // The port isn't available for lookups yet, so no control request can interfere.
+    PortSnifferFilterStartCapture(filterContext);
+
+    // Add it to the collection of all our active filter devices and make it available for lookups by name.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+    status = WdfCollectionAdd(FilterDevices, device);
+    if (NT_SUCCESS(status))
+    {
+        PortHashInsert(&PortHashTable, &filterContext->HashEntry, filterContext->PortName.Buffer, filterContext->PortName.Length / sizeof(WCHAR));
+        PortSnifferFilterAssignPortIndex(filterContext);
+    }
+
+    count = WdfCollectionGetCount(FilterDevices);
+    WdfWaitLockRelease(FilterDevicesLock);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("WdfCollectionAdd failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Create our control device if this is the first port.
+    if (count == 1)
+    {
+        status = PortSnifferControlCreate(Driver);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("PortSnifferControlCreate failed, status = 0x%08lX\n", status));
+            goto Cleanup;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+
+Cleanup:
+    if (regKey != WDF_NO_HANDLE)
+    {
+        WdfRegistryClose(regKey);
+    }
+
+    return status;
+}
+
+void
+PortSnifferFilterEvtDeviceCleanup(
+    WDFDEVICE Device
+    )
+{
+    ULONG count;
+    PFILTER_CONTEXT filterContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtDeviceCleanup(%p)\n", Device));
+
+    filterContext = GetFilterContext(Device);
+
+    // This has usually been done in PortSnifferFilterEvtDeviceSelfManagedIoCleanup already, but not if the port was never started.
+    PortSnifferFilterUnpublishPort(filterContext);
+
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+    count = WdfCollectionGetCount(FilterDevices);
+
+    // Cancel all requests still waiting for log entries of this port.
+    // This must happen before the control device is deleted, because it is the parent of the wait queues.
+    if (filterContext->WaitQueue)
+    {
+        WdfObjectDelete(filterContext->WaitQueue);
+        filterContext->WaitQueue = NULL;
+    }
+
+    PortSnifferFilterDetachSubscribers(filterContext);
+
+    // Delete our control device if this is the last port.
+    if (count == 1)
+    {
+        KdPrint(("Deleting the control device.\n"));
+        WdfObjectDelete(ControlDevice);
+        ControlDevice = NULL;
+    }
+
+    // Delete our filter device from the collection.
+    WdfCollectionRemove(FilterDevices, Device);
+
+    // A shared port log stays mapped in the application until it closes its handle, only detach it from this port.
+    if (filterContext->Mapping)
+    {
+        PortSnifferFilterDetachMapping(filterContext);
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+
+    // Neither I/O nor control requests can reach this port anymore, so give back the memory of its port log.
+    // Don't use PortSnifferFilterFreePortLog here, because our LogLock child object may already be gone.
+    if (filterContext->Log.Buffer)
+    {
+        ExFreePoolWithTag(filterContext->Log.Buffer, POOL_TAG);
+        PortSnifferFilterReturnPortLogBudget(filterContext->Log.Size);
+        InterlockedDecrement(&PortLogCount);
+        PortLogRingInitialize(&filterContext->Log, NULL, 0);
+    }
+
+    // This has usually been done in PortSnifferFilterStopCapture already, but not if the port was never started.
+    PortSnifferFilterCloseCapture(filterContext);
+}
+
+__drv_functionClass(EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtDeviceSelfManagedIoCleanup(
+    __in WDFDEVICE Device
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtDeviceSelfManagedIoCleanup(%p)\n", Device));
+
+    // The port is being removed, but its child objects still exist.
+    // Let running control requests finish with them before they are deleted along with the device.
+    PortSnifferFilterUnpublishPort(GetFilterContext(Device));
+
+    // Report the last suppressed repetitions, so that they make it into the capture file as well.
+    WdfTimerStop(GetFilterContext(Device)->RepeatTimer, TRUE);
+    PortSnifferFilterReportRepeats(GetFilterContext(Device));
+
+    // Write the last captured entries while we can still acquire our locks.
+    PortSnifferFilterStopCapture(GetFilterContext(Device));
+
+    // The port is no longer published, so no closed handle can start its linger period again.
+    WdfTimerStop(GetFilterContext(Device)->LingerTimer, TRUE);
+}
+
+__drv_functionClass(EVT_WDF_WORKITEM)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtDrainWorkItem(
+    __in WDFWORKITEM WorkItem
+    )
+{
+    PFILTER_CONTEXT filterContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtDrainWorkItem(%p)\n", WorkItem));
+
+    // Producers have captured new entries, so merge them into the port log.
+    // Only we wait for LogLock here, while the producers can go on capturing.
+    filterContext = GetFilterContext(WdfWorkItemGetParentObject(WorkItem));
+
+    WdfWaitLockAcquire(filterContext->LogLock, NULL);
+    PortSnifferFilterDrainCaptureRings(filterContext);
+    WdfWaitLockRelease(filterContext->LogLock);
+}
+
+__drv_functionClass(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterEvtIoDeviceControl(
+    __in WDFQUEUE Queue,
+    __in WDFREQUEST Request,
+    __in size_t OutputBufferLength,
+    __in size_t InputBufferLength,
+    __in ULONG IoControlCode
+    )
+{
+    BOOLEAN capture;
+    WDFDEVICE device;
+    PFILTER_CONTEXT filterContext;
+    USHORT monitorMask;
+    WDF_REQUEST_SEND_OPTIONS sendOptions;
+    BOOLEAN sendResult;
+    NTSTATUS status;
+    WDFIOTARGET target;
+    BOOLEAN waitForCompletion;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtIoDeviceControl(%p, %p, %Iu, %Iu, %lX)\n", Queue, Request, OutputBufferLength, InputBufferLength, IoControlCode));
+
+    device = WdfIoQueueGetDevice(Queue);
+    filterContext = GetFilterContext(device);
+    target = WdfDeviceGetIoTarget(device);
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    // Character times for coalescing depend on the line settings, so keep track of them even if we don't log them.
+    if (IoControlCode == IOCTL_SERIAL_SET_BAUD_RATE || IoControlCode == IOCTL_SERIAL_SET_LINE_CONTROL)
+    {
+        PortSnifferFilterTrackLineSettings(filterContext, Request, IoControlCode);
+    }
+
+    monitorMask = filterContext->MonitorMask;
+    capture = ((monitorMask & PORTSNIFFER_MONITOR_IOCTL) && PORTSNIFFER_IOCTL_FILTER_TEST(filterContext->IoctlFilter, IoControlCode));
+    waitForCompletion = FALSE;
+
+    if (capture || (monitorMask & PORTSNIFFER_MONITOR_STATS))
+    {
+        // We monitor or at least count this I/O Device Control request.
+        // Its output buffer and status are only known when the port driver completes it.
+        // Requests skipped by sampling or only counted for statistics are only counted on completion.
+        if (PortSnifferFilterSampleRequest(filterContext, Request, PORTSNIFFER_MONITOR_IOCTL, capture))
+        {
+            PortSnifferFilterEvtIoDeviceControlInternal(filterContext, Request, OutputBufferLength, InputBufferLength, IoControlCode);
+
+            if (monitorMask & PORTSNIFFER_MONITOR_LIFECYCLE)
+            {
+                // We also trace the lifecycle of I/O Device Control requests for this port.
+                PortSnifferFilterBeginLifecycle(Request, PORTSNIFFER_MONITOR_IOCTL, IoControlCode, OutputBufferLength);
+            }
+        }
+
+        waitForCompletion = TRUE;
+    }
+
+    if ((monitorMask & PORTSNIFFER_MONITOR_LINE_STATUS) && PortSnifferFilterBeginLineStatus(Request, IoControlCode))
+    {
+        // This status request may reveal a change of the line status, which we only learn on completion.
+        waitForCompletion = TRUE;
+    }
+
+    if (waitForCompletion)
+    {
+        WdfRequestSetCompletionRoutine(Request, PortSnifferFilterEvtIoDeviceControlCompletionRoutine, filterContext);
+        sendResult = WdfRequestSend(Request, target, WDF_NO_SEND_OPTIONS);
+    }
+    else
+    {
+        // We don't monitor this I/O Device Control request.
+        // Forward the request and we're done.
+        WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+        sendResult = WdfRequestSend(Request, target, &sendOptions);
+    }
+
+    if (!sendResult)
+    {
+        status = WdfRequestGetStatus(Request);
+        KdPrint(("WdfRequestSend failed, status = 0x%08lX\n", status));
+        PortSnifferFilterCountRequest(filterContext, Request, status, 0);
+        PortSnifferFilterCaptureIoctlEntry(filterContext, Request, status, 0);
+        PortSnifferFilterCaptureLifecycleEntry(filterContext, Request, status, 0);
+        WdfRequestComplete(Request, status);
+    }
+}
+
+void
+PortSnifferFilterEvtIoDeviceControlCompletionRoutine(
+    __in WDFREQUEST Request,
+    __in WDFIOTARGET Target,
+    __in PWDF_REQUEST_COMPLETION_PARAMS Params,
+    __in WDFCONTEXT Context
+    )
+{
+    PFILTER_CONTEXT filterContext;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    KdPrint(("PortSnifferFilterEvtIoDeviceControlCompletionRoutine(%p, %p, %p, %p)\n", Request, Target, Params, Context));
+
+    // Completion Routines may run at IRQL == DISPATCH_LEVEL, but the IOCTL buffers are nonpaged and so are the capture rings.
+    filterContext = (PFILTER_CONTEXT)Context;
+    PortSnifferFilterCountRequest(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+    PortSnifferFilterCaptureIoctlEntry(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+    PortSnifferFilterCaptureLineStatusEntry(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+    PortSnifferFilterCaptureLifecycleEntry(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+    WdfRequestComplete(Request, Params->IoStatus.Status);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtIoDeviceControlInternal(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in size_t OutputBufferLength,
+    __in size_t InputBufferLength,
+    __in ULONG IoControlCode
+    )
+{
+    // The input and output buffer must fit into a log entry together, with the input buffer taking precedence.
+    const size_t MaxBufferLength = PORTSNIFFER_PORTLOG_ENTRY_LENGTH - FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) - FIELD_OFFSET(PORTSNIFFER_IOCTL_DATA, Data);
+
+    PUCHAR inputBuffer;
+    size_t inputLength;
+    PPORTSNIFFER_IOCTL_DATA ioctlData;
+    size_t ioctlDataLength;
+    PUCHAR outputBuffer;
+    size_t outputLength;
+    PREQUEST_CONTEXT requestContext;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtIoDeviceControlInternal(%p, %p, %Iu, %Iu, %lX)\n", FilterContext, Request, OutputBufferLength, InputBufferLength, IoControlCode));
+
+    // The buffers of METHOD_NEITHER requests are only valid in the context of the application, so we can't capture them.
+    inputBuffer = NULL;
+    inputLength = 0;
+    outputBuffer = NULL;
+    outputLength = 0;
+
+    if (METHOD_FROM_CTL_CODE(IoControlCode) != METHOD_NEITHER)
+    {
+        if (InputBufferLength > 0)
+        {
+            status = WdfRequestRetrieveInputBuffer(Request, 0, &inputBuffer, &inputLength);
+            if (!NT_SUCCESS(status))
+            {
+                KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
+                inputLength = 0;
+            }
+        }
+
+        if (OutputBufferLength > 0)
+        {
+            status = WdfRequestRetrieveOutputBuffer(Request, 0, &outputBuffer, &outputLength);
+            if (!NT_SUCCESS(status))
+            {
+                KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
+                outputLength = 0;
+            }
+        }
+    }
+
+    inputLength = min(inputLength, MaxBufferLength);
+    outputLength = min(outputLength, MaxBufferLength - inputLength);
+
+    // Allocate the entry data for the largest possible output right away, so that the completion routine doesn't have to.
+    ioctlDataLength = FIELD_OFFSET(PORTSNIFFER_IOCTL_DATA, Data) + inputLength + outputLength;
+    ioctlData = ExAllocatePoolWithTag(NonPagedPool, ioctlDataLength, POOL_TAG);
+    if (!ioctlData)
+    {
+        KdPrint(("ExAllocatePoolWithTag failed for %Iu bytes\n", ioctlDataLength));
+        return;
+    }
+
+    ioctlData->IoControlCode = IoControlCode;
+    ioctlData->Status = STATUS_PENDING;
+    ioctlData->InputLength = (USHORT)inputLength;
+    ioctlData->OutputLength = 0;
+    RtlCopyMemory(ioctlData->Data, inputBuffer, inputLength);
+
+    requestContext = GetRequestContext(Request);
+    requestContext->IoctlData = ioctlData;
+    requestContext->OutputBuffer = outputBuffer;
+    requestContext->OutputLength = (USHORT)outputLength;
+}
+
+__drv_functionClass(EVT_WDF_IO_QUEUE_IO_READ)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterEvtIoRead(
+    __in WDFQUEUE Queue,
+    __in WDFREQUEST Request,
+    __in size_t Length
+    )
+{
+    WDFDEVICE device;
+    PFILTER_CONTEXT filterContext;
+    USHORT monitorMask;
+    WDFMEMORY outputMemory;
+    WDF_REQUEST_SEND_OPTIONS sendOptions;
+    BOOLEAN sendResult;
+    NTSTATUS status;
+    WDFIOTARGET target;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtIoRead(%p, %p, %Iu)\n", Queue, Request, Length));
+
+    device = WdfIoQueueGetDevice(Queue);
+    filterContext = GetFilterContext(device);
+    target = WdfDeviceGetIoTarget(device);
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    monitorMask = filterContext->MonitorMask;
+    if (monitorMask & (PORTSNIFFER_MONITOR_READ | PORTSNIFFER_MONITOR_STATS))
+    {
+        // We monitor or at least count read requests for this port.
+        // As an upper filter driver, we have to wait until lower drivers have filled the read buffer.
+        status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("WdfRequestRetrieveOutputMemory failed, status = 0x%08lX\n", status));
+            WdfRequestComplete(Request, status);
+            return;
+        }
+
+        status = WdfIoTargetFormatRequestForRead(target, Request, outputMemory, NULL, NULL);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("WdfIoTargetFormatRequestForRead failed, status = 0x%08lX\n", status));
+            WdfRequestComplete(Request, status);
+            return;
+        }
+
+        // Requests skipped by sampling or only counted for statistics are only counted on completion.
+        if (PortSnifferFilterSampleRequest(filterContext, Request, PORTSNIFFER_MONITOR_READ, (monitorMask & PORTSNIFFER_MONITOR_READ) != 0)
+            && (monitorMask & PORTSNIFFER_MONITOR_LIFECYCLE))
+        {
+            // We also trace the lifecycle of read requests for this port.
+            PortSnifferFilterBeginLifecycle(Request, PORTSNIFFER_MONITOR_READ, 0, Length);
+        }
+
+        WdfRequestSetCompletionRoutine(Request, PortSnifferFilterEvtIoReadCompletionRoutine, filterContext);
+        sendResult = WdfRequestSend(Request, target, WDF_NO_SEND_OPTIONS);
+    }
+    else
+    {
+        // We don't monitor read requests for this port.
+        // Forward the request and we're done.
+        WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+        sendResult = WdfRequestSend(Request, target, &sendOptions);
+    }
+
+    if (!sendResult)
+    {
+        status = WdfRequestGetStatus(Request);
+        KdPrint(("WdfRequestSend failed, status = 0x%08lX\n", status));
+        PortSnifferFilterCountRequest(filterContext, Request, status, 0);
+        PortSnifferFilterCaptureLifecycleEntry(filterContext, Request, status, 0);
+        WdfRequestComplete(Request, status);
+    }
+}
+
+void
+PortSnifferFilterEvtIoReadCompletionRoutine(
+    __in WDFREQUEST Request,
+    __in WDFIOTARGET Target,
+    __in PWDF_REQUEST_COMPLETION_PARAMS Params,
+    __in WDFCONTEXT Context
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PREQUEST_CONTEXT requestContext;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    KdPrint(("PortSnifferFilterEvtIoReadCompletionRoutine(%p, %p, %p, %p)\n", Request, Target, Params, Context));
+
+    filterContext = (PFILTER_CONTEXT)Context;
+    requestContext = GetRequestContext(Request);
+    PortSnifferFilterCountRequest(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+
+    if (requestContext->SamplingWeight > 0 && NT_SUCCESS(Params->IoStatus.Status) && Params->Parameters.Read.Length > 0)
+    {
+        // This is a successfully completed read request, which we want to log.
+        // Completion Routines may run at IRQL == DISPATCH_LEVEL, but the read buffer is nonpaged and so are the capture rings.
+        // Capture the data right here, so that every read request is completed without delay and no matter how many
+        // of them are outstanding.
+        PortSnifferFilterCapturePortLogEntry(filterContext,
+            PORTSNIFFER_MONITOR_READ,
+            WdfMemoryGetBuffer(Params->Parameters.Read.Buffer, NULL),
+            Params->Parameters.Read.Length,
+            requestContext->SamplingWeight
+        );
+    }
+
+    // Failed and empty reads only show up here if their lifecycle is traced.
+    PortSnifferFilterCaptureLifecycleEntry(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+    WdfRequestComplete(Request, Params->IoStatus.Status);
+}
+
+__drv_functionClass(EVT_WDF_IO_QUEUE_IO_WRITE)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterEvtIoWrite(
+    __in WDFQUEUE Queue,
+    __in WDFREQUEST Request,
+    __in size_t Length
+    )
+{
+    WDFDEVICE device;
+    PFILTER_CONTEXT filterContext;
+    WDFMEMORY inputMemory;
+    USHORT monitorMask;
+    WDF_REQUEST_SEND_OPTIONS sendOptions;
+    BOOLEAN sendResult;
+    NTSTATUS status;
+    WDFIOTARGET target;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtIoWrite(%p, %p, %Iu)\n", Queue, Request, Length));
+
+    device = WdfIoQueueGetDevice(Queue);
+    filterContext = GetFilterContext(device);
+    target = WdfDeviceGetIoTarget(device);
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    monitorMask = filterContext->MonitorMask;
+    if (monitorMask & (PORTSNIFFER_MONITOR_WRITE | PORTSNIFFER_MONITOR_STATS))
+    {
+        // We monitor or at least count write requests for this port.
+        // The port driver may complete them after sending only part of the write buffer (e.g. on a write timeout),
+        // so we have to wait until it tells us how much data has actually gone out.
+        status = WdfRequestRetrieveInputMemory(Request, &inputMemory);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("WdfRequestRetrieveInputMemory failed, status = 0x%08lX\n", status));
+            WdfRequestComplete(Request, status);
+            return;
+        }
+
+        status = WdfIoTargetFormatRequestForWrite(target, Request, inputMemory, NULL, NULL);
+        if (!NT_SUCCESS(status))
+        {
+            KdPrint(("WdfIoTargetFormatRequestForWrite failed, status = 0x%08lX\n", status));
+            WdfRequestComplete(Request, status);
+            return;
+        }
+
+        // Requests skipped by sampling or only counted for statistics are only counted on completion.
+        if (PortSnifferFilterSampleRequest(filterContext, Request, PORTSNIFFER_MONITOR_WRITE, (monitorMask & PORTSNIFFER_MONITOR_WRITE) != 0)
+            && (monitorMask & PORTSNIFFER_MONITOR_LIFECYCLE))
+        {
+            // We also trace the lifecycle of write requests for this port.
+            PortSnifferFilterBeginLifecycle(Request, PORTSNIFFER_MONITOR_WRITE, 0, Length);
+        }
+
+        WdfRequestSetCompletionRoutine(Request, PortSnifferFilterEvtIoWriteCompletionRoutine, filterContext);
+        sendResult = WdfRequestSend(Request, target, WDF_NO_SEND_OPTIONS);
+    }
+    else
+    {
+        // We don't monitor write requests for this port.
+        // Forward the request and we're done.
+        WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+        sendResult = WdfRequestSend(Request, target, &sendOptions);
+    }
+
+    if (!sendResult)
+    {
+        status = WdfRequestGetStatus(Request);
+        KdPrint(("WdfRequestSend failed, status = 0x%08lX\n", status));
+        PortSnifferFilterCountRequest(filterContext, Request, status, 0);
+        PortSnifferFilterCaptureLifecycleEntry(filterContext, Request, status, 0);
+        WdfRequestComplete(Request, status);
+    }
+}
+
+void
+PortSnifferFilterEvtIoWriteCompletionRoutine(
+    __in WDFREQUEST Request,
+    __in WDFIOTARGET Target,
+    __in PWDF_REQUEST_COMPLETION_PARAMS Params,
+    __in WDFCONTEXT Context
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    PREQUEST_CONTEXT requestContext;
+
+    UNREFERENCED_PARAMETER(Target);
+
+    KdPrint(("PortSnifferFilterEvtIoWriteCompletionRoutine(%p, %p, %p, %p)\n", Request, Target, Params, Context));
+
+    filterContext = (PFILTER_CONTEXT)Context;
+    requestContext = GetRequestContext(Request);
+    PortSnifferFilterCountRequest(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+
+    if (requestContext->SamplingWeight > 0 && Params->Parameters.Write.Length > 0)
+    {
+        // Log exactly the data the port driver has sent, which is the beginning of the write buffer.
+        // Failed and timed out requests may still have sent some of it.
+        // Completion Routines may run at IRQL == DISPATCH_LEVEL, but the write buffer is nonpaged and so are the capture rings.
+        PortSnifferFilterCapturePortLogEntry(filterContext,
+            PORTSNIFFER_MONITOR_WRITE,
+            WdfMemoryGetBuffer(Params->Parameters.Write.Buffer, NULL),
+            Params->Parameters.Write.Length,
+            requestContext->SamplingWeight
+        );
+    }
+
+    // Requests that haven't sent anything only show up here if their lifecycle is traced.
+    PortSnifferFilterCaptureLifecycleEntry(filterContext, Request, Params->IoStatus.Status, Params->IoStatus.Information);
+    WdfRequestComplete(Request, Params->IoStatus.Status);
+}
+
+__drv_functionClass(EVT_WDF_TIMER)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtLingerTimer(
+    __in WDFTIMER Timer
+    )
+{
+    PFILTER_CONTEXT filterContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtLingerTimer(%p)\n", Timer));
+
+    // Nobody has resumed monitoring within the linger period, so stop capturing.
+    // The port log keeps its entries for popping them later, just like with PORTSNIFFER_MONITOR_NONE.
+    filterContext = GetFilterContext(WdfTimerGetParentObject(Timer));
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+
+    if (filterContext->LingerPending)
+    {
+        KdPrint(("Linger period of %wZ has elapsed\n", &filterContext->PortName));
+        filterContext->LingerPending = FALSE;
+        filterContext->MonitorMask &= PORTSNIFFER_MONITOR_STATS;
+    }
+
+    WdfWaitLockRelease(FilterDevicesLock);
+}
+
+__drv_functionClass(EVT_WDF_TIMER)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtRepeatTimer(
+    __in WDFTIMER Timer
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtRepeatTimer(%p)\n", Timer));
+
+    // Report the repetitions suppressed for a while, so that a port polling the same all the time doesn't look idle.
+    PortSnifferFilterReportRepeats(GetFilterContext(WdfTimerGetParentObject(Timer)));
+}
+
+__drv_functionClass(EVT_WDF_TIMER)
+__drv_sameIRQL
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterEvtStatsTimer(
+    __in WDFTIMER Timer
+    )
+{
+    PFILTER_CONTEXT filterContext;
+    ULONG i;
+    KIRQL oldIrql;
+    PSTATS_SNAPSHOT snapshot;
+
+    KdPrint(("PortSnifferFilterEvtStatsTimer(%p)\n", Timer));
+
+    // This must not be pageable, because it runs at DISPATCH_LEVEL.
+    filterContext = GetFilterContext(WdfTimerGetParentObject(Timer));
+    KeAcquireSpinLock(&filterContext->StatsLock, &oldIrql);
+
+    filterContext->StatsSeconds++;
+    snapshot = &filterContext->StatsHistory[filterContext->StatsSeconds % STATS_HISTORY_LENGTH];
+
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        snapshot->Completed[i] = InterlockedCompareExchange64(&filterContext->RequestCounters[i].Completed, 0, 0);
+        snapshot->Bytes[i] = InterlockedCompareExchange64(&filterContext->RequestCounters[i].Bytes, 0, 0);
+    }
+
+    KeReleaseSpinLock(&filterContext->StatsLock, oldIrql);
+}
+
+__drv_functionClass(EVT_WDF_TIMER)
+__drv_sameIRQL
+__drv_maxIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterEvtWaitTimer(
+    __in WDFTIMER Timer
+    )
+{
+    PFILTER_CONTEXT filterContext;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterEvtWaitTimer(%p)\n", Timer));
+
+    // The maximum delay has elapsed, so complete the oldest pending request with whatever log entries are available.
+    filterContext = GetFilterContext(WdfTimerGetParentObject(Timer));
+
+    WdfWaitLockAcquire(filterContext->LogLock, NULL);
+    filterContext->WaitTimerStarted = FALSE;
+    PortSnifferFilterCompleteWaitRequests(filterContext, TRUE);
+    WdfWaitLockRelease(filterContext->LogLock);
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterFillGapEntry(
+    __out PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry,
+    __inout PPORTLOG_GAP Gap
+    )
+{
+    PPORTSNIFFER_GAP_DATA gapData;
+
+    KdPrint(("PortSnifferFilterFillGapEntry(%p, %p)\n", Entry, Gap));
+
+    // The gap entry is timestamped with the first dropped entry and takes over its sequence number.
+    Entry->Timestamp = Gap->Timestamp;
+    Entry->Duration = 0;
+    Entry->SequenceNumber = Gap->SequenceNumber;
+    Entry->Type = PORTSNIFFER_PORTLOG_GAP;
+    Entry->Flags = 0;
+    Entry->OriginalLength = sizeof(PORTSNIFFER_GAP_DATA);
+    Entry->DataLength = sizeof(PORTSNIFFER_GAP_DATA);
+    Entry->SamplingWeight = 1;
+
+    gapData = (PPORTSNIFFER_GAP_DATA)Entry->Data;
+    gapData->DroppedBytes = Gap->Bytes;
+    gapData->DroppedEntries = Gap->Entries;
+
+    // The gap has been reported.
+    RtlZeroMemory(Gap, sizeof(PORTLOG_GAP));
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterFreeCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PCAPTURE_RING captureRing;
+    PPORTLOG_SHARED_HEADER headers[CAPTURE_COUNT];
+    ULONG i;
+    KIRQL oldIrql;
+
+    KdPrint(("PortSnifferFilterFreeCaptureRings(%p)\n", FilterContext));
+
+    // This must not be pageable, because it acquires the ProducerLocks.
+    // Producers check Header while holding ProducerLock, so none of them can use a capture ring after we have reset it.
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        captureRing = &FilterContext->CaptureRings[i];
+
+        KeAcquireSpinLock(&captureRing->ProducerLock, &oldIrql);
+        headers[i] = captureRing->Header;
+        captureRing->Header = NULL;
+        KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+    }
+
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        if (headers[i])
+        {
+            ExFreePoolWithTag(headers[i], POOL_TAG);
+        }
+    }
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterFreePortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PVOID buffer;
+    ULONG size;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterFreePortLog(%p)\n", FilterContext));
+
+    // The caller must hold FilterDevicesLock (see PortSnifferFilterAllocatePortLog).
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+    FilterContext->OpenRecord = NULL;
+    FilterContext->TriggerState = PORTSNIFFER_TRIGGER_NONE;
+
+    if (FilterContext->Mapping)
+    {
+        // A shared port log is freed along with its mapping.
+        PortSnifferFilterDetachMapping(FilterContext);
+        buffer = NULL;
+        size = 0;
+    }
+    else
+    {
+        buffer = FilterContext->Log.Buffer;
+        size = FilterContext->Log.Size;
+        PortLogRingInitialize(&FilterContext->Log, NULL, 0);
+    }
+
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    if (buffer)
+    {
+        ExFreePoolWithTag(buffer, POOL_TAG);
+        PortSnifferFilterReturnPortLogBudget(size);
+        InterlockedDecrement(&PortLogCount);
+    }
+
+    PortSnifferFilterFreeCaptureRings(FilterContext);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+LONGLONG
+PortSnifferFilterGetCoalesceGapTime(
+    __in PFILTER_CONTEXT FilterContext
+    )
+{
+    ULONG halfBits;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterGetCoalesceGapTime(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    // A character consists of a start bit, the data bits, an optional parity bit and the stop bits.
+    // Count them in half bits to account for 1.5 stop bits.
+    halfBits = 2 + 2 * FilterContext->LineControl.WordLength;
+
+    if (FilterContext->LineControl.Parity != NO_PARITY)
+    {
+        halfBits += 2;
+    }
+
+    if (FilterContext->LineControl.StopBits == STOP_BITS_1_5)
+    {
+        halfBits += 3;
+    }
+    else if (FilterContext->LineControl.StopBits == STOP_BITS_2)
+    {
+        halfBits += 4;
+    }
+    else
+    {
+        halfBits += 2;
+    }
+
+    // CoalesceGap is given in tenths of character times and we return performance counter ticks.
+    return (LONGLONG)FilterContext->CoalesceGap * halfBits * PerformanceFrequency.QuadPart / (20 * (LONGLONG)FilterContext->BaudRate);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_RING
+PortSnifferFilterGetConsumerRing(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterGetConsumerRing(%p, %p)\n", FilterContext, Subscriber));
+
+    // The caller must hold LogLock.
+    // Without a subscriber, entries are consumed right from the port log.
+    if (!Subscriber)
+    {
+        return &FilterContext->Log;
+    }
+
+    // A subscriber reads through a view of the port log that only has a Head of its own.
+    // The port log may have got new entries or been resized since, so bring the rest of the view up to date.
+    Subscriber->Cursor.Buffer = FilterContext->Log.Buffer;
+    Subscriber->Cursor.Size = FilterContext->Log.Size;
+    Subscriber->Cursor.Tail = FilterContext->Log.Tail;
+    return &Subscriber->Cursor;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONG
+PortSnifferFilterGetFairShare(void)
+{
+    LONG count;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterGetFairShare()\n"));
+
+    // Every allocated port log may claim an equal part of the budget.
+    count = PortLogCount;
+    return PortLogBudget / (ULONG)max(count, 1);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_REPEAT
+PortSnifferFilterGetRepeat(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in USHORT Type
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterGetRepeat(%p, %u)\n", FilterContext, Type));
+
+    // The caller must hold LogLock.
+    // Only read, write and IOCTL entries are compared, and only to earlier ones of the same type.
+    if (FilterContext->RepeatDepth == 0)
+    {
+        return NULL;
+    }
+
+    switch (Type)
+    {
+        case PORTSNIFFER_MONITOR_READ:
+            return &FilterContext->Repeats[CAPTURE_READ];
+
+        case PORTSNIFFER_MONITOR_WRITE:
+            return &FilterContext->Repeats[CAPTURE_WRITE];
+
+        case PORTSNIFFER_MONITOR_IOCTL:
+            return &FilterContext->Repeats[CAPTURE_IOCTL];
+
+        default:
+            return NULL;
+    }
+}
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterGetStatistics(
+    __in PFILTER_CONTEXT FilterContext,
+    __out PPORTSNIFFER_PORT_STATISTICS Statistics
+    )
+{
+    static const ULONG WindowSeconds[PORTSNIFFER_STATS_WINDOWS] = { 1, 10, 60 };
+
+    ULONG bucket;
+    PSTATS_SNAPSHOT first;
+    ULONG i;
+    PSTATS_SNAPSHOT last;
+    KIRQL oldIrql;
+    PPORTSNIFFER_REQUEST_STATISTICS requestStatistics;
+    ULONG seconds;
+    ULONG w;
+
+    KdPrint(("PortSnifferFilterGetStatistics(%p, %p)\n", FilterContext, Statistics));
+
+    RtlZeroMemory(Statistics, sizeof(PORTSNIFFER_PORT_STATISTICS));
+    RtlCopyMemory(Statistics->PortName, FilterContext->PortName.Buffer, min(FilterContext->PortName.Length, sizeof(Statistics->PortName) - sizeof(WCHAR)));
+    Statistics->PortIndex = FilterContext->PortIndex;
+    Statistics->MonitorMask = FilterContext->MonitorMask;
+
+    // This must not be pageable, because it runs at DISPATCH_LEVEL while holding StatsLock.
+    KeAcquireSpinLock(&FilterContext->StatsLock, &oldIrql);
+    Statistics->Seconds = FilterContext->StatsSeconds;
+
+    for (i = 0; i < CAPTURE_COUNT; i++)
+    {
+        requestStatistics = &Statistics->Requests[i];
+        requestStatistics->Requests = InterlockedCompareExchange64(&FilterContext->RequestCounters[i].Completed, 0, 0);
+        requestStatistics->Bytes = InterlockedCompareExchange64(&FilterContext->RequestCounters[i].Bytes, 0, 0);
+        requestStatistics->FailedRequests = InterlockedCompareExchange64(&FilterContext->RequestCounters[i].Failed, 0, 0);
+
+        for (bucket = 0; bucket < PORTSNIFFER_STATS_SIZE_BUCKETS; bucket++)
+        {
+            requestStatistics->SizeHistogram[bucket] = InterlockedCompareExchange64(&FilterContext->RequestCounters[i].SizeHistogram[bucket], 0, 0);
+        }
+
+        // Windows are limited to the snapshots taken so far.
+        last = &FilterContext->StatsHistory[FilterContext->StatsSeconds % STATS_HISTORY_LENGTH];
+
+        for (w = 0; w < PORTSNIFFER_STATS_WINDOWS; w++)
+        {
+            seconds = min(WindowSeconds[w], FilterContext->StatsSeconds);
+            if (seconds > 0)
+            {
+                first = &FilterContext->StatsHistory[(FilterContext->StatsSeconds - seconds) % STATS_HISTORY_LENGTH];
+                requestStatistics->RequestRates[w] = (ULONG)((last->Completed[i] - first->Completed[i]) / seconds);
+                requestStatistics->ByteRates[w] = (ULONG)((last->Bytes[i] - first->Bytes[i]) / seconds);
+            }
+        }
+    }
+
+    KeReleaseSpinLock(&FilterContext->StatsLock, oldIrql);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterGrowPortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    ULONG headroom;
+    ULONG newSize;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterGrowPortLog(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    // A shared port log can't grow, because it is mapped into the application.
+    if (FilterContext->Mapping)
+    {
+        return FALSE;
+    }
+
+    newSize = FilterContext->Log.Size * 2;
+    if (newSize > FilterContext->LogCapacity)
+    {
+        return FALSE;
+    }
+
+    // Every port may grow up to its fair share of the budget.
+    // Beyond that, it may only take half of the remaining headroom, so that other busy ports can still grow as well.
+    if (newSize > PortSnifferFilterGetFairShare())
+    {
+        headroom = PortLogBudget - (ULONG)PortLogBudgetUsed;
+        if (newSize - FilterContext->Log.Size > headroom / 2)
+        {
+            return FALSE;
+        }
+    }
+
+    return PortSnifferFilterResizePortLog(FilterContext, newSize);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONGLONG
+PortSnifferFilterHashEntry(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry
+    )
+{
+    const UCHAR* bytes;
+    ULONGLONG hash;
+    ULONG i;
+    ULONG length;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterHashEntry(%p)\n", Entry));
+
+    // 64-bit FNV-1a over Type, Flags, OriginalLength and DataLength followed by the data.
+    // Timestamp, Duration, SequenceNumber and SamplingWeight differ between repetitions and are left out.
+    hash = 0xCBF29CE484222325ULL;
+
+    bytes = (const UCHAR*)&Entry->Type;
+    length = FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, SamplingWeight) - FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Type);
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+
+    bytes = Entry->Data;
+    for (i = 0; i < Entry->DataLength; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterIsOldestEntryRead(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PLIST_ENTRY entry;
+    PPORTLOG_RING ring;
+    PPORTLOG_SUBSCRIBER subscriber;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterIsOldestEntryRead(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    // Tells whether a subscriber has already read the oldest entry, which is then only kept for those lagging behind.
+    if (IsListEmpty(&FilterContext->Subscribers) || !PortLogRingPeek(&FilterContext->Log))
+    {
+        return FALSE;
+    }
+
+    for (entry = FilterContext->Subscribers.Flink; entry != &FilterContext->Subscribers; entry = entry->Flink)
+    {
+        subscriber = CONTAINING_RECORD(entry, PORTLOG_SUBSCRIBER, ListEntry);
+        ring = PortSnifferFilterGetConsumerRing(FilterContext, subscriber);
+        PortLogRingPeek(ring);
+
+        if (ring->Head != FilterContext->Log.Head)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterIsTriggerPending(
+    __in PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterIsTriggerPending(%p)\n", FilterContext));
+
+    // The caller must hold LogLock.
+    // Entries are held back from all consumers while a trigger is armed or its capture is still incomplete.
+    return (FilterContext->TriggerState == PORTSNIFFER_TRIGGER_ARMED || FilterContext->TriggerState == PORTSNIFFER_TRIGGER_FIRED);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONG
+PortSnifferFilterNormalizeCapacity(
+    __in ULONG Capacity
+    )
+{
+    ULONG normalizedCapacity;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterNormalizeCapacity(%lu)\n", Capacity));
+
+    // Round up to the next power of two within the supported range.
+    normalizedCapacity = PORTLOG_MIN_CAPACITY;
+    while (normalizedCapacity < Capacity && normalizedCapacity < PORTLOG_MAX_CAPACITY)
+    {
+        normalizedCapacity *= 2;
+    }
+
+    return normalizedCapacity;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterOpenCaptureFile(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    DECLARE_CONST_UNICODE_STRING(nextCaptureFileValueName, L"NextCaptureFile");
+
+    LARGE_INTEGER allocationSize;
+    WDFKEY captureKey;
+    HANDLE directoryHandle;
+    HANDLE fileHandle;
+    PORTSNIFFER_CAPTURE_FILE_HEADER header;
+    IO_STATUS_BLOCK ioStatusBlock;
+    OBJECT_ATTRIBUTES objectAttributes;
+    LARGE_INTEGER offset;
+    UNICODE_STRING path;
+    USHORT pathLength;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterOpenCaptureFile(%p)\n", FilterContext));
+
+    // The caller must hold CaptureLock.
+    // Close the current file first, even if we fail to open the next one.
+    if (FilterContext->CaptureFileHandle)
+    {
+        ZwClose(FilterContext->CaptureFileHandle);
+        FilterContext->CaptureFileHandle = NULL;
+    }
+
+    // Create the directory if necessary.
+    // This fails as long as the volume isn't available yet during boot, so the caller just tries again later.
+    InitializeObjectAttributes(&objectAttributes, &CaptureDirectory, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ZwCreateFile(&directoryHandle, FILE_LIST_DIRECTORY | SYNCHRONIZE, &objectAttributes, &ioStatusBlock, NULL,
+        FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_OPEN_IF, FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ZwCreateFile failed for %wZ, status = 0x%08lX\n", &CaptureDirectory, status));
+        return status;
+    }
+
+    ZwClose(directoryHandle);
+
+    // The path is too long for the kernel stack.
+    pathLength = (CAPTURE_DIRECTORY_LENGTH + PORTSNIFFER_PORTNAME_LENGTH + 16) * sizeof(WCHAR);
+    RtlInitEmptyUnicodeString(&path, ExAllocatePoolWithTag(PagedPool, pathLength, POOL_TAG), pathLength);
+    if (!path.Buffer)
+    {
+        KdPrint(("ExAllocatePoolWithTag failed for %u bytes\n", pathLength));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = RtlUnicodeStringPrintf(&path, L"%wZ\\%wZ-%lu.pslog", &CaptureDirectory, &FilterContext->PortName, FilterContext->CaptureFileIndex);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("RtlUnicodeStringPrintf failed, status = 0x%08lX\n", status));
+        goto Cleanup;
+    }
+
+    // Replace any previous file of that name and reserve its full size at once,
+    // so that the file system can allocate it contiguously for our sequential writes.
+    allocationSize.QuadPart = CaptureFileSize;
+    InitializeObjectAttributes(&objectAttributes, &path, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ZwCreateFile(&fileHandle, FILE_WRITE_DATA | SYNCHRONIZE, &objectAttributes, &ioStatusBlock, &allocationSize,
+        FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+        FILE_NON_DIRECTORY_FILE | FILE_SEQUENTIAL_ONLY | FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ZwCreateFile failed for %wZ, status = 0x%08lX\n", &path, status));
+        goto Cleanup;
+    }
+
+    RtlZeroMemory(&header, sizeof(header));
+    header.Signature = PORTSNIFFER_CAPTURE_FILE_SIGNATURE;
+    header.HeaderLength = sizeof(PORTSNIFFER_CAPTURE_FILE_HEADER);
+    header.MajorVersion = PORTSNIFFER_MAJOR_VERSION;
+    header.MinorVersion = PORTSNIFFER_MINOR_VERSION;
+    RtlCopyMemory(header.PortName, FilterContext->PortName.Buffer, FilterContext->PortName.Length);
+    PortSnifferFilterQueryClock(&header.Clock);
+
+    offset.QuadPart = 0;
+    status = ZwWriteFile(fileHandle, NULL, NULL, NULL, &ioStatusBlock, &header, sizeof(header), &offset, NULL);
+    if (!NT_SUCCESS(status))
+    {
+        KdPrint(("ZwWriteFile failed for %wZ, status = 0x%08lX\n", &path, status));
+        ZwClose(fileHandle);
+        goto Cleanup;
+    }
+
+    KdPrint(("Capturing %wZ into %wZ\n", &FilterContext->PortName, &path));
+    FilterContext->CaptureFileHandle = fileHandle;
+    FilterContext->CaptureFileOffset = sizeof(PORTSNIFFER_CAPTURE_FILE_HEADER);
+
+    // Continue with the next file after a reboot as well, so that the files of the previous boot are kept as long as possible.
+    FilterContext->CaptureFileIndex = (FilterContext->CaptureFileIndex + 1) % CaptureFileCount;
+    if (NT_SUCCESS(PortSnifferFilterOpenCaptureKey(FilterContext, KEY_SET_VALUE, &captureKey)))
+    {
+        WdfRegistryAssignULong(captureKey, &nextCaptureFileValueName, FilterContext->CaptureFileIndex);
+        WdfRegistryClose(captureKey);
+    }
+
+    status = STATUS_SUCCESS;
+
+Cleanup:
+    ExFreePoolWithTag(path.Buffer, POOL_TAG);
+    return status;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterOpenCaptureKey(
+    __in PFILTER_CONTEXT FilterContext,
+    __in ACCESS_MASK DesiredAccess,
+    __out WDFKEY* Key
+    )
+{
+    UNICODE_STRING keyName;
+    WCHAR keyNameBuffer[PORTSNIFFER_PORTNAME_LENGTH + 8];
+    WDFKEY parametersKey;
+    NTSTATUS status;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterOpenCaptureKey(%p, %08lX, %p)\n", FilterContext, DesiredAccess, Key));
+
+    // The capture settings of a port are in the "Ports\PORTNAME" subkey of our Parameters registry key.
+    // Neither key needs to exist.
+    status = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), DesiredAccess, WDF_NO_OBJECT_ATTRIBUTES, &parametersKey);
+    if (!NT_SUCCESS(status))
+    {
+        return status;
+    }
+
+    RtlInitEmptyUnicodeString(&keyName, keyNameBuffer, sizeof(keyNameBuffer));
+    status = RtlUnicodeStringPrintf(&keyName, L"Ports\\%wZ", &FilterContext->PortName);
+    if (NT_SUCCESS(status))
+    {
+        status = WdfRegistryOpenKey(parametersKey, &keyName, DesiredAccess, WDF_NO_OBJECT_ATTRIBUTES, Key);
+    }
+
+    WdfRegistryClose(parametersKey);
+    return status;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterOverwriteOldestEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTLOG_RECORD Record
+    )
+{
+    ULONGLONG bytes;
+    BOOLEAN dropped;
+    ULONG entries;
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE entry;
+    PPORTSNIFFER_GAP_DATA gapData;
+    PLIST_ENTRY listEntry;
+    PPORTLOG_RING ring;
+    PPORTLOG_SUBSCRIBER subscriber;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterOverwriteOldestEntry(%p, %p)\n", FilterContext, Record));
+
+    // The caller must hold LogLock and only calls us for a private port log, so we can trust its contents.
+    // An overwritten gap entry is merged into the new gap.
+    entry = PORTLOG_RECORD_PAYLOAD(Record);
+    if (entry->Type == PORTSNIFFER_PORTLOG_GAP)
+    {
+        gapData = (PPORTSNIFFER_GAP_DATA)entry->Data;
+        entries = gapData->DroppedEntries;
+        bytes = gapData->DroppedBytes;
+    }
+    else
+    {
+        entries = 1;
+        bytes = entry->OriginalLength;
+    }
+
+    if (IsListEmpty(&FilterContext->Subscribers))
+    {
+        PortSnifferFilterAddToGap(&FilterContext->OverwrittenGap, entry, entries, bytes);
+        dropped = TRUE;
+    }
+    else
+    {
+        // Only the subscribers that haven't read the entry yet lose it.
+        // It has only been dropped if none of them has read it.
+        dropped = TRUE;
+
+        for (listEntry = FilterContext->Subscribers.Flink; listEntry != &FilterContext->Subscribers; listEntry = listEntry->Flink)
+        {
+            subscriber = CONTAINING_RECORD(listEntry, PORTLOG_SUBSCRIBER, ListEntry);
+            ring = PortSnifferFilterGetConsumerRing(FilterContext, subscriber);
+            PortLogRingPeek(ring);
+
+            if (ring->Head == FilterContext->Log.Head)
+            {
+                PortSnifferFilterAddToGap(&subscriber->MissedGap, entry, entries, bytes);
+                PortLogRingRemove(ring, Record);
+            }
+            else
+            {
+                dropped = FALSE;
+            }
+        }
+    }
+
+    // The entries of a gap entry have already been counted as dropped.
+    if (dropped && entry->Type != PORTSNIFFER_PORTLOG_GAP)
+    {
+        FilterContext->Counters.DroppedEntries++;
+        FilterContext->Counters.DroppedBytes += entry->OriginalLength;
+    }
+
+    PortLogRingRemove(&FilterContext->Log, Record);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+size_t
+PortSnifferFilterPackPortLogEntries(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __out_bcount(BufferLength) PUCHAR Buffer,
+    __in size_t BufferLength
+    )
+{
+    PPORTLOG_GAP gap;
+    size_t offset;
+    PPORTLOG_RECORD record;
+    PPORTLOG_RING ring;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterPackPortLogEntries(%p, %p, %p, %Iu)\n", FilterContext, Subscriber, Buffer, BufferLength));
+
+    // The caller must hold LogLock and provide at least PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH bytes.
+    // Never read from a shared port log, as the application can write anything to it.
+    offset = 0;
+
+    if (FilterContext->Log.Buffer && !FilterContext->Mapping && !PortSnifferFilterIsTriggerPending(FilterContext))
+    {
+        // A subscriber reads from its own position and only learns about the entries it has missed itself.
+        ring = PortSnifferFilterGetConsumerRing(FilterContext, Subscriber);
+        gap = Subscriber ? &Subscriber->MissedGap : &FilterContext->OverwrittenGap;
+
+        // Report overwritten entries before the oldest remaining one.
+        if (gap->Entries > 0)
+        {
+            record = (PPORTLOG_RECORD)Buffer;
+            record->PayloadLength = FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + sizeof(PORTSNIFFER_GAP_DATA);
+            record->Size = PORTLOG_RECORD_SIZE(record->PayloadLength);
+            record->Flags = 0;
+            PortSnifferFilterFillGapEntry(PORTLOG_RECORD_PAYLOAD(record), gap);
+
+            offset = record->Size;
+        }
+
+        // Move as many of the oldest log entries as fit into the buffer.
+        for (;;)
+        {
+            record = PortLogRingPeek(ring);
+            if (!record || record->Size > BufferLength - offset)
+            {
+                break;
+            }
+
+            offset += PortLogPackRecord(&Buffer[offset], record);
+            PortLogRingRemove(ring, record);
+        }
+
+        PortSnifferFilterReclaimPortLog(FilterContext);
+    }
+
+    return offset;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterQueryClock(
+    __out PPORTSNIFFER_CLOCK_DATA ClockData
+    )
+{
+    LARGE_INTEGER previousSystemTime;
+    LARGE_INTEGER startCounter;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterQueryClock(%p)\n", ClockData));
+
+    // The system time only advances with the clock interrupt, e.g. every 15.6 milliseconds.
+    // Wait for it to advance and read the performance counter right afterwards, so that both describe the same moment.
+    // This costs up to one clock interrupt interval, which is why we only do it every PORTSNIFFER_CLOCK_INTERVAL seconds.
+    // Never wait longer than a second, just in case.
+    startCounter = KeQueryPerformanceCounter(NULL);
+    KeQuerySystemTime(&previousSystemTime);
+
+    do
+    {
+        KeQuerySystemTime(&ClockData->SystemTime);
+        ClockData->PerformanceCounter = KeQueryPerformanceCounter(NULL);
+    }
+    while (ClockData->SystemTime.QuadPart == previousSystemTime.QuadPart &&
+        ClockData->PerformanceCounter.QuadPart - startCounter.QuadPart < PerformanceFrequency.QuadPart);
+
+    ClockData->PerformanceFrequency = PerformanceFrequency;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterReclaimPortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    ULONG distance;
+    PLIST_ENTRY entry;
+    ULONG minDistance;
+    PPORTLOG_RECORD record;
+    PPORTLOG_RING ring;
+    PPORTLOG_SUBSCRIBER subscriber;
+    ULONG target;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterReclaimPortLog(%p)\n", FilterContext));
+
+    // The caller must hold LogLock and has just consumed entries.
+    // Without subscribers, they have been removed from the port log right away. Otherwise, remove those all subscribers
+    // have read, which are the ones before the read position lagging furthest behind.
+    if (!IsListEmpty(&FilterContext->Subscribers))
+    {
+        // Skip padding everywhere first, so that positions at the same record compare equal.
+        PortLogRingPeek(&FilterContext->Log);
+        minDistance = MAXULONG;
+
+        for (entry = FilterContext->Subscribers.Flink; entry != &FilterContext->Subscribers; entry = entry->Flink)
+        {
+            subscriber = CONTAINING_RECORD(entry, PORTLOG_SUBSCRIBER, ListEntry);
+            ring = PortSnifferFilterGetConsumerRing(FilterContext, subscriber);
+            PortLogRingPeek(ring);
+
+            distance = ring->Head - FilterContext->Log.Head;
+            minDistance = min(minDistance, distance);
+        }
+
+        target = FilterContext->Log.Head + minDistance;
+        while ((record = PortLogRingPeek(&FilterContext->Log)) != NULL && FilterContext->Log.Head != target)
+        {
+            PortLogRingRemove(&FilterContext->Log, record);
+        }
+    }
+
+    PortSnifferFilterShrinkPortLog(FilterContext);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterRememberRepeat(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in USHORT Type,
+    __in ULONGLONG Hash,
+    __in ULONG SequenceNumber
+    )
+{
+    ULONG i;
+    PPORTLOG_REPEAT repeat;
+    PPORTLOG_REPEAT_HASH repeatHash;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterRememberRepeat(%p, %u, %I64X, %lu)\n", FilterContext, Type, Hash, SequenceNumber));
+
+    // The caller must hold LogLock and has just stored an entry with this Hash under SequenceNumber.
+    repeat = PortSnifferFilterGetRepeat(FilterContext, Type);
+    if (!repeat)
+    {
+        return;
+    }
+
+    // Entries aren't suppressed while a trigger is armed, so the hash may be known already.
+    for (i = 0; i < repeat->HashCount; i++)
+    {
+        if (repeat->Hashes[i].Hash == Hash)
+        {
+            repeat->Hashes[i].SequenceNumber = SequenceNumber;
+            return;
+        }
+    }
+
+    // Otherwise, it replaces the oldest one. Any repetitions counted for that have been reported before storing the entry.
+    repeatHash = &repeat->Hashes[repeat->NextHash];
+    RtlZeroMemory(repeatHash, sizeof(PORTLOG_REPEAT_HASH));
+    repeatHash->Hash = Hash;
+    repeatHash->SequenceNumber = SequenceNumber;
+
+    repeat->NextHash = (repeat->NextHash + 1) % FilterContext->RepeatDepth;
+    if (repeat->HashCount < FilterContext->RepeatDepth)
+    {
+        repeat->HashCount++;
+    }
+
+    repeat->Type = Type;
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterReportRepeats(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterReportRepeats(%p)\n", FilterContext));
+
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+
+    // A shared port log closed by the application doesn't want them anymore.
+    if (!FilterContext->Log.Buffer)
+    {
+        PortSnifferFilterResetRepeats(FilterContext);
+    }
+    else if (PortSnifferFilterAddRepeatEntries(FilterContext))
+    {
+        PortSnifferFilterDeliverPortLogEntries(FilterContext);
+    }
+
+    WdfWaitLockRelease(FilterContext->LogLock);
 }
 
 __drv_requiresIRQL(PASSIVE_LEVEL)
-void
-PortSnifferControlPopPortLogEntry(
-    __in WDFREQUEST Request
+PPORTLOG_RECORD
+PortSnifferFilterReservePortLogEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in ULONG DataLength
     )
 {
-    ULONG count;
-    WDFDEVICE device;
-    PFILTER_CONTEXT filterContext;
-    ULONG i;
-    PPORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST popRequest;
-    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE response;
-    ULONG_PTR responseLength = 0;
-    NTSTATUS status;
-    UNICODE_STRING unicodePortName;
+    PPORTLOG_RECORD oldestRecord;
+    ULONG payloadLength;
+    PPORTLOG_RECORD record;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferControlPopPortLogEntry(%p)\n", Request));
+    KdPrint(("PortSnifferFilterReservePortLogEntry(%p, %lu)\n", FilterContext, DataLength));
 
-    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST), &popRequest, NULL);
-    if (!NT_SUCCESS(status))
+    // The caller must hold LogLock.
+    payloadLength = FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + DataLength;
+    record = PortLogRingReserve(&FilterContext->Log, payloadLength);
+
+    // If the application hasn't consumed entries for some time, try to make room by growing the port log.
+    if (!record && PortSnifferFilterGrowPortLog(FilterContext))
     {
-        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
-        return;
+        record = PortLogRingReserve(&FilterContext->Log, payloadLength);
     }
 
-    status = WdfRequestRetrieveOutputBuffer(Request, PORTSNIFFER_PORTLOG_ENTRY_LENGTH, &response, NULL);
-    if (!NT_SUCCESS(status))
+    // Otherwise, cut off the subscribers lagging behind the others first, so that a stalled subscriber doesn't make
+    // the others lose new entries. They lose their oldest unread entries instead.
+    while (!record && PortSnifferFilterIsOldestEntryRead(FilterContext))
     {
-        KdPrint(("WdfRequestRetrieveOutputBuffer failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
-        return;
+        PortSnifferFilterOverwriteOldestEntry(FilterContext, PortLogRingPeek(&FilterContext->Log));
+        record = PortLogRingReserve(&FilterContext->Log, payloadLength);
     }
 
-    // The caller may have sent us a non-NUL-terminated buffer, causing a buffer overrun if fed directly to wcscmp.
-    // Avoid that by NUL-terminating the last possible character ourselves.
-    popRequest->PortName[PORTSNIFFER_PORTNAME_LENGTH - 1] = L'\0';
-    RtlInitUnicodeString(&unicodePortName, popRequest->PortName);
-
-    // Look for the requested port name.
-    status = STATUS_NO_SUCH_DEVICE;
-    WdfWaitLockAcquire(FilterDevicesLock, NULL);
-    count = WdfCollectionGetCount(FilterDevices);
-
-    for (i = 0; i < count; i++)
+    // If that isn't enough, make room by removing the oldest entries if we may.
+    if (!record && FilterContext->OverflowPolicy == PORTSNIFFER_OVERFLOW_OVERWRITE_OLDEST && !FilterContext->Mapping)
     {
-        device = WdfCollectionGetItem(FilterDevices, i);
-        filterContext = GetFilterContext(device);
-
-        if (RtlCompareUnicodeString(&filterContext->PortName, &unicodePortName, FALSE) == 0)
+        while (!record && (oldestRecord = PortLogRingPeek(&FilterContext->Log)) != NULL)
         {
-            status = PortSnifferControlPopPortLogEntryInternal(filterContext, response, &responseLength);
-            break;
+            PortSnifferFilterOverwriteOldestEntry(FilterContext, oldestRecord);
+            record = PortLogRingReserve(&FilterContext->Log, payloadLength);
         }
     }
 
-    WdfWaitLockRelease(FilterDevicesLock);
-    WdfRequestCompleteWithInformation(Request, status, responseLength);
+    return record;
 }
 
-__drv_requiresIRQL(PASSIVE_LEVEL)
-NTSTATUS
-PortSnifferControlPopPortLogEntryInternal(
-    __inout PFILTER_CONTEXT FilterContext,
-    __out PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Response,
-    __out PULONG_PTR ResponseLength
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterResetLineStatus(
+    __inout PFILTER_CONTEXT FilterContext
     )
 {
-    PPORTLOG_ENTRY entry;
-    NTSTATUS status;
-
-    PAGED_CODE();
-    KdPrint(("PortSnifferControlPopPortLogEntryInternal(%p, %p, %p)\n", FilterContext, Response, ResponseLength));
-
-    WdfWaitLockAcquire(FilterContext->LogEntryLock, NULL);
+    KIRQL oldIrql;
 
-    if (FilterContext->LogEntryCount > 0)
-    {
-        // Get the first log entry and copy its information to the response buffer.
-        entry = FilterContext->LogEntryHead;
-        *ResponseLength = FIELD_OFFSET(PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, Data) + entry->Response.DataLength;
-        RtlCopyMemory(Response, &entry->Response, *ResponseLength);
+    KdPrint(("PortSnifferFilterResetLineStatus(%p)\n", FilterContext));
 
-        // Remove the entry from the list.
-        if (FilterContext->LogEntryTail == entry)
-        {
-            FilterContext->LogEntryTail = NULL;
-        }
+    // This must not be pageable, because it runs at DISPATCH_LEVEL while holding LineStatusLock.
+    KeAcquireSpinLock(&FilterContext->LineStatusLock, &oldIrql);
+    RtlZeroMemory(&FilterContext->LineStatus, sizeof(FilterContext->LineStatus));
+    FilterContext->LineStatusValid = 0;
+    RtlZeroMemory(&FilterContext->LineStats, sizeof(FilterContext->LineStats));
+    KeReleaseSpinLock(&FilterContext->LineStatusLock, oldIrql);
+}
 
-        FilterContext->LogEntryHead = entry->Next;
-        FilterContext->LogEntryCount--;
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterResetRepeats(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterResetRepeats(%p)\n", FilterContext));
 
-        // Return its memory back to the lookaside list.
-        WdfObjectDelete(entry->Memory);
+    // The caller must hold LogLock and has reported all suppressed repetitions it wants to keep.
+    // The next entry of every type is added again. RepeatTimer finds nothing to report if it is still pending.
+    RtlZeroMemory(FilterContext->Repeats, sizeof(FilterContext->Repeats));
+}
 
-        status = STATUS_SUCCESS;
-    }
-    else
-    {
-        *ResponseLength = 0;
-        status = STATUS_NO_MORE_ENTRIES;
-    }
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterResetStatistics(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    KIRQL oldIrql;
 
-    WdfWaitLockRelease(FilterContext->LogEntryLock);
+    KdPrint(("PortSnifferFilterResetStatistics(%p)\n", FilterContext));
 
-    return status;
+    // This must not be pageable, because it runs at DISPATCH_LEVEL while holding StatsLock.
+    // The first snapshot is the one of the zeroed counters.
+    KeAcquireSpinLock(&FilterContext->StatsLock, &oldIrql);
+    RtlZeroMemory(FilterContext->RequestCounters, sizeof(FilterContext->RequestCounters));
+    RtlZeroMemory(FilterContext->StatsHistory, sizeof(FilterContext->StatsHistory));
+    FilterContext->StatsSeconds = 0;
+    KeReleaseSpinLock(&FilterContext->StatsLock, oldIrql);
 }
 
 __drv_requiresIRQL(PASSIVE_LEVEL)
-void
-PortSnifferControlResetPortMonitoring(
-    __in WDFREQUEST Request
+BOOLEAN
+PortSnifferFilterResizePortLog(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in ULONG NewSize
     )
 {
-    ULONG count;
-    WDFDEVICE device;
-    PFILTER_CONTEXT filterContext;
-    ULONG i;
-    PPORTSNIFFER_RESET_PORT_MONITORING_REQUEST portMonitoringRequest;
-    NTSTATUS status;
-    UNICODE_STRING unicodePortName;
+    PVOID buffer;
+    PLIST_ENTRY entry;
+    PORTLOG_RING newLog;
+    ULONG oldSize;
+    ULONG readEntries;
+    PPORTLOG_RECORD record;
+    PPORTLOG_RING ring;
+    PPORTLOG_SUBSCRIBER subscriber;
+    PORTLOG_RING unread;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferControlResetPortMonitoring(%p)\n", Request));
+    KdPrint(("PortSnifferFilterResizePortLog(%p, %lu)\n", FilterContext, NewSize));
 
-    status = WdfRequestRetrieveInputBuffer(Request, sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST), &portMonitoringRequest, NULL);
-    if (!NT_SUCCESS(status))
+    // The caller must hold LogLock and only calls us for a private port log without an open entry.
+    // It must also ensure that all entries fit into the new size, which is the case when growing or when the port log is empty.
+    oldSize = FilterContext->Log.Size;
+    if (NewSize > oldSize && !PortSnifferFilterChargePortLogBudget(NewSize - oldSize))
     {
-        KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
-        return;
+        KdPrint(("Port log budget is exhausted\n"));
+        return FALSE;
     }
 
-    // The caller may have sent us a non-NUL-terminated buffer, causing a buffer overrun if fed directly to wcscmp.
-    // Avoid that by NUL-terminating the last possible character ourselves.
-    portMonitoringRequest->PortName[PORTSNIFFER_PORTNAME_LENGTH - 1] = L'\0';
-    RtlInitUnicodeString(&unicodePortName, portMonitoringRequest->PortName);
+    buffer = ExAllocatePoolWithTag(PagedPool, NewSize, POOL_TAG);
+    if (!buffer)
+    {
+        KdPrint(("ExAllocatePoolWithTag failed for %lu bytes\n", NewSize));
 
-    // Look for the requested port name.
-    status = STATUS_NO_SUCH_DEVICE;
-    WdfWaitLockAcquire(FilterDevicesLock, NULL);
-    count = WdfCollectionGetCount(FilterDevices);
+        if (NewSize > oldSize)
+        {
+            PortSnifferFilterReturnPortLogBudget(NewSize - oldSize);
+        }
 
-    for (i = 0; i < count; i++)
+        return FALSE;
+    }
+
+    // Positions change when moving the entries, so remember how many entries each subscriber has yet to read.
+    for (entry = FilterContext->Subscribers.Flink; entry != &FilterContext->Subscribers; entry = entry->Flink)
     {
-        device = WdfCollectionGetItem(FilterDevices, i);
-        filterContext = GetFilterContext(device);
+        subscriber = CONTAINING_RECORD(entry, PORTLOG_SUBSCRIBER, ListEntry);
+        unread = *PortSnifferFilterGetConsumerRing(FilterContext, subscriber);
+        subscriber->Cursor.EntryCount = 0;
 
-        if (RtlCompareUnicodeString(&filterContext->PortName, &unicodePortName, FALSE) == 0)
+        while ((record = PortLogRingPeek(&unread)) != NULL)
         {
-            // Set the new monitor mask, clear recorded events, and exit the loop.
-            filterContext->MonitorMask = portMonitoringRequest->MonitorMask;
-            PortSnifferFilterClearPortLog(filterContext);
-            status = STATUS_SUCCESS;
-            break;
+            PortLogRingRemove(&unread, record);
+            subscriber->Cursor.EntryCount++;
         }
     }
 
-    WdfWaitLockRelease(FilterDevicesLock);
-    WdfRequestComplete(Request, status);
+    PortLogRingInitialize(&newLog, buffer, NewSize);
+    PortLogRingMove(&newLog, &FilterContext->Log);
+
+    ExFreePoolWithTag(FilterContext->Log.Buffer, POOL_TAG);
+    FilterContext->Log = newLog;
+
+    // Let each subscriber skip the entries it has already read.
+    for (entry = FilterContext->Subscribers.Flink; entry != &FilterContext->Subscribers; entry = entry->Flink)
+    {
+        subscriber = CONTAINING_RECORD(entry, PORTLOG_SUBSCRIBER, ListEntry);
+        readEntries = FilterContext->Log.EntryCount - subscriber->Cursor.EntryCount;
+        subscriber->Cursor.Head = FilterContext->Log.Head;
+        ring = PortSnifferFilterGetConsumerRing(FilterContext, subscriber);
+
+        while (readEntries > 0 && (record = PortLogRingPeek(ring)) != NULL)
+        {
+            PortLogRingRemove(ring, record);
+            readEntries--;
+        }
+    }
+
+    if (NewSize < oldSize)
+    {
+        PortSnifferFilterReturnPortLogBudget(oldSize - NewSize);
+    }
+
+    KdPrint(("Resized port log from %lu to %lu bytes\n", oldSize, NewSize));
+    return TRUE;
 }
 
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
-PortSnifferFilterAddPortLogEntry(
-    __inout PFILTER_CONTEXT FilterContext,
-    __in USHORT Type,
-    __in PUCHAR Data,
-    __in size_t DataLength
+PortSnifferFilterReturnPortLogBudget(
+    __in ULONG Length
     )
 {
-    // We always allocate the same PORTSNIFFER_PORTLOG_ENTRY_LENGTH bytes for every log entry.
-    // The actual data may consume everything that's left after the other fields.
-    const USHORT MaxDataLength = PORTSNIFFER_PORTLOG_ENTRY_LENGTH - FIELD_OFFSET(PORTLOG_ENTRY, Response.Data);
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterReturnPortLogBudget(%lu)\n", Length));
 
-    PPORTLOG_ENTRY entry;
-    WDFMEMORY entryMemory;
-    NTSTATUS status;
+    InterlockedExchangeAdd(&PortLogBudgetUsed, -(LONG)Length);
+}
 
-    PAGED_CODE();
-    KdPrint(("PortSnifferFilterAddPortLogEntry(%p, %x, %p, %Iu)\n", FilterContext, Type, Data, DataLength));
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterSampleRequest(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in USHORT MonitorType,
+    __in BOOLEAN Capture
+    )
+{
+    PREQUEST_COUNTERS counters;
+    LONG dispatched;
+    PREQUEST_CONTEXT requestContext;
+    LONGLONG seconds;
+    USHORT samplingMode;
+    USHORT samplingRate;
+    USHORT samplingWeight;
 
-    WdfWaitLockAcquire(FilterContext->LogEntryLock, NULL);
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterSampleRequest(%p, %p, %x, %u)\n", FilterContext, Request, MonitorType, Capture));
 
-    // Don't add anything if the application hasn't popped entries for some time.
-    if (FilterContext->LogEntryCount >= MAX_LOG_ENTRIES_PER_PORT)
+    if (MonitorType == PORTSNIFFER_MONITOR_READ)
     {
-        KdPrint(("List is full, not adding log entry\n"));
-        goto Cleanup;
+        counters = &FilterContext->RequestCounters[CAPTURE_READ];
     }
-
-    // Allocate a new log entry of PORTSNIFFER_PORTLOG_ENTRY_LENGTH bytes from our lookaside list.
-    status = WdfMemoryCreateFromLookaside(PortLogLookaside, &entryMemory);
-    if (!NT_SUCCESS(status))
+    else if (MonitorType == PORTSNIFFER_MONITOR_WRITE)
     {
-        KdPrint(("WdfMemoryCreateFromLookaside failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        counters = &FilterContext->RequestCounters[CAPTURE_WRITE];
     }
-
-    // Truncate any data that goes beyond our maximum supported length.
-    if (DataLength > MaxDataLength)
+    else
     {
-        KdPrint(("Truncating log entry data from %Iu to %u bytes\n", DataLength, MaxDataLength));
-        DataLength = MaxDataLength;
+        counters = &FilterContext->RequestCounters[CAPTURE_IOCTL];
     }
 
-    // Set all log entry information.
-    entry = WdfMemoryGetBuffer(entryMemory, NULL);
-    entry->Memory = entryMemory;
-    entry->Next = NULL;
-    KeQuerySystemTime(&entry->Response.Timestamp);
-    entry->Response.Type = Type;
-    entry->Response.DataLength = (USHORT)DataLength;
-    RtlCopyMemory(entry->Response.Data, Data, DataLength);
+    // The sampling settings may change at any time without us holding LogLock.
+    // A request seeing a mix of old and new settings is harmless, as long as we never divide by a zero rate.
+    samplingMode = FilterContext->SamplingMode;
+    samplingRate = FilterContext->SamplingRate;
+    samplingWeight = 1;
 
-    // Add us to the end of the list.
-    if (FilterContext->LogEntryCount > 0)
+    if (!Capture)
     {
-        FilterContext->LogEntryTail->Next = entry;
+        // This request is only counted for statistics.
+        samplingWeight = 0;
     }
-    else
+    else if (samplingRate > 1)
     {
-        FilterContext->LogEntryHead = entry;
+        if (samplingMode == PORTSNIFFER_SAMPLING_REQUESTS)
+        {
+            // Sample each type on its own, so that alternating reads and writes don't hide one of them.
+            dispatched = InterlockedIncrement(&counters->Dispatched) - 1;
+            samplingWeight = ((ULONG)dispatched % samplingRate == 0) ? samplingRate : 0;
+        }
+        else if (samplingMode == PORTSNIFFER_SAMPLING_SECONDS)
+        {
+            seconds = (KeQueryPerformanceCounter(NULL).QuadPart - FilterContext->SamplingStart) / PerformanceFrequency.QuadPart;
+            samplingWeight = (seconds >= 0 && seconds % samplingRate == 0) ? samplingRate : 0;
+        }
     }
 
-    FilterContext->LogEntryTail = entry;
-    FilterContext->LogEntryCount++;
+    requestContext = GetRequestContext(Request);
+    requestContext->MonitorType = MonitorType;
+    requestContext->SamplingWeight = samplingWeight;
 
-Cleanup:
-    WdfWaitLockRelease(FilterContext->LogEntryLock);
+    return (samplingWeight > 0);
 }
 
-__drv_requiresIRQL(PASSIVE_LEVEL)
+__drv_maxIRQL(DISPATCH_LEVEL)
 void
-PortSnifferFilterClearPortLog(
-    __inout PFILTER_CONTEXT FilterContext
+PortSnifferFilterSetCaptureFilter(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in_ecount(InstructionCount) const CAPTURE_FILTER_INSTRUCTION* Instructions,
+    __in ULONG InstructionCount
     )
 {
-    PPORTLOG_ENTRY entry;
-    PPORTLOG_ENTRY nextEntry;
-
-    PAGED_CODE();
-    KdPrint(("PortSnifferFilterClearPortLog(%p)\n", FilterContext));
+    ULONG i;
+    KIRQL oldIrql;
 
-    WdfWaitLockAcquire(FilterContext->LogEntryLock, NULL);
+    KdPrint(("PortSnifferFilterSetCaptureFilter(%p, %p, %lu)\n", FilterContext, Instructions, InstructionCount));
 
-    // Return the memory for each entry back to the lookaside list.
-    for (entry = FilterContext->LogEntryHead; entry; entry = nextEntry)
+    // This must not be pageable, because it runs at DISPATCH_LEVEL while holding the ProducerLocks.
+    // Acquire them in the order of CaptureRings. Producers only ever hold one of them, so this can't deadlock.
+    KeAcquireSpinLock(&FilterContext->CaptureRings[0].ProducerLock, &oldIrql);
+    for (i = 1; i < CAPTURE_COUNT; i++)
     {
-        nextEntry = entry->Next;
-        WdfObjectDelete(entry->Memory);
+        KeAcquireSpinLockAtDpcLevel(&FilterContext->CaptureRings[i].ProducerLock);
     }
 
-    // Clear the bookkeeping information.
-    FilterContext->LogEntryHead = NULL;
-    FilterContext->LogEntryTail = NULL;
-    FilterContext->LogEntryCount = 0;
+    RtlCopyMemory(FilterContext->CaptureFilter, Instructions, InstructionCount * sizeof(CAPTURE_FILTER_INSTRUCTION));
+    FilterContext->CaptureFilterLength = InstructionCount;
+
+    for (i = CAPTURE_COUNT - 1; i > 0; i--)
+    {
+        KeReleaseSpinLockFromDpcLevel(&FilterContext->CaptureRings[i].ProducerLock);
+    }
 
-    WdfWaitLockRelease(FilterContext->LogEntryLock);
+    KeReleaseSpinLock(&FilterContext->CaptureRings[0].ProducerLock, oldIrql);
 }
 
-__drv_functionClass(EVT_WDF_DRIVER_DEVICE_ADD)
-__drv_sameIRQL
-__drv_maxIRQL(PASSIVE_LEVEL)
-NTSTATUS
-PortSnifferFilterEvtDeviceAdd(
-    __in WDFDRIVER Driver,
-    __inout PWDFDEVICE_INIT DeviceInit
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterShrinkPortLog(
+    __inout PFILTER_CONTEXT FilterContext
     )
 {
-    DECLARE_CONST_UNICODE_STRING(portNameValueName, L"PortName");
-
-    ULONG count;
-    WDFDEVICE device;
-    WDF_OBJECT_ATTRIBUTES deviceAttributes;
-    PFILTER_CONTEXT filterContext;
-    WDF_OBJECT_ATTRIBUTES ioQueueAttributes;
-    WDF_IO_QUEUE_CONFIG ioQueueConfig;
-    WDF_OBJECT_ATTRIBUTES logEntryLockAttributes;
-    WDFSTRING portNameValueData;
-    WDF_OBJECT_ATTRIBUTES portNameValueDataAttributes;
-    WDF_OBJECT_ATTRIBUTES readWorkItemAttributes;
-    WDF_WORKITEM_CONFIG readWorkItemConfig;
-    WDFKEY regKey = WDF_NO_HANDLE;
-    NTSTATUS status;
+    ULONG initialSize;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtDeviceAdd(%p, %p)\n", Driver, DeviceInit));
-
-    // Register us as a filter device.
-    WdfFdoInitSetFilter(DeviceInit);
-
-    // Register a callback to clean up the control device for the last port.
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, FILTER_CONTEXT);
-    deviceAttributes.EvtCleanupCallback = PortSnifferFilterEvtDeviceCleanup;
+    KdPrint(("PortSnifferFilterShrinkPortLog(%p)\n", FilterContext));
 
-    // Create our filter device and attach it to the stack of the port device.
-    status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
-    if (!NT_SUCCESS(status))
+    // The caller must hold LogLock.
+    // Only shrink an empty private port log, so that no entries need to be moved.
+    if (!FilterContext->Log.Buffer || FilterContext->Mapping || FilterContext->Log.EntryCount > 0 || FilterContext->OpenRecord)
     {
-        KdPrint(("WdfDeviceCreate failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        return;
     }
 
-    // Query the port name and store it in our context.
-    status = WdfDeviceOpenRegistryKey(device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &regKey);
-    if (!NT_SUCCESS(status))
+    initialSize = min(PORTLOG_INITIAL_SIZE, FilterContext->LogCapacity);
+    if (FilterContext->Log.Size <= initialSize)
     {
-        KdPrint(("WdfFdoInitOpenRegistryKey failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        return;
     }
 
-    WDF_OBJECT_ATTRIBUTES_INIT(&portNameValueDataAttributes);
-    portNameValueDataAttributes.ParentObject = device;
-    status = WdfStringCreate(NULL, &portNameValueDataAttributes, &portNameValueData);
-    if (!NT_SUCCESS(status))
+    // Keep the memory of a port within its capacity and fair share, because the port may get busy again soon.
+    // Give back everything else now that the application has caught up, so that other busy ports can use it.
+    if (FilterContext->Log.Size <= FilterContext->LogCapacity && FilterContext->Log.Size <= PortSnifferFilterGetFairShare())
     {
-        KdPrint(("WdfStringCreate failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        return;
     }
 
-    status = WdfRegistryQueryString(regKey, &portNameValueName, portNameValueData);
-    if (!NT_SUCCESS(status))
-    {
-        KdPrint(("WdfRegistryQueryString failed, status = 0x%08lX\n", status));
-        goto Cleanup;
-    }
+    PortSnifferFilterResizePortLog(FilterContext, initialSize);
+}
 
-    filterContext = GetFilterContext(device);
-    WdfStringGetUnicodeString(portNameValueData, &filterContext->PortName);
-    if (filterContext->PortName.Length >= PORTSNIFFER_PORTNAME_LENGTH)
-    {
-        KdPrint(("PortName is too long: %wZ\n", &filterContext->PortName));
-        status = STATUS_NAME_TOO_LONG;
-        goto Cleanup;
-    }
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterStartCapture(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    DECLARE_CONST_UNICODE_STRING(monitorMaskValueName, L"MonitorMask");
+    DECLARE_CONST_UNICODE_STRING(nextCaptureFileValueName, L"NextCaptureFile");
+    DECLARE_CONST_UNICODE_STRING(portLogCapacityValueName, L"PortLogCapacity");
+
+    WDFKEY captureKey;
+    ULONG monitorMask;
+    NTSTATUS status;
+    PPORTLOG_SUBSCRIBER subscriber;
+    ULONG value;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterStartCapture(%p)\n", FilterContext));
 
-    // Initialize a Work Item for adding port log read entries at IRQL == PASSIVE_LEVEL.
-    WDF_WORKITEM_CONFIG_INIT(&readWorkItemConfig, PortSnifferFilterEvtIoReadCompletionWorkItem);
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&readWorkItemAttributes, READ_WORK_ITEM_CONTEXT);
-    readWorkItemAttributes.ParentObject = device;
-    status = WdfWorkItemCreate(&readWorkItemConfig, &readWorkItemAttributes, &filterContext->ReadWorkItem);
+    // This is called while the port is being added, before any control request can find it.
+    // Only ports with a MonitorMask in their registry key are captured, all others are monitored on request only.
+    status = PortSnifferFilterOpenCaptureKey(FilterContext, KEY_READ, &captureKey);
     if (!NT_SUCCESS(status))
     {
-        KdPrint(("WdfWorkItemCreate failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        return;
     }
 
-    // Initialize the remaining context fields.
-    filterContext->MonitorMask = PORTSNIFFER_MONITOR_NONE;
+    monitorMask = PORTSNIFFER_MONITOR_NONE;
+    WdfRegistryQueryULong(captureKey, &monitorMaskValueName, &monitorMask);
 
-    filterContext->LogEntryHead = NULL;
-    filterContext->LogEntryTail = NULL;
-    filterContext->LogEntryCount = 0;
-
-    WDF_OBJECT_ATTRIBUTES_INIT(&logEntryLockAttributes);
-    logEntryLockAttributes.ParentObject = device;
-    status = WdfWaitLockCreate(&logEntryLockAttributes, &filterContext->LogEntryLock);
-    if (!NT_SUCCESS(status))
+    if (NT_SUCCESS(WdfRegistryQueryULong(captureKey, &portLogCapacityValueName, &value)))
     {
-        KdPrint(("WdfWaitLockCreate failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        FilterContext->LogCapacity = PortSnifferFilterNormalizeCapacity(value);
     }
 
-    // Register callbacks for all requests we possibly want to monitor.
-    WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig, WdfIoQueueDispatchParallel);
-    ioQueueConfig.EvtIoRead = PortSnifferFilterEvtIoRead;
-    ioQueueConfig.EvtIoWrite = PortSnifferFilterEvtIoWrite;
-    ioQueueConfig.EvtIoDeviceControl = PortSnifferFilterEvtIoDeviceControl;
+    if (NT_SUCCESS(WdfRegistryQueryULong(captureKey, &nextCaptureFileValueName, &value)))
+    {
+        FilterContext->CaptureFileIndex = value % CaptureFileCount;
+    }
 
-    // Ensure that all callback routines are run at IRQL == PASSIVE_LEVEL as we are dealing with paged-pool memory there.
-    WDF_OBJECT_ATTRIBUTES_INIT(&ioQueueAttributes);
-    ioQueueAttributes.ExecutionLevel = WdfExecutionLevelPassive;
+    WdfRegistryClose(captureKey);
 
-    // Set up an I/O Queue to handle requests to our filter device.
-    status = WdfIoQueueCreate(device, &ioQueueConfig, &ioQueueAttributes, WDF_NO_HANDLE);
-    if (!NT_SUCCESS(status))
+    // Statistics alone don't produce any log entries to capture.
+    if ((monitorMask & ~PORTSNIFFER_MONITOR_STATS) == PORTSNIFFER_MONITOR_NONE || monitorMask > MAXUSHORT)
     {
-        KdPrint(("WdfIoQueueCreate failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        KdPrint(("Invalid capture monitor mask 0x%08lX for %wZ\n", monitorMask, &FilterContext->PortName));
+        return;
     }
 
-    // Add it to the collection of all our active filter devices.
-    WdfWaitLockAcquire(FilterDevicesLock, NULL);
-    status = WdfCollectionAdd(FilterDevices, device);
-    count = WdfCollectionGetCount(FilterDevices);
-    WdfWaitLockRelease(FilterDevicesLock);
-    if (!NT_SUCCESS(status))
+    // Failing to capture must never fail the port itself, so just leave it unmonitored then.
+    FilterContext->CaptureBuffer = ExAllocatePoolWithTag(PagedPool, CAPTURE_FILE_BATCH_SIZE, POOL_TAG);
+    if (!FilterContext->CaptureBuffer)
     {
-        KdPrint(("WdfCollectionAdd failed, status = 0x%08lX\n", status));
-        goto Cleanup;
+        KdPrint(("ExAllocatePoolWithTag failed for %lu bytes\n", (ULONG)CAPTURE_FILE_BATCH_SIZE));
+        return;
     }
 
-    // Create our control device if this is the first port.
-    if (count == 1)
+    status = PortSnifferFilterAllocatePortLog(FilterContext);
+    if (!NT_SUCCESS(status))
     {
-        status = PortSnifferControlCreate(Driver);
-        if (!NT_SUCCESS(status))
-        {
-            KdPrint(("PortSnifferControlCreate failed, status = 0x%08lX\n", status));
-            goto Cleanup;
-        }
+        KdPrint(("PortSnifferFilterAllocatePortLog failed, status = 0x%08lX\n", status));
+        PortSnifferFilterCloseCapture(FilterContext);
+        return;
     }
 
-    status = STATUS_SUCCESS;
+    // The capture file writer reads the port log like any other subscriber.
+    // Applications can therefore subscribe to the port as well, but can't reset or map it.
+    subscriber = &FilterContext->CaptureSubscriber;
 
-Cleanup:
-    if (regKey != WDF_NO_HANDLE)
+    WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+    subscriber->Cursor = FilterContext->Log;
+    RtlZeroMemory(&subscriber->MissedGap, sizeof(subscriber->MissedGap));
+    subscriber->FilterContext = FilterContext;
+    InsertTailList(&FilterContext->Subscribers, &subscriber->ListEntry);
+    FilterContext->MonitorMask = (USHORT)monitorMask;
+    WdfWaitLockRelease(FilterContext->LogLock);
+
+    // Snapshot the request counters every second while collecting statistics.
+    if (monitorMask & PORTSNIFFER_MONITOR_STATS)
     {
-        WdfRegistryClose(regKey);
+        WdfTimerStart(FilterContext->StatsTimer, WDF_REL_TIMEOUT_IN_MS(1000));
     }
 
-    return status;
+    WdfTimerStart(FilterContext->CaptureTimer, WDF_REL_TIMEOUT_IN_MS(CAPTURE_FILE_WRITE_INTERVAL));
+    KdPrint(("Started capturing %wZ with monitor mask 0x%04lX\n", &FilterContext->PortName, monitorMask));
 }
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
 void
-PortSnifferFilterEvtDeviceCleanup(
-    WDFDEVICE Device
+PortSnifferFilterStopCapture(
+    __inout PFILTER_CONTEXT FilterContext
     )
 {
-    ULONG count;
-
     PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtDeviceCleanup(%p)\n", Device));
-
-    WdfWaitLockAcquire(FilterDevicesLock, NULL);
-    count = WdfCollectionGetCount(FilterDevices);
+    KdPrint(("PortSnifferFilterStopCapture(%p)\n", FilterContext));
 
-    // Delete our control device if this is the last port.
-    if (count == 1)
+    // The port is being removed, but its child objects still exist.
+    // Write everything that has been captured until now and close the capture file for good.
+    if (!FilterContext->CaptureBuffer)
     {
-        KdPrint(("Deleting the control device.\n"));
-        WdfObjectDelete(ControlDevice);
-        ControlDevice = NULL;
+        return;
     }
 
-    // Delete our filter device from the collection.
-    WdfCollectionRemove(FilterDevices, Device);
-    WdfWaitLockRelease(FilterDevicesLock);
+    WdfTimerStop(FilterContext->CaptureTimer, TRUE);
+    WdfWorkItemFlush(FilterContext->CaptureWorkItem);
+
+    WdfWaitLockAcquire(FilterContext->CaptureLock, NULL);
+    PortSnifferFilterWriteCaptureFile(FilterContext);
+    PortSnifferFilterCloseCapture(FilterContext);
+    WdfWaitLockRelease(FilterContext->CaptureLock);
 }
 
-__drv_functionClass(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
-__drv_sameIRQL
-__drv_maxIRQL(DISPATCH_LEVEL)
-void
-PortSnifferFilterEvtIoDeviceControl(
-    __in WDFQUEUE Queue,
-    __in WDFREQUEST Request,
-    __in size_t OutputBufferLength,
-    __in size_t InputBufferLength,
-    __in ULONG IoControlCode
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterSuppressRepeat(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry,
+    __out PULONGLONG Hash
     )
 {
-    WDFDEVICE device;
-    PFILTER_CONTEXT filterContext;
-    WDF_REQUEST_SEND_OPTIONS sendOptions;
-    NTSTATUS status;
-    WDFIOTARGET target;
-
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
+    ULONG i;
+    ULONG j;
+    BOOLEAN pending;
+    PPORTLOG_REPEAT repeat;
+    PPORTLOG_REPEAT_HASH repeatHash;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtIoDeviceControl(%p, %p, %Iu, %Iu, %lX)\n", Queue, Request, OutputBufferLength, InputBufferLength, IoControlCode));
-
-    device = WdfIoQueueGetDevice(Queue);
-    filterContext = GetFilterContext(device);
-    target = WdfDeviceGetIoTarget(device);
-    WdfRequestFormatRequestUsingCurrentType(Request);
+    KdPrint(("PortSnifferFilterSuppressRepeat(%p, %p, %p)\n", FilterContext, CapturedEntry, Hash));
 
-    if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_IOCTL)
+    // The caller must hold LogLock and passes Hash to PortSnifferFilterRememberRepeat if the entry is stored.
+    repeat = PortSnifferFilterGetRepeat(FilterContext, CapturedEntry->Type);
+    if (!repeat)
     {
-        // We monitor I/O Device Control requests for this port.
-        PortSnifferFilterEvtIoDeviceControlInternal(filterContext, Request, IoControlCode);
+        return FALSE;
     }
 
-    WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
-    if (!WdfRequestSend(Request, target, &sendOptions))
+    *Hash = PortSnifferFilterHashEntry(CapturedEntry);
+
+    // An armed trigger has to see every entry, so nothing is suppressed until it has fired.
+    if (FilterContext->TriggerState == PORTSNIFFER_TRIGGER_ARMED)
     {
-        status = WdfRequestGetStatus(Request);
-        KdPrint(("WdfRequestSend failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
+        return FALSE;
     }
-}
 
-__drv_requiresIRQL(PASSIVE_LEVEL)
-void
-PortSnifferFilterEvtIoDeviceControlInternal(
-    __inout PFILTER_CONTEXT FilterContext,
-    __in WDFREQUEST Request,
-    __in ULONG IoControlCode
-    )
-{
-    PUCHAR inputBuffer;
-    size_t inputBufferLength;
-    PORTSNIFFER_IOCTL_DATA ioctlData;
-    NTSTATUS status;
+    for (i = 0; i < repeat->HashCount; i++)
+    {
+        if (repeat->Hashes[i].Hash == *Hash)
+        {
+            break;
+        }
+    }
 
-    PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtIoDeviceControlInternal(%p, %p, %lX)\n", FilterContext, Request, IoControlCode));
+    if (i == repeat->HashCount)
+    {
+        return FALSE;
+    }
 
-    switch (IoControlCode)
+    // The first repetition since the last report starts RepeatTimer, unless another one already has.
+    repeatHash = &repeat->Hashes[i];
+    if (repeatHash->Entries == 0)
     {
-        case IOCTL_SERIAL_SET_BAUD_RATE:
-        case IOCTL_SERIAL_SET_HANDFLOW:
-        case IOCTL_SERIAL_SET_LINE_CONTROL:
-        case IOCTL_SERIAL_SET_QUEUE_SIZE:
-        case IOCTL_SERIAL_SET_TIMEOUTS:
-            // These IOCTLs come with an input buffer that contains the interesting information.
-            status = WdfRequestRetrieveInputBuffer(Request, 0, &inputBuffer, &inputBufferLength);
-            if (!NT_SUCCESS(status))
+        pending = FALSE;
+        for (i = 0; i < CAPTURE_COUNT; i++)
+        {
+            for (j = 0; j < FilterContext->Repeats[i].HashCount; j++)
             {
-                KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
-                return;
+                if (FilterContext->Repeats[i].Hashes[j].Entries > 0)
+                {
+                    pending = TRUE;
+                }
             }
+        }
 
-            if (inputBufferLength > sizeof(ioctlData.u))
-            {
-                KdPrint(("inputBuffer is too large to be logged (%Iu bytes)\n", inputBufferLength));
-                return;
-            }
+        if (!pending)
+        {
+            WdfTimerStart(FilterContext->RepeatTimer, WDF_REL_TIMEOUT_IN_SEC(PORTSNIFFER_CLOCK_INTERVAL));
+        }
 
-            RtlCopyMemory(&ioctlData.u, inputBuffer, inputBufferLength);
+        repeatHash->Timestamp = CapturedEntry->Timestamp;
+    }
 
-            // Fall-through
+    repeatHash->LastTimestamp = CapturedEntry->Timestamp;
+    repeatHash->Entries++;
+    repeatHash->Bytes += CapturedEntry->OriginalLength;
 
-        case IOCTL_SERIAL_CLR_DTR:
-        case IOCTL_SERIAL_CLR_RTS:
-        case IOCTL_SERIAL_SET_BREAK_OFF:
-        case IOCTL_SERIAL_SET_BREAK_ON:
-        case IOCTL_SERIAL_SET_DTR:
-        case IOCTL_SERIAL_SET_RTS:
-        case IOCTL_SERIAL_SET_XON:
-        case IOCTL_SERIAL_SET_XOFF:
-            ioctlData.IoControlCode = IoControlCode;
-            PortSnifferFilterAddPortLogEntry(FilterContext, PORTSNIFFER_MONITOR_IOCTL, (PUCHAR)&ioctlData, sizeof(ioctlData));
-    }
+    return TRUE;
 }
 
-__drv_functionClass(EVT_WDF_IO_QUEUE_IO_READ)
-__drv_sameIRQL
-__drv_maxIRQL(DISPATCH_LEVEL)
+__drv_requiresIRQL(PASSIVE_LEVEL)
+LONGLONG
+PortSnifferFilterSyncCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    )
+{
+    KdPrint(("PortSnifferFilterSyncCaptureRings(%p)\n", FilterContext));
+
+    // This must not be pageable, because it acquires the ProducerLocks. The caller must hold LogLock.
+    return CaptureRingsSync(FilterContext->CaptureRings, CAPTURE_COUNT);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+LONGLONG
+PortSnifferFilterTicksToRelativeTime(
+    __in LONGLONG Ticks
+    )
+{
+    LONGLONG frequency;
+
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterTicksToRelativeTime(%I64d)\n", Ticks));
+
+    // Convert performance counter ticks into the negative 100-nanosecond units of a relative due time for WdfTimerStart.
+    // Divide first, so that large tick counts can't overflow.
+    frequency = PerformanceFrequency.QuadPart;
+    return -(Ticks / frequency * 10000000 + Ticks % frequency * 10000000 / frequency);
+}
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
 void
-PortSnifferFilterEvtIoRead(
-    __in WDFQUEUE Queue,
+PortSnifferFilterTrackLineSettings(
+    __inout PFILTER_CONTEXT FilterContext,
     __in WDFREQUEST Request,
-    __in size_t Length
+    __in ULONG IoControlCode
     )
 {
-    WDFDEVICE device;
-    PFILTER_CONTEXT filterContext;
-    WDFMEMORY outputMemory;
-    WDF_REQUEST_SEND_OPTIONS sendOptions;
-    BOOLEAN sendResult;
+    PSERIAL_BAUD_RATE baudRate;
+    PSERIAL_LINE_CONTROL lineControl;
     NTSTATUS status;
-    WDFIOTARGET target;
-
-    UNREFERENCED_PARAMETER(Length);
 
     PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtIoRead(%p, %p, %Iu)\n", Queue, Request, Length));
-
-    device = WdfIoQueueGetDevice(Queue);
-    filterContext = GetFilterContext(device);
-    target = WdfDeviceGetIoTarget(device);
-    WdfRequestFormatRequestUsingCurrentType(Request);
+    KdPrint(("PortSnifferFilterTrackLineSettings(%p, %p, %lX)\n", FilterContext, Request, IoControlCode));
 
-    if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_READ)
+    // We see the settings before the port driver has validated them, so only accept sane ones.
+    if (IoControlCode == IOCTL_SERIAL_SET_BAUD_RATE)
     {
-        // We monitor read requests for this port.
-        // As an upper filter driver, we have to wait until lower drivers have filled the read buffer.
-        status = WdfRequestRetrieveOutputMemory(Request, &outputMemory);
-        if (!NT_SUCCESS(status))
-        {
-            KdPrint(("WdfRequestRetrieveOutputMemory failed, status = 0x%08lX\n", status));
-            WdfRequestComplete(Request, status);
-            return;
-        }
-
-        status = WdfIoTargetFormatRequestForRead(target, Request, outputMemory, NULL, NULL);
-        if (!NT_SUCCESS(status))
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(SERIAL_BAUD_RATE), &baudRate, NULL);
+        if (NT_SUCCESS(status) && baudRate->BaudRate > 0)
         {
-            KdPrint(("WdfIoTargetFormatRequestForRead failed, status = 0x%08lX\n", status));
-            WdfRequestComplete(Request, status);
-            return;
+            WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+            FilterContext->BaudRate = baudRate->BaudRate;
+            WdfWaitLockRelease(FilterContext->LogLock);
         }
-
-        WdfRequestSetCompletionRoutine(Request, PortSnifferFilterEvtIoReadCompletionRoutine, filterContext);
-        sendResult = WdfRequestSend(Request, target, WDF_NO_SEND_OPTIONS);
     }
     else
     {
-        // We don't monitor read requests for this port.
-        // Forward the request and we're done.
-        WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
-        sendResult = WdfRequestSend(Request, target, &sendOptions);
-    }
-
-    if (!sendResult)
-    {
-        status = WdfRequestGetStatus(Request);
-        KdPrint(("WdfRequestSend failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(SERIAL_LINE_CONTROL), &lineControl, NULL);
+        if (NT_SUCCESS(status) && lineControl->WordLength >= 5 && lineControl->WordLength <= 8 && lineControl->StopBits <= STOP_BITS_2)
+        {
+            WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+            FilterContext->LineControl = *lineControl;
+            WdfWaitLockRelease(FilterContext->LogLock);
+        }
     }
 }
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
 void
-PortSnifferFilterEvtIoReadCompletionRoutine(
-    __in WDFREQUEST Request,
-    __in WDFIOTARGET Target,
-    __in PWDF_REQUEST_COMPLETION_PARAMS Params,
-    __in WDFCONTEXT Context
+PortSnifferFilterUnpublishPort(
+    __inout PFILTER_CONTEXT FilterContext
     )
 {
-    PFILTER_CONTEXT filterContext;
-    PREAD_WORK_ITEM_CONTEXT readWorkItemContext;
-
-    UNREFERENCED_PARAMETER(Target);
+    PAGED_CODE();
+    KdPrint(("PortSnifferFilterUnpublishPort(%p)\n", FilterContext));
 
-    KdPrint(("PortSnifferFilterEvtIoReadCompletionRoutine(%p, %p, %p, %p)\n", Request, Target, Params, Context));
+    // Control requests can't look up the port by name or index anymore afterwards.
+    // Removing the entry again is harmless (see PortHashRemove).
+    // PortIndex itself stays unchanged, because merged requests still holding a reference read it without FilterDevicesLock.
+    WdfWaitLockAcquire(FilterDevicesLock, NULL);
+    PortHashRemove(&FilterContext->HashEntry);
 
-    if (!NT_SUCCESS(Params->IoStatus.Status) || Params->Parameters.Read.Length == 0)
+    if (FilterContext->PortIndex != PORTSNIFFER_PORT_INDEX_NONE && PortIndexes[FilterContext->PortIndex] == FilterContext)
     {
-        WdfRequestComplete(Request, Params->IoStatus.Status);
-        return;
+        PortIndexes[FilterContext->PortIndex] = NULL;
     }
 
-    // This is a successfully completed read request, which we want to log.
-    // As Completion Routines always run at IRQL <= DISPATCH_LEVEL, we need to queue a Work Item to ensure IRQL == PASSIVE_LEVEL
-    // and therefore be able to call PortSnifferFilterAddPortLogEntry.
-    filterContext = (PFILTER_CONTEXT)Context;
-    readWorkItemContext = GetReadWorkItemContext(filterContext->ReadWorkItem);
-    readWorkItemContext->Request = Request;
-    readWorkItemContext->ReadBuffer = WdfMemoryGetBuffer(Params->Parameters.Read.Buffer, NULL);
-    readWorkItemContext->BytesRead = Params->Parameters.Read.Length;
-    readWorkItemContext->FilterContext = filterContext;
+    WdfWaitLockRelease(FilterDevicesLock);
 
-    WdfWorkItemEnqueue(filterContext->ReadWorkItem);
+    // Wait for all control requests still using the port, including those through a port session, and fail all further ones.
+    // Waiting again is harmless as well.
+    ExWaitForRundownProtectionRelease(&FilterContext->Rundown);
 }
 
-__drv_functionClass(EVT_WDF_WORKITEM)
-__drv_sameIRQL
-__drv_maxIRQL(PASSIVE_LEVEL)
+__drv_requiresIRQL(PASSIVE_LEVEL)
 void
-PortSnifferFilterEvtIoReadCompletionWorkItem(
-    __in WDFWORKITEM WorkItem
+PortSnifferFilterWriteCaptureFile(
+    __inout PFILTER_CONTEXT FilterContext
     )
 {
-    PREAD_WORK_ITEM_CONTEXT readWorkItemContext;
+    IO_STATUS_BLOCK ioStatusBlock;
+    ULONG length;
+    LARGE_INTEGER offset;
+    NTSTATUS status;
 
     PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtIoReadCompletionWorkItem(%p)\n", WorkItem));
+    KdPrint(("PortSnifferFilterWriteCaptureFile(%p)\n", FilterContext));
 
-    // Now that we are running at IRQL == PASSIVE_LEVEL, log the read request and finally complete it.
-    readWorkItemContext = GetReadWorkItemContext(WorkItem);
-    PortSnifferFilterAddPortLogEntry(readWorkItemContext->FilterContext,
-        PORTSNIFFER_MONITOR_READ,
-        readWorkItemContext->ReadBuffer,
-        readWorkItemContext->BytesRead
-    );
+    // The caller must hold CaptureLock.
+    // Nothing is to be written anymore once the capture has been stopped.
+    if (!FilterContext->CaptureBuffer)
+    {
+        return;
+    }
 
-    WdfRequestComplete(readWorkItemContext->Request, STATUS_SUCCESS);
-}
+    for (;;)
+    {
+        // Keep the entries in the port log until we have a file to write them to.
+        if (!FilterContext->CaptureFileHandle && !NT_SUCCESS(PortSnifferFilterOpenCaptureFile(FilterContext)))
+        {
+            return;
+        }
 
-__drv_functionClass(EVT_WDF_IO_QUEUE_IO_WRITE)
-__drv_sameIRQL
-__drv_maxIRQL(DISPATCH_LEVEL)
-void
-PortSnifferFilterEvtIoWrite(
-    __in WDFQUEUE Queue,
-    __in WDFREQUEST Request,
-    __in size_t Length
-    )
-{
-    PUCHAR buffer;
-    WDFDEVICE device;
-    PFILTER_CONTEXT filterContext;
-    size_t length;
-    WDF_REQUEST_SEND_OPTIONS sendOptions;
-    NTSTATUS status;
-    WDFIOTARGET target;
+        // A batch that couldn't be written last time goes first. Only hold LogLock for packing a new one, never while writing it.
+        if (FilterContext->CaptureBufferLength == 0)
+        {
+            WdfWaitLockAcquire(FilterContext->LogLock, NULL);
+            if (FilterContext->CaptureSubscriber.FilterContext == FilterContext)
+            {
+                FilterContext->CaptureBufferLength = (ULONG)PortSnifferFilterPackPortLogEntries(FilterContext, &FilterContext->CaptureSubscriber, FilterContext->CaptureBuffer, CAPTURE_FILE_BATCH_SIZE);
+            }
 
-    UNREFERENCED_PARAMETER(Length);
+            WdfWaitLockRelease(FilterContext->LogLock);
+        }
 
-    PAGED_CODE();
-    KdPrint(("PortSnifferFilterEvtIoWrite(%p, %p, %Iu)\n", Queue, Request, Length));
+        length = FilterContext->CaptureBufferLength;
+        if (length == 0)
+        {
+            return;
+        }
 
-    device = WdfIoQueueGetDevice(Queue);
-    filterContext = GetFilterContext(device);
-    target = WdfDeviceGetIoTarget(device);
-    WdfRequestFormatRequestUsingCurrentType(Request);
+        // Continue with the next file once this one would exceed its size.
+        // If that fails, keep the batch and try again next time. In the meantime, the capture subscriber falls behind
+        // and eventually gets a gap entry, so that the capture files still account for everything.
+        if (FilterContext->CaptureFileOffset + length > CaptureFileSize && !NT_SUCCESS(PortSnifferFilterOpenCaptureFile(FilterContext)))
+        {
+            KdPrint(("Keeping %lu bytes of log entries of %wZ for the next attempt\n", length, &FilterContext->PortName));
+            return;
+        }
 
-    if (filterContext->MonitorMask & PORTSNIFFER_MONITOR_WRITE)
-    {
-        // We monitor write requests for this port.
-        // As an upper filter driver, we can just get everything we need from the write buffer.
-        status = WdfRequestRetrieveInputBuffer(Request, 0, &buffer, &length);
+        offset.QuadPart = FilterContext->CaptureFileOffset;
+        status = ZwWriteFile(FilterContext->CaptureFileHandle, NULL, NULL, NULL, &ioStatusBlock, FilterContext->CaptureBuffer, length, &offset, NULL);
         if (!NT_SUCCESS(status))
         {
-            KdPrint(("WdfRequestRetrieveInputBuffer failed, status = 0x%08lX\n", status));
-            WdfRequestComplete(Request, status);
+            // Give up on this file and write the batch to the next one next time.
+            KdPrint(("ZwWriteFile failed, status = 0x%08lX\n", status));
+            ZwClose(FilterContext->CaptureFileHandle);
+            FilterContext->CaptureFileHandle = NULL;
             return;
         }
 
-        PortSnifferFilterAddPortLogEntry(filterContext, PORTSNIFFER_MONITOR_WRITE, buffer, length);
-    }
+        FilterContext->CaptureFileOffset += length;
+        FilterContext->CaptureBufferLength = 0;
 
-    WDF_REQUEST_SEND_OPTIONS_INIT(&sendOptions, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
-    if (!WdfRequestSend(Request, target, &sendOptions))
-    {
-        status = WdfRequestGetStatus(Request);
-        KdPrint(("WdfRequestSend failed, status = 0x%08lX\n", status));
-        WdfRequestComplete(Request, status);
+        // Leave a small remainder to the next run instead of writing in small pieces.
+        if (length < CAPTURE_FILE_BATCH_SIZE / 2)
+        {
+            return;
+        }
     }
 }
@@ -8,9 +8,13 @@
 #pragma once
 
 #include <ntddk.h>
+#include <ntstrsafe.h>
 #include <wdf.h>
 
+#include "../capturering.h"
 #include "../ioctl.h"
+#include "../porthash.h"
+#include "../portlog.h"
 #include "../version.h"
 
 
@@ -19,74 +23,492 @@
 #define POOL_TAG                            (ULONG)'nSoP'
 
 // The worst case is a serial port at 115200 baud, which is read via 1-byte requests.
-// 115200 baud makes 14400 bytes/second. Considering that the PortSniffer-Tool polls the
-// driver in 10 millisecond intervals (100 times/second), we need to buffer up to
-// 144 1-byte log entries.
-// Choose 160 (divisible by 32) as the upper limit here to be on the safe side.
-#define MAX_LOG_ENTRIES_PER_PORT            160
+// 115200 baud makes 14400 bytes/second. Every 1-byte log entry takes up 32 bytes in the port log
+// (PORTLOG_RECORD header, PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE header, data, alignment).
+// A 256 KiB port log therefore holds more than 8000 such entries, which is about 570 milliseconds
+// of traffic in the worst case. This is plenty for an application that consumes entries as soon as they are added,
+// so every port log starts with this size. It only grows when an application can't keep up or traffic comes in bursts.
+// All sizes must be powers of two.
+#define PORTLOG_INITIAL_SIZE                (256 * 1024)
+#define PORTLOG_MIN_CAPACITY                (64 * 1024)
+#define PORTLOG_MAX_CAPACITY                (64 * 1024 * 1024)
 
+// Defaults for the PortLogCapacity and PortLogBudget values of the driver's Parameters registry key.
+// The budget limits the memory of all port logs together.
+#define PORTLOG_DEFAULT_CAPACITY            (2 * 1024 * 1024)
+#define PORTLOG_DEFAULT_BUDGET              (16 * 1024 * 1024)
+#define PORTLOG_MAX_BUDGET                  (1024 * 1024 * 1024)
 
-typedef struct _PORTLOG_ENTRY
+// Line settings assumed for calculating character times until the application sets its own ones.
+// Parallel ports never set any, so they always use these.
+#define DEFAULT_BAUD_RATE                   9600
+#define DEFAULT_WORD_LENGTH                 8
+
+// Log entries are captured into one CAPTURE_RING per direction (see capturering.h), which the drain work item merges
+// into the port log.
+// The same indexes select the REQUEST_COUNTERS of a port and match PORTSNIFFER_STATS_READ, _WRITE and _IOCTL.
+#define CAPTURE_READ                        0
+#define CAPTURE_WRITE                       1
+#define CAPTURE_IOCTL                       2
+#define CAPTURE_COUNT                       3
+
+// A capture ring only has to hold the entries captured until the drain work item runs, which is usually a matter
+// of microseconds. 32 KiB hold about 1000 1-byte entries, which is about 70 milliseconds of traffic in the worst case.
+// The size is fixed and not charged to the port log budget, because capture rings are allocated from nonpaged pool.
+// Must be a power of two.
+#define CAPTURE_RING_SIZE                   (32 * 1024)
+
+// Number of per-second snapshots of the request counters kept for calculating rates over the longest window of 60 seconds.
+#define STATS_HISTORY_LENGTH                (60 + 1)
+
+// Defaults and limits for the CaptureDirectory, CaptureFileSize and CaptureFileCount values of the driver's Parameters
+// registry key, which apply to all ports configured for unattended capture (see PortSnifferFilterStartCapture).
+// The directory is given as an NT path.
+#define CAPTURE_DEFAULT_DIRECTORY           L"\\SystemRoot\\PortSniffer"
+#define CAPTURE_DIRECTORY_LENGTH            260
+#define CAPTURE_FILE_DEFAULT_SIZE           (16 * 1024 * 1024)
+#define CAPTURE_FILE_MIN_SIZE               (1024 * 1024)
+#define CAPTURE_FILE_MAX_SIZE               (1024 * 1024 * 1024)
+#define CAPTURE_FILE_DEFAULT_COUNT          4
+#define CAPTURE_FILE_MAX_COUNT              1000
+
+// Capture files are written in batches of up to this size, and at least once per CAPTURE_FILE_WRITE_INTERVAL milliseconds.
+// A batch is written earlier when half of it has been collected, so that busy ports are written in large chunks.
+#define CAPTURE_FILE_BATCH_SIZE             (256 * 1024)
+#define CAPTURE_FILE_WRITE_INTERVAL         1000
+
+
+struct _FILTER_CONTEXT;
+struct _PORTLOG_MAPPING;
+
+// Requests of one capture ring's type, updated with interlocked operations.
+typedef struct _REQUEST_COUNTERS
 {
-    WDFMEMORY Memory;
-    struct _PORTLOG_ENTRY* Next;
-    PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Response;
+    // Requests dispatched since monitoring was started, for sampling every n-th of them.
+    volatile LONG Dispatched;
+
+    // Requests completed since monitoring was started, including those skipped by sampling, and the bytes they transferred.
+    volatile LONGLONG Completed;
+    volatile LONGLONG Bytes;
+
+    // Completed requests that have failed and all completed requests by their transferred bytes,
+    // see PORTSNIFFER_REQUEST_STATISTICS.
+    volatile LONGLONG Failed;
+    volatile LONGLONG SizeHistogram[PORTSNIFFER_STATS_SIZE_BUCKETS];
+}
+REQUEST_COUNTERS, *PREQUEST_COUNTERS;
+
+// Completed requests and transferred bytes of each type at one tick of the statistics timer.
+typedef struct _STATS_SNAPSHOT
+{
+    LONGLONG Completed[CAPTURE_COUNT];
+    LONGLONG Bytes[CAPTURE_COUNT];
 }
-PORTLOG_ENTRY, *PPORTLOG_ENTRY;
+STATS_SNAPSHOT, *PSTATS_SNAPSHOT;
 
+// Entry stored in the port log, which later entries are compared to for suppressing repetitions.
+// SequenceNumber is the one of the stored entry (or of the coalesced entry it has been appended to).
+// The other fields describe the repetitions suppressed since, which haven't been reported through a
+// PORTSNIFFER_PORTLOG_REPEAT entry yet.
+typedef struct _PORTLOG_REPEAT_HASH
+{
+    ULONGLONG Hash;
+    ULONG SequenceNumber;
+    LARGE_INTEGER Timestamp;
+    LARGE_INTEGER LastTimestamp;
+    ULONG Entries;
+    ULONGLONG Bytes;
+}
+PORTLOG_REPEAT_HASH, *PPORTLOG_REPEAT_HASH;
+
+// Recent entries of one type for suppressing repetitions, see RepeatDepth of PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST.
+// Hashes is a ring of the last HashCount entries of Type stored in the port log, with the oldest one at NextHash
+// once it is full.
+typedef struct _PORTLOG_REPEAT
+{
+    PORTLOG_REPEAT_HASH Hashes[PORTSNIFFER_MAX_REPEAT_DEPTH];
+    ULONG HashCount;
+    ULONG NextHash;
+    USHORT Type;
+}
+PORTLOG_REPEAT, *PPORTLOG_REPEAT;
+
+// Read position of a handle subscribed to a port via PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT.
+// It is part of the file object of the control device and only unsubscribed when the handle is closed.
+// The capture file writer of a port reads through a PORTLOG_SUBSCRIBER of its own, which has no WaitQueue.
+typedef struct _PORTLOG_SUBSCRIBER
+{
+    // Entry in the Subscribers list of the port, protected by LogLock.
+    LIST_ENTRY ListEntry;
+
+    // The subscribed port or NULL if the handle isn't subscribed or the port has been removed.
+    // Protected by FilterDevicesLock. Unsubscribing also holds LogLock, so a control request holding a reference to
+    // the port may check it under LogLock instead.
+    struct _FILTER_CONTEXT* FilterContext;
+
+    // Read position in the port log and entries lost before it, protected by LogLock.
+    // Cursor only differs from Log in its Head, see PortSnifferFilterGetConsumerRing.
+    // Its EntryCount is only valid while the port log is resized.
+    PORTLOG_RING Cursor;
+    PORTLOG_GAP MissedGap;
+
+    // Pending PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES requests of this subscriber and their wait parameters.
+    // WaitQueue is a manual queue of the control device, which is created when subscribing.
+    // The wait parameters are protected by LogLock.
+    WDFQUEUE WaitQueue;
+    ULONG WaitMinLength;
+    ULONG WaitMaxDelay;
+}
+PORTLOG_SUBSCRIBER, *PPORTLOG_SUBSCRIBER;
 
 typedef struct _FILTER_CONTEXT
 {
     UNICODE_STRING PortName;
     USHORT MonitorMask;
 
-    PPORTLOG_ENTRY LogEntryHead;
-    PPORTLOG_ENTRY LogEntryTail;
-    WDFWAITLOCK LogEntryLock;
-    USHORT LogEntryCount;
+    // Entry of the port in PortHashTable, protected by FilterDevicesLock.
+    // It is removed when the port is removed, so that control requests can't find it anymore.
+    PORT_HASH_ENTRY HashEntry;
+
+    // Index of the port in PortIndexes or PORTSNIFFER_PORT_INDEX_NONE, fixed once the port has been added.
+    USHORT PortIndex;
+
+    // Held by every control request while it uses the port.
+    // This keeps the port alive without holding FilterDevicesLock and is drained before the port is removed.
+    EX_RUNDOWN_REF Rundown;
+
+    // Capture rings and port log are only allocated while the port is monitored.
+    // If Mapping is set, Log is the producer side of a port log shared with the application.
+    CAPTURE_RING CaptureRings[CAPTURE_COUNT];
+    WDFWORKITEM DrainWorkItem;
+    PORTLOG_RING Log;
+    WDFWAITLOCK LogLock;
+    struct _PORTLOG_MAPPING* Mapping;
+
+    // PORTLOG_SUBSCRIBER structures of the handles subscribed to this port, protected by LogLock.
+    // While there are any, entries are only removed from Log once every subscriber has read them.
+    LIST_ENTRY Subscribers;
+
+    // Settings from PORTSNIFFER_IOCTL_CONTROL_CONFIGURE_PORTLOG, protected by LogLock.
+    // SnapLength and the sampling settings are also read without LogLock when dispatching and capturing requests.
+    // SamplingStart is the performance counter value from which on PORTSNIFFER_SAMPLING_SECONDS counts seconds.
+    ULONG LogCapacity;
+    USHORT OverflowPolicy;
+    USHORT CoalesceGap;
+    USHORT SnapLength;
+    USHORT SamplingMode;
+    USHORT SamplingRate;
+    USHORT RepeatDepth;
+    LONGLONG SamplingStart;
+
+    // Read or write entry currently being coalesced, protected by LogLock.
+    // OpenRecord has been reserved right after the Tail of the port log, but is only committed when the next entry
+    // doesn't continue it or CoalesceTimer finds the gap elapsed. Nothing else may be reserved in the meantime.
+    // OpenEntry holds the header fields of the open entry (its Data is unused). A mapped port log can be modified by the
+    // application at any time, so they are only ever written to OpenRecord and never read back from it.
+    PPORTLOG_RECORD OpenRecord;
+    PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE OpenEntry;
+    WDFTIMER CoalesceTimer;
+
+    // Suppressed repetitions of read, write and IOCTL entries, indexed like CaptureRings and protected by LogLock.
+    // RepeatTimer reports them if nothing else does within PORTSNIFFER_CLOCK_INTERVAL seconds after the first one.
+    PORTLOG_REPEAT Repeats[CAPTURE_COUNT];
+    WDFTIMER RepeatTimer;
 
-    WDFWORKITEM ReadWorkItem;
+    // Bitmap of the IOCTL function codes to log, see PORTSNIFFER_IOCTL_CONTROL_SET_IOCTL_FILTER.
+    // It is read without a lock, so a request racing with an update may still be checked against the previous filter.
+    ULONG IoctlFilter[PORTSNIFFER_IOCTL_FILTER_FUNCTIONS / 32];
+
+    // Verified program of PORTSNIFFER_IOCTL_CONTROL_SET_CAPTURE_FILTER, which captures everything if CaptureFilterLength is zero.
+    // Protected by the ProducerLocks of all CaptureRings together, so that capturing only needs the lock it holds anyway.
+    CAPTURE_FILTER_INSTRUCTION CaptureFilter[CAPTURE_FILTER_MAX_INSTRUCTIONS];
+    ULONG CaptureFilterLength;
+
+    // Line settings last set by the application for calculating character times, protected by LogLock.
+    ULONG BaudRate;
+    SERIAL_LINE_CONTROL LineControl;
+
+    // Line status last reported through a PORTSNIFFER_PORTLOG_LINE_STATUS entry, protected by LineStatusLock.
+    // LineStatusValid holds the PORTSNIFFER_LINE_STATUS_* flags of all status IOCTLs completed since monitoring was started.
+    // LineStats are the error counters of the last IOCTL_SERIAL_GET_STATS for calculating their increase.
+    KSPIN_LOCK LineStatusLock;
+    PORTSNIFFER_LINE_STATUS_DATA LineStatus;
+    ULONG LineStatusValid;
+    SERIALPERF_STATS LineStats;
+
+    // Performance counter value from which on the next entries shall be preceded by a clock entry, protected by LogLock.
+    LONGLONG NextClockEntry;
+
+    // Sequence numbers and drop accounting, protected by LogLock.
+    // DroppedGap describes the newest entries dropped while the port log was full, which are reported at the end of the log.
+    // OverwrittenGap describes the oldest entries overwritten to make room, which are reported when popping the next entry.
+    // The request counters of the response are taken from RequestCounters instead.
+    PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE Counters;
+    PORTLOG_GAP DroppedGap;
+    PORTLOG_GAP OverwrittenGap;
+
+    // Requests of each monitored type, indexed like CaptureRings.
+    REQUEST_COUNTERS RequestCounters[CAPTURE_COUNT];
+
+    // Snapshots of RequestCounters taken every second by StatsTimer under PORTSNIFFER_MONITOR_STATS, protected by StatsLock.
+    // StatsSeconds counts the snapshots since the counters have been reset. The latest one is at
+    // StatsSeconds % STATS_HISTORY_LENGTH, and the first one with all counters zero is taken at the reset.
+    WDFTIMER StatsTimer;
+    KSPIN_LOCK StatsLock;
+    STATS_SNAPSHOT StatsHistory[STATS_HISTORY_LENGTH];
+    ULONG StatsSeconds;
+
+    // Pending PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES requests of all handles not subscribed to this port.
+    // WaitQueue is a manual queue of the control device and only created when the first request arrives.
+    // All other fields are protected by LogLock.
+    WDFQUEUE WaitQueue;
+    ULONG WaitMinLength;
+    ULONG WaitMaxDelay;
+    WDFTIMER WaitTimer;
+    BOOLEAN WaitTimerStarted;
+
+    // Unattended capture into files, see PortSnifferFilterStartCapture.
+    // CaptureSubscriber is linked into Subscribers while the port is captured. CaptureWorkItem packs its entries into
+    // CaptureBuffer and appends them to the current capture file, whenever CaptureTimer fires or a batch is half full.
+    // CaptureBuffer is NULL if the port isn't captured. It and the file fields are protected by CaptureLock.
+    // CaptureBufferLength is the length of a packed batch that couldn't be written yet and is retried first.
+    PORTLOG_SUBSCRIBER CaptureSubscriber;
+    WDFWORKITEM CaptureWorkItem;
+    WDFTIMER CaptureTimer;
+    WDFWAITLOCK CaptureLock;
+    PUCHAR CaptureBuffer;
+    ULONG CaptureBufferLength;
+    HANDLE CaptureFileHandle;
+    ULONG CaptureFileIndex;
+    ULONG CaptureFileOffset;
+
+    // Trigger of PORTSNIFFER_IOCTL_CONTROL_ARM_PORT_TRIGGER, protected by LogLock.
+    // TriggerState is one of the PORTSNIFFER_TRIGGER_* values and falls back to PORTSNIFFER_TRIGGER_NONE whenever the
+    // port log is cleared or freed. TriggerPostBytes counts the bytes of the entries added after the trigger has fired.
+    USHORT TriggerState;
+    CAPTURE_FILTER_INSTRUCTION Trigger[CAPTURE_FILTER_MAX_INSTRUCTIONS];
+    ULONG TriggerLength;
+    ULONG TriggerPreLength;
+    ULONG TriggerPostLength;
+    ULONG TriggerPostBytes;
+    LARGE_INTEGER TriggerTimestamp;
+    PORTSNIFFER_CLOCK_DATA TriggerClock;
+
+    // Linger period of PORTSNIFFER_IOCTL_CONTROL_SET_PORT_MONITOR_MASK, protected by FilterDevicesLock.
+    // LingerOwner is the file object monitoring has been bound to. It is only compared, never dereferenced.
+    // When it is cleaned up, LingerPending is set and LingerTimer stops capturing after LingerTime seconds.
+    WDFFILEOBJECT LingerOwner;
+    ULONG LingerTime;
+    BOOLEAN LingerPending;
+    WDFTIMER LingerTimer;
 }
 FILTER_CONTEXT, *PFILTER_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILTER_CONTEXT, GetFilterContext)
 
 
-typedef struct _READ_WORK_ITEM_CONTEXT
+// Context of every request sent to a filter device.
+// The framework zeroes it, so a zero RequestType in Lifecycle means that the request is not traced.
+typedef struct _REQUEST_CONTEXT
 {
-    WDFREQUEST Request;
-    PUCHAR ReadBuffer;
-    size_t BytesRead;
+    PORTSNIFFER_LIFECYCLE_DATA Lifecycle;
+
+    // Log entry data of a monitored IOCTL, allocated from nonpaged pool when the request is dispatched.
+    // It already holds the input buffer, because buffered IOCTLs return their output in the same buffer.
+    // The output buffer is appended from OutputBuffer when the request is completed, up to OutputLength bytes.
+    PPORTSNIFFER_IOCTL_DATA IoctlData;
+    PUCHAR OutputBuffer;
+    USHORT OutputLength;
+
+    // Output buffer of a status IOCTL checked for line status changes on completion or NULL.
+    PVOID LineStatusBuffer;
+    ULONG LineStatusIoControlCode;
+
+    // Type of a monitored request (PORTSNIFFER_MONITOR_READ, PORTSNIFFER_MONITOR_WRITE or PORTSNIFFER_MONITOR_IOCTL),
+    // which is counted on completion, and the SamplingWeight of its log entries.
+    // A zero MonitorType means that the request isn't counted, a zero SamplingWeight that it isn't captured, because
+    // sampling has skipped it or it is only counted for PORTSNIFFER_MONITOR_STATS.
+    USHORT MonitorType;
+    USHORT SamplingWeight;
+}
+REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, GetRequestContext)
+
+
+// A port log mapped into the application via PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG.
+// It belongs to the file object of the control device, because it can only be unmapped in the context of the application.
+typedef struct _PORTLOG_MAPPING
+{
+    LIST_ENTRY ListEntry;
+
+    // The port adding log entries to this mapping or NULL if it has been detached.
+    // Protected by FilterDevicesLock.
     PFILTER_CONTEXT FilterContext;
+
+    PPORTLOG_SHARED_HEADER Header;
+    ULONG Length;
+
+    // Size of the records area following the header, which has been charged to the port log budget.
+    ULONG LogSize;
+
+    PMDL Mdl;
+    PVOID UserAddress;
+    PKEVENT Event;
 }
-READ_WORK_ITEM_CONTEXT, *PREAD_WORK_ITEM_CONTEXT;
+PORTLOG_MAPPING, *PPORTLOG_MAPPING;
 
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(READ_WORK_ITEM_CONTEXT, GetReadWorkItemContext)
+
+typedef struct _CONTROL_FILE_CONTEXT
+{
+    // All PORTLOG_MAPPING structures of this file object, protected by FilterDevicesLock.
+    LIST_ENTRY Mappings;
+
+    // Referenced filter device bound via PORTSNIFFER_IOCTL_CONTROL_OPEN_PORT_SESSION or NULL.
+    // It is only set while holding FilterDevicesLock and never changes afterwards, so it is read without a lock.
+    WDFDEVICE SessionDevice;
+
+    // Read position in the port log of SessionDevice if the handle has been subscribed to it.
+    PORTLOG_SUBSCRIBER Subscriber;
+}
+CONTROL_FILE_CONTEXT, *PCONTROL_FILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_FILE_CONTEXT, GetControlFileContext)
 
 
 DRIVER_INITIALIZE DriverEntry;
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlArmPortTrigger(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlClearPortLog(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlConfigurePortLog(
+    __in WDFREQUEST Request
+    );
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 NTSTATUS
 PortSnifferControlCreate(
     __in WDFDRIVER Driver
     );
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlCreateMapping(
+    __in HANDLE EventHandle,
+    __in ULONG LogSize,
+    __out PPORTLOG_MAPPING* Mapping
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlDeleteMapping(
+    __in PPORTLOG_MAPPING Mapping
+    );
+
+EVT_WDF_DEVICE_FILE_CREATE PortSnifferControlEvtDeviceFileCreate;
+
+EVT_WDF_FILE_CLEANUP PortSnifferControlEvtFileCleanup;
+
+EVT_WDF_FILE_CLOSE PortSnifferControlEvtFileClose;
+
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL
 PortSnifferControlEvtIoDeviceControl;
 
+EVT_WDF_IO_IN_CALLER_CONTEXT PortSnifferControlEvtIoInCallerContext;
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlDereferencePort(
+    __in PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PFILTER_CONTEXT
+PortSnifferControlFindPort(
+    __inout_ecount(PORTSNIFFER_PORTNAME_LENGTH) PWSTR PortName
+    );
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
 PortSnifferControlGetAttachedPorts(
     __in WDFREQUEST Request
     );
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortIndexes(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortLogCounters(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortStatistics(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlGetPortTrigger(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_SUBSCRIBER
+PortSnifferControlGetSubscriber(
+    __in WDFREQUEST Request,
+    __in PFILTER_CONTEXT FilterContext
+    );
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
 PortSnifferControlGetVersion(
     __in WDFREQUEST Request
     );
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlMapPortLog(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlOpenPortSession(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlPopMergedPortLogEntries(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+size_t
+PortSnifferControlPopMergedPortLogEntriesInternal(
+    __in_ecount(Count) PFILTER_CONTEXT* FilterContexts,
+    __in ULONG Count,
+    __out_bcount(ResponseBufferLength) PPORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE Response,
+    __in size_t ResponseBufferLength
+    );
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
 PortSnifferControlPopPortLogEntry(
@@ -97,10 +519,35 @@ __drv_requiresIRQL(PASSIVE_LEVEL)
 NTSTATUS
 PortSnifferControlPopPortLogEntryInternal(
     __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
     __out PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Response,
     __out PULONG_PTR ResponseLength
     );
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlPopPortLogEntries(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlPopPortLogEntriesInternal(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __out_bcount(ResponseBufferLength) PUCHAR Response,
+    __in size_t ResponseBufferLength,
+    __out PULONG_PTR ResponseLength
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlReferencePort(
+    __in WDFREQUEST Request,
+    __inout_ecount(PORTSNIFFER_PORTNAME_LENGTH) PWSTR PortName,
+    __out PFILTER_CONTEXT* FilterContext
+    );
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
 PortSnifferControlResetPortMonitoring(
@@ -109,11 +556,193 @@ PortSnifferControlResetPortMonitoring(
 
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
+PortSnifferControlSetCaptureFilter(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSetIoctlFilter(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSetPortMonitorMask(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlSubscribePort(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlUnsubscribePort(
+    __inout PPORTLOG_SUBSCRIBER Subscriber
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferControlWaitPortLogEntries(
+    __in WDFREQUEST Request
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferControlWaitPortLogEntriesInternal(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __in WDFREQUEST Request,
+    __in PPORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST WaitRequest,
+    __in size_t ResponseBufferLength
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddClockEntry(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddGapEntry(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
 PortSnifferFilterAddPortLogEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry,
+    __out PBOOLEAN Stored
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAddRepeatEntries(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterAddToGap(
+    __inout PPORTLOG_GAP Gap,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry,
+    __in ULONG Entries,
+    __in ULONGLONG Bytes
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAdvanceTrigger(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterAllocateCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterAllocatePortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterAppendToOpenEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterAssignPortIndex(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterBeginLifecycle(
+    __in WDFREQUEST Request,
+    __in USHORT RequestType,
+    __in ULONG IoControlCode,
+    __in size_t RequestedLength
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterBeginLineStatus(
+    __in WDFREQUEST Request,
+    __in ULONG IoControlCode
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCancelLinger(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCaptureIoctlEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCaptureLifecycleEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCaptureLineStatusEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCapturePortLogEntry(
     __inout PFILTER_CONTEXT FilterContext,
     __in USHORT Type,
     __in PUCHAR Data,
-    __in size_t DataLength
+    __in size_t DataLength,
+    __in USHORT SamplingWeight
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterChargePortLogBudget(
+    __in ULONG Length
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterCheckConsumer(
+    __in PFILTER_CONTEXT FilterContext,
+    __in_opt PPORTLOG_SUBSCRIBER Subscriber
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterClearCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
     );
 
 __drv_requiresIRQL(PASSIVE_LEVEL)
@@ -122,17 +751,100 @@ PortSnifferFilterClearPortLog(
     __inout PFILTER_CONTEXT FilterContext
     );
 
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCloseCapture(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCloseOpenEntry(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCompleteWaitQueue(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __in BOOLEAN DelayElapsed
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterCompleteWaitRequests(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in BOOLEAN DelayElapsed
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterCountRequest(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in NTSTATUS Status,
+    __in ULONG_PTR Information
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDeliverPortLogEntries(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDetachMapping(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDetachSubscribers(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterDrainCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterDropPortLogEntries(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PLARGE_INTEGER Timestamp,
+    __in ULONG Entries,
+    __in ULONGLONG Bytes
+    );
+
+EVT_WDF_TIMER PortSnifferFilterEvtCaptureTimer;
+
+EVT_WDF_WORKITEM PortSnifferFilterEvtCaptureWorkItem;
+
+EVT_WDF_TIMER PortSnifferFilterEvtCoalesceTimer;
+
 EVT_WDF_DRIVER_DEVICE_ADD PortSnifferFilterEvtDeviceAdd;
 
 EVT_WDF_DEVICE_CONTEXT_CLEANUP PortSnifferFilterEvtDeviceCleanup;
 
+EVT_WDF_DEVICE_SELF_MANAGED_IO_CLEANUP PortSnifferFilterEvtDeviceSelfManagedIoCleanup;
+
+EVT_WDF_WORKITEM PortSnifferFilterEvtDrainWorkItem;
+
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL PortSnifferFilterEvtIoDeviceControl;
 
+EVT_WDF_REQUEST_COMPLETION_ROUTINE PortSnifferFilterEvtIoDeviceControlCompletionRoutine;
+
 __drv_requiresIRQL(PASSIVE_LEVEL)
 void
 PortSnifferFilterEvtIoDeviceControlInternal(
     __inout PFILTER_CONTEXT FilterContext,
     __in WDFREQUEST Request,
+    __in size_t OutputBufferLength,
+    __in size_t InputBufferLength,
     __in ULONG IoControlCode
     );
 
@@ -140,6 +852,264 @@ EVT_WDF_IO_QUEUE_IO_READ PortSnifferFilterEvtIoRead;
 
 EVT_WDF_REQUEST_COMPLETION_ROUTINE PortSnifferFilterEvtIoReadCompletionRoutine;
 
-EVT_WDF_WORKITEM PortSnifferFilterEvtIoReadCompletionWorkItem;
-
 EVT_WDF_IO_QUEUE_IO_WRITE PortSnifferFilterEvtIoWrite;
+
+EVT_WDF_REQUEST_COMPLETION_ROUTINE PortSnifferFilterEvtIoWriteCompletionRoutine;
+
+EVT_WDF_TIMER PortSnifferFilterEvtLingerTimer;
+
+EVT_WDF_TIMER PortSnifferFilterEvtRepeatTimer;
+
+EVT_WDF_TIMER PortSnifferFilterEvtStatsTimer;
+
+EVT_WDF_TIMER PortSnifferFilterEvtWaitTimer;
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterFillGapEntry(
+    __out PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry,
+    __inout PPORTLOG_GAP Gap
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterFreeCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterFreePortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+LONGLONG
+PortSnifferFilterGetCoalesceGapTime(
+    __in PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_RING
+PortSnifferFilterGetConsumerRing(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONG
+PortSnifferFilterGetFairShare(void);
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_REPEAT
+PortSnifferFilterGetRepeat(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in USHORT Type
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterGetStatistics(
+    __in PFILTER_CONTEXT FilterContext,
+    __out PPORTSNIFFER_PORT_STATISTICS Statistics
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterGrowPortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONGLONG
+PortSnifferFilterHashEntry(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterIsOldestEntryRead(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterIsTriggerPending(
+    __in PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+ULONG
+PortSnifferFilterNormalizeCapacity(
+    __in ULONG Capacity
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterOpenCaptureFile(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+NTSTATUS
+PortSnifferFilterOpenCaptureKey(
+    __in PFILTER_CONTEXT FilterContext,
+    __in ACCESS_MASK DesiredAccess,
+    __out WDFKEY* Key
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterOverwriteOldestEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTLOG_RECORD Record
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+size_t
+PortSnifferFilterPackPortLogEntries(
+    __inout PFILTER_CONTEXT FilterContext,
+    __inout_opt PPORTLOG_SUBSCRIBER Subscriber,
+    __out_bcount(BufferLength) PUCHAR Buffer,
+    __in size_t BufferLength
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterQueryClock(
+    __out PPORTSNIFFER_CLOCK_DATA ClockData
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterReclaimPortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterRememberRepeat(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in USHORT Type,
+    __in ULONGLONG Hash,
+    __in ULONG SequenceNumber
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterReportRepeats(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+PPORTLOG_RECORD
+PortSnifferFilterReservePortLogEntry(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in ULONG DataLength
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterResetLineStatus(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterResetRepeats(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterResetStatistics(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterResizePortLog(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in ULONG NewSize
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterReturnPortLogBudget(
+    __in ULONG Length
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterSampleRequest(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in USHORT MonitorType,
+    __in BOOLEAN Capture
+    );
+
+__drv_maxIRQL(DISPATCH_LEVEL)
+void
+PortSnifferFilterSetCaptureFilter(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in_ecount(InstructionCount) const CAPTURE_FILTER_INSTRUCTION* Instructions,
+    __in ULONG InstructionCount
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterShrinkPortLog(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterStartCapture(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterStopCapture(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+BOOLEAN
+PortSnifferFilterSuppressRepeat(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE CapturedEntry,
+    __out PULONGLONG Hash
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+LONGLONG
+PortSnifferFilterSyncCaptureRings(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+LONGLONG
+PortSnifferFilterTicksToRelativeTime(
+    __in LONGLONG Ticks
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterTrackLineSettings(
+    __inout PFILTER_CONTEXT FilterContext,
+    __in WDFREQUEST Request,
+    __in ULONG IoControlCode
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterUnpublishPort(
+    __inout PFILTER_CONTEXT FilterContext
+    );
+
+__drv_requiresIRQL(PASSIVE_LEVEL)
+void
+PortSnifferFilterWriteCaptureFile(
+    __inout PFILTER_CONTEXT FilterContext
+    );
@@ -9,6 +9,9 @@
 
 #include <ntddser.h>
 
+#include "capturefilter.h"
+#include "portlog.h"
+
 // A single page should be a sufficient maximum length for a single PORTSNIFFER_PORTLOG_POP_ENTRY_RESPONSE.
 // Always allocate an output buffer this large for PORTSNIFFER_IOCTL_CONTROL_PORTLOG_POP_ENTRY.
 #define PORTSNIFFER_PORTLOG_ENTRY_LENGTH    4096
@@ -58,9 +61,55 @@ PORTSNIFFER_RESET_PORT_MONITORING_REQUEST, *PPORTSNIFFER_RESET_PORT_MONITORING_R
 
 #define PORTSNIFFER_MONITOR_NONE            0x0000
 #define PORTSNIFFER_MONITOR_READ            0x0001
+
+// Write entries are captured when the port driver completes the request (since version 3.0, when it was dispatched before).
+// They only contain the data that has actually been sent, which may be less than the application wanted to write.
 #define PORTSNIFFER_MONITOR_WRITE           0x0002
+
+// IOCTL entries are captured when the port driver completes the request, with its input and output buffer (since version 3.0).
+// PORTSNIFFER_IOCTL_CONTROL_SET_IOCTL_FILTER selects the logged IOCTLs, all of them by default.
 #define PORTSNIFFER_MONITOR_IOCTL           0x0004
 
+// Additionally log a PORTSNIFFER_PORTLOG_LIFECYCLE entry whenever a request of a monitored type completes (available since version 3.0).
+// This covers every read, write or IOCTL request, including failed, timed out and canceled ones.
+// Lifecycle entries end any entry being coalesced, so coalescing only combines data within a single request then.
+#define PORTSNIFFER_MONITOR_LIFECYCLE       0x0008
+
+// Log a PORTSNIFFER_PORTLOG_LINE_STATUS entry whenever a status IOCTL of the application reveals a change of the line status
+// (available since version 3.0). Repeated polls of an unchanged status don't add any entries.
+#define PORTSNIFFER_MONITOR_LINE_STATUS     0x0010
+
+// Count every read, write and IOCTL request for PORTSNIFFER_IOCTL_CONTROL_GET_PORT_STATISTICS without logging it
+// (available since version 3.0). If this is the only type, the port gets no port log at all.
+#define PORTSNIFFER_MONITOR_STATS           0x0020
+
+// Type of a synthetic log entry reporting entries that have been dropped because the port log was full (available since version 3.0).
+// Entries dropped under PORTSNIFFER_OVERFLOW_DROP_NEWEST are reported right before the next entry that fits again.
+// Entries overwritten under PORTSNIFFER_OVERFLOW_OVERWRITE_OLDEST are reported before the oldest remaining entry.
+// Its data is a PORTSNIFFER_GAP_DATA structure and its SequenceNumber is the one of the first dropped entry.
+#define PORTSNIFFER_PORTLOG_GAP             0x8000
+
+// Type of a synthetic log entry correlating the performance counter with the system time (available since version 3.0).
+// It is the first entry after monitoring has been started and repeats about every PORTSNIFFER_CLOCK_INTERVAL seconds
+// while entries are added. Unlike all other entries, it may have a later Timestamp than the entries following it.
+// Its data is a PORTSNIFFER_CLOCK_DATA structure.
+#define PORTSNIFFER_PORTLOG_CLOCK           0x8001
+#define PORTSNIFFER_CLOCK_INTERVAL          10
+
+// Type of a log entry describing a completed request (available since version 3.0), see PORTSNIFFER_MONITOR_LIFECYCLE.
+// Its Timestamp is the completion time of the request and its data is a PORTSNIFFER_LIFECYCLE_DATA structure.
+#define PORTSNIFFER_PORTLOG_LIFECYCLE       0x8002
+
+// Type of a log entry describing a change of the line status (available since version 3.0), see PORTSNIFFER_MONITOR_LINE_STATUS.
+// Its data is a PORTSNIFFER_LINE_STATUS_DATA structure.
+#define PORTSNIFFER_PORTLOG_LINE_STATUS     0x8003
+
+// Type of a synthetic log entry summarizing suppressed repetitions of earlier entries (available since version 3.0),
+// see RepeatDepth of PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST. Its Timestamp is the one of the first suppressed entry.
+// Suppressed entries don't consume sequence numbers, only the summarizing entry does.
+// Its data is a PORTSNIFFER_REPEAT_DATA structure.
+#define PORTSNIFFER_PORTLOG_REPEAT          0x8004
+
 #define PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING     CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 2, METHOD_BUFFERED, FILE_WRITE_ACCESS)
 
 
@@ -73,28 +122,675 @@ PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST, *PPORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST;
 
 typedef struct _PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE
 {
+    // Value of the performance counter when the entry was captured (available since version 3.0, system time before).
+    // Use the most recent PORTSNIFFER_PORTLOG_CLOCK entry to convert it to UTC.
     LARGE_INTEGER Timestamp;
+
+    // Performance counter ticks from Timestamp to the last data appended to a coalesced entry (available since version 3.0).
+    // It is zero for all entries that haven't been coalesced, see PORTSNIFFER_IOCTL_CONTROL_CONFIGURE_PORTLOG.
+    ULONG Duration;
+
+    // Sequence number of the entry, counted per port from zero since monitoring was started (available since version 3.0).
+    // Dropped entries still consume their sequence numbers, see PORTSNIFFER_PORTLOG_GAP.
+    ULONG SequenceNumber;
+
     USHORT Type;
+
+    // PORTSNIFFER_PORTLOG_FLAG_* values (available since version 3.0).
+    USHORT Flags;
+
+    // Length of the data before it has been truncated (available since version 3.0).
+    // Data always holds DataLength bytes, OriginalLength only differs if PORTSNIFFER_PORTLOG_FLAG_TRUNCATED is set.
+    ULONG OriginalLength;
+
     USHORT DataLength;
+
+    // Number of requests this entry stands for (available since version 3.0).
+    // It is 1 unless the port samples its requests, see PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST.
+    USHORT SamplingWeight;
+
     BYTE Data[ANYSIZE_ARRAY];
 }
 PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE, *PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE;
 
+// Data holds only the first DataLength of OriginalLength bytes, because of the SnapLength of the port or because the
+// data doesn't fit into PORTSNIFFER_PORTLOG_ENTRY_LENGTH.
+#define PORTSNIFFER_PORTLOG_FLAG_TRUNCATED  0x0001
+
 #define PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRY         CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 3, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 
-// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_MONITOR_IOCTL.
+// Pop as many monitoring log entries for a given port as fit into the output buffer (available since version 3.0).
+// The input buffer is a PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST.
+// The output buffer receives PORTLOG_RECORD structures packed back-to-back (see portlog.h), each followed by
+// a PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE as its payload. Walk them using PortLogGetPackedRecord.
+// The output buffer must be at least PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH bytes large to hold the largest possible entry.
+#define PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH          PORTLOG_RECORD_SIZE(PORTSNIFFER_PORTLOG_ENTRY_LENGTH)
+
+#define PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES       CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 4, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+
+// Wait for monitoring log entries of a given port and pop as many as fit into the output buffer (available since version 3.0).
+// The driver keeps the request pending until at least MinBatchLength bytes of log entries have accumulated or MaxDelay
+// milliseconds have passed since entries became available, whatever comes first.
+// Set both to zero to get every log entry delivered as soon as it has been added.
+// A nonzero MinBatchLength together with a zero MaxDelay waits for that many bytes without any time limit.
+// The parameters of the most recent request apply to all pending requests for the port.
+//
+// Keep multiple requests pending via overlapped I/O to never leave the port without a waiting request.
+// They are completed in the order they have been sent.
+// The output buffer has the same format and minimum length as for PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES.
+typedef struct _PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    ULONG MinBatchLength;
+    ULONG MaxDelay;
+}
+PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST, *PPORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES      CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 5, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+
+// Map the port log of a given port into the calling process to consume log entries without any copying (available since version 3.0).
+// Monitoring must have been started for the port before. From then on, the driver adds log entries to the shared port log
+// instead of its private one, and all pop and wait requests for the port fail with STATUS_INVALID_DEVICE_STATE.
+// The mapping begins with a PORTLOG_SHARED_HEADER. Consume the records following it as described in portlog.h.
+// Each record carries a PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE as its payload.
+//
+// The driver sets the given auto-reset event whenever it adds records while the consumer is waiting.
+// When monitoring is stopped or the driver is detached from the port, PORTLOG_SHARED_FLAG_DETACHED is set and the event is signaled.
+// The mapping stays valid until the handle to the control device is closed.
+typedef struct _PORTSNIFFER_MAP_PORTLOG_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+
+    // Event handle, always passed as a 64-bit value to keep the layout independent of the architecture.
+    ULONGLONG Event;
+}
+PORTSNIFFER_MAP_PORTLOG_REQUEST, *PPORTSNIFFER_MAP_PORTLOG_REQUEST;
+
+typedef struct _PORTSNIFFER_MAP_PORTLOG_RESPONSE
+{
+    // Address and length in bytes of the mapping in the calling process.
+    ULONGLONG Address;
+    ULONG Length;
+}
+PORTSNIFFER_MAP_PORTLOG_RESPONSE, *PPORTSNIFFER_MAP_PORTLOG_RESPONSE;
+
+#define PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG               CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 6, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+
+// Query the cumulative counters of the port log of a given port (available since version 3.0).
+// The counters are reset when monitoring is started and keep their values after it has been stopped.
+typedef struct _PORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+}
+PORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST, *PPORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST;
+
+typedef struct _PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE
+{
+    // Sequence number of the next log entry, which equals the number of entries that have been added or dropped.
+    ULONG NextSequenceNumber;
+
+    // Number of entries dropped because the port log was full and the total length in bytes of their data.
+    // This counts the OriginalLength of truncated entries.
+    ULONG DroppedEntries;
+    ULONGLONG DroppedBytes;
+
+    // Number of monitored read, write and IOCTL requests completed since monitoring was started and the bytes transferred
+    // by the read and write requests (available since version 3.0).
+    // These are exact, as they include the requests skipped by sampling.
+    ULONGLONG ReadRequests;
+    ULONGLONG ReadBytes;
+    ULONGLONG WriteRequests;
+    ULONGLONG WriteBytes;
+    ULONGLONG IoctlRequests;
+}
+PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE, *PPORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE;
+
+#define PORTSNIFFER_IOCTL_CONTROL_GET_PORTLOG_COUNTERS      CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 7, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+
+// Configure the port log of a given port (available since version 3.0).
+// The port log starts small and grows on demand while entries are not consumed fast enough, up to Capacity bytes and
+// as long as the memory budget of the driver for all port logs permits. Ports growing beyond their fair share of that budget
+// give the memory back once their entries have been consumed.
+// A port log mapped via PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG can't grow and is therefore allocated with the full capacity.
+//
+// Capacity is rounded up to a power of two and limited to the supported range.
+// Pass zero to use the default capacity from the PortLogCapacity value of the driver's Parameters registry key.
+//
+// CoalesceGap enables coalescing of read and write entries (available since version 3.0).
+// Data of the same type arriving within this gap after the previous data is appended to the same entry instead of adding a new one.
+// The gap is given in tenths of character times at the baud rate and line control last set on the port (e.g. 15 for 1.5 characters).
+// Until these are set, 9600 baud with 8 data bits, no parity and 1 stop bit are assumed. Pass zero to disable coalescing.
+//
+// SnapLength limits the data of every read and write entry to its first SnapLength bytes (available since version 3.0).
+// This also applies to coalesced entries as a whole. Pass zero to capture all data.
+//
+// SamplingMode and SamplingRate only capture a sample of the read, write and IOCTL requests (available since version 3.0).
+// Entries of sampled requests carry SamplingRate as their SamplingWeight, while the request counters of
+// PORTSNIFFER_IOCTL_CONTROL_GET_PORTLOG_COUNTERS still count every request. Line status entries are never sampled.
+//
+// RepeatDepth suppresses read, write and IOCTL entries repeating one of the last RepeatDepth entries of their type
+// (available since version 3.0). This is meant for ports that poll the same request and get the same response all the time.
+// Suppressed entries are counted and reported through a PORTSNIFFER_PORTLOG_REPEAT entry once an entry differs, when
+// another entry is added, and at least every PORTSNIFFER_CLOCK_INTERVAL seconds. Entries are compared by a 64-bit hash
+// of their type, flags, lengths and data before any coalescing. Pass zero to add every entry.
+// Nothing is suppressed while a trigger is armed, so that every entry is checked against it.
+//
+// The settings apply immediately and persist until the driver is detached from the port.
+typedef struct _PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    ULONG Capacity;
+    USHORT OverflowPolicy;
+    USHORT CoalesceGap;
+    USHORT SnapLength;
+    USHORT SamplingMode;
+    USHORT SamplingRate;
+    USHORT RepeatDepth;
+}
+PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST, *PPORTSNIFFER_CONFIGURE_PORTLOG_REQUEST;
+
+#define PORTSNIFFER_MAX_REPEAT_DEPTH            8
+
+// Drop new entries while the port log is full (the default).
+#define PORTSNIFFER_OVERFLOW_DROP_NEWEST        0x0000
+
+// Remove the oldest entries to make room for new ones.
+// Mapped port logs can't do that, because their entries belong to the application. They always drop new entries.
+#define PORTSNIFFER_OVERFLOW_OVERWRITE_OLDEST   0x0001
+
+// Capture every request (the default).
+#define PORTSNIFFER_SAMPLING_NONE               0x0000
+
+// Capture every SamplingRate-th request of each type.
+#define PORTSNIFFER_SAMPLING_REQUESTS           0x0001
+
+// Capture the requests of one second out of every SamplingRate seconds.
+#define PORTSNIFFER_SAMPLING_SECONDS            0x0002
+
+#define PORTSNIFFER_IOCTL_CONTROL_CONFIGURE_PORTLOG         CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 8, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+
+// Bind the handle to the control device to a given port (available since version 3.0).
+// Afterwards, all requests on this handle that take a PortName may pass an empty one to address this port.
+// They skip the name lookup and don't contend with requests for other ports then.
+// A handle can only be bound once and stays bound until it is closed.
+// When the driver is detached from the port, requests for it fail with ERROR_FILE_NOT_FOUND just like for an unknown port name.
+typedef struct _PORTSNIFFER_OPEN_PORT_SESSION_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+}
+PORTSNIFFER_OPEN_PORT_SESSION_REQUEST, *PPORTSNIFFER_OPEN_PORT_SESSION_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_OPEN_PORT_SESSION         CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 9, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+
+// Select the IOCTLs logged for a given port under PORTSNIFFER_MONITOR_IOCTL (available since version 3.0).
+// The filter has a bit for every function code of an I/O control code, no matter its device type, method and access.
+// Use PORTSNIFFER_IOCTL_FILTER_SET to select an IOCTL. Set all bits to log every IOCTL again, which is the default.
+// The filter applies immediately and persists until the driver is detached from the port.
+#define PORTSNIFFER_IOCTL_FILTER_FUNCTIONS                  4096
+#define PORTSNIFFER_IOCTL_FUNCTION(IoControlCode)           (((IoControlCode) >> 2) & (PORTSNIFFER_IOCTL_FILTER_FUNCTIONS - 1))
+#define PORTSNIFFER_IOCTL_FILTER_SET(Functions, IoControlCode) \
+    ((Functions)[PORTSNIFFER_IOCTL_FUNCTION(IoControlCode) / 32] |= 1UL << (PORTSNIFFER_IOCTL_FUNCTION(IoControlCode) % 32))
+#define PORTSNIFFER_IOCTL_FILTER_TEST(Functions, IoControlCode) \
+    (((Functions)[PORTSNIFFER_IOCTL_FUNCTION(IoControlCode) / 32] & (1UL << (PORTSNIFFER_IOCTL_FUNCTION(IoControlCode) % 32))) != 0)
+
+typedef struct _PORTSNIFFER_SET_IOCTL_FILTER_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    ULONG Functions[PORTSNIFFER_IOCTL_FILTER_FUNCTIONS / 32];
+}
+PORTSNIFFER_SET_IOCTL_FILTER_REQUEST, *PPORTSNIFFER_SET_IOCTL_FILTER_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_SET_IOCTL_FILTER          CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 10, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+
+// Get the compact index of every port the PortSniffer Driver is currently attached to (available since version 3.0).
+// The driver assigns an index when it attaches to a port and keeps it until it is detached.
+// Indexes of detached ports are only handed out again after all other indexes have been used, so fetch this table again
+// whenever an entry of PORTSNIFFER_IOCTL_CONTROL_POP_MERGED_PORTLOG_ENTRIES carries an unknown index.
+// Ports beyond PORTSNIFFER_PORT_INDEX_COUNT get PORTSNIFFER_PORT_INDEX_NONE and can only be popped by name.
+#define PORTSNIFFER_PORT_INDEX_COUNT        256
+#define PORTSNIFFER_PORT_INDEX_NONE         0xFFFF
+
+typedef struct _PORTSNIFFER_PORT_INDEX_ENTRY
+{
+    USHORT PortIndex;
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+}
+PORTSNIFFER_PORT_INDEX_ENTRY, *PPORTSNIFFER_PORT_INDEX_ENTRY;
+
+typedef struct _PORTSNIFFER_GET_PORT_INDEXES_RESPONSE
+{
+    // Size in bytes of the entire response.
+    // Call this IOCTL with a buffer for only the Length field to get the required size.
+    ULONG Length;
+
+    // One entry per attached port, ordered by PortIndex.
+    PORTSNIFFER_PORT_INDEX_ENTRY Ports[ANYSIZE_ARRAY];
+}
+PORTSNIFFER_GET_PORT_INDEXES_RESPONSE, *PPORTSNIFFER_GET_PORT_INDEXES_RESPONSE;
+
+#define PORTSNIFFER_IOCTL_CONTROL_GET_PORT_INDEXES          CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 11, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+
+// Pop monitoring log entries of several ports at once, as many as fit into the output buffer (available since version 3.0).
+// PortMask selects the ports by their index from PORTSNIFFER_IOCTL_CONTROL_GET_PORT_INDEXES. Use
+// PORTSNIFFER_PORT_MASK_SET to select a port, or set all bits to pop the entries of every monitored port.
+// Entries of a port with a pending trigger only become available once its capture is complete, just like when popping
+// them by name.
+//
+// The output buffer receives a PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE. Its Records are PORTLOG_RECORD structures
+// packed back-to-back (see portlog.h), each followed by a PORTSNIFFER_MERGED_PORTLOG_ENTRY as its payload.
+// Walk them using PortLogGetPackedRecord, the first one starting at FIELD_OFFSET(PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE, Records).
+// The entries are ordered by their Timestamp across all ports, while the entries of each port keep their order.
+// The request completes with STATUS_NO_MORE_ENTRIES if there are no entries, but ExcludedPortMask is filled in anyway.
+// The output buffer must be at least PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_MIN_LENGTH bytes large to hold the largest possible entry.
+#define PORTSNIFFER_PORT_MASK_SET(PortMask, PortIndex)      ((PortMask)[(PortIndex) / 32] |= 1UL << ((PortIndex) % 32))
+#define PORTSNIFFER_PORT_MASK_TEST(PortMask, PortIndex)     (((PortMask)[(PortIndex) / 32] & (1UL << ((PortIndex) % 32))) != 0)
+
+typedef struct _PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_REQUEST
+{
+    ULONG PortMask[PORTSNIFFER_PORT_INDEX_COUNT / 32];
+}
+PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_REQUEST, *PPORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_REQUEST;
+
+typedef struct _PORTSNIFFER_MERGED_PORTLOG_ENTRY
+{
+    // Index of the port the entry belongs to. Reserved keeps Entry 8-byte aligned.
+    USHORT PortIndex;
+    USHORT Reserved[3];
+    PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE Entry;
+}
+PORTSNIFFER_MERGED_PORTLOG_ENTRY, *PPORTSNIFFER_MERGED_PORTLOG_ENTRY;
+
+typedef struct _PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE
+{
+    // Selected ports whose entries can't be popped here, because their port log is mapped via
+    // PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG or they have subscribers (see PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT).
+    // Use PORTSNIFFER_PORT_MASK_TEST to check a port. Popping their entries by name fails with STATUS_INVALID_DEVICE_STATE.
+    ULONG ExcludedPortMask[PORTSNIFFER_PORT_INDEX_COUNT / 32];
+
+    // Packed records of the popped entries, see above.
+    UCHAR Records[ANYSIZE_ARRAY];
+}
+PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE, *PPORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE;
+
+#define PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_MIN_LENGTH   (FIELD_OFFSET(PORTSNIFFER_POP_MERGED_PORTLOG_ENTRIES_RESPONSE, Records) + \
+    PORTLOG_RECORD_SIZE(FIELD_OFFSET(PORTSNIFFER_MERGED_PORTLOG_ENTRY, Entry) + PORTSNIFFER_PORTLOG_ENTRY_LENGTH))
+
+#define PORTSNIFFER_IOCTL_CONTROL_POP_MERGED_PORTLOG_ENTRIES    CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 12, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
+
+
+// Get the traffic statistics of all ports the PortSniffer Driver is currently attached to (available since version 3.0).
+// Requests of a type are counted while the port is monitored for that type, PORTSNIFFER_MONITOR_STATS counts all types.
+// The counters are reset whenever monitoring is started.
+// Rates are only calculated under PORTSNIFFER_MONITOR_STATS, from snapshots the driver takes of the counters every second.
+#define PORTSNIFFER_STATS_READ              0
+#define PORTSNIFFER_STATS_WRITE             1
+#define PORTSNIFFER_STATS_IOCTL             2
+#define PORTSNIFFER_STATS_TYPES             3
+
+#define PORTSNIFFER_STATS_SIZE_BUCKETS      16
+
+#define PORTSNIFFER_STATS_WINDOW_1S         0
+#define PORTSNIFFER_STATS_WINDOW_10S        1
+#define PORTSNIFFER_STATS_WINDOW_60S        2
+#define PORTSNIFFER_STATS_WINDOWS           3
+
+typedef struct _PORTSNIFFER_REQUEST_STATISTICS
+{
+    // Completed requests, the bytes transferred by read and write requests and the requests that have failed.
+    ULONGLONG Requests;
+    ULONGLONG Bytes;
+    ULONGLONG FailedRequests;
+
+    // Completed requests by the number of bytes they have transferred (the returned output length for IOCTLs).
+    // Bucket 0 counts empty transfers, bucket n transfers of 2^(n-1) to 2^n - 1 bytes and the last bucket all larger ones.
+    ULONGLONG SizeHistogram[PORTSNIFFER_STATS_SIZE_BUCKETS];
+
+    // Average requests and bytes per second over the last second, 10 seconds and 60 seconds (PORTSNIFFER_STATS_WINDOW_*).
+    ULONG RequestRates[PORTSNIFFER_STATS_WINDOWS];
+    ULONG ByteRates[PORTSNIFFER_STATS_WINDOWS];
+}
+PORTSNIFFER_REQUEST_STATISTICS, *PPORTSNIFFER_REQUEST_STATISTICS;
+
+typedef struct _PORTSNIFFER_PORT_STATISTICS
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+
+    // Index of the port as returned by PORTSNIFFER_IOCTL_CONTROL_GET_PORT_INDEXES and its current monitor mask.
+    USHORT PortIndex;
+    USHORT MonitorMask;
+
+    // Seconds of statistics collected under PORTSNIFFER_MONITOR_STATS.
+    // The rates cover only this many seconds as long as it is shorter than their window.
+    ULONG Seconds;
+
+    // Statistics indexed by PORTSNIFFER_STATS_READ, PORTSNIFFER_STATS_WRITE and PORTSNIFFER_STATS_IOCTL.
+    PORTSNIFFER_REQUEST_STATISTICS Requests[PORTSNIFFER_STATS_TYPES];
+}
+PORTSNIFFER_PORT_STATISTICS, *PPORTSNIFFER_PORT_STATISTICS;
+
+typedef struct _PORTSNIFFER_GET_PORT_STATISTICS_RESPONSE
+{
+    // Size in bytes of the entire response.
+    // Call this IOCTL with a buffer for only the Length field to get the required size.
+    ULONG Length;
+
+    // One entry per attached port.
+    PORTSNIFFER_PORT_STATISTICS Ports[ANYSIZE_ARRAY];
+}
+PORTSNIFFER_GET_PORT_STATISTICS_RESPONSE, *PPORTSNIFFER_GET_PORT_STATISTICS_RESPONSE;
+
+#define PORTSNIFFER_IOCTL_CONTROL_GET_PORT_STATISTICS       CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 13, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+
+// Set the capture filter program of a given port (available since version 3.0), see capturefilter.h.
+// The program runs for every read, write, IOCTL, lifecycle and line status entry before it is captured, and discarded
+// entries are neither logged nor counted as dropped. Request counters and statistics still include their requests.
+// The program sees the Type of the entry and its Data with the full length, as described by the data formats below.
+// Set an InstructionCount of zero to capture every entry again, which is the default.
+// Programs failing CaptureFilterVerify are rejected with ERROR_INVALID_PARAMETER.
+// The filter applies immediately and persists until the driver is detached from the port.
+typedef struct _PORTSNIFFER_SET_CAPTURE_FILTER_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    ULONG InstructionCount;
+    CAPTURE_FILTER_INSTRUCTION Instructions[CAPTURE_FILTER_MAX_INSTRUCTIONS];
+}
+PORTSNIFFER_SET_CAPTURE_FILTER_REQUEST, *PPORTSNIFFER_SET_CAPTURE_FILTER_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_SET_CAPTURE_FILTER        CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 14, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+
+// Subscribe the handle to the log entries of a given port (available since version 3.0).
+// This binds the handle to the port like PORTSNIFFER_IOCTL_CONTROL_OPEN_PORT_SESSION and gives it a read position of
+// its own in the port log, starting with the next entry. Several handles may subscribe to the same port, and each of
+// them reads every entry through PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRY, PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES
+// or PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES on this handle. Entries are only removed once all subscribers
+// have read them. If the port log is full and can't grow, the subscribers lagging behind the others lose their oldest
+// unread entries first, which they see as a PORTSNIFFER_PORTLOG_GAP entry. The OverflowPolicy only applies when all
+// subscribers are equally behind.
+//
+// Monitoring is started for the types of MonitorMask if it isn't running yet, otherwise they are added to the monitored
+// ones. It stops when the last subscriber closes its handle.
+// While a port has subscribers, PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING fails with STATUS_DEVICE_BUSY, and
+// PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG as well as popping or waiting without a subscription fail with
+// STATUS_INVALID_DEVICE_STATE. PORTSNIFFER_IOCTL_CONTROL_POP_MERGED_PORTLOG_ENTRIES reports such a port in ExcludedPortMask.
+// Subscribing fails with STATUS_DEVICE_BUSY if the handle is already subscribed or bound to another port, and with
+// STATUS_INVALID_DEVICE_STATE if the port log is mapped.
+typedef struct _PORTSNIFFER_SUBSCRIBE_PORT_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    USHORT MonitorMask;
+}
+PORTSNIFFER_SUBSCRIBE_PORT_REQUEST, *PPORTSNIFFER_SUBSCRIBE_PORT_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT            CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 15, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+
+// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_PORTLOG_GAP.
+typedef struct _PORTSNIFFER_GAP_DATA
+{
+    // Number of consecutive entries dropped and the total length in bytes of their data (their OriginalLength).
+    ULONGLONG DroppedBytes;
+    ULONG DroppedEntries;
+}
+PORTSNIFFER_GAP_DATA, *PPORTSNIFFER_GAP_DATA;
+
+
+// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_PORTLOG_CLOCK.
+typedef struct _PORTSNIFFER_CLOCK_DATA
+{
+    // Ticks per second of the performance counter.
+    LARGE_INTEGER PerformanceFrequency;
+
+    // The same moment as a performance counter value and as UTC system time in 100-nanosecond units since January 1, 1601.
+    // The driver reads the performance counter right after the system time has advanced, so that both agree within
+    // the precision of the performance counter.
+    LARGE_INTEGER PerformanceCounter;
+    LARGE_INTEGER SystemTime;
+}
+PORTSNIFFER_CLOCK_DATA, *PPORTSNIFFER_CLOCK_DATA;
+
+
+// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_PORTLOG_LIFECYCLE.
+typedef struct _PORTSNIFFER_LIFECYCLE_DATA
+{
+    // Performance counter value when the request was passed down to the port driver.
+    // The difference to the Timestamp of the entry is the time the port driver took to complete the request.
+    LARGE_INTEGER DispatchTimestamp;
+
+    // Final NTSTATUS of the request (e.g. STATUS_TIMEOUT or STATUS_CANCELLED).
+    LONG Status;
+
+    // I/O control code if RequestType is PORTSNIFFER_MONITOR_IOCTL, zero otherwise.
+    ULONG IoControlCode;
+
+    // Length of the read or write buffer or of the IOCTL output buffer, and the number of bytes actually transferred.
+    ULONG RequestedLength;
+    ULONG TransferredLength;
+
+    // PORTSNIFFER_MONITOR_READ, PORTSNIFFER_MONITOR_WRITE or PORTSNIFFER_MONITOR_IOCTL.
+    USHORT RequestType;
+}
+PORTSNIFFER_LIFECYCLE_DATA, *PPORTSNIFFER_LIFECYCLE_DATA;
+
+
+// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_PORTLOG_LINE_STATUS.
+// Every entry is caused by the completion of a single status IOCTL, which Changes tells through one of the flags below.
+// ModemStatus and HoldReasons always hold the last reported values, all other fields are only set by the IOCTL causing the entry.
+typedef struct _PORTSNIFFER_LINE_STATUS_DATA
+{
+    ULONG Changes;
+
+    // Modem status register (SERIAL_MSR_*) from IOCTL_SERIAL_GET_MODEMSTATUS.
+    // An entry is added when a line has changed, including lines that have changed back since the previous query.
+    ULONG ModemStatus;
+
+    // Hold reasons (SERIAL_TX_WAITING_*, SERIAL_RX_WAITING_*) and line errors (SERIAL_ERROR_*) from IOCTL_SERIAL_GET_COMMSTATUS.
+    // An entry is added when the hold reasons have changed or the port driver reports errors, which it collects between two queries.
+    ULONG HoldReasons;
+    ULONG Errors;
+
+    // Line events (SERIAL_EV_CTS, SERIAL_EV_DSR, SERIAL_EV_RLSD, SERIAL_EV_BREAK, SERIAL_EV_ERR, SERIAL_EV_RING) from
+    // IOCTL_SERIAL_WAIT_ON_MASK. Data events are visible through read and write entries and never cause an entry.
+    ULONG Events;
+
+    // Increase of the error counters of IOCTL_SERIAL_GET_STATS since the previous query.
+    // The first query after monitoring has been started only provides the baseline and doesn't add an entry.
+    ULONG FrameErrors;
+    ULONG SerialOverrunErrors;
+    ULONG BufferOverrunErrors;
+    ULONG ParityErrors;
+}
+PORTSNIFFER_LINE_STATUS_DATA, *PPORTSNIFFER_LINE_STATUS_DATA;
+
+#define PORTSNIFFER_LINE_STATUS_MODEM       0x0001
+#define PORTSNIFFER_LINE_STATUS_COMM        0x0002
+#define PORTSNIFFER_LINE_STATUS_EVENTS      0x0004
+#define PORTSNIFFER_LINE_STATUS_STATS       0x0008
+
+
+// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_PORTLOG_REPEAT (available since version 3.0).
+// It reports RepeatedEntries suppressed entries of RepeatedType, which have all repeated the entry with
+// RepeatedSequenceNumber. With a RepeatDepth above 1, there is one such entry for each repeated entry.
+typedef struct _PORTSNIFFER_REPEAT_DATA
+{
+    // Timestamp of the last suppressed entry.
+    LARGE_INTEGER LastTimestamp;
+
+    // Total OriginalLength of the suppressed entries.
+    ULONGLONG RepeatedBytes;
+
+    ULONG RepeatedEntries;
+
+    // Sequence number of the repeated entry. If it has been coalesced, this is the one of the coalesced entry.
+    ULONG RepeatedSequenceNumber;
+
+    USHORT RepeatedType;
+}
+PORTSNIFFER_REPEAT_DATA, *PPORTSNIFFER_REPEAT_DATA;
+
+// Data format when Type of PORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE is PORTSNIFFER_MONITOR_IOCTL (changed in version 3.0).
 typedef struct _PORTSNIFFER_IOCTL_DATA
 {
     ULONG IoControlCode;
-    union
-    {
-        SERIAL_BAUD_RATE SerialBaudRate;
-        SERIAL_HANDFLOW SerialHandflow;
-        SERIAL_LINE_CONTROL SerialLineControl;
-        SERIAL_QUEUE_SIZE SerialQueueSize;
-        SERIAL_TIMEOUTS SerialTimeouts;
-    }
-    u;
+
+    // Final NTSTATUS of the request.
+    LONG Status;
+
+    // Data is the input buffer as passed by the application, followed by the output buffer as returned by the port driver.
+    // Both are truncated so that the entry fits into PORTSNIFFER_PORTLOG_ENTRY_LENGTH, with the input buffer taking precedence.
+    // Buffers of METHOD_NEITHER requests can't be captured and are always empty.
+    USHORT InputLength;
+    USHORT OutputLength;
+    BYTE Data[ANYSIZE_ARRAY];
 }
 PORTSNIFFER_IOCTL_DATA, *PPORTSNIFFER_IOCTL_DATA;
+
+
+// Header of a capture file written by unattended capture (available since version 3.0).
+// A port is captured from the moment it is added if the driver's Parameters registry key has a subkey "Ports\PORTNAME"
+// with a MonitorMask value (REG_DWORD) and optionally a PortLogCapacity value. The driver then subscribes to the port
+// like PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT and appends all log entries to files named "PORTNAME-N.pslog" in the
+// directory of the CaptureDirectory value (an NT path, "\SystemRoot\PortSniffer" by default). Once a file would exceed
+// CaptureFileSize bytes (16 MiB by default), the driver continues with the next N, up to CaptureFileCount files
+// (4 by default) before overwriting the oldest one. The next N is remembered across reboots in a NextCaptureFile value.
+// Like any subscriber, the capture keeps the port from being reset or mapped, but other handles may subscribe to it as well.
+//
+// The header is followed by the log entries, packed like in the response of PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES.
+// Walk them using PortLogGetPackedRecord, the first one starting at HeaderLength. A file cut short by a crash simply ends
+// with the last complete entry.
+#define PORTSNIFFER_CAPTURE_FILE_SIGNATURE  0x50435350
+
+typedef struct _PORTSNIFFER_CAPTURE_FILE_HEADER
+{
+    ULONG Signature;
+    ULONG HeaderLength;
+
+    // Version of the driver that has written the file.
+    USHORT MajorVersion;
+    USHORT MinorVersion;
+
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+
+    // Correlation of the performance counter with the system time when the file was started,
+    // so that timestamps can be converted before the first PORTSNIFFER_PORTLOG_CLOCK entry of the file.
+    PORTSNIFFER_CLOCK_DATA Clock;
+}
+PORTSNIFFER_CAPTURE_FILE_HEADER, *PPORTSNIFFER_CAPTURE_FILE_HEADER;
+
+
+// Arm a trigger on a given port for capturing the traffic around an intermittent event (available since version 3.0).
+// This starts monitoring for the types of MonitorMask with an empty port log like PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING.
+// Until the trigger fires, the port log only keeps the newest PreTriggerLength bytes of log entries and overwrites the
+// older ones, which are reported through a PORTSNIFFER_PORTLOG_GAP entry. The first entry matching the trigger program
+// (see capturefilter.h) fires the trigger. The program sees the entries as they are added to the port log, so their
+// Data may already be truncated to the SnapLength of the port. Once PostTriggerLength bytes of entries have been added
+// after that one, monitoring stops except for PORTSNIFFER_MONITOR_STATS, and the port log holds the capture.
+// PreTriggerLength and PostTriggerLength must not exceed the capacity of the port log together. Pass zero for either
+// of them to take half of that capacity. Programs failing CaptureFilterVerify are rejected with ERROR_INVALID_PARAMETER.
+//
+// Until the capture is held, nothing is handed out of the port log: Popping returns no entries and waiting requests stay
+// pending, so an application waiting for the trigger costs no CPU time. Afterwards, the held entries are popped as usual.
+// Arming fails with STATUS_DEVICE_BUSY while the port has subscribers and with STATUS_INVALID_DEVICE_STATE while its
+// port log is mapped. As long as a trigger is armed or its capture is held, subscribing to the port and mapping its port
+// log fail with STATUS_INVALID_DEVICE_STATE. PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING disarms the trigger.
+typedef struct _PORTSNIFFER_ARM_PORT_TRIGGER_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    USHORT MonitorMask;
+    ULONG PreTriggerLength;
+    ULONG PostTriggerLength;
+    ULONG InstructionCount;
+    CAPTURE_FILTER_INSTRUCTION Instructions[CAPTURE_FILTER_MAX_INSTRUCTIONS];
+}
+PORTSNIFFER_ARM_PORT_TRIGGER_REQUEST, *PPORTSNIFFER_ARM_PORT_TRIGGER_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_ARM_PORT_TRIGGER          CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 16, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+
+// Query the state of the trigger of a given port (available since version 3.0), see PORTSNIFFER_IOCTL_CONTROL_ARM_PORT_TRIGGER.
+typedef struct _PORTSNIFFER_GET_PORT_TRIGGER_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+}
+PORTSNIFFER_GET_PORT_TRIGGER_REQUEST, *PPORTSNIFFER_GET_PORT_TRIGGER_REQUEST;
+
+typedef struct _PORTSNIFFER_GET_PORT_TRIGGER_RESPONSE
+{
+    // One of the PORTSNIFFER_TRIGGER_* values below.
+    USHORT State;
+
+    // Lengths the trigger has been armed with, after replacing zeros by their defaults.
+    ULONG PreTriggerLength;
+    ULONG PostTriggerLength;
+
+    // Timestamp of the entry that has fired the trigger and the clock correlation taken at that moment,
+    // so that all held entries can be converted even if their clock entries have been overwritten.
+    // Only valid from PORTSNIFFER_TRIGGER_FIRED on.
+    LARGE_INTEGER Timestamp;
+    PORTSNIFFER_CLOCK_DATA Clock;
+}
+PORTSNIFFER_GET_PORT_TRIGGER_RESPONSE, *PPORTSNIFFER_GET_PORT_TRIGGER_RESPONSE;
+
+// No trigger has been armed since monitoring was last started or stopped.
+#define PORTSNIFFER_TRIGGER_NONE            0x0000
+
+// Waiting for an entry matching the trigger program.
+#define PORTSNIFFER_TRIGGER_ARMED           0x0001
+
+// The trigger has fired and the entries after it are being captured.
+#define PORTSNIFFER_TRIGGER_FIRED           0x0002
+
+// The capture is complete and the port log holds it until it has been popped.
+#define PORTSNIFFER_TRIGGER_HELD            0x0003
+
+#define PORTSNIFFER_IOCTL_CONTROL_GET_PORT_TRIGGER          CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 17, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+
+// Change the monitor mask of a given port without discarding any buffered log entries (available since version 3.0).
+// Unlike PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING, entries and counters are kept, so a restarted application or
+// a changed MonitorMask continues exactly where the port log is. If the port has no port log yet, an empty one is allocated.
+// PORTSNIFFER_MONITOR_NONE only stops capturing and keeps the port log along with its entries for popping them later.
+// Use PORTSNIFFER_IOCTL_CONTROL_CLEAR_PORTLOG to discard entries explicitly.
+//
+// A nonzero LingerTime binds monitoring of the port to the calling handle: When it is closed, even because the
+// application has crashed, the port keeps being monitored for LingerTime more seconds before capturing stops and only
+// PORTSNIFFER_MONITOR_STATS remains. Another PORTSNIFFER_IOCTL_CONTROL_SET_PORT_MONITOR_MASK or
+// PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING request for the port within that time cancels this, so an application
+// restarted in time resumes without any gap.
+// Check the SequenceNumber of the first popped entry against the one expected next to verify that.
+// Fails with STATUS_DEVICE_BUSY while the port has subscribers and with STATUS_INVALID_DEVICE_STATE while a trigger
+// is armed or its capture is held.
+typedef struct _PORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    USHORT MonitorMask;
+    ULONG LingerTime;
+}
+PORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST, *PPORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST;
+
+// Upper limit of LingerTime, one day.
+#define PORTSNIFFER_MAX_LINGER_TIME         (24 * 60 * 60)
+
+#define PORTSNIFFER_IOCTL_CONTROL_SET_PORT_MONITOR_MASK     CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 18, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+
+// Discard all log entries of a given port and reset its counters and sequence numbers (available since version 3.0).
+// The monitor mask stays as it is. This also disarms a trigger of the port.
+// Fails with STATUS_DEVICE_BUSY while the port has subscribers, whose read positions would be invalidated.
+typedef struct _PORTSNIFFER_CLEAR_PORTLOG_REQUEST
+{
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+}
+PORTSNIFFER_CLEAR_PORTLOG_REQUEST, *PPORTSNIFFER_CLEAR_PORTLOG_REQUEST;
+
+#define PORTSNIFFER_IOCTL_CONTROL_CLEAR_PORTLOG             CTL_CODE(PORTSNIFFER_CONTROL_DEVICE_TYPE, PORTSNIFFER_CONTROL_IOCTL_INDEX + 19, METHOD_BUFFERED, FILE_WRITE_ACCESS)
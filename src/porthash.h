@@ -0,0 +1,146 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#pragma once
+
+// Hash index of ports by name, which the driver uses to look up the port of every control request.
+// A port name is hashed like RtlHashUnicodeString does with HASH_STRING_ALGORITHM_X65599 and without ignoring case.
+// The hash selects one of PORT_HASH_BUCKET_COUNT buckets, each of which is a list of the PORT_HASH_ENTRY structures
+// of all ports with a hash selecting that bucket. Names only differing in a few characters, like "COM1" to "COM256",
+// differ little in the lower bits of an X65599 hash, so the bucket is selected by the upper bits of the hash multiplied
+// with 2^32 divided by the golden ratio (Fibonacci hashing). Names are compared exactly, like RtlEqualUnicodeString does.
+//
+// The index doesn't synchronize anything itself, so the caller has to hold a lock around every function call
+// (the driver uses FilterDevicesLock). Entries don't copy the name, so it must stay valid while they are inserted.
+//
+// This header only depends on basic Windows data types and list functions.
+// It is therefore used by the driver and can also be compiled for user-mode tests on other platforms.
+
+#define PORT_HASH_BUCKET_SHIFT  6
+#define PORT_HASH_BUCKET_COUNT  (1 << PORT_HASH_BUCKET_SHIFT)
+
+typedef struct _PORT_HASH_ENTRY
+{
+    LIST_ENTRY ListEntry;
+    const WCHAR* Name;
+    ULONG NameLength;
+    ULONG NameHash;
+}
+PORT_HASH_ENTRY, *PPORT_HASH_ENTRY;
+
+typedef struct _PORT_HASH_TABLE
+{
+    LIST_ENTRY Buckets[PORT_HASH_BUCKET_COUNT];
+}
+PORT_HASH_TABLE, *PPORT_HASH_TABLE;
+
+static __inline ULONG
+PortHashName(
+    __in_ecount(NameLength) const WCHAR* Name,
+    __in ULONG NameLength
+    )
+{
+    ULONG hash;
+    ULONG i;
+
+    hash = 0;
+    for (i = 0; i < NameLength; i++)
+    {
+        hash = hash * 65599 + Name[i];
+    }
+
+    return hash;
+}
+
+static __inline PLIST_ENTRY
+PortHashGetBucket(
+    __in PPORT_HASH_TABLE Table,
+    __in ULONG Hash
+    )
+{
+    return &Table->Buckets[(ULONG)(Hash * 0x9E3779B9UL) >> (32 - PORT_HASH_BUCKET_SHIFT)];
+}
+
+static __inline void
+PortHashInitialize(
+    __out PPORT_HASH_TABLE Table
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < PORT_HASH_BUCKET_COUNT; i++)
+    {
+        InitializeListHead(&Table->Buckets[i]);
+    }
+}
+
+// Prepares an entry that isn't inserted yet, so that PortHashRemove can be called on it anyway.
+static __inline void
+PortHashInitializeEntry(
+    __out PPORT_HASH_ENTRY Entry
+    )
+{
+    InitializeListHead(&Entry->ListEntry);
+    Entry->Name = NULL;
+    Entry->NameLength = 0;
+    Entry->NameHash = 0;
+}
+
+static __inline PPORT_HASH_ENTRY
+PortHashFind(
+    __in PPORT_HASH_TABLE Table,
+    __in_ecount(NameLength) const WCHAR* Name,
+    __in ULONG NameLength
+    )
+{
+    PLIST_ENTRY bucket;
+    PPORT_HASH_ENTRY entry;
+    ULONG hash;
+    PLIST_ENTRY listEntry;
+
+    hash = PortHashName(Name, NameLength);
+    bucket = PortHashGetBucket(Table, hash);
+
+    for (listEntry = bucket->Flink; listEntry != bucket; listEntry = listEntry->Flink)
+    {
+        entry = CONTAINING_RECORD(listEntry, PORT_HASH_ENTRY, ListEntry);
+
+        if (entry->NameHash == hash &&
+            entry->NameLength == NameLength &&
+            RtlEqualMemory(entry->Name, Name, NameLength * sizeof(WCHAR)))
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static __inline void
+PortHashInsert(
+    __inout PPORT_HASH_TABLE Table,
+    __inout PPORT_HASH_ENTRY Entry,
+    __in_ecount(NameLength) const WCHAR* Name,
+    __in ULONG NameLength
+    )
+{
+    Entry->Name = Name;
+    Entry->NameLength = NameLength;
+    Entry->NameHash = PortHashName(Name, NameLength);
+
+    InsertTailList(PortHashGetBucket(Table, Entry->NameHash), &Entry->ListEntry);
+}
+
+// Removing an entry again is harmless, because it only points to itself then.
+static __inline void
+PortHashRemove(
+    __inout PPORT_HASH_ENTRY Entry
+    )
+{
+    RemoveEntryList(&Entry->ListEntry);
+    InitializeListHead(&Entry->ListEntry);
+}
@@ -0,0 +1,442 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#pragma once
+
+// The port log is a contiguous ring buffer of variable-length records.
+// Each record consists of a PORTLOG_RECORD header followed by its payload, padded to PORTLOG_RECORD_ALIGNMENT bytes.
+// A record never wraps around the end of the buffer. If the remaining space at the end is too small, it is filled
+// with a padding record and the new record is written to the start of the buffer.
+//
+// Positions are free-running ULONG counters, which are only reduced modulo the buffer size when accessing memory.
+// This makes Tail - Head the number of used bytes at all times, even when the counters overflow.
+//
+// The same record format is used to transfer multiple log entries at once from the driver to the tool.
+// In that case, records are packed back-to-back into a buffer, without any padding records.
+//
+// A port log can also be shared between the driver as producer and the tool as consumer by mapping it into the tool's
+// process. In that case, a PORTLOG_SHARED_HEADER precedes the records and publishes the positions of both sides.
+// Each side keeps a private PORTLOG_RING and only writes its own position to the shared header:
+// The producer reserves and commits records as usual and publishes its new Tail afterwards.
+// The consumer peeks and removes records as usual and publishes its new Head afterwards.
+// The driver uses the same protocol for its capture rings, which decouple capturing requests from the port log.
+//
+// This header only depends on basic Windows data types, RtlCopyMemory, RtlZeroMemory and MemoryBarrier.
+// It is therefore shared between driver and tool and can also be compiled for user-mode tests on other platforms.
+
+#define PORTLOG_RECORD_ALIGNMENT        8
+
+#define PORTLOG_RECORD_FLAG_PADDING     0x0001
+
+typedef struct _PORTLOG_RECORD
+{
+    // Size in bytes of the entire record, including this header and any trailing alignment bytes.
+    ULONG Size;
+    USHORT Flags;
+    USHORT PayloadLength;
+}
+PORTLOG_RECORD, *PPORTLOG_RECORD;
+
+#define PORTLOG_RECORD_PAYLOAD(Record)  ((PVOID)((PUCHAR)(Record) + sizeof(PORTLOG_RECORD)))
+#define PORTLOG_RECORD_SIZE(PayloadLength) \
+    ((ULONG)((sizeof(PORTLOG_RECORD) + (PayloadLength) + PORTLOG_RECORD_ALIGNMENT - 1) & ~(PORTLOG_RECORD_ALIGNMENT - 1)))
+
+typedef struct _PORTLOG_RING
+{
+    PUCHAR Buffer;
+
+    // Size of Buffer in bytes. Must be a power of two.
+    ULONG Size;
+
+    // Position of the oldest record.
+    ULONG Head;
+
+    // Position where the next record will be written.
+    ULONG Tail;
+
+    // Number of records between Head and Tail, not counting padding records.
+    ULONG EntryCount;
+
+    // Size of the record reserved by PortLogRingReserve and not committed yet.
+    // A shared record can be modified by the consumer at any time, so the producer never reads its header back.
+    ULONG PendingSize;
+}
+PORTLOG_RING, *PPORTLOG_RING;
+
+// Keep the positions written by producer and consumer on separate cache lines.
+#define PORTLOG_CACHE_LINE_SIZE         64
+
+#define PORTLOG_SHARED_FLAG_DETACHED    0x00000001
+
+typedef struct _PORTLOG_SHARED_HEADER
+{
+    // Size in bytes of the records area following this header. Must be a power of two.
+    ULONG Size;
+
+    // PORTLOG_SHARED_FLAG_* values set by the producer.
+    // PORTLOG_SHARED_FLAG_DETACHED means that the producer won't add any more records.
+    volatile ULONG Flags;
+    UCHAR Reserved1[PORTLOG_CACHE_LINE_SIZE - 2 * sizeof(ULONG)];
+
+    // Only written by the producer.
+    volatile ULONG Tail;
+    UCHAR Reserved2[PORTLOG_CACHE_LINE_SIZE - sizeof(ULONG)];
+
+    // Only written by the consumer.
+    volatile ULONG Head;
+
+    // Set by the consumer before it waits for a wakeup and cleared by the producer when it sends one.
+    volatile ULONG ConsumerWaiting;
+    UCHAR Reserved3[PORTLOG_CACHE_LINE_SIZE - 2 * sizeof(ULONG)];
+}
+PORTLOG_SHARED_HEADER, *PPORTLOG_SHARED_HEADER;
+
+#define PORTLOG_SHARED_RECORDS(Header)  ((PVOID)((PUCHAR)(Header) + sizeof(PORTLOG_SHARED_HEADER)))
+
+
+static __inline void
+PortLogRingInitialize(
+    __out PPORTLOG_RING Ring,
+    __in PVOID Buffer,
+    __in ULONG Size
+    )
+{
+    Ring->Buffer = (PUCHAR)Buffer;
+    Ring->Size = Size;
+    Ring->Head = 0;
+    Ring->Tail = 0;
+    Ring->EntryCount = 0;
+    Ring->PendingSize = 0;
+}
+
+static __inline void
+PortLogRingClear(
+    __inout PPORTLOG_RING Ring
+    )
+{
+    // All records between Head and Tail become free space at once.
+    Ring->Head = Ring->Tail;
+    Ring->EntryCount = 0;
+}
+
+static __inline PPORTLOG_RECORD
+PortLogRingReserve(
+    __inout PPORTLOG_RING Ring,
+    __in ULONG PayloadLength
+    )
+{
+    ULONG contiguousLength;
+    ULONG freeLength;
+    ULONG offset;
+    PPORTLOG_RECORD padding;
+    PPORTLOG_RECORD record;
+    ULONG recordSize;
+
+    recordSize = PORTLOG_RECORD_SIZE(PayloadLength);
+    freeLength = Ring->Size - (Ring->Tail - Ring->Head);
+    offset = Ring->Tail & (Ring->Size - 1);
+    contiguousLength = Ring->Size - offset;
+
+    if (recordSize > contiguousLength)
+    {
+        // The record doesn't fit at the end of the buffer.
+        // Check whether it fits at the start after padding the remaining bytes.
+        if (contiguousLength + recordSize > freeLength)
+        {
+            return NULL;
+        }
+
+        padding = (PPORTLOG_RECORD)&Ring->Buffer[offset];
+        padding->Size = contiguousLength;
+        padding->Flags = PORTLOG_RECORD_FLAG_PADDING;
+        padding->PayloadLength = 0;
+
+        Ring->Tail += contiguousLength;
+        offset = 0;
+    }
+    else if (recordSize > freeLength)
+    {
+        return NULL;
+    }
+
+    // Prepare the record header. The record only becomes part of the log when PortLogRingCommit is called.
+    record = (PPORTLOG_RECORD)&Ring->Buffer[offset];
+    record->Size = recordSize;
+    record->Flags = 0;
+    record->PayloadLength = (USHORT)PayloadLength;
+    Ring->PendingSize = recordSize;
+
+    return record;
+}
+
+static __inline BOOLEAN
+PortLogRingExtend(
+    __inout PPORTLOG_RING Ring,
+    __inout PPORTLOG_RECORD Record,
+    __in ULONG PayloadLength
+    )
+{
+    ULONG offset;
+    ULONG recordSize;
+
+    // Grow a record returned by PortLogRingReserve in place before it is committed, e.g. to append more data to it.
+    // Returns FALSE if the larger record would go beyond the end of the buffer or the free space.
+    recordSize = PORTLOG_RECORD_SIZE(PayloadLength);
+    offset = (ULONG)((PUCHAR)Record - Ring->Buffer);
+
+    if (recordSize > Ring->Size - offset || recordSize > Ring->Size - (Ring->Tail - Ring->Head))
+    {
+        return FALSE;
+    }
+
+    Record->Size = recordSize;
+    Record->PayloadLength = (USHORT)PayloadLength;
+    Ring->PendingSize = recordSize;
+
+    return TRUE;
+}
+
+static __inline void
+PortLogRingCommit(
+    __inout PPORTLOG_RING Ring
+    )
+{
+    // Commit the record reserved last, using its size as known to the producer.
+    Ring->Tail += Ring->PendingSize;
+    Ring->EntryCount++;
+    Ring->PendingSize = 0;
+}
+
+static __inline PPORTLOG_RECORD
+PortLogRingPeek(
+    __inout PPORTLOG_RING Ring
+    )
+{
+    PPORTLOG_RECORD record;
+
+    while (Ring->Head != Ring->Tail)
+    {
+        record = (PPORTLOG_RECORD)&Ring->Buffer[Ring->Head & (Ring->Size - 1)];
+        if (!(record->Flags & PORTLOG_RECORD_FLAG_PADDING))
+        {
+            return record;
+        }
+
+        // Skip over padding records.
+        Ring->Head += record->Size;
+    }
+
+    return NULL;
+}
+
+static __inline void
+PortLogRingRemove(
+    __inout PPORTLOG_RING Ring,
+    __in PPORTLOG_RECORD Record
+    )
+{
+    Ring->Head += Record->Size;
+    Ring->EntryCount--;
+}
+
+static __inline BOOLEAN
+PortLogRingMove(
+    __inout PPORTLOG_RING Destination,
+    __inout PPORTLOG_RING Source
+    )
+{
+    PPORTLOG_RECORD destinationRecord;
+    PPORTLOG_RECORD sourceRecord;
+
+    // Move all records from Source to Destination in their order, e.g. to resize a port log.
+    // Returns FALSE and leaves the remaining records in Source if Destination runs out of space.
+    while ((sourceRecord = PortLogRingPeek(Source)) != NULL)
+    {
+        destinationRecord = PortLogRingReserve(Destination, sourceRecord->PayloadLength);
+        if (!destinationRecord)
+        {
+            return FALSE;
+        }
+
+        RtlCopyMemory(PORTLOG_RECORD_PAYLOAD(destinationRecord), PORTLOG_RECORD_PAYLOAD(sourceRecord), sourceRecord->PayloadLength);
+        PortLogRingCommit(Destination);
+        PortLogRingRemove(Source, sourceRecord);
+    }
+
+    return TRUE;
+}
+
+static __inline ULONG
+PortLogPackRecord(
+    __out PVOID Destination,
+    __in PPORTLOG_RECORD Record
+    )
+{
+    ULONG length;
+
+    // Copy header and payload, but never the contents of the alignment bytes.
+    length = sizeof(PORTLOG_RECORD) + Record->PayloadLength;
+    RtlCopyMemory(Destination, Record, length);
+    RtlZeroMemory((PUCHAR)Destination + length, Record->Size - length);
+
+    return Record->Size;
+}
+
+static __inline PPORTLOG_RECORD
+PortLogGetPackedRecord(
+    __in PVOID Buffer,
+    __in ULONG Length,
+    __in ULONG Offset
+    )
+{
+    PPORTLOG_RECORD record;
+
+    // Return NULL at the end of the buffer or for any record that doesn't pass our sanity checks.
+    if (Offset >= Length || Length - Offset < sizeof(PORTLOG_RECORD))
+    {
+        return NULL;
+    }
+
+    record = (PPORTLOG_RECORD)((PUCHAR)Buffer + Offset);
+    if (record->Size > Length - Offset
+        || record->Size != PORTLOG_RECORD_SIZE(record->PayloadLength)
+        || (record->Flags & PORTLOG_RECORD_FLAG_PADDING))
+    {
+        return NULL;
+    }
+
+    return record;
+}
+
+static __inline ULONG
+PortLogLoadAcquire(
+    __in volatile ULONG* Position
+    )
+{
+    ULONG value;
+
+    // Nothing written by the other side before publishing this position may be read before the position itself.
+    value = *Position;
+    MemoryBarrier();
+
+    return value;
+}
+
+static __inline void
+PortLogStoreRelease(
+    __out volatile ULONG* Position,
+    __in ULONG Value
+    )
+{
+    // Everything written before may not become visible after the new position.
+    MemoryBarrier();
+    *Position = Value;
+}
+
+static __inline void
+PortLogSharedInitialize(
+    __out PPORTLOG_SHARED_HEADER Header,
+    __in ULONG Size,
+    __out PPORTLOG_RING ProducerRing
+    )
+{
+    RtlZeroMemory(Header, sizeof(PORTLOG_SHARED_HEADER));
+    Header->Size = Size;
+
+    PortLogRingInitialize(ProducerRing, PORTLOG_SHARED_RECORDS(Header), Size);
+}
+
+static __inline void
+PortLogSharedProducerSync(
+    __inout PPORTLOG_RING Ring,
+    __in PPORTLOG_SHARED_HEADER Header
+    )
+{
+    ULONG head;
+
+    // Learn about the space freed by the consumer.
+    // The consumer may write anything to the shared header, so only accept an aligned Head
+    // that moves forward within the records we have published. This keeps Tail - Head <= Size.
+    head = PortLogLoadAcquire(&Header->Head);
+    if ((head & (PORTLOG_RECORD_ALIGNMENT - 1)) == 0 && head - Ring->Head <= Ring->Tail - Ring->Head)
+    {
+        Ring->Head = head;
+    }
+}
+
+static __inline BOOLEAN
+PortLogSharedProducerPublish(
+    __in PPORTLOG_RING Ring,
+    __inout PPORTLOG_SHARED_HEADER Header
+    )
+{
+    PortLogStoreRelease(&Header->Tail, Ring->Tail);
+
+    // Tail must be visible before we check whether the consumer is waiting, and the consumer does it the other way round.
+    // This way, either we see ConsumerWaiting or the consumer sees our new Tail.
+    // Returns TRUE if the caller has to wake up the consumer.
+    MemoryBarrier();
+    if (Header->ConsumerWaiting)
+    {
+        Header->ConsumerWaiting = 0;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static __inline void
+PortLogSharedConsumerInitialize(
+    __in PPORTLOG_SHARED_HEADER Header,
+    __out PPORTLOG_RING ConsumerRing
+    )
+{
+    PortLogRingInitialize(ConsumerRing, PORTLOG_SHARED_RECORDS(Header), Header->Size);
+    ConsumerRing->Head = Header->Head;
+    ConsumerRing->Tail = ConsumerRing->Head;
+}
+
+static __inline void
+PortLogSharedConsumerSync(
+    __inout PPORTLOG_RING Ring,
+    __in PPORTLOG_SHARED_HEADER Header
+    )
+{
+    // Learn about the records committed by the producer.
+    Ring->Tail = PortLogLoadAcquire(&Header->Tail);
+}
+
+static __inline void
+PortLogSharedConsumerPublish(
+    __in PPORTLOG_RING Ring,
+    __inout PPORTLOG_SHARED_HEADER Header
+    )
+{
+    // Hand the space of all removed records back to the producer.
+    PortLogStoreRelease(&Header->Head, Ring->Head);
+}
+
+static __inline BOOLEAN
+PortLogSharedConsumerPrepareWait(
+    __inout PPORTLOG_RING Ring,
+    __inout PPORTLOG_SHARED_HEADER Header
+    )
+{
+    // Announce that we are going to wait and check for new records once more afterwards (see PortLogSharedProducerPublish).
+    // Returns TRUE if the caller may wait for a wakeup or FALSE if there are new records to consume.
+    Header->ConsumerWaiting = 1;
+    MemoryBarrier();
+
+    PortLogSharedConsumerSync(Ring, Header);
+    if (Ring->Head != Ring->Tail || (Header->Flags & PORTLOG_SHARED_FLAG_DETACHED))
+    {
+        Header->ConsumerWaiting = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -26,11 +26,65 @@ _PrintUsage()
     printf("    /version                Get the version of the running driver.\n");
     printf("\n");
     printf("Monitoring:\n");
-    printf("    /monitor PORT TYPES     Monitor the given port.\n");
+    printf("    /monitor PORT TYPES [SIZE [GAP]] [/ioctls IOCTLS] [/snaplen SNAPLEN]\n");
+    printf("             [/sample N | /sampleseconds M] [/filter EXPR] [/subscribe]\n");
+    printf("             [/trigger EXPR [/pre KIB] [/post KIB]] [/linger SECONDS]\n");
+    printf("             [/resume SEQ] [/repeats N] [/us | /ns]\n");
+    printf("                            Monitor the given port.\n");
     printf("                            TYPES may be one or more of:\n");
     printf("                               R - Read requests\n");
     printf("                               W - Write requests\n");
-    printf("                               C - IOCTL_SERIAL_* requests\n");
+    printf("                               C - IOCTL requests\n");
+    printf("                               S - Changes of modem lines, hold reasons, line\n");
+    printf("                                   errors and error counters reported to the\n");
+    printf("                                   application\n");
+    printf("                               L - Completion status, length and service time\n");
+    printf("                                   of every request of the other TYPES\n");
+    printf("                            SIZE is the size of the port log in KiB\n");
+    printf("                            (default or 0: PortLogCapacity registry value or 2048).\n");
+    printf("                            GAP coalesces consecutive reads or writes arriving\n");
+    printf("                            within GAP character times into a single entry\n");
+    printf("                            (default: 0, no coalescing).\n");
+    printf("                            IOCTLS limits C to a comma-separated list of IOCTL\n");
+    printf("                            names (e.g. IOCTL_SERIAL_SET_BAUD_RATE) or codes.\n");
+    printf("                            SNAPLEN only captures the first SNAPLEN bytes of\n");
+    printf("                            every read or write entry (default: 0, everything).\n");
+    printf("                            /sample only captures every N-th request of each\n");
+    printf("                            type, /sampleseconds the requests of one second out\n");
+    printf("                            of every M seconds. All requests are still counted.\n");
+    printf("                            EXPR only captures the entries matching conditions\n");
+    printf("                            joined by \"and\" and \"or\" (binding weaker), each of\n");
+    printf("                            them a letter of TYPES or a comparison (==, !=, <,\n");
+    printf("                            <=, >, >=) of len, ioctl, byte[N], ushort[N] or\n");
+    printf("                            ulong[N] with a number, e.g. \"W and byte[0]==0x11\".\n");
+    printf("                            /subscribe reads the port alongside other subscribers\n");
+    printf("                            and keeps their settings unless options are given.\n");
+    printf("                            A port that already has subscribers, like an\n");
+    printf("                            unattended capture, is always read this way.\n");
+    printf("                            /trigger waits for the first entry matching EXPR,\n");
+    printf("                            e.g. \"C and ioctl==0x1B0010\" for a break, and prints\n");
+    printf("                            the last /pre KiB of entries before and the first\n");
+    printf("                            /post KiB after it (default: half of SIZE each).\n");
+    printf("                            /linger keeps the port monitored for SECONDS after\n");
+    printf("                            the tool has exited or crashed. /resume continues\n");
+    printf("                            with the entries buffered meanwhile and checks that\n");
+    printf("                            none is missing before sequence number SEQ. Both\n");
+    printf("                            keep the settings unless options are given.\n");
+    printf("                            /repeats only counts read, write and IOCTL entries\n");
+    printf("                            repeating one of the last N entries of their type\n");
+    printf("                            and prints them as P (default: 0, print all).\n");
+    printf("                            /us and /ns print timestamps with microsecond or\n");
+    printf("                            nanosecond precision instead of milliseconds.\n");
+    printf("\n");
+    printf("Statistics:\n");
+    printf("    /stats                  Print the traffic statistics of all attached ports.\n");
+    printf("    /stats PORT [/stop]     Start or stop collecting statistics for the given\n");
+    printf("                            port without logging any data. Collecting goes on\n");
+    printf("                            after this tool has exited.\n");
+    printf("\n");
+    printf("Unattended Capture:\n");
+    printf("    /read FILE [/us | /ns]  Print the log entries of a capture file written by the\n");
+    printf("                            driver for a port configured in the registry.\n");
     printf("\n");
 
     return 1;
@@ -41,7 +95,9 @@ OpenPortSniffer(void)
 {
     HANDLE hPortSniffer;
 
-    hPortSniffer = CreateFileW(L"\\\\.\\EnlyzePortSniffer", GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    // Open the control device for overlapped I/O, so that we can keep multiple requests pending while monitoring.
+    // Use PortSnifferDeviceIoControl for all other requests.
+    hPortSniffer = CreateFileW(L"\\\\.\\EnlyzePortSniffer", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
     if (hPortSniffer == INVALID_HANDLE_VALUE)
     {
         fprintf(stderr, "Could not open \"\\\\.\\EnlyzePortSniffer\", last error is %lu.\n", GetLastError());
@@ -54,6 +110,44 @@ OpenPortSniffer(void)
     return hPortSniffer;
 }
 
+BOOL
+PortSnifferDeviceIoControl(
+    __in HANDLE hPortSniffer,
+    __in DWORD dwIoControlCode,
+    __in_bcount_opt(cbInBuffer) PVOID pInBuffer,
+    __in DWORD cbInBuffer,
+    __out_bcount_opt(cbOutBuffer) PVOID pOutBuffer,
+    __in DWORD cbOutBuffer,
+    __out PDWORD pcbReturned
+    )
+{
+    BOOL bReturnValue;
+    DWORD dwLastError;
+    OVERLAPPED Overlapped;
+
+    // Handles returned by OpenPortSniffer are opened for overlapped I/O.
+    // Even a synchronous DeviceIoControl call therefore needs an OVERLAPPED structure with its own event.
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+    {
+        return FALSE;
+    }
+
+    bReturnValue = DeviceIoControl(hPortSniffer, dwIoControlCode, pInBuffer, cbInBuffer, pOutBuffer, cbOutBuffer, pcbReturned, &Overlapped);
+    if (!bReturnValue && GetLastError() == ERROR_IO_PENDING)
+    {
+        bReturnValue = GetOverlappedResult(hPortSniffer, &Overlapped, pcbReturned, TRUE);
+    }
+
+    // Preserve the last error of the request for our caller.
+    dwLastError = GetLastError();
+    CloseHandle(Overlapped.hEvent);
+    SetLastError(dwLastError);
+
+    return bReturnValue;
+}
+
 int __cdecl
 wmain(
     __in int argc,
@@ -94,9 +188,25 @@ wmain(
     {
         return HandleVersionParameter();
     }
-    else if (argc == 4 && wcscmp(argv[1], L"/monitor") == 0)
+    else if (argc >= 4 && wcscmp(argv[1], L"/monitor") == 0)
+    {
+        return HandleMonitorParameter(argv[2], argv[3], argc - 4, &argv[4]);
+    }
+    else if (argc == 2 && wcscmp(argv[1], L"/stats") == 0)
+    {
+        return HandleStatsParameter(NULL, FALSE);
+    }
+    else if (argc == 3 && wcscmp(argv[1], L"/stats") == 0)
+    {
+        return HandleStatsParameter(argv[2], FALSE);
+    }
+    else if (argc == 4 && wcscmp(argv[1], L"/stats") == 0 && wcscmp(argv[3], L"/stop") == 0)
+    {
+        return HandleStatsParameter(argv[2], TRUE);
+    }
+    else if (argc >= 3 && wcscmp(argv[1], L"/read") == 0)
     {
-        return HandleMonitorParameter(argv[2], argv[3]);
+        return HandleReadParameter(argv[2], argc - 3, &argv[3]);
     }
     else
     {
@@ -55,13 +55,39 @@ HandleUninstallParameter(void);
 int
 HandleMonitorParameter(
     __in PCWSTR pwszPort,
-    __in PCWSTR pwszTypes
+    __in PCWSTR pwszTypes,
+    __in int argc,
+    __in_ecount(argc) wchar_t* argv[]
+    );
+
+int
+HandleReadParameter(
+    __in PCWSTR pwszFile,
+    __in int argc,
+    __in_ecount(argc) wchar_t* argv[]
+    );
+
+int
+HandleStatsParameter(
+    __in_opt PCWSTR pwszPort,
+    __in BOOL bStop
     );
 
 // PortSniffer-Tool.c
 HANDLE
 OpenPortSniffer(void);
 
+BOOL
+PortSnifferDeviceIoControl(
+    __in HANDLE hPortSniffer,
+    __in DWORD dwIoControlCode,
+    __in_bcount_opt(cbInBuffer) PVOID pInBuffer,
+    __in DWORD cbInBuffer,
+    __out_bcount_opt(cbOutBuffer) PVOID pOutBuffer,
+    __in DWORD cbOutBuffer,
+    __out PDWORD pcbReturned
+    );
+
 // setup.c
 int
 AttachPortCallback(
@@ -14,7 +14,47 @@ typedef struct _FLAG_TRANSLATION
 }
 FLAG_TRANSLATION;
 
+typedef void (*PRINT_IOCTL_BUFFER_ROUTINE)(
+    __in const BYTE* pBuffer
+    );
+
+typedef struct _IOCTL_TRANSLATION
+{
+    ULONG IoControlCode;
+    const char* pszName;
+    PRINT_IOCTL_BUFFER_ROUTINE pfnPrintInput;
+    USHORT cbInput;
+    PRINT_IOCTL_BUFFER_ROUTINE pfnPrintOutput;
+    USHORT cbOutput;
+}
+IOCTL_TRANSLATION;
+
+// Called for every log entry delivered to _WaitForEntries. Returning FALSE stops waiting with an error.
+typedef BOOL (*CONSUME_ENTRY_ROUTINE)(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse,
+    __inout_opt PVOID pContext
+    );
+
+typedef struct _RESUME_CONTEXT
+{
+    BOOL bResume;
+    PULONG pulNextSequenceNumber;
+}
+RESUME_CONTEXT, *PRESUME_CONTEXT;
+
 static BOOL _bTerminationRequested = FALSE;
+static HANDLE _hTerminationEvent = NULL;
+
+// Most recent PORTSNIFFER_PORTLOG_CLOCK entry for converting timestamps.
+static PORTSNIFFER_CLOCK_DATA _ClockData;
+static BOOL _bClockDataValid = FALSE;
+
+// Printed fraction of a second: milliseconds by default, microseconds with /us, nanoseconds with /ns.
+static int _iFractionDigits = 3;
+static ULONG _ulFractionDivisor = 1000000;
+
+// Receives the log entries of a subscription, at least 16 of them with the maximum length at once.
+static UCHAR _SubscriptionBuffer[16 * PORTSNIFFER_POP_PORTLOG_ENTRIES_MIN_LENGTH];
 
 
 static BOOL WINAPI
@@ -25,6 +65,415 @@ _CtrlHandlerRoutine(
     UNREFERENCED_PARAMETER(dwCtrlType);
 
     _bTerminationRequested = TRUE;
+    SetEvent(_hTerminationEvent);
+    return TRUE;
+}
+
+static BOOL
+_ConvertTimestamp(
+    __in PLARGE_INTEGER pTimestamp,
+    __out PSYSTEMTIME pSystemTime,
+    __out PULONG pulNanoseconds
+    )
+{
+    LONGLONG Delta;
+    LONGLONG Frequency;
+    LONGLONG Nanoseconds;
+    LONGLONG Remainder;
+    LARGE_INTEGER Time;
+
+    if (!_bClockDataValid)
+    {
+        return FALSE;
+    }
+
+    // Timestamps are performance counter values, so get their distance to the correlated system time in nanoseconds.
+    // Divide first, so that large distances can't overflow.
+    Frequency = _ClockData.PerformanceFrequency.QuadPart;
+    Delta = pTimestamp->QuadPart - _ClockData.PerformanceCounter.QuadPart;
+    Nanoseconds = Delta / Frequency * 1000000000 + Delta % Frequency * 1000000000 / Frequency;
+
+    // A FILETIME only takes 100-nanosecond units, so keep the remaining nanoseconds separately.
+    Time.QuadPart = _ClockData.SystemTime.QuadPart + Nanoseconds / 100;
+    Remainder = Nanoseconds % 100;
+    if (Remainder < 0)
+    {
+        Time.QuadPart--;
+        Remainder += 100;
+    }
+
+    // The LARGE_INTEGER Time can be casted to a FILETIME (but not necessarily vice-versa!)
+    FileTimeToSystemTime((PFILETIME)&Time, pSystemTime);
+    *pulNanoseconds = (ULONG)(Time.QuadPart % 10000000) * 100 + (ULONG)Remainder;
+
+    return TRUE;
+}
+
+static BOOL
+_ParseCapacity(
+    __in PCWSTR pwszCapacity,
+    __out PULONG pCapacity
+    )
+{
+    PWSTR pwszEnd;
+    ULONG KiB;
+
+    // The capacity is given in KiB to keep the numbers readable.
+    // A capacity of 0 lets the driver choose its default.
+    KiB = wcstoul(pwszCapacity, &pwszEnd, 10);
+    if (*pwszEnd || KiB > MAXULONG / 1024)
+    {
+        fprintf(stderr, "Invalid SIZE: %S\n", pwszCapacity);
+        return FALSE;
+    }
+
+    *pCapacity = KiB * 1024;
+    return TRUE;
+}
+
+static BOOL
+_SkipToken(
+    __inout PCWSTR* ppwsz,
+    __in PCWSTR pwszToken
+    )
+{
+    size_t cch;
+
+    cch = wcslen(pwszToken);
+    if (wcsncmp(*ppwsz, pwszToken, cch) != 0)
+    {
+        return FALSE;
+    }
+
+    *ppwsz += cch;
+    return TRUE;
+}
+
+static BOOL
+_ParseCaptureFilter(
+    __in PCWSTR pwszExpression,
+    __out PPORTSNIFFER_SET_CAPTURE_FILTER_REQUEST pRequest
+    )
+{
+    BOOL bSwapTargets;
+    ULONG i;
+    ULONG iConjunctionStart;
+    PCAPTURE_FILTER_INSTRUCTION pInstruction;
+    PCWSTR p;
+    PWSTR pwszEnd;
+    USHORT wCode;
+
+    // The expression is a list of conditions joined by "and" and "or", where "and" binds stronger.
+    // Every condition becomes a load followed by a jump, which goes on with the next condition if it holds and skips to
+    // the next "or" otherwise. A list of conditions that all hold returns 1, falling through the last one returns 0.
+    pRequest->InstructionCount = 0;
+    iConjunctionStart = 0;
+    p = pwszExpression;
+
+    for (;;)
+    {
+        // Leave room for the load and jump of this condition, the return of its conjunction and the final return.
+        if (pRequest->InstructionCount + 4 > CAPTURE_FILTER_MAX_INSTRUCTIONS)
+        {
+            fprintf(stderr, "EXPR is too complex: %S\n", pwszExpression);
+            return FALSE;
+        }
+
+        while (*p == L' ')
+        {
+            p++;
+        }
+
+        pInstruction = &pRequest->Instructions[pRequest->InstructionCount++];
+        pInstruction->JumpTrue = 0;
+        pInstruction->JumpFalse = 0;
+        pInstruction->K = 0;
+
+        // A single letter of TYPES is a condition of its own. All other conditions compare a value with a number.
+        if (*p && wcschr(L"RWCSL", *p) && (p[1] == L' ' || p[1] == L'\0'))
+        {
+            pInstruction->Code = CAPTURE_FILTER_LD_TYPE;
+            pInstruction++;
+            pRequest->InstructionCount++;
+
+            pInstruction->Code = CAPTURE_FILTER_JEQ;
+            pInstruction->K = (*p == L'R') ? PORTSNIFFER_MONITOR_READ :
+                              (*p == L'W') ? PORTSNIFFER_MONITOR_WRITE :
+                              (*p == L'C') ? PORTSNIFFER_MONITOR_IOCTL :
+                              (*p == L'S') ? PORTSNIFFER_PORTLOG_LINE_STATUS : PORTSNIFFER_PORTLOG_LIFECYCLE;
+            bSwapTargets = FALSE;
+            p++;
+        }
+        else
+        {
+            if (_SkipToken(&p, L"len"))
+            {
+                pInstruction->Code = CAPTURE_FILTER_LD_LENGTH;
+            }
+            else if (_SkipToken(&p, L"ioctl"))
+            {
+                pInstruction->Code = CAPTURE_FILTER_LD_IOCTL;
+            }
+            else
+            {
+                if (_SkipToken(&p, L"byte["))
+                {
+                    pInstruction->Code = CAPTURE_FILTER_LD_BYTE;
+                }
+                else if (_SkipToken(&p, L"ushort["))
+                {
+                    pInstruction->Code = CAPTURE_FILTER_LD_USHORT;
+                }
+                else if (_SkipToken(&p, L"ulong["))
+                {
+                    pInstruction->Code = CAPTURE_FILTER_LD_ULONG;
+                }
+                else
+                {
+                    fprintf(stderr, "Invalid condition in EXPR: %S\n", p);
+                    return FALSE;
+                }
+
+                pInstruction->K = wcstoul(p, &pwszEnd, 0);
+                if (pwszEnd == p || *pwszEnd != L']')
+                {
+                    fprintf(stderr, "Invalid offset in EXPR: %S\n", p);
+                    return FALSE;
+                }
+
+                p = pwszEnd + 1;
+            }
+
+            while (*p == L' ')
+            {
+                p++;
+            }
+
+            // Conditions that don't have a jump of their own use the opposite one with swapped targets.
+            bSwapTargets = FALSE;
+            if (_SkipToken(&p, L"=="))
+            {
+                wCode = CAPTURE_FILTER_JEQ;
+            }
+            else if (_SkipToken(&p, L"!="))
+            {
+                wCode = CAPTURE_FILTER_JEQ;
+                bSwapTargets = TRUE;
+            }
+            else if (_SkipToken(&p, L">="))
+            {
+                wCode = CAPTURE_FILTER_JGE;
+            }
+            else if (_SkipToken(&p, L"<="))
+            {
+                wCode = CAPTURE_FILTER_JGT;
+                bSwapTargets = TRUE;
+            }
+            else if (_SkipToken(&p, L">"))
+            {
+                wCode = CAPTURE_FILTER_JGT;
+            }
+            else if (_SkipToken(&p, L"<"))
+            {
+                wCode = CAPTURE_FILTER_JGE;
+                bSwapTargets = TRUE;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid comparison in EXPR: %S\n", p);
+                return FALSE;
+            }
+
+            while (*p == L' ')
+            {
+                p++;
+            }
+
+            pInstruction = &pRequest->Instructions[pRequest->InstructionCount++];
+            pInstruction->Code = wCode;
+            pInstruction->K = wcstoul(p, &pwszEnd, 0);
+            if (pwszEnd == p)
+            {
+                fprintf(stderr, "Invalid number in EXPR: %S\n", p);
+                return FALSE;
+            }
+
+            p = pwszEnd;
+        }
+
+        // The target for a failed condition is only known at the end of its conjunction, so mark the jump for now.
+        pInstruction->JumpTrue = bSwapTargets ? 0xFF : 0;
+        pInstruction->JumpFalse = bSwapTargets ? 0 : 0xFF;
+
+        while (*p == L' ')
+        {
+            p++;
+        }
+
+        if (_SkipToken(&p, L"and "))
+        {
+            continue;
+        }
+
+        // Close the conjunction with a return of 1 and let all of its failed conditions jump right after it.
+        pInstruction = &pRequest->Instructions[pRequest->InstructionCount++];
+        pInstruction->Code = CAPTURE_FILTER_RETURN;
+        pInstruction->JumpTrue = 0;
+        pInstruction->JumpFalse = 0;
+        pInstruction->K = 1;
+
+        for (i = iConjunctionStart; i < pRequest->InstructionCount - 1; i++)
+        {
+            pInstruction = &pRequest->Instructions[i];
+            if (pInstruction->JumpTrue == 0xFF)
+            {
+                pInstruction->JumpTrue = (UCHAR)(pRequest->InstructionCount - i - 1);
+            }
+
+            if (pInstruction->JumpFalse == 0xFF)
+            {
+                pInstruction->JumpFalse = (UCHAR)(pRequest->InstructionCount - i - 1);
+            }
+        }
+
+        iConjunctionStart = pRequest->InstructionCount;
+
+        if (!*p)
+        {
+            break;
+        }
+
+        if (!_SkipToken(&p, L"or "))
+        {
+            fprintf(stderr, "Expected \"and\" or \"or\" in EXPR: %S\n", p);
+            return FALSE;
+        }
+    }
+
+    // Nothing of the expression holds.
+    pInstruction = &pRequest->Instructions[pRequest->InstructionCount++];
+    pInstruction->Code = CAPTURE_FILTER_RETURN;
+    pInstruction->JumpTrue = 0;
+    pInstruction->JumpFalse = 0;
+    pInstruction->K = 0;
+
+    return TRUE;
+}
+
+static BOOL
+_ParseCoalesceGap(
+    __in PCWSTR pwszCoalesceGap,
+    __out PUSHORT pCoalesceGap
+    )
+{
+    double Characters;
+    PWSTR pwszEnd;
+
+    // The gap is given in character times, but the driver takes tenths of them.
+    Characters = wcstod(pwszCoalesceGap, &pwszEnd);
+    if (*pwszEnd || Characters < 0.0 || Characters * 10.0 > MAXUSHORT)
+    {
+        fprintf(stderr, "Invalid GAP: %S\n", pwszCoalesceGap);
+        return FALSE;
+    }
+
+    *pCoalesceGap = (USHORT)(Characters * 10.0 + 0.5);
+    return TRUE;
+}
+
+static BOOL
+_ParseLingerTime(
+    __in PCWSTR pwszLingerTime,
+    __out PULONG pLingerTime
+    )
+{
+    PWSTR pwszEnd;
+
+    *pLingerTime = wcstoul(pwszLingerTime, &pwszEnd, 10);
+    if (*pwszEnd || *pLingerTime == 0 || *pLingerTime > PORTSNIFFER_MAX_LINGER_TIME)
+    {
+        fprintf(stderr, "Invalid linger time: %S\n", pwszLingerTime);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+_ParseRepeatDepth(
+    __in PCWSTR pwszRepeatDepth,
+    __out PUSHORT pRepeatDepth
+    )
+{
+    PWSTR pwszEnd;
+    ULONG RepeatDepth;
+
+    RepeatDepth = wcstoul(pwszRepeatDepth, &pwszEnd, 10);
+    if (*pwszEnd || RepeatDepth > PORTSNIFFER_MAX_REPEAT_DEPTH)
+    {
+        fprintf(stderr, "Invalid repeat depth: %S\n", pwszRepeatDepth);
+        return FALSE;
+    }
+
+    *pRepeatDepth = (USHORT)RepeatDepth;
+    return TRUE;
+}
+
+static BOOL
+_ParseSamplingRate(
+    __in PCWSTR pwszSamplingRate,
+    __out PUSHORT pSamplingRate
+    )
+{
+    PWSTR pwszEnd;
+    ULONG SamplingRate;
+
+    SamplingRate = wcstoul(pwszSamplingRate, &pwszEnd, 10);
+    if (*pwszEnd || SamplingRate == 0 || SamplingRate > MAXUSHORT)
+    {
+        fprintf(stderr, "Invalid sampling rate: %S\n", pwszSamplingRate);
+        return FALSE;
+    }
+
+    *pSamplingRate = (USHORT)SamplingRate;
+    return TRUE;
+}
+
+static BOOL
+_ParseSequenceNumber(
+    __in PCWSTR pwszSequenceNumber,
+    __out PULONG pSequenceNumber
+    )
+{
+    PWSTR pwszEnd;
+
+    *pSequenceNumber = wcstoul(pwszSequenceNumber, &pwszEnd, 10);
+    if (*pwszEnd || !*pwszSequenceNumber)
+    {
+        fprintf(stderr, "Invalid sequence number: %S\n", pwszSequenceNumber);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+_ParseSnapLength(
+    __in PCWSTR pwszSnapLength,
+    __out PUSHORT pSnapLength
+    )
+{
+    PWSTR pwszEnd;
+    ULONG SnapLength;
+
+    SnapLength = wcstoul(pwszSnapLength, &pwszEnd, 10);
+    if (*pwszEnd || SnapLength > MAXUSHORT)
+    {
+        fprintf(stderr, "Invalid SNAPLEN: %S\n", pwszSnapLength);
+        return FALSE;
+    }
+
+    *pSnapLength = (USHORT)SnapLength;
     return TRUE;
 }
 
@@ -36,269 +485,1963 @@ _ParseTypes(
 {
     PCWSTR p;
 
-    *pMonitorMask = 0;
-    for (p = pwszTypes; *p; p++)
+    *pMonitorMask = 0;
+    for (p = pwszTypes; *p; p++)
+    {
+        if (*p == L'R')
+        {
+            *pMonitorMask |= PORTSNIFFER_MONITOR_READ;
+        }
+        else if (*p == L'W')
+        {
+            *pMonitorMask |= PORTSNIFFER_MONITOR_WRITE;
+        }
+        else if (*p == L'C')
+        {
+            *pMonitorMask |= PORTSNIFFER_MONITOR_IOCTL;
+        }
+        else if (*p == L'S')
+        {
+            *pMonitorMask |= PORTSNIFFER_MONITOR_LINE_STATUS;
+        }
+        else if (*p == L'L')
+        {
+            *pMonitorMask |= PORTSNIFFER_MONITOR_LIFECYCLE;
+        }
+        else
+        {
+            fprintf(stderr, "Invalid character for TYPES: %lc\n", *p);
+            return FALSE;
+        }
+    }
+
+    if ((*pMonitorMask & ~PORTSNIFFER_MONITOR_LIFECYCLE) == 0)
+    {
+        fprintf(stderr, "No TYPES to monitor were given.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+_PrintBitmask(
+    __in ULONG Bitmask,
+    __in const FLAG_TRANSLATION* TranslationTable,
+    __in size_t TranslationTableEntries
+    )
+{
+    BOOL bPrintedOne = FALSE;
+    size_t i;
+
+    for (i = 0; i < TranslationTableEntries; i++)
+    {
+        if (Bitmask & TranslationTable[i].FlagBit)
+        {
+            if (bPrintedOne)
+            {
+                printf("|");
+            }
+
+            printf("%s", TranslationTable[i].pszFlagName);
+            bPrintedOne = TRUE;
+        }
+    }
+}
+
+static void
+_PrintDuration(
+    __in ULONGLONG ullTicks
+    )
+{
+    ULONGLONG ullNanoseconds;
+
+    // Durations are performance counter ticks, which we can only convert once we have seen a clock entry.
+    if (!_bClockDataValid)
+    {
+        printf(" (%I64u ticks)", ullTicks);
+        return;
+    }
+
+    ullNanoseconds = ullTicks * 1000000000ULL / (ULONGLONG)_ClockData.PerformanceFrequency.QuadPart;
+    printf(" (%I64u.%04I64u ms)", ullNanoseconds / 1000000, ullNanoseconds % 1000000 / 100);
+}
+
+static const FLAG_TRANSLATION _ControlHandShakeTranslationTable[] = {
+    { SERIAL_DTR_CONTROL, "SERIAL_DTR_CONTROL" },
+    { SERIAL_DTR_HANDSHAKE, "SERIAL_DTR_HANDSHAKE" },
+    { SERIAL_CTS_HANDSHAKE, "SERIAL_CTS_HANDSHAKE"},
+    { SERIAL_DSR_HANDSHAKE, "SERIAL_DSR_HANDSHAKE" },
+    { SERIAL_DCD_HANDSHAKE, "SERIAL_DCD_HANDSHAKE" },
+    { SERIAL_DSR_SENSITIVITY, "SERIAL_DSR_SENSITIVITY" },
+    { SERIAL_ERROR_ABORT, "SERIAL_ERROR_ABORT" }
+};
+
+static const FLAG_TRANSLATION _ErrorsTranslationTable[] = {
+    { SERIAL_ERROR_BREAK, "SERIAL_ERROR_BREAK" },
+    { SERIAL_ERROR_FRAMING, "SERIAL_ERROR_FRAMING" },
+    { SERIAL_ERROR_OVERRUN, "SERIAL_ERROR_OVERRUN" },
+    { SERIAL_ERROR_QUEUEOVERRUN, "SERIAL_ERROR_QUEUEOVERRUN" },
+    { SERIAL_ERROR_PARITY, "SERIAL_ERROR_PARITY" }
+};
+
+static const FLAG_TRANSLATION _FlowReplaceTranslationTable[] = {
+    { SERIAL_AUTO_TRANSMIT, "SERIAL_AUTO_TRANSMIT" },
+    { SERIAL_AUTO_RECEIVE, "SERIAL_AUTO_RECEIVE" },
+    { SERIAL_ERROR_CHAR, "SERIAL_ERROR_CHAR" },
+    { SERIAL_NULL_STRIPPING, "SERIAL_NULL_STRIPPING" },
+    { SERIAL_BREAK_CHAR, "SERIAL_BREAK_CHAR" },
+    { SERIAL_RTS_CONTROL, "SERIAL_RTS_CONTROL" },
+    { SERIAL_RTS_HANDSHAKE, "SERIAL_RTS_HANDSHAKE" },
+    { SERIAL_XOFF_CONTINUE, "SERIAL_XOFF_CONTINUE" }
+};
+
+static const FLAG_TRANSLATION _HoldReasonsTranslationTable[] = {
+    { SERIAL_TX_WAITING_FOR_CTS, "SERIAL_TX_WAITING_FOR_CTS" },
+    { SERIAL_TX_WAITING_FOR_DSR, "SERIAL_TX_WAITING_FOR_DSR" },
+    { SERIAL_TX_WAITING_FOR_DCD, "SERIAL_TX_WAITING_FOR_DCD" },
+    { SERIAL_TX_WAITING_FOR_XON, "SERIAL_TX_WAITING_FOR_XON" },
+    { SERIAL_TX_WAITING_XOFF_SENT, "SERIAL_TX_WAITING_XOFF_SENT" },
+    { SERIAL_TX_WAITING_ON_BREAK, "SERIAL_TX_WAITING_ON_BREAK" },
+    { SERIAL_RX_WAITING_FOR_DSR, "SERIAL_RX_WAITING_FOR_DSR" }
+};
+
+static const FLAG_TRANSLATION _ModemStatusTranslationTable[] = {
+    { SERIAL_MSR_DCTS, "SERIAL_MSR_DCTS" },
+    { SERIAL_MSR_DDSR, "SERIAL_MSR_DDSR" },
+    { SERIAL_MSR_TERI, "SERIAL_MSR_TERI" },
+    { SERIAL_MSR_DDCD, "SERIAL_MSR_DDCD" },
+    { SERIAL_MSR_CTS, "SERIAL_MSR_CTS" },
+    { SERIAL_MSR_DSR, "SERIAL_MSR_DSR" },
+    { SERIAL_MSR_RI, "SERIAL_MSR_RI" },
+    { SERIAL_MSR_DCD, "SERIAL_MSR_DCD" }
+};
+
+static const FLAG_TRANSLATION _PurgeTranslationTable[] = {
+    { SERIAL_PURGE_TXABORT, "SERIAL_PURGE_TXABORT" },
+    { SERIAL_PURGE_RXABORT, "SERIAL_PURGE_RXABORT" },
+    { SERIAL_PURGE_TXCLEAR, "SERIAL_PURGE_TXCLEAR" },
+    { SERIAL_PURGE_RXCLEAR, "SERIAL_PURGE_RXCLEAR" }
+};
+
+static const FLAG_TRANSLATION _WaitMaskTranslationTable[] = {
+    { SERIAL_EV_RXCHAR, "SERIAL_EV_RXCHAR" },
+    { SERIAL_EV_RXFLAG, "SERIAL_EV_RXFLAG" },
+    { SERIAL_EV_TXEMPTY, "SERIAL_EV_TXEMPTY" },
+    { SERIAL_EV_CTS, "SERIAL_EV_CTS" },
+    { SERIAL_EV_DSR, "SERIAL_EV_DSR" },
+    { SERIAL_EV_RLSD, "SERIAL_EV_RLSD" },
+    { SERIAL_EV_BREAK, "SERIAL_EV_BREAK" },
+    { SERIAL_EV_ERR, "SERIAL_EV_ERR" },
+    { SERIAL_EV_RING, "SERIAL_EV_RING" },
+    { SERIAL_EV_PERR, "SERIAL_EV_PERR" },
+    { SERIAL_EV_RX80FULL, "SERIAL_EV_RX80FULL" },
+    { SERIAL_EV_EVENT1, "SERIAL_EV_EVENT1" },
+    { SERIAL_EV_EVENT2, "SERIAL_EV_EVENT2" }
+};
+
+static void
+_PrintSerialBaudRate(
+    __in const BYTE* pBuffer
+    )
+{
+    const SERIAL_BAUD_RATE* pBaudRate = (const SERIAL_BAUD_RATE*)pBuffer;
+    printf("%lu", pBaudRate->BaudRate);
+}
+
+static void
+_PrintSerialChars(
+    __in const BYTE* pBuffer
+    )
+{
+    const SERIAL_CHARS* pChars = (const SERIAL_CHARS*)pBuffer;
+    printf("EofChar:0x%02X, ErrorChar:0x%02X, BreakChar:0x%02X, EventChar:0x%02X, XonChar:0x%02X, XoffChar:0x%02X",
+           pChars->EofChar, pChars->ErrorChar, pChars->BreakChar, pChars->EventChar, pChars->XonChar, pChars->XoffChar);
+}
+
+static void
+_PrintSerialHandflow(
+    __in const BYTE* pBuffer
+    )
+{
+    const SERIAL_HANDFLOW* pHandflow = (const SERIAL_HANDFLOW*)pBuffer;
+
+    printf("ControlHandShake:");
+    _PrintBitmask(pHandflow->ControlHandShake, _ControlHandShakeTranslationTable, _countof(_ControlHandShakeTranslationTable));
+    printf(", FlowReplace:");
+    _PrintBitmask(pHandflow->FlowReplace, _FlowReplaceTranslationTable, _countof(_FlowReplaceTranslationTable));
+    printf(", XonLimit:%ld, XoffLimit:%ld", pHandflow->XonLimit, pHandflow->XoffLimit);
+}
+
+static void
+_PrintSerialLineControl(
+    __in const BYTE* pBuffer
+    )
+{
+    const char* pszParity[] = { "NO_PARITY", "ODD_PARITY", "EVEN_PARITY", "MARK_PARITY", "SPACE_PARITY" };
+    const char* pszStopBits[] = { "STOP_BIT_1", "STOP_BITS_1_5", "STOP_BITS_2" };
+    const SERIAL_LINE_CONTROL* pLineControl = (const SERIAL_LINE_CONTROL*)pBuffer;
+
+    if (pLineControl->StopBits < _countof(pszStopBits))
+    {
+        printf("StopBits:%s, ", pszStopBits[pLineControl->StopBits]);
+    }
+
+    if (pLineControl->Parity < _countof(pszParity))
+    {
+        printf("Parity:%s, ", pszParity[pLineControl->Parity]);
+    }
+
+    printf("WordLength:%u", pLineControl->WordLength);
+}
+
+static void
+_PrintSerialModemStatus(
+    __in const BYTE* pBuffer
+    )
+{
+    _PrintBitmask(*(const ULONG*)pBuffer, _ModemStatusTranslationTable, _countof(_ModemStatusTranslationTable));
+}
+
+static void
+_PrintSerialPurge(
+    __in const BYTE* pBuffer
+    )
+{
+    _PrintBitmask(*(const ULONG*)pBuffer, _PurgeTranslationTable, _countof(_PurgeTranslationTable));
+}
+
+static void
+_PrintSerialQueueSize(
+    __in const BYTE* pBuffer
+    )
+{
+    const SERIAL_QUEUE_SIZE* pQueueSize = (const SERIAL_QUEUE_SIZE*)pBuffer;
+    printf("InSize:%lu, OutSize:%lu", pQueueSize->InSize, pQueueSize->OutSize);
+}
+
+static void
+_PrintSerialStatus(
+    __in const BYTE* pBuffer
+    )
+{
+    const SERIAL_STATUS* pStatus = (const SERIAL_STATUS*)pBuffer;
+    printf("Errors:0x%lX, HoldReasons:0x%lX, AmountInInQueue:%lu, AmountInOutQueue:%lu",
+           pStatus->Errors, pStatus->HoldReasons, pStatus->AmountInInQueue, pStatus->AmountInOutQueue);
+}
+
+static void
+_PrintSerialTimeouts(
+    __in const BYTE* pBuffer
+    )
+{
+    const SERIAL_TIMEOUTS* pTimeouts = (const SERIAL_TIMEOUTS*)pBuffer;
+    printf("ReadIntervalTimeout:%lu, ReadTotalTimeoutMultiplier:%lu, ReadTotalTimeoutConstant:%lu, WriteTotalTimeoutMultiplier:%lu, WriteTotalTimeoutConstant:%lu",
+           pTimeouts->ReadIntervalTimeout,
+           pTimeouts->ReadTotalTimeoutMultiplier,
+           pTimeouts->ReadTotalTimeoutConstant,
+           pTimeouts->WriteTotalTimeoutMultiplier,
+           pTimeouts->WriteTotalTimeoutConstant);
+}
+
+static void
+_PrintSerialWaitMask(
+    __in const BYTE* pBuffer
+    )
+{
+    _PrintBitmask(*(const ULONG*)pBuffer, _WaitMaskTranslationTable, _countof(_WaitMaskTranslationTable));
+}
+
+// Names of all IOCTLs we know and routines to decode their buffers.
+// A buffer is only decoded if it has been captured with at least the size of the structure the routine expects.
+static const IOCTL_TRANSLATION _IoctlTranslationTable[] = {
+    { IOCTL_SERIAL_SET_BAUD_RATE, "IOCTL_SERIAL_SET_BAUD_RATE", _PrintSerialBaudRate, sizeof(SERIAL_BAUD_RATE), NULL, 0 },
+    { IOCTL_SERIAL_SET_QUEUE_SIZE, "IOCTL_SERIAL_SET_QUEUE_SIZE", _PrintSerialQueueSize, sizeof(SERIAL_QUEUE_SIZE), NULL, 0 },
+    { IOCTL_SERIAL_SET_LINE_CONTROL, "IOCTL_SERIAL_SET_LINE_CONTROL", _PrintSerialLineControl, sizeof(SERIAL_LINE_CONTROL), NULL, 0 },
+    { IOCTL_SERIAL_SET_BREAK_ON, "IOCTL_SERIAL_SET_BREAK_ON", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_BREAK_OFF, "IOCTL_SERIAL_SET_BREAK_OFF", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_IMMEDIATE_CHAR, "IOCTL_SERIAL_IMMEDIATE_CHAR", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_TIMEOUTS, "IOCTL_SERIAL_SET_TIMEOUTS", _PrintSerialTimeouts, sizeof(SERIAL_TIMEOUTS), NULL, 0 },
+    { IOCTL_SERIAL_GET_TIMEOUTS, "IOCTL_SERIAL_GET_TIMEOUTS", NULL, 0, _PrintSerialTimeouts, sizeof(SERIAL_TIMEOUTS) },
+    { IOCTL_SERIAL_SET_DTR, "IOCTL_SERIAL_SET_DTR", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_CLR_DTR, "IOCTL_SERIAL_CLR_DTR", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_RESET_DEVICE, "IOCTL_SERIAL_RESET_DEVICE", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_RTS, "IOCTL_SERIAL_SET_RTS", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_CLR_RTS, "IOCTL_SERIAL_CLR_RTS", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_XOFF, "IOCTL_SERIAL_SET_XOFF", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_XON, "IOCTL_SERIAL_SET_XON", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_GET_WAIT_MASK, "IOCTL_SERIAL_GET_WAIT_MASK", NULL, 0, _PrintSerialWaitMask, sizeof(ULONG) },
+    { IOCTL_SERIAL_SET_WAIT_MASK, "IOCTL_SERIAL_SET_WAIT_MASK", _PrintSerialWaitMask, sizeof(ULONG), NULL, 0 },
+    { IOCTL_SERIAL_WAIT_ON_MASK, "IOCTL_SERIAL_WAIT_ON_MASK", NULL, 0, _PrintSerialWaitMask, sizeof(ULONG) },
+    { IOCTL_SERIAL_PURGE, "IOCTL_SERIAL_PURGE", _PrintSerialPurge, sizeof(ULONG), NULL, 0 },
+    { IOCTL_SERIAL_GET_BAUD_RATE, "IOCTL_SERIAL_GET_BAUD_RATE", NULL, 0, _PrintSerialBaudRate, sizeof(SERIAL_BAUD_RATE) },
+    { IOCTL_SERIAL_GET_LINE_CONTROL, "IOCTL_SERIAL_GET_LINE_CONTROL", NULL, 0, _PrintSerialLineControl, sizeof(SERIAL_LINE_CONTROL) },
+    { IOCTL_SERIAL_GET_CHARS, "IOCTL_SERIAL_GET_CHARS", NULL, 0, _PrintSerialChars, sizeof(SERIAL_CHARS) },
+    { IOCTL_SERIAL_SET_CHARS, "IOCTL_SERIAL_SET_CHARS", _PrintSerialChars, sizeof(SERIAL_CHARS), NULL, 0 },
+    { IOCTL_SERIAL_GET_HANDFLOW, "IOCTL_SERIAL_GET_HANDFLOW", NULL, 0, _PrintSerialHandflow, sizeof(SERIAL_HANDFLOW) },
+    { IOCTL_SERIAL_SET_HANDFLOW, "IOCTL_SERIAL_SET_HANDFLOW", _PrintSerialHandflow, sizeof(SERIAL_HANDFLOW), NULL, 0 },
+    { IOCTL_SERIAL_GET_MODEMSTATUS, "IOCTL_SERIAL_GET_MODEMSTATUS", NULL, 0, _PrintSerialModemStatus, sizeof(ULONG) },
+    { IOCTL_SERIAL_GET_COMMSTATUS, "IOCTL_SERIAL_GET_COMMSTATUS", NULL, 0, _PrintSerialStatus, sizeof(SERIAL_STATUS) },
+    { IOCTL_SERIAL_XOFF_COUNTER, "IOCTL_SERIAL_XOFF_COUNTER", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_GET_PROPERTIES, "IOCTL_SERIAL_GET_PROPERTIES", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_GET_DTRRTS, "IOCTL_SERIAL_GET_DTRRTS", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_LSRMST_INSERT, "IOCTL_SERIAL_LSRMST_INSERT", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_CONFIG_SIZE, "IOCTL_SERIAL_CONFIG_SIZE", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_GET_COMMCONFIG, "IOCTL_SERIAL_GET_COMMCONFIG", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_COMMCONFIG, "IOCTL_SERIAL_SET_COMMCONFIG", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_GET_STATS, "IOCTL_SERIAL_GET_STATS", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_CLEAR_STATS, "IOCTL_SERIAL_CLEAR_STATS", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_GET_MODEM_CONTROL, "IOCTL_SERIAL_GET_MODEM_CONTROL", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_MODEM_CONTROL, "IOCTL_SERIAL_SET_MODEM_CONTROL", NULL, 0, NULL, 0 },
+    { IOCTL_SERIAL_SET_FIFO_CONTROL, "IOCTL_SERIAL_SET_FIFO_CONTROL", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_QUERY_INFORMATION, "IOCTL_PAR_QUERY_INFORMATION", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_SET_INFORMATION, "IOCTL_PAR_SET_INFORMATION", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_QUERY_DEVICE_ID, "IOCTL_PAR_QUERY_DEVICE_ID", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_QUERY_DEVICE_ID_SIZE, "IOCTL_PAR_QUERY_DEVICE_ID_SIZE", NULL, 0, NULL, 0 },
+    { IOCTL_IEEE1284_GET_MODE, "IOCTL_IEEE1284_GET_MODE", NULL, 0, NULL, 0 },
+    { IOCTL_IEEE1284_NEGOTIATE, "IOCTL_IEEE1284_NEGOTIATE", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_SET_WRITE_ADDRESS, "IOCTL_PAR_SET_WRITE_ADDRESS", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_SET_READ_ADDRESS, "IOCTL_PAR_SET_READ_ADDRESS", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_GET_DEVICE_CAPS, "IOCTL_PAR_GET_DEVICE_CAPS", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_GET_DEFAULT_MODES, "IOCTL_PAR_GET_DEFAULT_MODES", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_QUERY_RAW_DEVICE_ID, "IOCTL_PAR_QUERY_RAW_DEVICE_ID", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_IS_PORT_FREE, "IOCTL_PAR_IS_PORT_FREE", NULL, 0, NULL, 0 },
+    { IOCTL_PAR_QUERY_LOCATION, "IOCTL_PAR_QUERY_LOCATION", NULL, 0, NULL, 0 }
+};
+
+static const IOCTL_TRANSLATION*
+_FindIoctlTranslation(
+    __in ULONG IoControlCode
+    )
+{
+    size_t i;
+
+    for (i = 0; i < _countof(_IoctlTranslationTable); i++)
+    {
+        if (_IoctlTranslationTable[i].IoControlCode == IoControlCode)
+        {
+            return &_IoctlTranslationTable[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+_PrintIoctlBuffer(
+    __in const char* pszPrefix,
+    __in_bcount(cbBuffer) const BYTE* pBuffer,
+    __in USHORT cbBuffer,
+    __in_opt PRINT_IOCTL_BUFFER_ROUTINE pfnPrintBuffer,
+    __in USHORT cbExpected
+    )
+{
+    USHORT i;
+
+    if (cbBuffer == 0)
+    {
+        return;
+    }
+
+    printf("%s", pszPrefix);
+
+    if (pfnPrintBuffer && cbBuffer >= cbExpected)
+    {
+        pfnPrintBuffer(pBuffer);
+    }
+    else
+    {
+        // Dump the bytes of buffers we can't decode.
+        for (i = 0; i < cbBuffer; i++)
+        {
+            printf("%s%02X", (i > 0) ? " " : "", pBuffer[i]);
+        }
+    }
+}
+
+static BOOL
+_PrintIoctlResponse(
+    __in PPORTSNIFFER_IOCTL_DATA pIoctlData,
+    __in USHORT DataLength
+    )
+{
+    const IOCTL_TRANSLATION* pTranslation;
+
+    if (DataLength < FIELD_OFFSET(PORTSNIFFER_IOCTL_DATA, Data) ||
+        DataLength < FIELD_OFFSET(PORTSNIFFER_IOCTL_DATA, Data) + pIoctlData->InputLength + pIoctlData->OutputLength)
+    {
+        fprintf(stderr, "Captured an invalid IOCTL entry with %u bytes of data\n", DataLength);
+        return FALSE;
+    }
+
+    // Print in the format "NAME: INPUT -> OUTPUT", followed by the status if the request has failed.
+    pTranslation = _FindIoctlTranslation(pIoctlData->IoControlCode);
+    if (pTranslation)
+    {
+        printf("%s", pTranslation->pszName);
+        _PrintIoctlBuffer(": ", pIoctlData->Data, pIoctlData->InputLength, pTranslation->pfnPrintInput, pTranslation->cbInput);
+        _PrintIoctlBuffer(" -> ", &pIoctlData->Data[pIoctlData->InputLength], pIoctlData->OutputLength, pTranslation->pfnPrintOutput, pTranslation->cbOutput);
+    }
+    else
+    {
+        printf("IOCTL 0x%08lX", pIoctlData->IoControlCode);
+        _PrintIoctlBuffer(": ", pIoctlData->Data, pIoctlData->InputLength, NULL, 0);
+        _PrintIoctlBuffer(" -> ", &pIoctlData->Data[pIoctlData->InputLength], pIoctlData->OutputLength, NULL, 0);
+    }
+
+    if (pIoctlData->Status < 0)
+    {
+        printf(" (status 0x%08lX)", (ULONG)pIoctlData->Status);
+    }
+
+    return TRUE;
+}
+
+static BOOL
+_ParseIoctlFilter(
+    __in PCWSTR pwszIoctls,
+    __out_ecount(PORTSNIFFER_IOCTL_FILTER_FUNCTIONS / 32) PULONG pFunctions
+    )
+{
+    size_t cch;
+    size_t i;
+    ULONG IoControlCode;
+    PCWSTR p;
+    PWSTR pwszEnd;
+    char szName[64];
+
+    ZeroMemory(pFunctions, PORTSNIFFER_IOCTL_FILTER_FUNCTIONS / 8);
+
+    // The list is separated by commas and contains IOCTL names known to us or numeric I/O control codes.
+    for (p = pwszIoctls; *p; p += cch + (p[cch] == L','))
+    {
+        cch = wcscspn(p, L",");
+        if (cch == 0 || cch >= sizeof(szName))
+        {
+            fprintf(stderr, "Invalid IOCTLS: %S\n", pwszIoctls);
+            return FALSE;
+        }
+
+        IoControlCode = wcstoul(p, &pwszEnd, 0);
+        if (pwszEnd != p + cch)
+        {
+            StringCchPrintfA(szName, sizeof(szName), "%.*S", (int)cch, p);
+
+            for (i = 0; i < _countof(_IoctlTranslationTable); i++)
+            {
+                if (strcmp(_IoctlTranslationTable[i].pszName, szName) == 0)
+                {
+                    break;
+                }
+            }
+
+            if (i == _countof(_IoctlTranslationTable))
+            {
+                fprintf(stderr, "Unknown IOCTL: %s\n", szName);
+                return FALSE;
+            }
+
+            IoControlCode = _IoctlTranslationTable[i].IoControlCode;
+        }
+
+        PORTSNIFFER_IOCTL_FILTER_SET(pFunctions, IoControlCode);
+    }
+
+    return TRUE;
+}
+
+static void
+_PrintLifecycleResponse(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse
+    )
+{
+    char cRequestType;
+    PPORTSNIFFER_LIFECYCLE_DATA pLifecycleData;
+    const IOCTL_TRANSLATION* pTranslation;
+
+    pLifecycleData = (PPORTSNIFFER_LIFECYCLE_DATA)pPopResponse->Data;
+    if (pLifecycleData->RequestType == PORTSNIFFER_MONITOR_READ)
+    {
+        cRequestType = 'R';
+    }
+    else if (pLifecycleData->RequestType == PORTSNIFFER_MONITOR_WRITE)
+    {
+        cRequestType = 'W';
+    }
+    else
+    {
+        cRequestType = 'C';
+    }
+
+    // Print in the format "REQUEST TYPE [IOCTL CODE] STATUS TRANSFERRED/REQUESTED (SERVICE TIME)".
+    printf(" %c", cRequestType);
+    if (pLifecycleData->RequestType == PORTSNIFFER_MONITOR_IOCTL)
+    {
+        pTranslation = _FindIoctlTranslation(pLifecycleData->IoControlCode);
+        if (pTranslation)
+        {
+            printf(" %s", pTranslation->pszName);
+        }
+        else
+        {
+            printf(" 0x%08lX", pLifecycleData->IoControlCode);
+        }
+    }
+
+    printf(" status 0x%08lX, %lu of %lu bytes",
+           (ULONG)pLifecycleData->Status, pLifecycleData->TransferredLength, pLifecycleData->RequestedLength);
+    _PrintDuration((ULONGLONG)(pPopResponse->Timestamp.QuadPart - pLifecycleData->DispatchTimestamp.QuadPart));
+}
+
+static void
+_PrintLineStatusResponse(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse
+    )
+{
+    PPORTSNIFFER_LINE_STATUS_DATA pLineStatusData;
+
+    // Only print the part of the line status that the entry reports as changed.
+    pLineStatusData = (PPORTSNIFFER_LINE_STATUS_DATA)pPopResponse->Data;
+    if (pLineStatusData->Changes & PORTSNIFFER_LINE_STATUS_MODEM)
+    {
+        printf(" ModemStatus:");
+        _PrintBitmask(pLineStatusData->ModemStatus, _ModemStatusTranslationTable, _countof(_ModemStatusTranslationTable));
+    }
+
+    if (pLineStatusData->Changes & PORTSNIFFER_LINE_STATUS_COMM)
+    {
+        printf(" HoldReasons:");
+        _PrintBitmask(pLineStatusData->HoldReasons, _HoldReasonsTranslationTable, _countof(_HoldReasonsTranslationTable));
+        printf(", Errors:");
+        _PrintBitmask(pLineStatusData->Errors, _ErrorsTranslationTable, _countof(_ErrorsTranslationTable));
+    }
+
+    if (pLineStatusData->Changes & PORTSNIFFER_LINE_STATUS_EVENTS)
+    {
+        printf(" Events:");
+        _PrintBitmask(pLineStatusData->Events, _WaitMaskTranslationTable, _countof(_WaitMaskTranslationTable));
+    }
+
+    if (pLineStatusData->Changes & PORTSNIFFER_LINE_STATUS_STATS)
+    {
+        printf(" FrameErrors:+%lu, SerialOverrunErrors:+%lu, BufferOverrunErrors:+%lu, ParityErrors:+%lu",
+               pLineStatusData->FrameErrors, pLineStatusData->SerialOverrunErrors,
+               pLineStatusData->BufferOverrunErrors, pLineStatusData->ParityErrors);
+    }
+}
+
+static BOOL
+_PrintResponse(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse
+    )
+{
+    char cType;
+    PPORTSNIFFER_GAP_DATA pGapData;
+    PPORTSNIFFER_IOCTL_DATA pIoctlData;
+    PPORTSNIFFER_REPEAT_DATA pRepeatData;
+    SYSTEMTIME SystemTimeStamp;
+    USHORT i;
+    ULONG ulNanoseconds;
+
+    // Clock entries aren't printed, we just use them for converting the timestamps of all following entries.
+    if (pPopResponse->Type == PORTSNIFFER_PORTLOG_CLOCK)
+    {
+        CopyMemory(&_ClockData, pPopResponse->Data, sizeof(PORTSNIFFER_CLOCK_DATA));
+        _bClockDataValid = (_ClockData.PerformanceFrequency.QuadPart > 0);
+        return TRUE;
+    }
+
+    // Indicate the monitored request via a single character.
+    if (pPopResponse->Type == PORTSNIFFER_MONITOR_READ)
+    {
+        cType = 'R';
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_MONITOR_WRITE)
+    {
+        cType = 'W';
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_MONITOR_IOCTL)
+    {
+        cType = 'C';
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_GAP)
+    {
+        cType = 'G';
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_LIFECYCLE)
+    {
+        cType = 'L';
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_LINE_STATUS)
+    {
+        cType = 'S';
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_REPEAT)
+    {
+        cType = 'P';
+    }
+    else
+    {
+        fprintf(stderr, "Captured an invalid request type: 0x%04X\n", pPopResponse->Type);
+        return FALSE;
+    }
+
+    // Print in the format "UTC TIMESTAMP | TYPE | LENGTH | DATA", where LENGTH is the length before any truncation.
+    // Without a clock entry, we can only print the raw performance counter value.
+    if (_ConvertTimestamp(&pPopResponse->Timestamp, &SystemTimeStamp, &ulNanoseconds))
+    {
+        printf("%04u-%02u-%02u %02u:%02u:%02u.%0*lu | %c | %4u |",
+               SystemTimeStamp.wYear, SystemTimeStamp.wMonth, SystemTimeStamp.wDay,
+               SystemTimeStamp.wHour, SystemTimeStamp.wMinute, SystemTimeStamp.wSecond,
+               _iFractionDigits, ulNanoseconds / _ulFractionDivisor,
+               cType, pPopResponse->OriginalLength);
+    }
+    else
+    {
+        printf("%I64d ticks | %c | %4lu |", pPopResponse->Timestamp.QuadPart, cType, pPopResponse->OriginalLength);
+    }
+
+    if (pPopResponse->Type == PORTSNIFFER_MONITOR_IOCTL)
+    {
+        // IOCTLs need specialized printing depending on the IOCTL code.
+        pIoctlData = (PPORTSNIFFER_IOCTL_DATA)pPopResponse->Data;
+        printf(" ");
+
+        if (!_PrintIoctlResponse(pIoctlData, pPopResponse->DataLength))
+        {
+            return FALSE;
+        }
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_GAP)
+    {
+        // The driver had to drop entries, because we couldn't keep up.
+        pGapData = (PPORTSNIFFER_GAP_DATA)pPopResponse->Data;
+        printf(" Dropped %lu log entries with %I64u bytes of data", pGapData->DroppedEntries, pGapData->DroppedBytes);
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_LIFECYCLE)
+    {
+        // A monitored request has been completed.
+        _PrintLifecycleResponse(pPopResponse);
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_LINE_STATUS)
+    {
+        // The line status reported to the application has changed.
+        _PrintLineStatusResponse(pPopResponse);
+    }
+    else if (pPopResponse->Type == PORTSNIFFER_PORTLOG_REPEAT)
+    {
+        // The driver has suppressed entries repeating an earlier entry of their type, up to the last one printed.
+        pRepeatData = (PPORTSNIFFER_REPEAT_DATA)pPopResponse->Data;
+        printf(" Repeated %s entry #%lu %lu times with %I64u bytes of data",
+               (pRepeatData->RepeatedType == PORTSNIFFER_MONITOR_READ) ? "read" :
+               (pRepeatData->RepeatedType == PORTSNIFFER_MONITOR_WRITE) ? "write" : "IOCTL",
+               pRepeatData->RepeatedSequenceNumber,
+               pRepeatData->RepeatedEntries,
+               pRepeatData->RepeatedBytes);
+        _PrintDuration((ULONGLONG)(pRepeatData->LastTimestamp.QuadPart - pPopResponse->Timestamp.QuadPart));
+    }
+    else
+    {
+        // For read and write requests, we just dump the bytes of the buffer.
+        for (i = 0; i < pPopResponse->DataLength; i++)
+        {
+            printf(" %02X", pPopResponse->Data[i]);
+        }
+
+        // The driver has only captured the first bytes because of the SNAPLEN.
+        if (pPopResponse->Flags & PORTSNIFFER_PORTLOG_FLAG_TRUNCATED)
+        {
+            printf(" ... (%u bytes captured)", pPopResponse->DataLength);
+        }
+
+        // The driver has coalesced data arriving over this many performance counter ticks into a single entry.
+        if (pPopResponse->Duration > 0)
+        {
+            _PrintDuration(pPopResponse->Duration);
+        }
+    }
+
+    // The entry stands for this many requests, because the driver only captures a sample of them.
+    if (pPopResponse->SamplingWeight > 1)
+    {
+        printf(" [1:%u]", pPopResponse->SamplingWeight);
+    }
+
+    printf("\n");
+    return TRUE;
+}
+
+static void
+_PrintNoLongerAttached(
+    __in PCWSTR pwszPort
+    )
+{
+    fprintf(stderr, "The PortSniffer Driver is no longer attached to %S!\n", pwszPort);
+    fprintf(stderr, "Please run this tool using the /attach option.\n");
+}
+
+static void
+_PrintSummary(
+    __in HANDLE hPortSniffer,
+    __in PCWSTR pwszPort
+    )
+{
+    DWORD cbReturned;
+    PORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST CountersRequest;
+    PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE CountersResponse;
+
+    StringCchCopyW(CountersRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+
+    if (!PortSnifferDeviceIoControl(hPortSniffer,
+        (DWORD)PORTSNIFFER_IOCTL_CONTROL_GET_PORTLOG_COUNTERS,
+        &CountersRequest,
+        sizeof(PORTSNIFFER_GET_PORTLOG_COUNTERS_REQUEST),
+        &CountersResponse,
+        sizeof(PORTSNIFFER_GET_PORTLOG_COUNTERS_RESPONSE),
+        &cbReturned))
+    {
+        // There is nothing to report if the driver has been detached from the port in the meantime.
+        if (GetLastError() != ERROR_FILE_NOT_FOUND)
+        {
+            fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_GET_PORTLOG_COUNTERS, last error is %lu.\n", GetLastError());
+        }
+
+        return;
+    }
+
+    printf("\n%lu log entries in total, %lu of them dropped with %I64u bytes of data.\n",
+           CountersResponse.NextSequenceNumber,
+           CountersResponse.DroppedEntries,
+           CountersResponse.DroppedBytes);
+
+    // These count every monitored request, even if only a sample of them has been captured.
+    printf("%I64u read requests with %I64u bytes, %I64u write requests with %I64u bytes, %I64u IOCTL requests.\n",
+           CountersResponse.ReadRequests,
+           CountersResponse.ReadBytes,
+           CountersResponse.WriteRequests,
+           CountersResponse.WriteBytes,
+           CountersResponse.IoctlRequests);
+}
+
+static BOOL
+_ConsumeSharedPortLog(
+    __in HANDLE hPortSniffer,
+    __in PCWSTR pwszPort
+    )
+{
+    BOOL bReturnValue = FALSE;
+    DWORD cbReturned;
+    DWORD dwWaitResult;
+    HANDLE hEvent;
+    HANDLE hWaitHandles[2];
+    PORTSNIFFER_MAP_PORTLOG_REQUEST MapRequest;
+    PORTSNIFFER_MAP_PORTLOG_RESPONSE MapResponse;
+    PPORTLOG_SHARED_HEADER pHeader;
+    PPORTLOG_RECORD pRecord;
+    PORTLOG_RING Ring;
+
+    // The driver sets this event when it has added log entries while we are waiting.
+    hEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    if (!hEvent)
+    {
+        fprintf(stderr, "CreateEventW failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    // Map the port log into our process. It stays mapped until we close our handle to the driver.
+    StringCchCopyW(MapRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    MapRequest.Event = (ULONG_PTR)hEvent;
+
+    if (!PortSnifferDeviceIoControl(hPortSniffer,
+        (DWORD)PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG,
+        &MapRequest,
+        sizeof(PORTSNIFFER_MAP_PORTLOG_REQUEST),
+        &MapResponse,
+        sizeof(PORTSNIFFER_MAP_PORTLOG_RESPONSE),
+        &cbReturned))
+    {
+        fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_MAP_PORTLOG, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    pHeader = (PPORTLOG_SHARED_HEADER)(ULONG_PTR)MapResponse.Address;
+    PortLogSharedConsumerInitialize(pHeader, &Ring);
+
+    hWaitHandles[0] = hEvent;
+    hWaitHandles[1] = _hTerminationEvent;
+
+    while (!_bTerminationRequested)
+    {
+        // Print all log entries the driver has added so far, right from the shared port log.
+        PortLogSharedConsumerSync(&Ring, pHeader);
+        while ((pRecord = PortLogRingPeek(&Ring)) != NULL)
+        {
+            if (!_PrintResponse(PORTLOG_RECORD_PAYLOAD(pRecord)))
+            {
+                goto Cleanup;
+            }
+
+            PortLogRingRemove(&Ring, pRecord);
+        }
+
+        // Give the space back to the driver.
+        PortLogSharedConsumerPublish(&Ring, pHeader);
+
+        if (PortLogSharedConsumerPrepareWait(&Ring, pHeader))
+        {
+            dwWaitResult = WaitForMultipleObjects(_countof(hWaitHandles), hWaitHandles, FALSE, INFINITE);
+            if (dwWaitResult == WAIT_OBJECT_0 + 1)
+            {
+                break;
+            }
+            else if (dwWaitResult != WAIT_OBJECT_0)
+            {
+                fprintf(stderr, "WaitForMultipleObjects failed, last error is %lu.\n", GetLastError());
+                goto Cleanup;
+            }
+        }
+        else if (Ring.Head == Ring.Tail && (pHeader->Flags & PORTLOG_SHARED_FLAG_DETACHED))
+        {
+            // We have printed everything and the driver won't add anything anymore.
+            _PrintNoLongerAttached(pwszPort);
+            goto Cleanup;
+        }
+    }
+
+    bReturnValue = TRUE;
+
+Cleanup:
+    if (hEvent)
+    {
+        CloseHandle(hEvent);
+    }
+
+    return bReturnValue;
+}
+
+// Keeps a PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES request pending until termination is requested
+// and calls pfnConsumeEntry for every log entry it delivers.
+static BOOL
+_WaitForEntries(
+    __in HANDLE hPortSniffer,
+    __in PCWSTR pwszPort,
+    __in PPORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST pWaitRequest,
+    __in CONSUME_ENTRY_ROUTINE pfnConsumeEntry,
+    __inout_opt PVOID pContext
+    )
+{
+    BOOL bReturnValue = FALSE;
+    DWORD cbReturned;
+    DWORD dwWaitResult;
+    HANDLE hWaitHandles[2];
+    OVERLAPPED Overlapped;
+    PPORTLOG_RECORD pRecord;
+    ULONG Offset;
+
+    // This event is set when the driver completes our wait request.
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+    {
+        fprintf(stderr, "CreateEventW failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    hWaitHandles[0] = Overlapped.hEvent;
+    hWaitHandles[1] = _hTerminationEvent;
+
+    while (!_bTerminationRequested)
+    {
+        if (!DeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES,
+            pWaitRequest,
+            sizeof(PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST),
+            _SubscriptionBuffer,
+            sizeof(_SubscriptionBuffer),
+            &cbReturned,
+            &Overlapped))
+        {
+            if (GetLastError() != ERROR_IO_PENDING)
+            {
+                if (GetLastError() == ERROR_FILE_NOT_FOUND)
+                {
+                    _PrintNoLongerAttached(pwszPort);
+                }
+                else
+                {
+                    fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES, last error is %lu.\n", GetLastError());
+                }
+
+                goto Cleanup;
+            }
+
+            dwWaitResult = WaitForMultipleObjects(_countof(hWaitHandles), hWaitHandles, FALSE, INFINITE);
+            if (dwWaitResult == WAIT_OBJECT_0 + 1)
+            {
+                // Don't leave the request behind when we exit.
+                CancelIo(hPortSniffer);
+                GetOverlappedResult(hPortSniffer, &Overlapped, &cbReturned, TRUE);
+                break;
+            }
+            else if (dwWaitResult != WAIT_OBJECT_0)
+            {
+                fprintf(stderr, "WaitForMultipleObjects failed, last error is %lu.\n", GetLastError());
+                goto Cleanup;
+            }
+
+            if (!GetOverlappedResult(hPortSniffer, &Overlapped, &cbReturned, FALSE))
+            {
+                // The driver cancels our request when it is detached from the port, and the next one reports that.
+                if (GetLastError() == ERROR_OPERATION_ABORTED)
+                {
+                    continue;
+                }
+
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES, last error is %lu.\n", GetLastError());
+                goto Cleanup;
+            }
+        }
+
+        // Hand over all log entries we have got.
+        Offset = 0;
+        while ((pRecord = PortLogGetPackedRecord(_SubscriptionBuffer, cbReturned, Offset)) != NULL)
+        {
+            if (!pfnConsumeEntry(PORTLOG_RECORD_PAYLOAD(pRecord), pContext))
+            {
+                goto Cleanup;
+            }
+
+            Offset += pRecord->Size;
+        }
+    }
+
+    bReturnValue = TRUE;
+
+Cleanup:
+    if (Overlapped.hEvent)
+    {
+        CloseHandle(Overlapped.hEvent);
+    }
+
+    return bReturnValue;
+}
+
+static BOOL
+_PrintEntry(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse,
+    __inout_opt PVOID pContext
+    )
+{
+    UNREFERENCED_PARAMETER(pContext);
+
+    return _PrintResponse(pPopResponse);
+}
+
+static BOOL
+_ConsumeSubscription(
+    __in HANDLE hPortSniffer,
+    __in PCWSTR pwszPort
+    )
+{
+    PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST WaitRequest;
+
+    // The empty port name addresses the port our handle is subscribed to.
+    // Get every log entry as soon as it has been added.
+    ZeroMemory(&WaitRequest, sizeof(WaitRequest));
+
+    return _WaitForEntries(hPortSniffer, pwszPort, &WaitRequest, _PrintEntry, NULL);
+}
+
+static BOOL
+_PrintResumedEntry(
+    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse,
+    __inout_opt PVOID pContext
+    )
+{
+    PPORTSNIFFER_GAP_DATA pGapData;
+    PRESUME_CONTEXT pResumeContext = (PRESUME_CONTEXT)pContext;
+
+    // Tell whether the previous run has been continued without losing anything in between.
+    // A gap entry takes the sequence number of its first dropped entry, so it continues at the expected one as well.
+    if (pResumeContext->bResume)
+    {
+        if (pPopResponse->SequenceNumber == *pResumeContext->pulNextSequenceNumber && pPopResponse->Type != PORTSNIFFER_PORTLOG_GAP)
+        {
+            fprintf(stderr, "Resumed at sequence number %lu without a gap.\n", *pResumeContext->pulNextSequenceNumber);
+        }
+        else if (pPopResponse->SequenceNumber == *pResumeContext->pulNextSequenceNumber)
+        {
+            fprintf(stderr, "Resumed at sequence number %lu, but entries have been dropped right after it!\n", *pResumeContext->pulNextSequenceNumber);
+        }
+        else
+        {
+            fprintf(stderr, "Expected to resume at sequence number %lu, but the port log continues at %lu!\n", *pResumeContext->pulNextSequenceNumber, pPopResponse->SequenceNumber);
+        }
+
+        pResumeContext->bResume = FALSE;
+    }
+
+    if (!_PrintResponse(pPopResponse))
+    {
+        return FALSE;
+    }
+
+    // A gap entry stands for all the entries it reports.
+    *pResumeContext->pulNextSequenceNumber = pPopResponse->SequenceNumber + 1;
+    if (pPopResponse->Type == PORTSNIFFER_PORTLOG_GAP)
+    {
+        pGapData = (PPORTSNIFFER_GAP_DATA)pPopResponse->Data;
+        *pResumeContext->pulNextSequenceNumber = pPopResponse->SequenceNumber + pGapData->DroppedEntries;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+_ConsumePortLog(
+    __in HANDLE hPortSniffer,
+    __in PCWSTR pwszPort,
+    __in BOOL bResume,
+    __inout PULONG pulNextSequenceNumber
+    )
+{
+    RESUME_CONTEXT ResumeContext;
+    PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST WaitRequest;
+
+    // Pop every log entry from the private port log as soon as it has been added.
+    // Unlike a mapped port log, it stays with the port when we exit, so a later run can continue where we have stopped.
+    ZeroMemory(&WaitRequest, sizeof(WaitRequest));
+    StringCchCopyW(WaitRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+
+    // Keep track of the sequence number expected next.
+    ResumeContext.bResume = bResume;
+    ResumeContext.pulNextSequenceNumber = pulNextSequenceNumber;
+
+    return _WaitForEntries(hPortSniffer, pwszPort, &WaitRequest, _PrintResumedEntry, &ResumeContext);
+}
+
+static BOOL
+_PrintTriggerEntries(
+    __in DWORD cbEntries,
+    __in PLARGE_INTEGER pTriggerTimestamp,
+    __inout PBOOL pbTriggerPrinted
+    )
+{
+    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse;
+    PPORTLOG_RECORD pRecord;
+    ULONG Offset;
+
+    Offset = 0;
+    while ((pRecord = PortLogGetPackedRecord(_SubscriptionBuffer, cbEntries, Offset)) != NULL)
+    {
+        // Mark the entry that has fired the trigger.
+        pPopResponse = PORTLOG_RECORD_PAYLOAD(pRecord);
+        if (!*pbTriggerPrinted && pPopResponse->Type != PORTSNIFFER_PORTLOG_CLOCK && pPopResponse->Timestamp.QuadPart == pTriggerTimestamp->QuadPart)
+        {
+            printf("------------------------+---+------+ TRIGGER\n");
+            *pbTriggerPrinted = TRUE;
+        }
+
+        if (!_PrintResponse(pPopResponse))
+        {
+            return FALSE;
+        }
+
+        Offset += pRecord->Size;
+    }
+
+    return TRUE;
+}
+
+static BOOL
+_WaitForTrigger(
+    __in HANDLE hPortSniffer,
+    __in PCWSTR pwszPort
+    )
+{
+    BOOL bReturnValue = FALSE;
+    BOOL bTriggerPrinted = FALSE;
+    DWORD cbReturned;
+    DWORD dwWaitResult;
+    PORTSNIFFER_GET_PORT_TRIGGER_REQUEST GetPortTriggerRequest;
+    PORTSNIFFER_GET_PORT_TRIGGER_RESPONSE GetPortTriggerResponse;
+    HANDLE hWaitHandles[2];
+    OVERLAPPED Overlapped;
+    PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST PopRequest;
+    PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST WaitRequest;
+
+    // This event is set when the driver completes our wait request.
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent)
+    {
+        fprintf(stderr, "CreateEventW failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    // The driver holds back all entries until the capture around the trigger is complete and then delivers them at once.
+    ZeroMemory(&WaitRequest, sizeof(WaitRequest));
+    StringCchCopyW(WaitRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+
+    hWaitHandles[0] = Overlapped.hEvent;
+    hWaitHandles[1] = _hTerminationEvent;
+
+    fprintf(stderr, "Waiting for the trigger on %S...\n", pwszPort);
+
+    for (;;)
+    {
+        if (DeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES,
+            &WaitRequest,
+            sizeof(PORTSNIFFER_WAIT_PORTLOG_ENTRIES_REQUEST),
+            _SubscriptionBuffer,
+            sizeof(_SubscriptionBuffer),
+            &cbReturned,
+            &Overlapped))
+        {
+            break;
+        }
+
+        if (GetLastError() != ERROR_IO_PENDING)
+        {
+            if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            {
+                _PrintNoLongerAttached(pwszPort);
+            }
+            else
+            {
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES, last error is %lu.\n", GetLastError());
+            }
+
+            goto Cleanup;
+        }
+
+        dwWaitResult = WaitForMultipleObjects(_countof(hWaitHandles), hWaitHandles, FALSE, INFINITE);
+        if (dwWaitResult == WAIT_OBJECT_0 + 1)
+        {
+            // Don't leave the request behind when we exit. The trigger has never fired, so there is nothing to print.
+            CancelIo(hPortSniffer);
+            GetOverlappedResult(hPortSniffer, &Overlapped, &cbReturned, TRUE);
+            bReturnValue = TRUE;
+            goto Cleanup;
+        }
+        else if (dwWaitResult != WAIT_OBJECT_0)
+        {
+            fprintf(stderr, "WaitForMultipleObjects failed, last error is %lu.\n", GetLastError());
+            goto Cleanup;
+        }
+
+        if (GetOverlappedResult(hPortSniffer, &Overlapped, &cbReturned, FALSE))
+        {
+            break;
+        }
+
+        // The driver cancels our request when it is detached from the port, and the next one reports that.
+        if (GetLastError() != ERROR_OPERATION_ABORTED)
+        {
+            fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_WAIT_PORTLOG_ENTRIES, last error is %lu.\n", GetLastError());
+            goto Cleanup;
+        }
+    }
+
+    // The clock entries before the trigger may have been trimmed away, so start with the clock taken when it fired.
+    StringCchCopyW(GetPortTriggerRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+
+    if (!PortSnifferDeviceIoControl(hPortSniffer,
+        (DWORD)PORTSNIFFER_IOCTL_CONTROL_GET_PORT_TRIGGER,
+        &GetPortTriggerRequest,
+        sizeof(PORTSNIFFER_GET_PORT_TRIGGER_REQUEST),
+        &GetPortTriggerResponse,
+        sizeof(PORTSNIFFER_GET_PORT_TRIGGER_RESPONSE),
+        &cbReturned))
+    {
+        fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_GET_PORT_TRIGGER, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    CopyMemory(&_ClockData, &GetPortTriggerResponse.Clock, sizeof(PORTSNIFFER_CLOCK_DATA));
+    _bClockDataValid = (_ClockData.PerformanceFrequency.QuadPart > 0);
+
+    // Print the entries we have got along with the wait request and pop all others the driver is holding for us.
+    StringCchCopyW(PopRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+
+    do
+    {
+        if (!_PrintTriggerEntries(cbReturned, &GetPortTriggerResponse.Timestamp, &bTriggerPrinted))
+        {
+            goto Cleanup;
+        }
+
+        if (!PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES,
+            &PopRequest,
+            sizeof(PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST),
+            _SubscriptionBuffer,
+            sizeof(_SubscriptionBuffer),
+            &cbReturned))
+        {
+            fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRIES, last error is %lu.\n", GetLastError());
+            goto Cleanup;
+        }
+    }
+    while (cbReturned > 0);
+
+    bReturnValue = TRUE;
+
+Cleanup:
+    if (Overlapped.hEvent)
+    {
+        CloseHandle(Overlapped.hEvent);
+    }
+
+    return bReturnValue;
+}
+
+int
+HandleMonitorParameter(
+    __in PCWSTR pwszPort,
+    __in PCWSTR pwszTypes,
+    __in int argc,
+    __in_ecount(argc) wchar_t* argv[]
+    )
+{
+    BOOL bKeepSettings;
+    BOOL bLingering = FALSE;
+    BOOL bMonitoringStarted = FALSE;
+    BOOL bResume = FALSE;
+    BOOL bSubscribe = FALSE;
+    BOOL bSubscribed = FALSE;
+    PORTSNIFFER_ARM_PORT_TRIGGER_REQUEST ArmPortTriggerRequest;
+    DWORD cbReturned;
+    PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST ConfigurePortLogRequest;
+    HANDLE hPortSniffer = INVALID_HANDLE_VALUE;
+    int i;
+    int iReturnValue = 1;
+    PCWSTR pwszCapacity = NULL;
+    PCWSTR pwszCoalesceGap = NULL;
+    PCWSTR pwszFilter = NULL;
+    PCWSTR pwszIoctls = NULL;
+    PCWSTR pwszLingerTime = NULL;
+    PCWSTR pwszPostTrigger = NULL;
+    PCWSTR pwszPreTrigger = NULL;
+    PCWSTR pwszRepeatDepth = NULL;
+    PCWSTR pwszResume = NULL;
+    PCWSTR pwszSamplingRate = NULL;
+    PCWSTR pwszSnapLength = NULL;
+    PCWSTR pwszTrigger = NULL;
+    PORTSNIFFER_RESET_PORT_MONITORING_REQUEST ResetPortMonitoringRequest;
+    PORTSNIFFER_SET_CAPTURE_FILTER_REQUEST SetCaptureFilterRequest;
+    PORTSNIFFER_SET_IOCTL_FILTER_REQUEST SetIoctlFilterRequest;
+    PORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST SetPortMonitorMaskRequest;
+    PORTSNIFFER_SUBSCRIBE_PORT_REQUEST SubscribePortRequest;
+    PORTSNIFFER_SET_CAPTURE_FILTER_REQUEST TriggerProgram;
+    ULONG ulNextSequenceNumber = 0;
+
+    // The optional SIZE and GAP are positional, the options may be given anywhere after them.
+    ConfigurePortLogRequest.SamplingMode = PORTSNIFFER_SAMPLING_NONE;
+
+    for (i = 0; i < argc; i++)
+    {
+        if (wcscmp(argv[i], L"/ioctls") == 0 && i + 1 < argc)
+        {
+            pwszIoctls = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/filter") == 0 && i + 1 < argc)
+        {
+            pwszFilter = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/snaplen") == 0 && i + 1 < argc)
+        {
+            pwszSnapLength = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/sample") == 0 && i + 1 < argc)
+        {
+            ConfigurePortLogRequest.SamplingMode = PORTSNIFFER_SAMPLING_REQUESTS;
+            pwszSamplingRate = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/sampleseconds") == 0 && i + 1 < argc)
+        {
+            ConfigurePortLogRequest.SamplingMode = PORTSNIFFER_SAMPLING_SECONDS;
+            pwszSamplingRate = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/repeats") == 0 && i + 1 < argc)
+        {
+            pwszRepeatDepth = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/subscribe") == 0)
+        {
+            bSubscribe = TRUE;
+        }
+        else if (wcscmp(argv[i], L"/trigger") == 0 && i + 1 < argc)
+        {
+            pwszTrigger = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/pre") == 0 && i + 1 < argc)
+        {
+            pwszPreTrigger = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/post") == 0 && i + 1 < argc)
+        {
+            pwszPostTrigger = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/linger") == 0 && i + 1 < argc)
+        {
+            pwszLingerTime = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/resume") == 0 && i + 1 < argc)
+        {
+            pwszResume = argv[++i];
+        }
+        else if (wcscmp(argv[i], L"/us") == 0)
+        {
+            _iFractionDigits = 6;
+            _ulFractionDivisor = 1000;
+        }
+        else if (wcscmp(argv[i], L"/ns") == 0)
+        {
+            _iFractionDigits = 9;
+            _ulFractionDivisor = 1;
+        }
+        else if (!pwszCapacity)
+        {
+            pwszCapacity = argv[i];
+        }
+        else if (!pwszCoalesceGap)
+        {
+            pwszCoalesceGap = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Unexpected parameter: %S\n", argv[i]);
+            goto Cleanup;
+        }
+    }
+
+    // Check the input parameters and prepare the IOCTL requests.
+    if (wcslen(pwszPort) >= PORTSNIFFER_PORTNAME_LENGTH)
+    {
+        fprintf(stderr, "Port name is too long: %S\n", pwszPort);
+        goto Cleanup;
+    }
+
+    StringCchCopyW(ResetPortMonitoringRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+
+    if (!_ParseTypes(pwszTypes, &ResetPortMonitoringRequest.MonitorMask))
+    {
+        goto Cleanup;
+    }
+
+    StringCchCopyW(SubscribePortRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    SubscribePortRequest.MonitorMask = ResetPortMonitoringRequest.MonitorMask;
+
+    // A trigger holds its capture for a single consumer, so it can't be combined with a subscription.
+    if (pwszTrigger && bSubscribe)
+    {
+        fprintf(stderr, "/trigger can't be combined with /subscribe!\n");
+        goto Cleanup;
+    }
+
+    if (!pwszTrigger && (pwszPreTrigger || pwszPostTrigger))
+    {
+        fprintf(stderr, "/pre and /post require /trigger!\n");
+        goto Cleanup;
+    }
+
+    // The trigger is given in the same syntax as a capture filter.
+    // Lengths of 0 let the driver split the port log capacity equally.
+    StringCchCopyW(ArmPortTriggerRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    ArmPortTriggerRequest.MonitorMask = ResetPortMonitoringRequest.MonitorMask;
+    ArmPortTriggerRequest.PreTriggerLength = 0;
+    ArmPortTriggerRequest.PostTriggerLength = 0;
+    ArmPortTriggerRequest.InstructionCount = 0;
+
+    if (pwszTrigger)
+    {
+        if (!_ParseCaptureFilter(pwszTrigger, &TriggerProgram))
+        {
+            goto Cleanup;
+        }
+
+        ArmPortTriggerRequest.InstructionCount = TriggerProgram.InstructionCount;
+        CopyMemory(ArmPortTriggerRequest.Instructions, TriggerProgram.Instructions, TriggerProgram.InstructionCount * sizeof(CAPTURE_FILTER_INSTRUCTION));
+    }
+
+    if (pwszPreTrigger && !_ParseCapacity(pwszPreTrigger, &ArmPortTriggerRequest.PreTriggerLength))
+    {
+        goto Cleanup;
+    }
+
+    if (pwszPostTrigger && !_ParseCapacity(pwszPostTrigger, &ArmPortTriggerRequest.PostTriggerLength))
+    {
+        goto Cleanup;
+    }
+
+    // Lingering and resuming continue with whatever the port log has buffered, so they need a port log of their own.
+    if ((pwszLingerTime || pwszResume) && (pwszTrigger || bSubscribe))
+    {
+        fprintf(stderr, "/linger and /resume can't be combined with /trigger or /subscribe!\n");
+        goto Cleanup;
+    }
+
+    StringCchCopyW(SetPortMonitorMaskRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    SetPortMonitorMaskRequest.MonitorMask = ResetPortMonitoringRequest.MonitorMask;
+    SetPortMonitorMaskRequest.LingerTime = 0;
+
+    if (pwszLingerTime && !_ParseLingerTime(pwszLingerTime, &SetPortMonitorMaskRequest.LingerTime))
+    {
+        goto Cleanup;
+    }
+
+    if (pwszResume)
+    {
+        if (!_ParseSequenceNumber(pwszResume, &ulNextSequenceNumber))
+        {
+            goto Cleanup;
+        }
+
+        bResume = TRUE;
+    }
+
+    // These consumers share the port log with others or with a previous run and leave its settings alone unless they have been given any.
+    bKeepSettings = (bSubscribe || pwszLingerTime || pwszResume);
+
+    // We consume all log entries from a shared port log, which always drops new entries when it is full.
+    StringCchCopyW(ConfigurePortLogRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    ConfigurePortLogRequest.Capacity = 0;
+    ConfigurePortLogRequest.OverflowPolicy = PORTSNIFFER_OVERFLOW_DROP_NEWEST;
+    ConfigurePortLogRequest.CoalesceGap = 0;
+    ConfigurePortLogRequest.SnapLength = 0;
+    ConfigurePortLogRequest.SamplingRate = 0;
+    ConfigurePortLogRequest.RepeatDepth = 0;
+
+    if (pwszCapacity && !_ParseCapacity(pwszCapacity, &ConfigurePortLogRequest.Capacity))
+    {
+        goto Cleanup;
+    }
+
+    if (pwszCoalesceGap && !_ParseCoalesceGap(pwszCoalesceGap, &ConfigurePortLogRequest.CoalesceGap))
+    {
+        goto Cleanup;
+    }
+
+    if (pwszSnapLength && !_ParseSnapLength(pwszSnapLength, &ConfigurePortLogRequest.SnapLength))
+    {
+        goto Cleanup;
+    }
+
+    if (pwszSamplingRate && !_ParseSamplingRate(pwszSamplingRate, &ConfigurePortLogRequest.SamplingRate))
+    {
+        goto Cleanup;
+    }
+
+    if (pwszRepeatDepth && !_ParseRepeatDepth(pwszRepeatDepth, &ConfigurePortLogRequest.RepeatDepth))
+    {
+        goto Cleanup;
+    }
+
+    // Log all IOCTLs unless only some of them have been selected.
+    StringCchCopyW(SetIoctlFilterRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    FillMemory(SetIoctlFilterRequest.Functions, sizeof(SetIoctlFilterRequest.Functions), 0xFF);
+
+    if (pwszIoctls && !_ParseIoctlFilter(pwszIoctls, SetIoctlFilterRequest.Functions))
+    {
+        goto Cleanup;
+    }
+
+    // Capture every entry unless a filter expression has been given.
+    StringCchCopyW(SetCaptureFilterRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+    SetCaptureFilterRequest.InstructionCount = 0;
+
+    if (pwszFilter && !_ParseCaptureFilter(pwszFilter, &SetCaptureFilterRequest))
+    {
+        goto Cleanup;
+    }
+
+    // Connect to our driver.
+    hPortSniffer = OpenPortSniffer();
+    if (hPortSniffer == INVALID_HANDLE_VALUE)
+    {
+        goto Cleanup;
+    }
+
+    // Verify that driver and tool are compatible.
+    if (!VerifyDriverAndToolVersions(hPortSniffer, FALSE, NULL))
+    {
+        goto Cleanup;
+    }
+
+    // Configure the port log. Without any options, this restores the default capacity and disables coalescing, truncation,
+    // sampling and the suppression of repetitions.
+    if ((!bKeepSettings || pwszCapacity || pwszCoalesceGap || pwszSnapLength || pwszSamplingRate || pwszRepeatDepth) && !PortSnifferDeviceIoControl(hPortSniffer,
+        (DWORD)PORTSNIFFER_IOCTL_CONTROL_CONFIGURE_PORTLOG,
+        &ConfigurePortLogRequest,
+        sizeof(PORTSNIFFER_CONFIGURE_PORTLOG_REQUEST),
+        NULL,
+        0,
+        &cbReturned))
+    {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+        {
+            fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
+            fprintf(stderr, "Please run this tool using the /attach option.\n");
+        }
+        else
+        {
+            fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_CONFIGURE_PORTLOG, last error is %lu.\n", GetLastError());
+        }
+
+        goto Cleanup;
+    }
+
+    // The IOCTL filter persists as well, so always set it.
+    if ((!bKeepSettings || pwszIoctls) && !PortSnifferDeviceIoControl(hPortSniffer,
+        (DWORD)PORTSNIFFER_IOCTL_CONTROL_SET_IOCTL_FILTER,
+        &SetIoctlFilterRequest,
+        sizeof(PORTSNIFFER_SET_IOCTL_FILTER_REQUEST),
+        NULL,
+        0,
+        &cbReturned))
+    {
+        fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_SET_IOCTL_FILTER, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    // Same for the capture filter.
+    if ((!bKeepSettings || pwszFilter) && !PortSnifferDeviceIoControl(hPortSniffer,
+        (DWORD)PORTSNIFFER_IOCTL_CONTROL_SET_CAPTURE_FILTER,
+        &SetCaptureFilterRequest,
+        sizeof(PORTSNIFFER_SET_CAPTURE_FILTER_REQUEST),
+        NULL,
+        0,
+        &cbReturned))
+    {
+        fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_SET_CAPTURE_FILTER, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    // This event wakes us up when monitoring shall be stopped.
+    _hTerminationEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!_hTerminationEvent)
+    {
+        fprintf(stderr, "CreateEventW failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    if (pwszTrigger)
+    {
+        // Start monitoring on this port and keep the entries around the first one matching the trigger.
+        if (!PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_ARM_PORT_TRIGGER,
+            &ArmPortTriggerRequest,
+            sizeof(PORTSNIFFER_ARM_PORT_TRIGGER_REQUEST),
+            NULL,
+            0,
+            &cbReturned))
+        {
+            if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            {
+                fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
+                fprintf(stderr, "Please run this tool using the /attach option.\n");
+            }
+            else if (GetLastError() == ERROR_BUSY)
+            {
+                fprintf(stderr, "%S has subscribers, so no trigger can be armed!\n", pwszPort);
+            }
+            else
+            {
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_ARM_PORT_TRIGGER, last error is %lu.\n", GetLastError());
+            }
+
+            goto Cleanup;
+        }
+
+        bMonitoringStarted = TRUE;
+    }
+    else if (pwszLingerTime || pwszResume)
+    {
+        // Set the monitor mask without discarding what the port log has buffered since a previous run.
+        // With a linger time, the driver goes on capturing for that long after our handle has been closed.
+        if (!PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_SET_PORT_MONITOR_MASK,
+            &SetPortMonitorMaskRequest,
+            sizeof(PORTSNIFFER_SET_PORT_MONITOR_MASK_REQUEST),
+            NULL,
+            0,
+            &cbReturned))
+        {
+            if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            {
+                fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
+                fprintf(stderr, "Please run this tool using the /attach option.\n");
+            }
+            else if (GetLastError() == ERROR_BUSY)
+            {
+                fprintf(stderr, "%S has subscribers, like an unattended capture, so /linger and /resume can't be used!\n", pwszPort);
+                fprintf(stderr, "Please use /subscribe to read its log entries alongside them.\n");
+            }
+            else
+            {
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_SET_PORT_MONITOR_MASK, last error is %lu.\n", GetLastError());
+            }
+
+            goto Cleanup;
+        }
+
+        if (pwszLingerTime)
+        {
+            bLingering = TRUE;
+        }
+        else
+        {
+            bMonitoringStarted = TRUE;
+        }
+    }
+    else if (!bSubscribe)
+    {
+        // Start monitoring on this port.
+        if (PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING,
+            &ResetPortMonitoringRequest,
+            sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST),
+            NULL,
+            0,
+            &cbReturned))
+        {
+            bMonitoringStarted = TRUE;
+        }
+        else if (GetLastError() == ERROR_BUSY)
+        {
+            // The subscribers, like an unattended capture of the port, control its monitoring.
+            printf("%S already has subscribers, like an unattended capture. Reading its log entries alongside them as with /subscribe.\n", pwszPort);
+            bSubscribe = TRUE;
+        }
+        else
+        {
+            if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            {
+                fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
+                fprintf(stderr, "Please run this tool using the /attach option.\n");
+            }
+            else
+            {
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING, last error is %lu.\n", GetLastError());
+            }
+
+            goto Cleanup;
+        }
+    }
+
+    if (bSubscribe)
+    {
+        // Read the log entries alongside other subscribers.
+        // The driver starts monitoring if necessary and stops it again when the last subscriber closes its handle.
+        if (!PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT,
+            &SubscribePortRequest,
+            sizeof(PORTSNIFFER_SUBSCRIBE_PORT_REQUEST),
+            NULL,
+            0,
+            &cbReturned))
+        {
+            if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            {
+                fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
+                fprintf(stderr, "Please run this tool using the /attach option.\n");
+            }
+            else
+            {
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_SUBSCRIBE_PORT, last error is %lu.\n", GetLastError());
+            }
+
+            goto Cleanup;
+        }
+
+        bSubscribed = TRUE;
+    }
+
+    // Handle Ctrl+C requests to gracefully stop monitoring.
+    if (!SetConsoleCtrlHandler(_CtrlHandlerRoutine, TRUE))
+    {
+        fprintf(stderr, "SetConsoleCtrlHandler failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
+    }
+
+    // Print the table header.
+    printf("UTC TIMESTAMP           | T |  LEN | DATA\n");
+
+    if (bSubscribed)
     {
-        if (*p == L'R')
+        // Get new port log entries through our own read position.
+        if (!_ConsumeSubscription(hPortSniffer, pwszPort))
         {
-            *pMonitorMask |= PORTSNIFFER_MONITOR_READ;
+            goto Cleanup;
         }
-        else if (*p == L'W')
+    }
+    else if (pwszTrigger)
+    {
+        // Get the held entries once the capture around the trigger is complete.
+        if (!_WaitForTrigger(hPortSniffer, pwszPort))
         {
-            *pMonitorMask |= PORTSNIFFER_MONITOR_WRITE;
+            goto Cleanup;
         }
-        else if (*p == L'C')
+    }
+    else if (bLingering || bResume)
+    {
+        // Pop the port log, which outlives us.
+        if (!_ConsumePortLog(hPortSniffer, pwszPort, bResume, &ulNextSequenceNumber))
         {
-            *pMonitorMask |= PORTSNIFFER_MONITOR_IOCTL;
+            goto Cleanup;
         }
-        else
+    }
+    else
+    {
+        // Read new port log entries directly from the driver's memory.
+        if (!_ConsumeSharedPortLog(hPortSniffer, pwszPort))
         {
-            fprintf(stderr, "Invalid character for TYPES: %lc\n", *p);
-            return FALSE;
+            goto Cleanup;
         }
     }
 
-    if (*pMonitorMask == 0)
+    iReturnValue = 0;
+
+Cleanup:
+    if (bSubscribed)
     {
-        fprintf(stderr, "No TYPES to monitor were given.\n");
-        return FALSE;
+        // Report how many entries the port has dropped. Closing our handle below ends the subscription.
+        _PrintSummary(hPortSniffer, pwszPort);
     }
 
-    return TRUE;
-}
-
-static void
-_PrintBitmask(
-    __in ULONG Bitmask,
-    __in const FLAG_TRANSLATION* TranslationTable,
-    __in size_t TranslationTableEntries
-    )
-{
-    BOOL bPrintedOne = FALSE;
-    size_t i;
+    if (bLingering)
+    {
+        // Closing our handle below starts the linger period. Monitoring is only stopped if no one resumes it in time.
+        _PrintSummary(hPortSniffer, pwszPort);
+        printf("The port keeps being monitored for %lu seconds. Pass /resume %lu to continue without a gap.\n", SetPortMonitorMaskRequest.LingerTime, ulNextSequenceNumber);
+    }
 
-    for (i = 0; i < TranslationTableEntries; i++)
+    if (bMonitoringStarted)
     {
-        if (Bitmask & TranslationTable[i].FlagBit)
-        {
-            if (bPrintedOne)
-            {
-                printf("|");
-            }
+        // Report how many entries we have missed.
+        _PrintSummary(hPortSniffer, pwszPort);
 
-            printf("%s", TranslationTable[i].pszFlagName);
-            bPrintedOne = TRUE;
-        }
+        // Tell our driver to stop monitoring now that we are gone.
+        // Failure to do so won't really do any harm, but keep the port log allocated and accumulate entries until it is full.
+        ResetPortMonitoringRequest.MonitorMask = PORTSNIFFER_MONITOR_NONE;
+        PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING,
+            &ResetPortMonitoringRequest,
+            sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST),
+            NULL,
+            0,
+            &cbReturned);
     }
-}
-
-static BOOL
-_PrintIoctlResponse(
-    __in PPORTSNIFFER_IOCTL_DATA pIoctlData
-    )
-{
-    const FLAG_TRANSLATION ControlHandShakeTranslationTable[] = {
-        { SERIAL_DTR_CONTROL, "SERIAL_DTR_CONTROL" },
-        { SERIAL_DTR_HANDSHAKE, "SERIAL_DTR_HANDSHAKE" },
-        { SERIAL_CTS_HANDSHAKE, "SERIAL_CTS_HANDSHAKE"},
-        { SERIAL_DSR_HANDSHAKE, "SERIAL_DSR_HANDSHAKE" },
-        { SERIAL_DCD_HANDSHAKE, "SERIAL_DCD_HANDSHAKE" },
-        { SERIAL_DSR_SENSITIVITY, "SERIAL_DSR_SENSITIVITY" },
-        { SERIAL_ERROR_ABORT, "SERIAL_ERROR_ABORT" }
-    };
-    const FLAG_TRANSLATION FlowReplaceTranslationTable[] = {
-        { SERIAL_AUTO_TRANSMIT, "SERIAL_AUTO_TRANSMIT" },
-        { SERIAL_AUTO_RECEIVE, "SERIAL_AUTO_RECEIVE" },
-        { SERIAL_ERROR_CHAR, "SERIAL_ERROR_CHAR" },
-        { SERIAL_NULL_STRIPPING, "SERIAL_NULL_STRIPPING" },
-        { SERIAL_BREAK_CHAR, "SERIAL_BREAK_CHAR" },
-        { SERIAL_RTS_CONTROL, "SERIAL_RTS_CONTROL" },
-        { SERIAL_RTS_HANDSHAKE, "SERIAL_RTS_HANDSHAKE" },
-        { SERIAL_XOFF_CONTINUE, "SERIAL_XOFF_CONTINUE" }
-    };
-    const char* pszParity[] = { "NO_PARITY", "ODD_PARITY", "EVEN_PARITY", "MARK_PARITY", "SPACE_PARITY" };
-    const char* pszStopBits[] = { "STOP_BIT_1", "STOP_BITS_1_5", "STOP_BITS_2" };
 
-    switch (pIoctlData->IoControlCode)
+    if (hPortSniffer != INVALID_HANDLE_VALUE)
     {
-        case IOCTL_SERIAL_CLR_DTR:
-            printf("IOCTL_SERIAL_CLR_DTR");
-            return TRUE;
+        CloseHandle(hPortSniffer);
+    }
 
-        case IOCTL_SERIAL_CLR_RTS:
-            printf("IOCTL_SERIAL_CLR_RTS");
-            return TRUE;
+    return iReturnValue;
+}
 
-        case IOCTL_SERIAL_SET_BAUD_RATE:
-            printf("IOCTL_SERIAL_SET_BAUD_RATE: %lu", pIoctlData->u.SerialBaudRate.BaudRate);
-            return TRUE;
+static void
+_PrintPortStatistics(
+    __in PPORTSNIFFER_PORT_STATISTICS pStatistics
+    )
+{
+    static const char* TypeNames[PORTSNIFFER_STATS_TYPES] = { "Read", "Write", "IOCTL" };
 
-        case IOCTL_SERIAL_SET_BREAK_OFF:
-            printf("IOCTL_SERIAL_SET_BREAK_OFF");
-            return TRUE;
+    ULONG Bucket;
+    PPORTSNIFFER_REQUEST_STATISTICS pRequests;
+    ULONG Type;
 
-        case IOCTL_SERIAL_SET_BREAK_ON:
-            printf("IOCTL_SERIAL_SET_BREAK_ON");
-            return TRUE;
+    printf("%.*S", PORTSNIFFER_PORTNAME_LENGTH, pStatistics->PortName);
+    if (pStatistics->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+    {
+        printf(" (collecting statistics for %lu seconds)\n", pStatistics->Seconds);
+    }
+    else
+    {
+        printf(" (not collecting statistics)\n");
+    }
 
-        case IOCTL_SERIAL_SET_DTR:
-            printf("IOCTL_SERIAL_SET_DTR");
-            return TRUE;
+    for (Type = 0; Type < PORTSNIFFER_STATS_TYPES; Type++)
+    {
+        pRequests = &pStatistics->Requests[Type];
+        printf("    %-5s %I64u requests, %I64u failed, %I64u bytes\n", TypeNames[Type], pRequests->Requests, pRequests->FailedRequests, pRequests->Bytes);
 
-        case IOCTL_SERIAL_SET_HANDFLOW:
-            printf("IOCTL_SERIAL_SET_HANDFLOW: ControlHandShake:");
-            _PrintBitmask(pIoctlData->u.SerialHandflow.ControlHandShake, ControlHandShakeTranslationTable, _countof(ControlHandShakeTranslationTable));
-            printf(", FlowReplace:");
-            _PrintBitmask(pIoctlData->u.SerialHandflow.FlowReplace, FlowReplaceTranslationTable, _countof(FlowReplaceTranslationTable));
-            printf(", XonLimit:%ld, XoffLimit:%ld", pIoctlData->u.SerialHandflow.XonLimit, pIoctlData->u.SerialHandflow.XoffLimit);
-            return TRUE;
+        if (pStatistics->MonitorMask & PORTSNIFFER_MONITOR_STATS)
+        {
+            printf("          %lu / %lu / %lu requests/s, %lu / %lu / %lu bytes/s over 1 / 10 / 60 seconds\n",
+                   pRequests->RequestRates[PORTSNIFFER_STATS_WINDOW_1S],
+                   pRequests->RequestRates[PORTSNIFFER_STATS_WINDOW_10S],
+                   pRequests->RequestRates[PORTSNIFFER_STATS_WINDOW_60S],
+                   pRequests->ByteRates[PORTSNIFFER_STATS_WINDOW_1S],
+                   pRequests->ByteRates[PORTSNIFFER_STATS_WINDOW_10S],
+                   pRequests->ByteRates[PORTSNIFFER_STATS_WINDOW_60S]);
+        }
 
-        case IOCTL_SERIAL_SET_LINE_CONTROL:
+        if (pRequests->Requests == 0)
         {
-            printf("IOCTL_SERIAL_SET_LINE_CONTROL: ");
+            continue;
+        }
 
-            if (pIoctlData->u.SerialLineControl.StopBits < _countof(pszStopBits))
+        // Only print the buckets that have been hit, labeled with their range of transferred bytes.
+        printf("          Sizes:");
+        for (Bucket = 0; Bucket < PORTSNIFFER_STATS_SIZE_BUCKETS; Bucket++)
+        {
+            if (pRequests->SizeHistogram[Bucket] == 0)
             {
-                printf("StopBits:%s, ", pszStopBits[pIoctlData->u.SerialLineControl.StopBits]);
+                continue;
             }
 
-            if (pIoctlData->u.SerialLineControl.Parity < _countof(pszParity))
+            if (Bucket <= 1)
             {
-                printf("Parity:%s, ", pszParity[pIoctlData->u.SerialLineControl.Parity]);
+                printf(" %lu: %I64u", Bucket, pRequests->SizeHistogram[Bucket]);
+            }
+            else if (Bucket == PORTSNIFFER_STATS_SIZE_BUCKETS - 1)
+            {
+                printf(" %lu+: %I64u", 1UL << (Bucket - 1), pRequests->SizeHistogram[Bucket]);
+            }
+            else
+            {
+                printf(" %lu-%lu: %I64u", 1UL << (Bucket - 1), (1UL << Bucket) - 1, pRequests->SizeHistogram[Bucket]);
             }
-
-            printf("WordLength:%u", pIoctlData->u.SerialLineControl.WordLength);
-            return TRUE;
         }
 
-        case IOCTL_SERIAL_SET_QUEUE_SIZE:
-            printf("IOCTL_SERIAL_SET_QUEUE_SIZE: InSize:%lu, OutSize:%lu",
-                   pIoctlData->u.SerialQueueSize.InSize,
-                   pIoctlData->u.SerialQueueSize.OutSize);
-            return TRUE;
-
-        case IOCTL_SERIAL_SET_RTS:
-            printf("IOCTL_SERIAL_SET_RTS");
-            return TRUE;
-
-        case IOCTL_SERIAL_SET_TIMEOUTS:
-            printf("IOCTL_SERIAL_SET_TIMEOUTS: ReadIntervalTimeout:%lu, ReadTotalTimeoutMultiplier:%lu, ReadTotalTimeoutConstant:%lu, WriteTotalTimeoutMultiplier:%lu, WriteTotalTimeoutConstant:%lu",
-                   pIoctlData->u.SerialTimeouts.ReadIntervalTimeout,
-                   pIoctlData->u.SerialTimeouts.ReadTotalTimeoutMultiplier,
-                   pIoctlData->u.SerialTimeouts.ReadTotalTimeoutConstant,
-                   pIoctlData->u.SerialTimeouts.WriteTotalTimeoutMultiplier,
-                   pIoctlData->u.SerialTimeouts.WriteTotalTimeoutConstant);
-            return TRUE;
-
-        case IOCTL_SERIAL_SET_XON:
-            printf("IOCTL_SERIAL_SET_XON");
-            return TRUE;
-
-        case IOCTL_SERIAL_SET_XOFF:
-            printf("IOCTL_SERIAL_SET_XOFF");
-            return TRUE;
-
-        default:
-            fprintf(stderr, "Captured an unknown IOCTL code: 0x%08X\n", pIoctlData->IoControlCode);
-            return FALSE;
+        printf("\n");
     }
 }
 
-static BOOL
-_PrintResponse(
-    __in PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse
+int
+HandleReadParameter(
+    __in PCWSTR pwszFile,
+    __in int argc,
+    __in_ecount(argc) wchar_t* argv[]
     )
 {
-    char cType;
-    PFILETIME pFileTimeStamp;
-    PPORTSNIFFER_IOCTL_DATA pIoctlData;
-    SYSTEMTIME SystemTimeStamp;
-    USHORT i;
+    PBYTE pBuffer = NULL;
+    DWORD cbFile;
+    DWORD cbRead;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    int i;
+    int iReturnValue = 1;
+    PPORTSNIFFER_CAPTURE_FILE_HEADER pHeader;
+    PPORTLOG_RECORD pRecord;
+    ULONG Offset;
 
-    // Convert the timestamp into a printable format.
-    // The LARGE_INTEGER Timestamp can be casted to a FILETIME (but not necessarily vice-versa!)
-    pFileTimeStamp = (PFILETIME)&pPopResponse->Timestamp;
-    FileTimeToSystemTime(pFileTimeStamp, &SystemTimeStamp);
+    for (i = 0; i < argc; i++)
+    {
+        if (wcscmp(argv[i], L"/us") == 0)
+        {
+            _iFractionDigits = 6;
+            _ulFractionDivisor = 1000;
+        }
+        else if (wcscmp(argv[i], L"/ns") == 0)
+        {
+            _iFractionDigits = 9;
+            _ulFractionDivisor = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Unexpected parameter: %S\n", argv[i]);
+            goto Cleanup;
+        }
+    }
 
-    // Indicate the monitored request via a single character.
-    if (pPopResponse->Type == PORTSNIFFER_MONITOR_READ)
+    // The driver may still be appending to the file, so let it keep writing.
+    hFile = CreateFileW(pwszFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
     {
-        cType = 'R';
+        fprintf(stderr, "Could not open \"%S\", last error is %lu.\n", pwszFile, GetLastError());
+        goto Cleanup;
     }
-    else if (pPopResponse->Type == PORTSNIFFER_MONITOR_WRITE)
+
+    // Capture files are size-capped by the driver, so just read them as a whole.
+    cbFile = GetFileSize(hFile, NULL);
+    if (cbFile == INVALID_FILE_SIZE)
     {
-        cType = 'W';
+        fprintf(stderr, "GetFileSize failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
     }
-    else if (pPopResponse->Type == PORTSNIFFER_MONITOR_IOCTL)
+
+    if (cbFile < sizeof(PORTSNIFFER_CAPTURE_FILE_HEADER))
     {
-        cType = 'C';
+        fprintf(stderr, "\"%S\" is not a PortSniffer capture file!\n", pwszFile);
+        goto Cleanup;
     }
-    else
+
+    pBuffer = HeapAlloc(GetProcessHeap(), 0, cbFile);
+    if (!pBuffer)
     {
-        fprintf(stderr, "Captured an invalid request type: 0x%04X\n", pPopResponse->Type);
-        return FALSE;
+        fprintf(stderr, "HeapAlloc failed, last error is %lu.\n", GetLastError());
+        goto Cleanup;
     }
 
-    // Print in the format "UTC TIMESTAMP | TYPE | LENGTH | DATA".
-    printf("%04u-%02u-%02u %02u:%02u:%02u.%03u | %c | %4u |",
-           SystemTimeStamp.wYear, SystemTimeStamp.wMonth, SystemTimeStamp.wDay,
-           SystemTimeStamp.wHour, SystemTimeStamp.wMinute, SystemTimeStamp.wSecond, SystemTimeStamp.wMilliseconds,
-           cType, pPopResponse->DataLength);
+    if (!ReadFile(hFile, pBuffer, cbFile, &cbRead, NULL))
+    {
+        fprintf(stderr, "Could not read from \"%S\", last error is %lu.\n", pwszFile, GetLastError());
+        goto Cleanup;
+    }
 
-    if (pPopResponse->Type == PORTSNIFFER_MONITOR_IOCTL)
+    pHeader = (PPORTSNIFFER_CAPTURE_FILE_HEADER)pBuffer;
+    if (cbRead < sizeof(PORTSNIFFER_CAPTURE_FILE_HEADER)
+        || pHeader->Signature != PORTSNIFFER_CAPTURE_FILE_SIGNATURE
+        || pHeader->HeaderLength < sizeof(PORTSNIFFER_CAPTURE_FILE_HEADER)
+        || pHeader->HeaderLength > cbRead)
     {
-        // IOCTLs need specialized printing depending on the IOCTL code.
-        pIoctlData = (PPORTSNIFFER_IOCTL_DATA)pPopResponse->Data;
-        printf(" ");
+        fprintf(stderr, "\"%S\" is not a PortSniffer capture file!\n", pwszFile);
+        goto Cleanup;
+    }
+
+    pHeader->PortName[PORTSNIFFER_PORTNAME_LENGTH - 1] = 0;
+    printf("Capture of %S written by PortSniffer Driver %hu.%hu\n", pHeader->PortName, pHeader->MajorVersion, pHeader->MinorVersion);
 
-        if (!_PrintIoctlResponse(pIoctlData))
+    // Timestamps are converted using the clock of the header until the first PORTSNIFFER_PORTLOG_CLOCK entry.
+    CopyMemory(&_ClockData, &pHeader->Clock, sizeof(PORTSNIFFER_CLOCK_DATA));
+    _bClockDataValid = (_ClockData.PerformanceFrequency.QuadPart > 0);
+
+    // Print all log entries of the file. A truncated last entry is skipped.
+    Offset = pHeader->HeaderLength;
+    while ((pRecord = PortLogGetPackedRecord(pBuffer, cbRead, Offset)) != NULL)
+    {
+        if (!_PrintResponse(PORTLOG_RECORD_PAYLOAD(pRecord)))
         {
-            return FALSE;
+            goto Cleanup;
         }
+
+        Offset += pRecord->Size;
     }
-    else
+
+    iReturnValue = 0;
+
+Cleanup:
+    if (pBuffer)
     {
-        // For read and write requests, we just dump the bytes of the buffer.
-        for (i = 0; i < pPopResponse->DataLength; i++)
-        {
-            printf(" %02X", pPopResponse->Data[i]);
-        }
+        HeapFree(GetProcessHeap(), 0, pBuffer);
     }
 
-    printf("\n");
-    return TRUE;
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+
+    return iReturnValue;
 }
 
 int
-HandleMonitorParameter(
-    __in PCWSTR pwszPort,
-    __in PCWSTR pwszTypes
+HandleStatsParameter(
+    __in_opt PCWSTR pwszPort,
+    __in BOOL bStop
     )
 {
-    BOOL bMonitoringStarted = FALSE;
+    DWORD cbResponse;
     DWORD cbReturned;
-    HANDLE hPortSniffer = INVALID_HANDLE_VALUE;
+    HANDLE hPortSniffer;
+    DWORD i;
     int iReturnValue = 1;
-    BYTE PopResponseBuffer[PORTSNIFFER_PORTLOG_ENTRY_LENGTH];
-    PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE pPopResponse = (PPORTSNIFFER_POP_PORTLOG_ENTRY_RESPONSE)PopResponseBuffer;
-    PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST PopRequest;
+    PPORTSNIFFER_GET_PORT_STATISTICS_RESPONSE pResponse = NULL;
     PORTSNIFFER_RESET_PORT_MONITORING_REQUEST ResetPortMonitoringRequest;
 
-    // Check the input parameters and prepare the IOCTL requests.
-    if (wcslen(pwszPort) >= PORTSNIFFER_PORTNAME_LENGTH)
-    {
-        fprintf(stderr, "Port name is too long: %S\n", pwszPort);
-        goto Cleanup;
-    }
-
-    StringCchCopyW(PopRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
-    StringCchCopyW(ResetPortMonitoringRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
-
-    if (!_ParseTypes(pwszTypes, &ResetPortMonitoringRequest.MonitorMask))
-    {
-        goto Cleanup;
-    }
-
     // Connect to our driver.
     hPortSniffer = OpenPortSniffer();
     if (hPortSniffer == INVALID_HANDLE_VALUE)
@@ -312,93 +2455,89 @@ HandleMonitorParameter(
         goto Cleanup;
     }
 
-    // Start monitoring on this port.
-    if (!DeviceIoControl(hPortSniffer,
-        (DWORD)PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING,
-        &ResetPortMonitoringRequest,
-        sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST),
-        NULL,
-        0,
-        &cbReturned,
-        NULL))
+    if (pwszPort)
     {
-        if (GetLastError() == ERROR_FILE_NOT_FOUND)
+        if (wcslen(pwszPort) >= PORTSNIFFER_PORTNAME_LENGTH)
         {
-            fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
-            fprintf(stderr, "Please run this tool using the /attach option.\n");
-        }
-        else
-        {
-            fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING, last error is %lu.\n", GetLastError());
+            fprintf(stderr, "Port name is too long: %S\n", pwszPort);
+            goto Cleanup;
         }
 
-        goto Cleanup;
-    }
-
-    bMonitoringStarted = TRUE;
-
-    // Handle Ctrl+C requests to gracefully stop monitoring.
-    if (!SetConsoleCtrlHandler(_CtrlHandlerRoutine, TRUE))
-    {
-        fprintf(stderr, "SetConsoleCtrlHandler failed, last error is %lu.\n", GetLastError());
-        goto Cleanup;
-    }
-
-    // Print the table header.
-    printf("UTC TIMESTAMP           | T |  LEN | DATA\n");
+        // Unlike /monitor, we leave collecting statistics running when we exit.
+        StringCchCopyW(ResetPortMonitoringRequest.PortName, PORTSNIFFER_PORTNAME_LENGTH, pwszPort);
+        ResetPortMonitoringRequest.MonitorMask = bStop ? PORTSNIFFER_MONITOR_NONE : PORTSNIFFER_MONITOR_STATS;
 
-    // Fetch new port log entries from our driver until we are terminated.
-    while (!_bTerminationRequested)
-    {
-        if (!DeviceIoControl(hPortSniffer,
-            (DWORD)PORTSNIFFER_IOCTL_CONTROL_POP_PORTLOG_ENTRY,
-            &PopRequest,
-            sizeof(PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST),
-            PopResponseBuffer,
-            sizeof(PopResponseBuffer),
-            &cbReturned,
-            NULL))
+        if (!PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING,
+            &ResetPortMonitoringRequest,
+            sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST),
+            NULL,
+            0,
+            &cbReturned))
         {
-            if (GetLastError() == ERROR_NO_MORE_ITEMS)
-            {
-                Sleep(10);
-                continue;
-            }
-            else if (GetLastError() == ERROR_FILE_NOT_FOUND)
+            if (GetLastError() == ERROR_FILE_NOT_FOUND)
             {
-                fprintf(stderr, "The PortSniffer Driver is no longer attached to %S!\n", pwszPort);
+                fprintf(stderr, "The PortSniffer Driver is not attached to %S!\n", pwszPort);
                 fprintf(stderr, "Please run this tool using the /attach option.\n");
-                goto Cleanup;
             }
             else
             {
-                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_POP_PORTLOG_ENTRY_REQUEST, last error is %lu.\n", GetLastError());
-                goto Cleanup;
+                fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING, last error is %lu.\n", GetLastError());
             }
+
+            goto Cleanup;
         }
 
-        if (!_PrintResponse(pPopResponse))
+        printf("%s collecting statistics for %S.\n", bStop ? "Stopped" : "Started", pwszPort);
+        iReturnValue = 0;
+        goto Cleanup;
+    }
+
+    // PORTSNIFFER_IOCTL_CONTROL_GET_PORT_STATISTICS returns a variable-sized buffer, with its Length as the first field.
+    // Retry with the returned length until the number of attached ports hasn't changed in-between.
+    cbResponse = sizeof(ULONG);
+    for (;;)
+    {
+        pResponse = HeapAlloc(GetProcessHeap(), 0, cbResponse);
+        if (!pResponse)
+        {
+            fprintf(stderr, "HeapAlloc failed, last error is %lu.\n", GetLastError());
+            goto Cleanup;
+        }
+
+        if (PortSnifferDeviceIoControl(hPortSniffer,
+            (DWORD)PORTSNIFFER_IOCTL_CONTROL_GET_PORT_STATISTICS,
+            NULL,
+            0,
+            pResponse,
+            cbResponse,
+            &cbResponse))
         {
+            break;
+        }
+
+        if (GetLastError() != ERROR_MORE_DATA)
+        {
+            fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_GET_PORT_STATISTICS, last error is %lu.\n", GetLastError());
             goto Cleanup;
         }
+
+        cbResponse = pResponse->Length;
+        HeapFree(GetProcessHeap(), 0, pResponse);
+        pResponse = NULL;
+    }
+
+    for (i = 0; (BYTE*)&pResponse->Ports[i + 1] <= (BYTE*)pResponse + cbResponse; i++)
+    {
+        _PrintPortStatistics(&pResponse->Ports[i]);
     }
 
     iReturnValue = 0;
 
 Cleanup:
-    if (bMonitoringStarted)
+    if (pResponse)
     {
-        // Tell our driver to stop monitoring now that we are gone.
-        // Failure to do so won't really do any harm, but accumulate port log entries until we have MAX_LOG_ENTRIES_PER_PORT.
-        ResetPortMonitoringRequest.MonitorMask = PORTSNIFFER_MONITOR_NONE;
-        DeviceIoControl(hPortSniffer,
-            (DWORD)PORTSNIFFER_IOCTL_CONTROL_RESET_PORT_MONITORING,
-            &ResetPortMonitoringRequest,
-            sizeof(PORTSNIFFER_RESET_PORT_MONITORING_REQUEST),
-            NULL,
-            0,
-            &cbReturned,
-            NULL);
+        HeapFree(GetProcessHeap(), 0, pResponse);
     }
 
     if (hPortSniffer != INVALID_HANDLE_VALUE)
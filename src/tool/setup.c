@@ -350,14 +350,13 @@ GetAttachedPorts(
             return NULL;
         }
 
-        if (DeviceIoControl(hPortSniffer,
+        if (PortSnifferDeviceIoControl(hPortSniffer,
             (DWORD)PORTSNIFFER_IOCTL_CONTROL_GET_ATTACHED_PORTS,
             NULL,
             0,
             pResponse,
             cbResponse,
-            &cbResponse,
-            NULL))
+            &cbResponse))
         {
             return pResponse;
         }
@@ -524,14 +523,13 @@ VerifyDriverAndToolVersions(
         pResponse = &response;
     }
 
-    if (!DeviceIoControl(hPortSniffer,
+    if (!PortSnifferDeviceIoControl(hPortSniffer,
         (DWORD)PORTSNIFFER_IOCTL_CONTROL_GET_VERSION,
         NULL,
         0,
         pResponse,
         sizeof(PORTSNIFFER_GET_VERSION_RESPONSE),
-        &cbReturned,
-        NULL))
+        &cbReturned))
     {
         fprintf(stderr, "DeviceIoControl failed for PORTSNIFFER_IOCTL_CONTROL_GET_VERSION, last error is %lu.\n", GetLastError());
         return FALSE;
@@ -9,8 +9,8 @@
 
 // We use Semantic Versioning (https://semver.org) without a patch version here.
 // Increase the major version on API-incompatible changes, increase the minor version on API-compatible changes.
-#define PORTSNIFFER_MAJOR_VERSION       2
-#define PORTSNIFFER_MINOR_VERSION       1
+#define PORTSNIFFER_MAJOR_VERSION       3
+#define PORTSNIFFER_MINOR_VERSION       0
 
 // The following two lines of macro magic turn arbitrary preprocessor constants into strings.
 #define STRINGIFY_INTERNAL(x)           #x
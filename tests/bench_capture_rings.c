@@ -0,0 +1,39 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "capturerings.h"
+
+#define ENTRIES_PER_PRODUCER    (4 * 1024 * 1024)
+
+static void
+_BenchCaptureRings(
+    ULONG Count
+    )
+{
+    TEST_DRAIN_RESULT result;
+    double seconds;
+
+    seconds = TestGetSeconds();
+    TestRunCaptureRings(Count, ENTRIES_PER_PRODUCER, FALSE, &result);
+    seconds = TestGetSeconds() - seconds;
+
+    printf("%lu capture ring(s): %6.1f M entries/s merged in %lu drain passes\n",
+           (unsigned long)Count, result.Entries / seconds / 1e6, (unsigned long)result.Passes);
+}
+
+int
+main(void)
+{
+    ULONG i;
+
+    for (i = 1; i <= CAPTURE_COUNT; i++)
+    {
+        _BenchCaptureRings(i);
+    }
+
+    return 0;
+}
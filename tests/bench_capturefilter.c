@@ -0,0 +1,93 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "test.h"
+#include "capturefilter.h"
+
+// PORTSNIFFER_MONITOR_WRITE and PORTSNIFFER_MONITOR_IOCTL of ioctl.h, which needs more of the Windows headers.
+#define TYPE_WRITE      0x0002
+#define TYPE_IOCTL      0x0004
+
+#define COUNT_OF(Array) (sizeof(Array) / sizeof((Array)[0]))
+#define TOTAL_RUNS      (32 * 1024 * 1024)
+
+static UCHAR Data[256];
+
+static void
+_BenchProgram(
+    const char* Name,
+    const CAPTURE_FILTER_INSTRUCTION* Instructions,
+    ULONG InstructionCount
+    )
+{
+    ULONG captured;
+    ULONG i;
+    double seconds;
+    USHORT type;
+
+    CHECK(CaptureFilterVerify(Instructions, InstructionCount));
+
+    // Alternate between writes, IOCTLs and the first data byte, so that every path of a program is taken.
+    captured = 0;
+    seconds = TestGetSeconds();
+
+    for (i = 0; i < TOTAL_RUNS; i++)
+    {
+        type = (i & 1) ? TYPE_IOCTL : TYPE_WRITE;
+        Data[0] = (UCHAR)(i >> 1);
+        captured += CaptureFilterRun(Instructions, InstructionCount, type, 0x1B0004, Data, sizeof(Data));
+    }
+
+    seconds = TestGetSeconds() - seconds;
+
+    printf("%-28s %2lu instructions: %6.1f M entries/s, %5.1f ns per entry, %lu captured\n",
+           Name, (unsigned long)InstructionCount, TOTAL_RUNS / seconds / 1e6, seconds / TOTAL_RUNS * 1e9, (unsigned long)captured);
+}
+
+int
+main(void)
+{
+    // "W and byte[0] == 2 or C and ioctl == 0x1B0004", as compiled by the tool.
+    const CAPTURE_FILTER_INSTRUCTION expression[] = {
+        { CAPTURE_FILTER_LD_TYPE, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 3, TYPE_WRITE },
+        { CAPTURE_FILTER_LD_BYTE, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 1, 0x02 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_LD_TYPE, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 3, TYPE_IOCTL },
+        { CAPTURE_FILTER_LD_IOCTL, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 1, 0x1B0004 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 0 },
+    };
+    ULONG i;
+    CAPTURE_FILTER_INSTRUCTION longest[CAPTURE_FILTER_MAX_INSTRUCTIONS];
+    const CAPTURE_FILTER_INSTRUCTION returnOne[] = {
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+    };
+
+    // The longest possible program runs every instruction and checks the bounds of every load.
+    for (i = 0; i < CAPTURE_FILTER_MAX_INSTRUCTIONS - 1; i++)
+    {
+        longest[i].Code = CAPTURE_FILTER_LD_ULONG;
+        longest[i].JumpTrue = 0;
+        longest[i].JumpFalse = 0;
+        longest[i].K = i * 4 % (sizeof(Data) - 3);
+    }
+
+    longest[i].Code = CAPTURE_FILTER_RETURN;
+    longest[i].JumpTrue = 0;
+    longest[i].JumpFalse = 0;
+    longest[i].K = 1;
+
+    _BenchProgram("Return", returnOne, COUNT_OF(returnOne));
+    _BenchProgram("Expression", expression, COUNT_OF(expression));
+    _BenchProgram("Longest program of loads", longest, COUNT_OF(longest));
+
+    return 0;
+}
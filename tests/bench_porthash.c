@@ -0,0 +1,246 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+// Every control request looks up its port in the hash index of porthash.h while holding FilterDevicesLock, and the
+// control device handles requests in parallel. A mutex stands in for that lock here, and several threads look up ports
+// through it at the same time, like applications polling their ports. This is compared with the linear search over
+// all ports, which the hash index has replaced and which holds the lock for much longer.
+#include <pthread.h>
+
+#include "test.h"
+#include "porthash.h"
+
+// Same as in ioctl.h.
+#define PORTSNIFFER_PORTNAME_LENGTH     10
+
+#define MAX_PORTS                       256
+#define MAX_THREADS                     4
+#define TOTAL_LOOKUPS                   (1024 * 1024)
+
+typedef struct _TEST_PORT
+{
+    PORT_HASH_ENTRY HashEntry;
+    WCHAR PortName[PORTSNIFFER_PORTNAME_LENGTH];
+    ULONG PortNameLength;
+}
+TEST_PORT, *PTEST_PORT;
+
+typedef struct _TEST_LOOKUP_THREAD
+{
+    pthread_t Thread;
+    ULONG FirstPort;
+    ULONG Lookups;
+}
+TEST_LOOKUP_THREAD, *PTEST_LOOKUP_THREAD;
+
+static pthread_mutex_t FilterDevicesLock = PTHREAD_MUTEX_INITIALIZER;
+static BOOLEAN Hashed;
+static PORT_HASH_TABLE PortHashTable;
+static ULONG PortCount;
+static TEST_PORT Ports[MAX_PORTS];
+
+static PTEST_PORT
+_FindPortHashed(
+    const WCHAR* PortName,
+    ULONG PortNameLength
+    )
+{
+    PPORT_HASH_ENTRY entry;
+
+    entry = PortHashFind(&PortHashTable, PortName, PortNameLength);
+    if (!entry)
+    {
+        return NULL;
+    }
+
+    return CONTAINING_RECORD(entry, TEST_PORT, HashEntry);
+}
+
+static PTEST_PORT
+_FindPortLinear(
+    const WCHAR* PortName,
+    ULONG PortNameLength
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < PortCount; i++)
+    {
+        if (Ports[i].PortNameLength == PortNameLength &&
+            memcmp(Ports[i].PortName, PortName, PortNameLength * sizeof(WCHAR)) == 0)
+        {
+            return &Ports[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void*
+_LookupThread(
+    void* Parameter
+    )
+{
+    PTEST_PORT foundPort;
+    ULONG i;
+    PTEST_PORT port;
+    PTEST_LOOKUP_THREAD thread;
+
+    thread = Parameter;
+
+    // Look up all ports in turn, like an application polling each of them.
+    for (i = 0; i < thread->Lookups; i++)
+    {
+        port = &Ports[(thread->FirstPort + i) % PortCount];
+
+        pthread_mutex_lock(&FilterDevicesLock);
+
+        if (Hashed)
+        {
+            foundPort = _FindPortHashed(port->PortName, port->PortNameLength);
+        }
+        else
+        {
+            foundPort = _FindPortLinear(port->PortName, port->PortNameLength);
+        }
+
+        pthread_mutex_unlock(&FilterDevicesLock);
+
+        CHECK(foundPort == port);
+    }
+
+    return NULL;
+}
+
+static double
+_RunLookupThreads(
+    ULONG ThreadCount,
+    BOOLEAN UseHash
+    )
+{
+    ULONG i;
+    double seconds;
+    TEST_LOOKUP_THREAD threads[MAX_THREADS];
+
+    Hashed = UseHash;
+    seconds = TestGetSeconds();
+
+    for (i = 0; i < ThreadCount; i++)
+    {
+        threads[i].FirstPort = i * PortCount / ThreadCount;
+        threads[i].Lookups = TOTAL_LOOKUPS / ThreadCount;
+        CHECK(pthread_create(&threads[i].Thread, NULL, _LookupThread, &threads[i]) == 0);
+    }
+
+    for (i = 0; i < ThreadCount; i++)
+    {
+        CHECK(pthread_join(threads[i].Thread, NULL) == 0);
+    }
+
+    return TestGetSeconds() - seconds;
+}
+
+static void
+_SetPortName(
+    PTEST_PORT Port,
+    ULONG Number
+    )
+{
+    char szPortName[PORTSNIFFER_PORTNAME_LENGTH];
+    ULONG i;
+
+    Port->PortNameLength = snprintf(szPortName, sizeof(szPortName), "COM%lu", (unsigned long)Number);
+    for (i = 0; i < Port->PortNameLength; i++)
+    {
+        Port->PortName[i] = (UCHAR)szPortName[i];
+    }
+}
+
+static void
+_BenchPortHash(
+    ULONG Count
+    )
+{
+    PLIST_ENTRY bucket;
+    PLIST_ENTRY entry;
+    ULONG i;
+    ULONG length;
+    ULONG longestBucket;
+    TEST_PORT missingPort;
+    double secondsHashed;
+    double secondsLinear;
+    ULONG threadCount;
+
+    PortCount = Count;
+    PortHashInitialize(&PortHashTable);
+
+    for (i = 0; i < Count; i++)
+    {
+        _SetPortName(&Ports[i], i + 1);
+        PortHashInitializeEntry(&Ports[i].HashEntry);
+        PortHashInsert(&PortHashTable, &Ports[i].HashEntry, Ports[i].PortName, Ports[i].PortNameLength);
+    }
+
+    longestBucket = 0;
+    for (i = 0; i < PORT_HASH_BUCKET_COUNT; i++)
+    {
+        bucket = &PortHashTable.Buckets[i];
+        length = 0;
+
+        for (entry = bucket->Flink; entry != bucket; entry = entry->Flink)
+        {
+            length++;
+        }
+
+        if (length > longestBucket)
+        {
+            longestBucket = length;
+        }
+    }
+
+    // Both must find every port and nothing for a port that isn't there.
+    // A removed port must not be found anymore, and removing it again must be harmless.
+    _SetPortName(&missingPort, MAX_PORTS + 1);
+    for (i = 0; i < Count; i++)
+    {
+        CHECK(_FindPortHashed(Ports[i].PortName, Ports[i].PortNameLength) == &Ports[i]);
+        CHECK(_FindPortLinear(Ports[i].PortName, Ports[i].PortNameLength) == &Ports[i]);
+    }
+
+    CHECK(_FindPortHashed(missingPort.PortName, missingPort.PortNameLength) == NULL);
+    CHECK(_FindPortLinear(missingPort.PortName, missingPort.PortNameLength) == NULL);
+    CHECK(_FindPortHashed(Ports[0].PortName, Ports[0].PortNameLength - 1) == NULL);
+
+    PortHashRemove(&Ports[0].HashEntry);
+    PortHashRemove(&Ports[0].HashEntry);
+    CHECK(_FindPortHashed(Ports[0].PortName, Ports[0].PortNameLength) == NULL);
+    PortHashInsert(&PortHashTable, &Ports[0].HashEntry, Ports[0].PortName, Ports[0].PortNameLength);
+    CHECK(_FindPortHashed(Ports[0].PortName, Ports[0].PortNameLength) == &Ports[0]);
+
+    for (threadCount = 1; threadCount <= MAX_THREADS; threadCount *= 2)
+    {
+        secondsLinear = _RunLookupThreads(threadCount, FALSE);
+        secondsHashed = _RunLookupThreads(threadCount, TRUE);
+
+        printf("%3lu ports, %lu threads: linear %6.1f ns, hashed %5.1f ns per lookup, longest bucket %lu\n",
+               (unsigned long)Count, (unsigned long)threadCount, secondsLinear / TOTAL_LOOKUPS * 1e9,
+               secondsHashed / TOTAL_LOOKUPS * 1e9, (unsigned long)longestBucket);
+    }
+}
+
+int
+main(void)
+{
+    ULONG count;
+
+    for (count = 4; count <= MAX_PORTS; count *= 4)
+    {
+        _BenchPortHash(count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "test.h"
+#include "portlog.h"
+
+#define RING_SIZE       (1024 * 1024)
+#define BATCH_RECORDS   64
+#define TOTAL_RECORDS   (16 * 1024 * 1024)
+
+static UCHAR Buffer[RING_SIZE];
+static UCHAR Payload[4096];
+
+static void
+_BenchRing(
+    ULONG PayloadLength
+    )
+{
+    ULONG i;
+    ULONG j;
+    ULONGLONG payloadBytes;
+    PPORTLOG_RECORD record;
+    PORTLOG_RING ring;
+    double seconds;
+
+    // Add a batch of records and remove it again, like the driver adds entries and the application pops them.
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    payloadBytes = 0;
+    seconds = TestGetSeconds();
+
+    for (i = 0; i < TOTAL_RECORDS; i += BATCH_RECORDS)
+    {
+        for (j = 0; j < BATCH_RECORDS; j++)
+        {
+            record = PortLogRingReserve(&ring, PayloadLength);
+            CHECK(record != NULL);
+            RtlCopyMemory(PORTLOG_RECORD_PAYLOAD(record), Payload, PayloadLength);
+            PortLogRingCommit(&ring);
+        }
+
+        while ((record = PortLogRingPeek(&ring)) != NULL)
+        {
+            payloadBytes += record->PayloadLength;
+            PortLogRingRemove(&ring, record);
+        }
+    }
+
+    seconds = TestGetSeconds() - seconds;
+    CHECK(payloadBytes == (ULONGLONG)TOTAL_RECORDS * PayloadLength);
+
+    printf("Ring with %4lu-byte payloads: %7.1f M records/s, %8.1f MB/s\n",
+           (unsigned long)PayloadLength, TOTAL_RECORDS / seconds / 1e6, payloadBytes / seconds / 1e6);
+}
+
+int
+main(void)
+{
+    _BenchRing(16);
+    _BenchRing(64);
+    _BenchRing(256);
+    _BenchRing(1024);
+
+    return 0;
+}
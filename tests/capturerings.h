@@ -0,0 +1,202 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#pragma once
+
+// Runs the capture rings of capturering.h like the driver does: Producer threads capture entries while holding the
+// ProducerLock of their capture ring, and the calling thread merges them by timestamp like the drain work item,
+// see PortSnifferFilterCapturePortLogEntry and PortSnifferFilterDrainCaptureRings.
+#include "test.h"
+#include "capturering.h"
+
+// Same as in EnlyzePortSniffer.h.
+#define CAPTURE_COUNT           3
+#define CAPTURE_RING_SIZE       (32 * 1024)
+
+// Starts with its timestamp, as capturering.h requires.
+typedef struct _TEST_CAPTURED_ENTRY
+{
+    LARGE_INTEGER Timestamp;
+    ULONG Producer;
+    ULONG SequenceNumber;
+}
+TEST_CAPTURED_ENTRY, *PTEST_CAPTURED_ENTRY;
+
+typedef struct _TEST_PRODUCER
+{
+    pthread_t Thread;
+    PCAPTURE_RING CaptureRing;
+    ULONG Index;
+    ULONG Entries;
+    BOOLEAN Preempt;
+}
+TEST_PRODUCER, *PTEST_PRODUCER;
+
+typedef struct _TEST_DRAIN_RESULT
+{
+    ULONGLONG Entries;
+    ULONG Passes;
+}
+TEST_DRAIN_RESULT, *PTEST_DRAIN_RESULT;
+
+static ULONG TestProducersDone;
+
+static void*
+_TestCaptureThread(
+    void* Parameter
+    )
+{
+    PCAPTURE_RING captureRing;
+    PTEST_CAPTURED_ENTRY entry;
+    KIRQL oldIrql;
+    PTEST_PRODUCER producer;
+    PPORTLOG_RECORD record;
+    ULONG sequenceNumber;
+
+    producer = Parameter;
+    captureRing = producer->CaptureRing;
+    sequenceNumber = 0;
+
+    while (sequenceNumber < producer->Entries)
+    {
+        KeAcquireSpinLock(&captureRing->ProducerLock, &oldIrql);
+
+        // The driver drops an entry if the capture ring is full. Retry instead, so that every entry can be checked.
+        record = CaptureRingReserve(captureRing, sizeof(TEST_CAPTURED_ENTRY));
+        if (!record)
+        {
+            KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+            sched_yield();
+            continue;
+        }
+
+        // Timestamp the entry while holding ProducerLock, just like the driver.
+        entry = PORTLOG_RECORD_PAYLOAD(record);
+        entry->Timestamp = KeQueryPerformanceCounter(NULL);
+        entry->Producer = producer->Index;
+        entry->SequenceNumber = sequenceNumber;
+
+        // Get preempted between timestamping and publishing now and then, so that the drain has to cope with it.
+        if (producer->Preempt && sequenceNumber % 64 == 0)
+        {
+            sched_yield();
+        }
+
+        CaptureRingCommit(captureRing);
+        CaptureRingPublish(captureRing);
+
+        KeReleaseSpinLock(&captureRing->ProducerLock, oldIrql);
+        sequenceNumber++;
+    }
+
+    __atomic_fetch_add(&TestProducersDone, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+// Runs Count producers capturing EntriesPerProducer entries each, while the calling thread drains them.
+// Checks that the drained entries are complete and in global timestamp order.
+// Preempt lets the threads give up the CPU at the worst moments, which uncovers ordering bugs even on a single CPU.
+static void
+TestRunCaptureRings(
+    ULONG Count,
+    ULONG EntriesPerProducer,
+    BOOLEAN Preempt,
+    PTEST_DRAIN_RESULT Result
+    )
+{
+    CAPTURE_RING captureRings[CAPTURE_COUNT];
+    LONGLONG cutoff;
+    BOOLEAN done;
+    PTEST_CAPTURED_ENTRY entry;
+    ULONG expectedSequenceNumbers[CAPTURE_COUNT];
+    PPORTLOG_SHARED_HEADER header;
+    ULONG i;
+    LONGLONG lastTimestamp;
+    PCAPTURE_RING oldestCaptureRing;
+    TEST_PRODUCER producers[CAPTURE_COUNT];
+    PPORTLOG_RECORD record;
+
+    CHECK(Count <= CAPTURE_COUNT);
+
+    TestProducersDone = 0;
+    WinShimYieldOnSpinLockRelease = Preempt;
+
+    // Like PortSnifferFilterAllocateCaptureRings.
+    for (i = 0; i < Count; i++)
+    {
+        header = aligned_alloc(PORTLOG_CACHE_LINE_SIZE, sizeof(PORTLOG_SHARED_HEADER) + CAPTURE_RING_SIZE);
+        CHECK(header != NULL);
+
+        KeInitializeSpinLock(&captureRings[i].ProducerLock);
+        captureRings[i].Header = header;
+        PortLogSharedInitialize(header, CAPTURE_RING_SIZE, &captureRings[i].ProducerRing);
+        RtlZeroMemory(&captureRings[i].DroppedGap, sizeof(captureRings[i].DroppedGap));
+        PortLogSharedConsumerInitialize(header, &captureRings[i].ConsumerRing);
+
+        producers[i].CaptureRing = &captureRings[i];
+        producers[i].Index = i;
+        producers[i].Entries = EntriesPerProducer;
+        producers[i].Preempt = Preempt;
+        expectedSequenceNumbers[i] = 0;
+    }
+
+    for (i = 0; i < Count; i++)
+    {
+        CHECK(pthread_create(&producers[i].Thread, NULL, _TestCaptureThread, &producers[i]) == 0);
+    }
+
+    Result->Entries = 0;
+    Result->Passes = 0;
+    lastTimestamp = 0;
+
+    do
+    {
+        // If all producers were done before the cutoff, this pass merges everything that is left.
+        done = (__atomic_load_n(&TestProducersDone, __ATOMIC_SEQ_CST) == Count);
+        cutoff = CaptureRingsSync(captureRings, Count);
+
+        while ((record = CaptureRingsPeekOldest(captureRings, Count, cutoff, &oldestCaptureRing)) != NULL)
+        {
+            // The merged entries must be in timestamp order across all passes, and no entry may be lost.
+            // Entries of different producers may share a timestamp.
+            entry = PORTLOG_RECORD_PAYLOAD(record);
+            CHECK(entry->Timestamp.QuadPart >= lastTimestamp);
+            CHECK(entry->Timestamp.QuadPart < cutoff);
+            CHECK(entry->Producer == (ULONG)(oldestCaptureRing - captureRings));
+            CHECK(entry->SequenceNumber == expectedSequenceNumbers[entry->Producer]);
+            lastTimestamp = entry->Timestamp.QuadPart;
+            expectedSequenceNumbers[entry->Producer]++;
+            Result->Entries++;
+
+            CaptureRingRemove(oldestCaptureRing, record);
+
+            // Let the producers capture more entries while merging.
+            if (Preempt && Result->Entries % 64 == 0)
+            {
+                sched_yield();
+            }
+        }
+
+        CaptureRingsRelease(captureRings, Count);
+
+        Result->Passes++;
+        sched_yield();
+    }
+    while (!done);
+
+    for (i = 0; i < Count; i++)
+    {
+        CHECK(pthread_join(producers[i].Thread, NULL) == 0);
+        CHECK(expectedSequenceNumbers[i] == EntriesPerProducer);
+        CHECK(PortLogRingPeek(&captureRings[i].ConsumerRing) == NULL);
+
+        pthread_mutex_destroy(&captureRings[i].ProducerLock);
+        free(captureRings[i].Header);
+    }
+
+    CHECK(Result->Entries == (ULONGLONG)Count * EntriesPerProducer);
+}
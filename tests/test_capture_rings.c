@@ -0,0 +1,29 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "capturerings.h"
+
+#define ROUNDS                  20
+#define ENTRIES_PER_PRODUCER    100000
+
+int
+main(void)
+{
+    ULONG count;
+    ULONG i;
+    TEST_DRAIN_RESULT result;
+
+    // Every round lets the producers and the drain interleave differently.
+    for (i = 0; i < ROUNDS; i++)
+    {
+        count = 1 + i % CAPTURE_COUNT;
+        TestRunCaptureRings(count, ENTRIES_PER_PRODUCER, TRUE, &result);
+    }
+
+    printf("All capture ring tests passed.\n");
+    return 0;
+}
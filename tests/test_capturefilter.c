@@ -0,0 +1,219 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "test.h"
+#include "capturefilter.h"
+
+// PORTSNIFFER_MONITOR_WRITE and PORTSNIFFER_MONITOR_IOCTL of ioctl.h, which needs more of the Windows headers.
+#define TYPE_WRITE      0x0002
+#define TYPE_IOCTL      0x0004
+
+#define COUNT_OF(Array) (sizeof(Array) / sizeof((Array)[0]))
+
+static const UCHAR Data[] = { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77 };
+
+static BOOLEAN
+_RunLoadEquals(
+    USHORT Code,
+    ULONG K,
+    ULONG Expected,
+    ULONG DataLength
+    )
+{
+    // Captures the entry if the load succeeds and yields Expected.
+    const CAPTURE_FILTER_INSTRUCTION program[] = {
+        { Code, 0, 0, K },
+        { CAPTURE_FILTER_JEQ, 0, 1, Expected },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 0 },
+    };
+
+    CHECK(CaptureFilterVerify(program, COUNT_OF(program)));
+    return CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data, DataLength);
+}
+
+static BOOLEAN
+_VerifyOne(
+    USHORT Code,
+    UCHAR JumpTrue,
+    UCHAR JumpFalse,
+    ULONG K
+    )
+{
+    // Puts the instruction in front of two returns, so that it may skip at most one instruction.
+    const CAPTURE_FILTER_INSTRUCTION program[] = {
+        { Code, JumpTrue, JumpFalse, K },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 0 },
+    };
+
+    return CaptureFilterVerify(program, COUNT_OF(program));
+}
+
+static void
+_TestRunArithmetic(void)
+{
+    // (ulong[0] >> 8) & 0xFF == 0x11
+    const CAPTURE_FILTER_INSTRUCTION program[] = {
+        { CAPTURE_FILTER_LD_ULONG, 0, 0, 0 },
+        { CAPTURE_FILTER_RSH, 0, 0, 8 },
+        { CAPTURE_FILTER_AND, 0, 0, 0xFF },
+        { CAPTURE_FILTER_JEQ, 0, 1, 0x11 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 0 },
+    };
+
+    CHECK(CaptureFilterVerify(program, COUNT_OF(program)));
+    CHECK(CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data, sizeof(Data)));
+}
+
+static void
+_TestRunBounds(void)
+{
+    // Every load right at the end of the data succeeds, and one byte further rejects the entry.
+    CHECK(_RunLoadEquals(CAPTURE_FILTER_LD_BYTE, sizeof(Data) - 1, 0x77, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_BYTE, sizeof(Data), 0, sizeof(Data)));
+
+    CHECK(_RunLoadEquals(CAPTURE_FILTER_LD_USHORT, sizeof(Data) - 2, 0x7766, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_USHORT, sizeof(Data) - 1, 0x77, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_USHORT, sizeof(Data), 0, sizeof(Data)));
+
+    CHECK(_RunLoadEquals(CAPTURE_FILTER_LD_ULONG, sizeof(Data) - 4, 0x77665544, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_ULONG, sizeof(Data) - 3, 0x776655, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_ULONG, sizeof(Data) - 1, 0x77, sizeof(Data)));
+
+    // The checks must not overflow for offsets close to the maximum.
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_BYTE, 0xFFFFFFFF, 0, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_USHORT, 0xFFFFFFFF, 0, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_ULONG, 0xFFFFFFFE, 0, sizeof(Data)));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_ULONG, 0xFFFFFFFD, 0, sizeof(Data)));
+
+    // Loads only see the data up to the passed length.
+    CHECK(_RunLoadEquals(CAPTURE_FILTER_LD_USHORT, 2, 0x3322, 4));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_ULONG, 1, 0x44332211, 4));
+    CHECK(!_RunLoadEquals(CAPTURE_FILTER_LD_BYTE, 0, 0x02, 0));
+    CHECK(_RunLoadEquals(CAPTURE_FILTER_LD_LENGTH, 0, 0, 0));
+}
+
+static void
+_TestRunEmptyProgram(void)
+{
+    // An empty program captures everything, even entries without data.
+    CHECK(CaptureFilterVerify(NULL, 0));
+    CHECK(CaptureFilterRun(NULL, 0, TYPE_WRITE, 0, NULL, 0));
+}
+
+static void
+_TestRunExpression(void)
+{
+    // "W and byte[0] == 2 or C and ioctl == 0x1B0004", as compiled by the tool.
+    const CAPTURE_FILTER_INSTRUCTION program[] = {
+        { CAPTURE_FILTER_LD_TYPE, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 3, TYPE_WRITE },
+        { CAPTURE_FILTER_LD_BYTE, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 1, 0x02 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_LD_TYPE, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 3, TYPE_IOCTL },
+        { CAPTURE_FILTER_LD_IOCTL, 0, 0, 0 },
+        { CAPTURE_FILTER_JEQ, 0, 1, 0x1B0004 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 0 },
+    };
+
+    CHECK(CaptureFilterVerify(program, COUNT_OF(program)));
+    CHECK(CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data, sizeof(Data)));
+    CHECK(!CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data + 1, sizeof(Data) - 1));
+    CHECK(!CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data, 0));
+    CHECK(CaptureFilterRun(program, COUNT_OF(program), TYPE_IOCTL, 0x1B0004, Data, sizeof(Data)));
+    CHECK(!CaptureFilterRun(program, COUNT_OF(program), TYPE_IOCTL, 0x1B0008, Data, sizeof(Data)));
+}
+
+static void
+_TestRunJumps(void)
+{
+    // Every jump goes to the return of 0 if it takes the wrong target for byte[1] == 0x11.
+    const CAPTURE_FILTER_INSTRUCTION program[] = {
+        { CAPTURE_FILTER_LD_BYTE, 0, 0, 1 },
+        { CAPTURE_FILTER_JGT, 0, 5, 0x10 },
+        { CAPTURE_FILTER_JGE, 0, 4, 0x11 },
+        { CAPTURE_FILTER_JGT, 3, 0, 0x11 },
+        { CAPTURE_FILTER_JSET, 0, 2, 0x10 },
+        { CAPTURE_FILTER_JSET, 1, 0, 0x20 },
+        { CAPTURE_FILTER_JUMP, 0, 0, 1 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 0 },
+        { CAPTURE_FILTER_RETURN, 0, 0, 1 },
+    };
+
+    CHECK(CaptureFilterVerify(program, COUNT_OF(program)));
+    CHECK(CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data, sizeof(Data)));
+    CHECK(!CaptureFilterRun(program, COUNT_OF(program), TYPE_WRITE, 0, Data + 2, sizeof(Data) - 2));
+}
+
+static void
+_TestVerify(void)
+{
+    CAPTURE_FILTER_INSTRUCTION program[CAPTURE_FILTER_MAX_INSTRUCTIONS + 1];
+    ULONG i;
+
+    // Jumps may skip everything up to the last instruction, but not beyond it.
+    CHECK(_VerifyOne(CAPTURE_FILTER_JUMP, 0, 0, 1));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_JUMP, 0, 0, 2));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_JUMP, 0, 0, 0xFFFFFFFF));
+    CHECK(_VerifyOne(CAPTURE_FILTER_JEQ, 1, 0, 0));
+    CHECK(_VerifyOne(CAPTURE_FILTER_JEQ, 0, 1, 0));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_JEQ, 2, 0, 0));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_JGT, 0, 2, 0));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_JGE, 0xFF, 0, 0));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_JSET, 0, 0xFF, 0));
+
+    // Shift counts must be below 32.
+    CHECK(_VerifyOne(CAPTURE_FILTER_RSH, 0, 0, 31));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_RSH, 0, 0, 32));
+    CHECK(!_VerifyOne(CAPTURE_FILTER_RSH, 0, 0, 0xFFFFFFFF));
+
+    // Unknown opcodes are rejected, including the gaps between the known ones.
+    CHECK(!_VerifyOne(0x0000, 0, 0, 0));
+    CHECK(!_VerifyOne(0x0008, 0, 0, 0));
+    CHECK(!_VerifyOne(0x0012, 0, 0, 0));
+    CHECK(!_VerifyOne(0x0025, 0, 0, 0));
+    CHECK(!_VerifyOne(0x0031, 0, 0, 0));
+    CHECK(!_VerifyOne(0xFFFF, 0, 0, 0));
+
+    // The last instruction must return.
+    for (i = 0; i < COUNT_OF(program); i++)
+    {
+        program[i].Code = CAPTURE_FILTER_LD_IMMEDIATE;
+        program[i].JumpTrue = 0;
+        program[i].JumpFalse = 0;
+        program[i].K = i;
+    }
+
+    CHECK(!CaptureFilterVerify(program, 1));
+    CHECK(!CaptureFilterVerify(program, CAPTURE_FILTER_MAX_INSTRUCTIONS));
+
+    // Programs may have up to CAPTURE_FILTER_MAX_INSTRUCTIONS instructions.
+    program[CAPTURE_FILTER_MAX_INSTRUCTIONS - 1].Code = CAPTURE_FILTER_RETURN;
+    CHECK(CaptureFilterVerify(program, CAPTURE_FILTER_MAX_INSTRUCTIONS));
+
+    program[CAPTURE_FILTER_MAX_INSTRUCTIONS].Code = CAPTURE_FILTER_RETURN;
+    CHECK(!CaptureFilterVerify(program, CAPTURE_FILTER_MAX_INSTRUCTIONS + 1));
+}
+
+int
+main(void)
+{
+    _TestVerify();
+    _TestRunArithmetic();
+    _TestRunBounds();
+    _TestRunEmptyProgram();
+    _TestRunExpression();
+    _TestRunJumps();
+
+    printf("All capture filter tests passed.\n");
+    return 0;
+}
@@ -0,0 +1,386 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include "test.h"
+#include "portlog.h"
+
+#define RING_SIZE       256
+
+static UCHAR Buffer[RING_SIZE];
+static UCHAR DestinationBuffer[2 * RING_SIZE];
+
+static BOOLEAN
+_AddRecord(
+    PPORTLOG_RING Ring,
+    ULONG PayloadLength,
+    UCHAR Fill
+    )
+{
+    PPORTLOG_RECORD record;
+
+    record = PortLogRingReserve(Ring, PayloadLength);
+    if (!record)
+    {
+        return FALSE;
+    }
+
+    memset(PORTLOG_RECORD_PAYLOAD(record), Fill, PayloadLength);
+    PortLogRingCommit(Ring);
+    return TRUE;
+}
+
+static void
+_CheckRecord(
+    PPORTLOG_RECORD Record,
+    ULONG PayloadLength,
+    UCHAR Fill
+    )
+{
+    PUCHAR payload;
+    ULONG i;
+
+    CHECK(Record != NULL);
+    CHECK(!(Record->Flags & PORTLOG_RECORD_FLAG_PADDING));
+    CHECK(Record->PayloadLength == PayloadLength);
+    CHECK(Record->Size == PORTLOG_RECORD_SIZE(PayloadLength));
+
+    payload = PORTLOG_RECORD_PAYLOAD(Record);
+    for (i = 0; i < PayloadLength; i++)
+    {
+        CHECK(payload[i] == Fill);
+    }
+}
+
+static void
+_RemoveRecord(
+    PPORTLOG_RING Ring,
+    ULONG PayloadLength,
+    UCHAR Fill
+    )
+{
+    PPORTLOG_RECORD record;
+
+    record = PortLogRingPeek(Ring);
+    _CheckRecord(record, PayloadLength, Fill);
+    PortLogRingRemove(Ring, record);
+}
+
+static void
+_TestRecordSize(void)
+{
+    // Header and payload are padded to PORTLOG_RECORD_ALIGNMENT bytes.
+    CHECK(sizeof(PORTLOG_RECORD) == 8);
+    CHECK(PORTLOG_RECORD_SIZE(0) == 8);
+    CHECK(PORTLOG_RECORD_SIZE(1) == 16);
+    CHECK(PORTLOG_RECORD_SIZE(8) == 16);
+    CHECK(PORTLOG_RECORD_SIZE(9) == 24);
+}
+
+static void
+_TestFull(void)
+{
+    PORTLOG_RING ring;
+    ULONG i;
+
+    // 8 records of 32 bytes fill the ring exactly.
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    for (i = 0; i < 8; i++)
+    {
+        CHECK(_AddRecord(&ring, 24, (UCHAR)i));
+    }
+
+    CHECK(ring.Tail - ring.Head == RING_SIZE);
+    CHECK(ring.EntryCount == 8);
+    CHECK(PortLogRingReserve(&ring, 0) == NULL);
+    CHECK(ring.Tail - ring.Head == RING_SIZE);
+
+    for (i = 0; i < 8; i++)
+    {
+        _RemoveRecord(&ring, 24, (UCHAR)i);
+    }
+
+    CHECK(PortLogRingPeek(&ring) == NULL);
+    CHECK(ring.EntryCount == 0);
+}
+
+static void
+_TestPadding(void)
+{
+    PPORTLOG_RECORD padding;
+    PORTLOG_RING ring;
+    ULONG i;
+
+    // Fill 224 bytes and free the first 96, leaving 32 bytes at the end and 96 at the start.
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    for (i = 0; i < 7; i++)
+    {
+        CHECK(_AddRecord(&ring, 24, (UCHAR)i));
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        _RemoveRecord(&ring, 24, (UCHAR)i);
+    }
+
+    // A record of 48 bytes doesn't fit at the end, so the end is padded and the record goes to the start.
+    CHECK(_AddRecord(&ring, 40, 0x40));
+    padding = (PPORTLOG_RECORD)&Buffer[224];
+    CHECK(padding->Flags & PORTLOG_RECORD_FLAG_PADDING);
+    CHECK(padding->Size == 32);
+    CHECK(ring.Tail == RING_SIZE + 48);
+    CHECK(ring.EntryCount == 5);
+
+    // 48 bytes are left, but a record may not overtake Head.
+    CHECK(PortLogRingReserve(&ring, 48) == NULL);
+    CHECK(_AddRecord(&ring, 40, 0x41));
+    CHECK(ring.Tail - ring.Head == RING_SIZE);
+
+    // The padding record is skipped, and the records come back in order.
+    for (i = 3; i < 7; i++)
+    {
+        _RemoveRecord(&ring, 24, (UCHAR)i);
+    }
+
+    _RemoveRecord(&ring, 40, 0x40);
+    _RemoveRecord(&ring, 40, 0x41);
+    CHECK(PortLogRingPeek(&ring) == NULL);
+    CHECK(ring.Head == ring.Tail);
+}
+
+static void
+_TestPaddingWithoutSpace(void)
+{
+    PORTLOG_RING ring;
+    ULONG i;
+
+    // 32 bytes are free at the end and 32 at the start, which is too little for padding plus a record of 48 bytes.
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    for (i = 0; i < 7; i++)
+    {
+        CHECK(_AddRecord(&ring, 24, (UCHAR)i));
+    }
+
+    _RemoveRecord(&ring, 24, 0);
+    CHECK(PortLogRingReserve(&ring, 40) == NULL);
+    CHECK(ring.Tail == 224);
+
+    // A record fitting at the end still goes there.
+    CHECK(_AddRecord(&ring, 24, 7));
+    CHECK(ring.Tail == RING_SIZE);
+}
+
+static void
+_TestCounterOverflow(void)
+{
+    PORTLOG_RING ring;
+    ULONG i;
+    ULONG payloadLength;
+
+    // Positions are free-running, so Tail - Head stays correct when they overflow.
+    // Records of varying length make sure that the padding moves around.
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    ring.Head = 0xFFFFFF00;
+    ring.Tail = 0xFFFFFF00;
+
+    for (i = 0; i < 1000; i++)
+    {
+        payloadLength = (i * 7) % 60;
+        CHECK(_AddRecord(&ring, payloadLength, (UCHAR)i));
+        CHECK(ring.Tail - ring.Head <= RING_SIZE);
+
+        if (i >= 1)
+        {
+            _RemoveRecord(&ring, ((i - 1) * 7) % 60, (UCHAR)(i - 1));
+        }
+    }
+
+    CHECK(ring.Tail < 0xFFFFFF00);
+    CHECK(ring.EntryCount == 1);
+}
+
+static void
+_TestExtend(void)
+{
+    PPORTLOG_RECORD record;
+    PORTLOG_RING ring;
+
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    CHECK(_AddRecord(&ring, 120, 1));
+
+    // Grow a reserved record before committing it.
+    record = PortLogRingReserve(&ring, 8);
+    CHECK(record != NULL);
+    CHECK(ring.PendingSize == 16);
+    CHECK(PortLogRingExtend(&ring, record, 40));
+    CHECK(record->Size == 48);
+    CHECK(record->PayloadLength == 40);
+    CHECK(ring.PendingSize == 48);
+
+    // It may neither go beyond the end of the buffer nor beyond the free space.
+    CHECK(!PortLogRingExtend(&ring, record, 128));
+    CHECK(record->Size == 48);
+    CHECK(ring.PendingSize == 48);
+
+    memset(PORTLOG_RECORD_PAYLOAD(record), 2, 40);
+    PortLogRingCommit(&ring);
+    CHECK(ring.Tail == 128 + 48);
+
+    _RemoveRecord(&ring, 120, 1);
+    _RemoveRecord(&ring, 40, 2);
+
+    // With the whole buffer free, the record still can't wrap around.
+    record = PortLogRingReserve(&ring, 8);
+    CHECK(record == (PPORTLOG_RECORD)&Buffer[176]);
+    CHECK(PortLogRingExtend(&ring, record, 72));
+    CHECK(!PortLogRingExtend(&ring, record, 73));
+}
+
+static void
+_TestCommitIgnoresRecordSize(void)
+{
+    PPORTLOG_RECORD record;
+    PORTLOG_RING ring;
+
+    // A shared record may be modified by the consumer before it is committed.
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    record = PortLogRingReserve(&ring, 16);
+    CHECK(record != NULL);
+    record->Size = 0xFFFFFFF0;
+    PortLogRingCommit(&ring);
+
+    CHECK(ring.Tail == 24);
+    CHECK(ring.PendingSize == 0);
+}
+
+static void
+_TestMove(void)
+{
+    PORTLOG_RING destination;
+    ULONG i;
+    PORTLOG_RING source;
+
+    // Build a source ring whose records wrap around its end.
+    PortLogRingInitialize(&source, Buffer, RING_SIZE);
+    for (i = 0; i < 7; i++)
+    {
+        CHECK(_AddRecord(&source, 24, (UCHAR)i));
+    }
+
+    for (i = 0; i < 5; i++)
+    {
+        _RemoveRecord(&source, 24, (UCHAR)i);
+    }
+
+    CHECK(_AddRecord(&source, 40, 0x40));
+    CHECK(_AddRecord(&source, 40, 0x41));
+    CHECK(source.EntryCount == 4);
+
+    // A larger ring takes all of them in order.
+    PortLogRingInitialize(&destination, DestinationBuffer, sizeof(DestinationBuffer));
+    CHECK(PortLogRingMove(&destination, &source));
+    CHECK(source.EntryCount == 0);
+    CHECK(PortLogRingPeek(&source) == NULL);
+    CHECK(destination.EntryCount == 4);
+    CHECK(destination.Tail == 2 * 32 + 2 * 48);
+
+    _RemoveRecord(&destination, 24, 5);
+    _RemoveRecord(&destination, 24, 6);
+    _RemoveRecord(&destination, 40, 0x40);
+    _RemoveRecord(&destination, 40, 0x41);
+
+    // A ring running out of space keeps the remaining records in the source.
+    PortLogRingInitialize(&source, Buffer, RING_SIZE);
+    for (i = 0; i < 8; i++)
+    {
+        CHECK(_AddRecord(&source, 24, (UCHAR)i));
+    }
+
+    PortLogRingInitialize(&destination, DestinationBuffer, 128);
+    CHECK(!PortLogRingMove(&destination, &source));
+    CHECK(destination.EntryCount == 4);
+    CHECK(source.EntryCount == 4);
+    _RemoveRecord(&source, 24, 4);
+    _RemoveRecord(&destination, 24, 0);
+}
+
+static void
+_TestPack(void)
+{
+    UCHAR buffer[256];
+    ULONG i;
+    ULONG length;
+    ULONG offset;
+    PPORTLOG_RECORD record;
+    PORTLOG_RING ring;
+
+    // Records are packed back-to-back with their alignment bytes zeroed, whatever the ring had there.
+    memset(Buffer, 0xCC, sizeof(Buffer));
+    PortLogRingInitialize(&ring, Buffer, RING_SIZE);
+    for (i = 1; i <= 4; i++)
+    {
+        CHECK(_AddRecord(&ring, i * 5, (UCHAR)i));
+    }
+
+    memset(buffer, 0xCC, sizeof(buffer));
+    length = 0;
+    while ((record = PortLogRingPeek(&ring)) != NULL)
+    {
+        length += PortLogPackRecord(&buffer[length], record);
+        PortLogRingRemove(&ring, record);
+    }
+
+    CHECK(length == 16 + 24 + 24 + 32);
+    CHECK(buffer[8 + 5] == 0 && buffer[15] == 0);
+    CHECK(buffer[length] == 0xCC);
+
+    // Unpacking returns them in order and stops at the end.
+    offset = 0;
+    for (i = 1; i <= 4; i++)
+    {
+        record = PortLogGetPackedRecord(buffer, length, offset);
+        _CheckRecord(record, i * 5, (UCHAR)i);
+        offset += record->Size;
+    }
+
+    CHECK(offset == length);
+    CHECK(PortLogGetPackedRecord(buffer, length, offset) == NULL);
+
+    // A record cut off by the end of the buffer is rejected, and so is a header cut off.
+    CHECK(PortLogGetPackedRecord(buffer, length - 1, 16 + 24 + 24) == NULL);
+    CHECK(PortLogGetPackedRecord(buffer, 16 + 4, 16) == NULL);
+    CHECK(PortLogGetPackedRecord(buffer, length, length + 8) == NULL);
+
+    // So are a size not matching the payload length and a padding record.
+    record = (PPORTLOG_RECORD)buffer;
+    record->Size = 24;
+    CHECK(PortLogGetPackedRecord(buffer, length, 0) == NULL);
+    record->Size = 16;
+    record->PayloadLength = 9;
+    CHECK(PortLogGetPackedRecord(buffer, length, 0) == NULL);
+    record->PayloadLength = 5;
+    record->Flags = PORTLOG_RECORD_FLAG_PADDING;
+    CHECK(PortLogGetPackedRecord(buffer, length, 0) == NULL);
+    record->Flags = 0;
+    CHECK(PortLogGetPackedRecord(buffer, length, 0) == record);
+}
+
+int
+main(void)
+{
+    _TestRecordSize();
+    _TestFull();
+    _TestPadding();
+    _TestPaddingWithoutSpace();
+    _TestCounterOverflow();
+    _TestExtend();
+    _TestCommitIgnoresRecordSize();
+    _TestMove();
+    _TestPack();
+
+    printf("All port log tests passed.\n");
+    return 0;
+}
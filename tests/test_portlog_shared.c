@@ -0,0 +1,202 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+#include "test.h"
+#include "portlog.h"
+
+#define RING_SIZE       4096
+#define TOTAL_RECORDS   2000000
+
+// Stands in for the event the driver sets to wake up the application.
+static sem_t Wakeup;
+static PPORTLOG_SHARED_HEADER Header;
+static PORTLOG_RING ProducerRing;
+static ULONG Wakeups;
+
+static ULONG
+_GetPayloadLength(
+    ULONG SequenceNumber
+    )
+{
+    // Vary the length, so that padding records show up at all positions.
+    return sizeof(ULONG) + (SequenceNumber * 13) % 200;
+}
+
+static void*
+_ProducerThread(
+    void* Parameter
+    )
+{
+    PUCHAR payload;
+    PPORTLOG_RECORD record;
+    PPORTLOG_RING ring;
+    ULONG sequenceNumber;
+
+    (void)Parameter;
+    ring = &ProducerRing;
+
+    for (sequenceNumber = 0; sequenceNumber < TOTAL_RECORDS; sequenceNumber++)
+    {
+        // Wait for the consumer to free some space if the ring is full.
+        while ((record = PortLogRingReserve(ring, _GetPayloadLength(sequenceNumber))) == NULL)
+        {
+            sched_yield();
+            PortLogSharedProducerSync(ring, Header);
+        }
+
+        payload = PORTLOG_RECORD_PAYLOAD(record);
+        memcpy(payload, &sequenceNumber, sizeof(ULONG));
+        memset(payload + sizeof(ULONG), (UCHAR)sequenceNumber, _GetPayloadLength(sequenceNumber) - sizeof(ULONG));
+        PortLogRingCommit(ring);
+
+        if (PortLogSharedProducerPublish(ring, Header))
+        {
+            Wakeups++;
+            sem_post(&Wakeup);
+        }
+    }
+
+    // Like detaching a mapping: Tell the consumer that nothing more is coming and wake it up.
+    Header->Flags |= PORTLOG_SHARED_FLAG_DETACHED;
+    MemoryBarrier();
+    sem_post(&Wakeup);
+
+    return NULL;
+}
+
+static void
+_TestProducerConsumer(void)
+{
+    ULONG expected;
+    ULONG i;
+    PUCHAR payload;
+    pthread_t producer;
+    PPORTLOG_RECORD record;
+    PORTLOG_RING ring;
+    ULONG sequenceNumber;
+    struct timespec timeout;
+    ULONG waits;
+
+    Header = aligned_alloc(PORTLOG_CACHE_LINE_SIZE, sizeof(PORTLOG_SHARED_HEADER) + RING_SIZE);
+    CHECK(Header != NULL);
+    CHECK(sem_init(&Wakeup, 0, 0) == 0);
+
+    // The consumer initializes its ring from the header, so the producer has to set it up first.
+    PortLogSharedInitialize(Header, RING_SIZE, &ProducerRing);
+    PortLogSharedConsumerInitialize(Header, &ring);
+    CHECK(pthread_create(&producer, NULL, _ProducerThread, NULL) == 0);
+
+    expected = 0;
+    waits = 0;
+    for (;;)
+    {
+        PortLogSharedConsumerSync(&ring, Header);
+
+        while ((record = PortLogRingPeek(&ring)) != NULL)
+        {
+            // Every record has to arrive complete and in order.
+            payload = PORTLOG_RECORD_PAYLOAD(record);
+            memcpy(&sequenceNumber, payload, sizeof(ULONG));
+            CHECK(sequenceNumber == expected);
+            CHECK(record->PayloadLength == _GetPayloadLength(sequenceNumber));
+            for (i = sizeof(ULONG); i < record->PayloadLength; i++)
+            {
+                CHECK(payload[i] == (UCHAR)sequenceNumber);
+            }
+
+            PortLogRingRemove(&ring, record);
+            expected++;
+        }
+
+        PortLogSharedConsumerPublish(&ring, Header);
+
+        if (!PortLogSharedConsumerPrepareWait(&ring, Header))
+        {
+            if (ring.Head == ring.Tail && (Header->Flags & PORTLOG_SHARED_FLAG_DETACHED))
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        // A lost wakeup would let us wait forever.
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += 5;
+        while (sem_timedwait(&Wakeup, &timeout) != 0)
+        {
+            CHECK(errno == EINTR);
+        }
+
+        waits++;
+    }
+
+    CHECK(pthread_join(producer, NULL) == 0);
+    CHECK(expected == TOTAL_RECORDS);
+    printf("%lu records passed with %lu waits and %lu wakeups.\n", (unsigned long)expected, (unsigned long)waits, (unsigned long)Wakeups);
+
+    sem_destroy(&Wakeup);
+    free(Header);
+}
+
+static void
+_TestProducerSyncRejectsBadHead(void)
+{
+    PPORTLOG_SHARED_HEADER header;
+    ULONG i;
+    PORTLOG_RING ring;
+
+    header = aligned_alloc(PORTLOG_CACHE_LINE_SIZE, sizeof(PORTLOG_SHARED_HEADER) + RING_SIZE);
+    CHECK(header != NULL);
+
+    PortLogSharedInitialize(header, RING_SIZE, &ring);
+    for (i = 0; i < 4; i++)
+    {
+        CHECK(PortLogRingReserve(&ring, 24) != NULL);
+        PortLogRingCommit(&ring);
+    }
+
+    PortLogSharedProducerPublish(&ring, header);
+
+    // The consumer may write anything, but the producer only accepts a Head within what it has published.
+    header->Head = 36;
+    PortLogSharedProducerSync(&ring, header);
+    CHECK(ring.Head == 0);
+
+    header->Head = 160;
+    PortLogSharedProducerSync(&ring, header);
+    CHECK(ring.Head == 0);
+
+    header->Head = 64;
+    PortLogSharedProducerSync(&ring, header);
+    CHECK(ring.Head == 64);
+
+    header->Head = 32;
+    PortLogSharedProducerSync(&ring, header);
+    CHECK(ring.Head == 64);
+
+    header->Head = 128;
+    PortLogSharedProducerSync(&ring, header);
+    CHECK(ring.Head == 128);
+
+    free(header);
+}
+
+int
+main(void)
+{
+    _TestProducerSyncRejectsBadHead();
+    _TestProducerConsumer();
+
+    printf("All shared port log tests passed.\n");
+    return 0;
+}
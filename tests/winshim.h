@@ -0,0 +1,131 @@
+//
+// PortSniffer - Monitor the traffic of arbitrary serial or parallel ports
+// Copyright 2022 Colin Finck, ENLYZE GmbH <c.finck@enlyze.com>
+//
+// SPDX-License-Identifier: MIT
+//
+
+#pragma once
+
+// The basic Windows data types, macros and kernel functions used by the portable headers of driver and tool,
+// so that they can be compiled with gcc on other platforms.
+// A mutex stands in for a spin lock, and the performance counter counts nanoseconds.
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t UCHAR, BOOLEAN, *PUCHAR;
+typedef uint16_t USHORT, WCHAR;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef void* PVOID;
+typedef UCHAR KIRQL;
+typedef pthread_mutex_t KSPIN_LOCK;
+
+// Tests may set this to give up the CPU after releasing a spin lock, which the driver never does.
+// This lets threads interleave at the worst moments even on a single CPU.
+static BOOLEAN WinShimYieldOnSpinLockRelease;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+}
+LARGE_INTEGER, *PLARGE_INTEGER;
+
+#define TRUE                    1
+#define FALSE                   0
+#define __inline                inline
+#define __in
+#define __in_bcount(Count)
+#define __in_ecount(Count)
+#define __inout
+#define __inout_ecount(Count)
+#define __out
+#define RtlCopyMemory           memcpy
+#define RtlEqualMemory(s1, s2, l) (memcmp((s1), (s2), (l)) == 0)
+#define RtlZeroMemory(d, l)     memset((d), 0, (l))
+#define MemoryBarrier()         __sync_synchronize()
+#define CONTAINING_RECORD(Address, Type, Field) ((Type*)((char*)(Address) - offsetof(Type, Field)))
+#define KeInitializeSpinLock(SpinLock)              pthread_mutex_init((SpinLock), NULL)
+#define KeAcquireSpinLock(SpinLock, OldIrql)        (*(OldIrql) = 0, pthread_mutex_lock(SpinLock))
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+}
+LIST_ENTRY, *PLIST_ENTRY;
+
+static inline void
+InitializeListHead(
+    PLIST_ENTRY ListHead
+    )
+{
+    ListHead->Flink = ListHead;
+    ListHead->Blink = ListHead;
+}
+
+static inline void
+InsertTailList(
+    PLIST_ENTRY ListHead,
+    PLIST_ENTRY Entry
+    )
+{
+    Entry->Flink = ListHead;
+    Entry->Blink = ListHead->Blink;
+    ListHead->Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+static inline BOOLEAN
+RemoveEntryList(
+    PLIST_ENTRY Entry
+    )
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+    return (Entry->Flink == Entry->Blink);
+}
+
+static inline LARGE_INTEGER
+KeQueryPerformanceCounter(
+    PLARGE_INTEGER PerformanceFrequency
+    )
+{
+    LARGE_INTEGER counter;
+    struct timespec now;
+
+    if (PerformanceFrequency)
+    {
+        PerformanceFrequency->QuadPart = 1000000000;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter.QuadPart = (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+    return counter;
+}
+
+static inline void
+KeReleaseSpinLock(
+    KSPIN_LOCK* SpinLock,
+    KIRQL NewIrql
+    )
+{
+    (void)NewIrql;
+    pthread_mutex_unlock(SpinLock);
+
+    if (WinShimYieldOnSpinLockRelease)
+    {
+        sched_yield();
+    }
+}